@@ -0,0 +1,135 @@
+/**
+ * @file alert.c
+ * @author Daniel Quadros
+ * @brief SMBALERT# monitoring
+ * @date 2024-10-15
+ * 
+ * Watches the alert inputs defined in hwconfig.h. When an input goes low
+ * the time is recorded (in the GPIO interrupt) and, in the main loop,
+ * the Alert Response Address is read (if enabled) and a record is sent
+ * to the host.
+ * 
+ * The ARA read is done only when there is no I2C transaction in progress.
+ * If the input is still low after the ARA read, other devices are also
+ * asking for attention and more reads are done.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+
+#include "hwconfig.h"
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cops.h"
+#include "usbstream.h"
+#include "alert.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+#ifdef ALERT_PINS
+
+// maximum ARA reads for one alert
+#define MAX_ARA_READS 4
+
+static const uint alert_pins[] = ALERT_PINS;
+#define ALERT_COUNT (sizeof(alert_pins)/sizeof(alert_pins[0]))
+
+static uint8_t alert_flags[ALERT_COUNT];
+static volatile bool alert_pending[ALERT_COUNT];
+static volatile uint32_t alert_time[ALERT_COUNT];
+
+// GPIO interrupt
+static void alert_irq(uint gpio, uint32_t events) {
+  for (int i = 0; i < ALERT_COUNT; i++) {
+    if ((alert_pins[i] == gpio) && !alert_pending[i]) {
+      alert_time[i] = time_us_32();
+      alert_pending[i] = true;
+    }
+  }
+}
+
+// Inits the alert inputs
+void alert_init(void) {
+  for (int i = 0; i < ALERT_COUNT; i++) {
+    alert_flags[i] = ALERT_ENABLE | ALERT_ARA;
+    gpio_init(alert_pins[i]);
+    gpio_set_dir(alert_pins[i], false);
+    gpio_pull_up(alert_pins[i]);
+    gpio_set_irq_enabled_with_callback(alert_pins[i], GPIO_IRQ_EDGE_FALL, true, alert_irq);
+  }
+}
+
+// Configures an alert input
+bool alert_config(uint8_t input, uint8_t flags) {
+  if (input >= ALERT_COUNT) {
+    return false;
+  }
+  dbg_printf("Alert %d flags %02X\n", input, flags);
+  alert_flags[input] = flags;
+  alert_pending[input] = false;
+  return true;
+}
+
+// Handles the alerts, call from the main loop
+void alert_task(void) {
+  for (int i = 0; i < ALERT_COUNT; i++) {
+    if (!alert_pending[i]) {
+      continue;
+    }
+    if (bbi2c_busy()) {
+      return;   // wait for the end of the transaction
+    }
+
+    struct usb_alert_record rec;
+    rec.input = i;
+    rec.addr = 0xFF;
+    rec.timestamp_us = alert_time[i];
+
+    if (alert_flags[i] & ALERT_ENABLE) {
+      bool sent = false;
+      if (alert_flags[i] & ALERT_ARA) {
+        for (int n = 0; (n < MAX_ARA_READS) && !gpio_get(alert_pins[i]); n++) {
+          rec.addr = i2c_ara();
+          if (rec.addr == 0xFF) {
+            break;
+          }
+          usbstream_send(RECORD_ALERT, &rec, sizeof(rec));
+          sent = true;
+        }
+      }
+      if (!sent) {
+        rec.addr = 0xFF;
+        usbstream_send(RECORD_ALERT, &rec, sizeof(rec));
+      }
+    }
+    alert_pending[i] = false;
+  }
+}
+
+#else
+
+void alert_init(void) {
+}
+
+bool alert_config(uint8_t input, uint8_t flags) {
+  return false;
+}
+
+void alert_task(void) {
+}
+
+#endif
@@ -0,0 +1,7 @@
+/*
+ * SMBALERT# monitoring
+ */
+
+void alert_init(void);
+bool alert_config(uint8_t input, uint8_t flags);
+void alert_task(void);
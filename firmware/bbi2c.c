@@ -12,6 +12,12 @@
  * PIO someday)
  * 
  * As a bonus, this follows more closely how i2c-tiny-usb handles i2c operations
+ *
+ * For clock periods up to 4us the bytes are sent and received by a
+ * "fast engine": unrolled bit loops that run from RAM (no XIP cache misses
+ * after an interrupt), change the pins with single SIO register writes and
+ * wait a number of system clock cycles instead of whole microseconds. This
+ * gives up to 1MHz (Fast-mode Plus) without using a PIO.
  *  
  * @copyright Copyright (c) 2024, Daniel Quadros
  * 
@@ -23,11 +29,15 @@
 
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
+#include "hardware/clocks.h"
 
 #include "hwconfig.h"
 #include "bbi2c.h"
+#include "dbglog.h"
 
-#if LIB_PICO_STDIO_UART
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
 #define dbg_printf(...) printf(__VA_ARGS__)
 #else
 #define dbg_printf(...)
@@ -49,11 +59,58 @@
 //
 static uint32_t clock_delay_before = 1;
 static uint32_t clock_delay_after = 4;
-static const uint32_t max_low_time_ms = 1000; // so we don't hang if someone pulls SCL low
+
+// Bus clock
+//
+// START, address, repeated START and STOP always use the bus clock, that
+// must be compliant with the slowest device on the bus. Targets that can
+// go faster (or need to go slower) may have their own clock, used for
+// the data bytes after they ACK their address. 0 in target_period means
+// the bus clock.
+static uint16_t bus_period_us = 10;
+static uint32_t bus_delay_before = 1;
+static uint32_t bus_delay_after = 4;
+static uint8_t target_period[128];
+static bool addr_phase = false;   // next byte written is an address
+
+// Fast engine
+//
+// SCL low and high times in system clock cycles, 0 if the clock is too
+// slow for the fast engine. SCL is low for a little more than half the
+// period, as tLOW has the tighter limit in Fast-mode and Fast-mode Plus.
+// The cycles spent accessing the pins are discounted.
+#define FAST_MAX_PERIOD_US  4
+#define FAST_LOW_PERCENT    55
+#define FAST_OVERHEAD       2
+
+#define SDA_MASK  (1u << SDA_PIN)
+#define SCL_MASK  (1u << SCL_PIN)
+
+static uint32_t fast_low = 0;
+static uint32_t fast_high = 0;
+static uint32_t bus_fast_low = 0;
+static uint32_t bus_fast_high = 0;
+
+// Clock stretch timeout
+//
+// If a target holds SCL low for more than this time the current 
+// transaction is aborted: bus_error is set and all operations are
+// ignored until bbi2c_recover() is called. The default is the
+// SMBus tTIMEOUT (25ms).
+static uint32_t stretch_timeout_us = 25000;
+static bool bus_error = false;
+
+// true between START and STOP
+static bool in_transfer = false;
+
+static struct bbi2c_stats stats;
 
 
 // Set SDA pin to HIGH (floating with pullup) or LOW (output) level
 static void bbi2c_set_sda(bool hi) {
+  if (bus_error) {
+    return;
+  }
   gpio_set_dir(SDA_PIN, !hi);
   if (!hi) {
     gpio_put(SDA_PIN, false);
@@ -65,17 +122,46 @@ static bool bbi2c_get_sda(void) {
   return gpio_get(SDA_PIN);
 }
 
+// Wait for SCL to go HIGH, returns false if timeout
+// (in RAM, bbi2c_fast_scl_high calls it on every bit)
+static bool __not_in_flash_func(bbi2c_wait_scl)(void) {
+  if (gpio_get(SCL_PIN)) {
+    return true;    // not stretched, don't bother reading the timer
+  }
+  uint32_t start = time_us_32();
+  while (!gpio_get(SCL_PIN)) {
+    if ((time_us_32() - start) > stretch_timeout_us) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Aborts the transaction when a target holds SCL low for too long
+// (in RAM, as it is called by the fast engine)
+static void __not_in_flash_func(bbi2c_scl_stuck)(void) {
+  dbg_printf("SCL stuck low\n");
+  stats.stretch_timeouts++;
+  bus_error = true;
+  gpio_set_dir(SDA_PIN, false);   // release the bus
+}
+
 // Set SCL pin to HIGH (floating with pullup) or LOW (output) level,
 // 
 // When setting to HIGH, waits for the slave to release the line
+// (if it takes too long, flags a bus error)
 static void bbi2c_set_scl(bool hi) {
+  if (bus_error) {
+    return;
+  }
   busy_wait_us_32 (clock_delay_before);
   if (hi) {
     gpio_set_dir(SCL_PIN, false);   // input with pull-up
     
     // wait until slave releases the line or timeout
-    absolute_time_t to = make_timeout_time_ms(max_low_time_ms);
-    while (!gpio_get(SCL_PIN) && (absolute_time_diff_us(get_absolute_time(), to) > 0)) {
+    if (!bbi2c_wait_scl()) {
+      bbi2c_scl_stuck();
+      return;
     }
   } else {
     gpio_set_dir(SCL_PIN, true);
@@ -84,32 +170,100 @@ static void bbi2c_set_scl(bool hi) {
   busy_wait_us_32 (clock_delay_after);
 }
 
-// Chooses clock delays
-void bbi2c_set_clock(uint16_t clock_period_us) {
-  
-  // Chooses clock delays
-  if (clock_period_us < 3) {
-    // clock = 500kHz, best we can do with us delays
-    clock_delay_after = 1;
-    clock_delay_before = 0;
-  } else if (clock_period_us < 5) {
-    // clock = 250kHz
-    clock_delay_after = 1;
-    clock_delay_before = 1;
+// Calculates the clock delays for a clock period
+static void bbi2c_calc_delays(uint16_t clock_period_us, uint32_t *before, uint32_t *after) {
+  if (clock_period_us < 5) {
+    // clock = 250kHz, best we can do with us delays (the data bytes
+    // use the fast engine, this is for START, repeated START and STOP)
+    *after = 1;
+    *before = 1;
   } else {
     uint16_t period = clock_period_us;
     if (period & 1) {
       period += 1;   // make it even
     }
-    clock_delay_before = period/6;
-    clock_delay_after = (period - 2*clock_delay_before)/2;
-    if (2*(clock_delay_before+clock_delay_after) < period) {
-      clock_delay_before++;
+    *before = period/6;
+    *after = (period - 2*(*before))/2;
+    if (2*(*before + *after) < period) {
+      (*before)++;
     }
   }
+}
+
+// Calculates the fast engine SCL low and high cycles for a clock period
+// (zero if the fast engine is not used)
+static void bbi2c_calc_fast(uint16_t clock_period_us, uint32_t *low, uint32_t *high) {
+  if ((clock_period_us == 0) || (clock_period_us > FAST_MAX_PERIOD_US)) {
+    *low = *high = 0;
+    return;
+  }
+  uint32_t cycles = (clock_get_hz(clk_sys) / 1000000) * clock_period_us;
+  uint32_t low_cycles = (cycles * FAST_LOW_PERCENT) / 100;
+  *low = low_cycles - FAST_OVERHEAD;
+  *high = cycles - low_cycles - FAST_OVERHEAD;
+}
+
+// Goes back to the bus clock
+static inline void bbi2c_bus_clock(void) {
+  clock_delay_before = bus_delay_before;
+  clock_delay_after = bus_delay_after;
+  fast_low = bus_fast_low;
+  fast_high = bus_fast_high;
+}
+
+// Chooses clock delays
+void bbi2c_set_clock(uint16_t clock_period_us) {
+  bus_period_us = clock_period_us;
+  bbi2c_calc_delays(clock_period_us, &bus_delay_before, &bus_delay_after);
+  bbi2c_calc_fast(clock_period_us, &bus_fast_low, &bus_fast_high);
+  bbi2c_bus_clock();
   dbg_printf("Delays: original=%d before=%d after=%d\n", clock_period_us, clock_delay_before, clock_delay_after);
 }
 
+// Gets the bus clock period
+uint16_t bbi2c_get_clock(void) {
+  return bus_period_us;
+}
+
+// Gets the bus clock delays (for code that drives other pins)
+void bbi2c_get_delays(uint32_t *before, uint32_t *after) {
+  *before = bus_delay_before;
+  *after = bus_delay_after;
+}
+
+// Sets the clock for the data bytes of a target (0 = bus clock)
+void bbi2c_set_target_clock(uint8_t addr, uint16_t clock_period_us) {
+  if (clock_period_us > 255) {
+    clock_period_us = 255;
+  }
+  target_period[addr & 0x7F] = clock_period_us;
+  dbg_printf("Target %02X clock period %d\n", addr, clock_period_us);
+}
+
+// Gets the clock period of a target (0 = bus clock)
+uint16_t bbi2c_get_target_clock(uint8_t addr) {
+  return target_period[addr & 0x7F];
+}
+
+// Sets the clock stretch timeout
+void bbi2c_set_timeout(uint32_t timeout_us) {
+  stretch_timeout_us = timeout_us;
+  dbg_printf("Stretch timeout: %u us\n", timeout_us);
+}
+
+// Changes the clock stretch timeout for a short time (not logged),
+// returns the previous value
+uint32_t bbi2c_swap_timeout(uint32_t timeout_us) {
+  uint32_t prev = stretch_timeout_us;
+  stretch_timeout_us = timeout_us;
+  return prev;
+}
+
+// Gets the clock stretch timeout
+uint32_t bbi2c_get_timeout(void) {
+  return stretch_timeout_us;
+}
+
 // Inits I2C
 void bbi2c_init(uint16_t clock_period_us) {
   
@@ -128,6 +282,10 @@ void bbi2c_init(uint16_t clock_period_us) {
   gpio_pull_up(SDA_PIN);
   gpio_set_slew_rate(SDA_PIN,  GPIO_SLEW_RATE_SLOW);
   gpio_set_input_hysteresis_enabled(SDA_PIN, true);
+
+  // The fast engine only changes the direction
+  gpio_put(SCL_PIN, false);
+  gpio_put(SDA_PIN, false);
 }
 
 /* clock HI, delay, then LO */
@@ -136,9 +294,167 @@ static void bbi2c_scl_toggle(void) {
   bbi2c_set_scl(LOW);
 }
 
+/* Checks if the current transaction was aborted */
+bool bbi2c_bus_error(void) {
+  return bus_error;
+}
+
+/* Checks if there is a transaction in progress (START sent, no STOP yet) */
+bool bbi2c_busy(void) {
+  return in_transfer;
+}
+
+/* Gets the error counters */
+void bbi2c_get_stats(struct bbi2c_stats *st) {
+  *st = stats;
+}
+
+/* Tries to free the bus
+ *
+ * Standard recovery sequence: clock SCL (up to 9 pulses) until the target 
+ * releases SDA, then send a STOP. Returns true if both lines end up HIGH.
+ * Clears the bus error flag.
+ */
+bool bbi2c_recover(void) {
+  dbg_printf("Bus recovery\n");
+  stats.recoveries++;
+  bus_error = false;
+  in_transfer = false;
+  addr_phase = false;
+  bbi2c_bus_clock();
+
+  gpio_set_dir(SDA_PIN, false);
+  gpio_set_dir(SCL_PIN, false);
+  busy_wait_us_32 (clock_delay_after);
+
+  bool ok = bbi2c_wait_scl();
+  for (int i = 0; ok && (i < 9) && !gpio_get(SDA_PIN); i++) {
+    gpio_set_dir(SCL_PIN, true);
+    gpio_put(SCL_PIN, false);
+    busy_wait_us_32 (clock_delay_before + clock_delay_after);
+    gpio_set_dir(SCL_PIN, false);
+    ok = bbi2c_wait_scl();
+    busy_wait_us_32 (clock_delay_before + clock_delay_after);
+  }
+
+  if (ok && gpio_get(SDA_PIN)) {
+    // STOP
+    gpio_set_dir(SCL_PIN, true);
+    gpio_put(SCL_PIN, false);
+    busy_wait_us_32 (clock_delay_after);
+    bbi2c_set_sda(LOW);
+    busy_wait_us_32 (clock_delay_after);
+    gpio_set_dir(SCL_PIN, false);
+    ok = bbi2c_wait_scl();
+    busy_wait_us_32 (clock_delay_after);
+    bbi2c_set_sda(HIGH);
+    busy_wait_us_32 (clock_delay_after);
+  }
+
+  ok = ok && gpio_get(SDA_PIN) && gpio_get(SCL_PIN);
+  if (!ok) {
+    dbg_printf("Bus recovery failed\n");
+    stats.recovery_failures++;
+    gpio_set_dir(SDA_PIN, false);
+    gpio_set_dir(SCL_PIN, false);
+  }
+  return ok;
+}
+
+/* Fast engine: releases SCL and waits the high time
+ *
+ * Returns false if a target held SCL low for longer than the timeout.
+ * The high time is counted from when SCL is seen high, so it is not
+ * shortened by the rise time or clock stretching.
+ */
+static __force_inline bool bbi2c_fast_scl_high(void) {
+  gpio_set_dir_in_masked(SCL_MASK);
+  if ((gpio_get_all() & SCL_MASK) == 0) {
+    if (!bbi2c_wait_scl()) {
+      bbi2c_scl_stuck();
+      return false;
+    }
+  }
+  busy_wait_at_least_cycles(fast_high);
+  return true;
+}
+
+/* Fast engine: sends a bit, starts and ends with SCL low */
+static __force_inline bool bbi2c_fast_send_bit(bool hi) {
+  if (hi) {
+    gpio_set_dir_in_masked(SDA_MASK);
+  } else {
+    gpio_set_dir_out_masked(SDA_MASK);
+  }
+  busy_wait_at_least_cycles(fast_low);
+  if (!bbi2c_fast_scl_high()) {
+    return false;
+  }
+  gpio_set_dir_out_masked(SCL_MASK);
+  return true;
+}
+
+/* Fast engine: write a byte, returns true if acknowledge */
+static bool __not_in_flash_func(bbi2c_fast_write)(uint8_t b) {
+  #pragma GCC unroll 8
+  for (int i = 0; i < 8; i++) {
+    if (!bbi2c_fast_send_bit(b & 0x80)) {
+      return false;
+    }
+    b = b << 1;
+  }
+
+  // ACK bit
+  gpio_set_dir_in_masked(SDA_MASK);
+  busy_wait_at_least_cycles(fast_low);
+  if (!bbi2c_fast_scl_high()) {
+    return false;
+  }
+  bool ack = (gpio_get_all() & SDA_MASK) == 0;
+  gpio_set_dir_out_masked(SCL_MASK);
+  busy_wait_at_least_cycles(fast_low);
+  return ack;
+}
+
+/* Fast engine: read a byte */
+static uint8_t __not_in_flash_func(bbi2c_fast_read)(bool last) {
+  uint8_t b = 0;
+
+  gpio_set_dir_in_masked(SDA_MASK);
+  #pragma GCC unroll 8
+  for (int i = 0; i < 8; i++) {
+    busy_wait_at_least_cycles(fast_low);
+    if (!bbi2c_fast_scl_high()) {
+      return 0xFF;
+    }
+    b = (b << 1) | ((gpio_get_all() & SDA_MASK) ? 1 : 0);
+    gpio_set_dir_out_masked(SCL_MASK);
+  }
+
+  // NAK if last, ACK if more
+  if (!bbi2c_fast_send_bit(last)) {
+    return 0xFF;
+  }
+  gpio_set_dir_in_masked(SDA_MASK);
+  busy_wait_at_least_cycles(fast_low);
+  return b;
+}
+
 /* i2c start condition */
 void bbi2c_start(void) {
+  bus_error = false;
+  if (!gpio_get(SDA_PIN) || !gpio_get(SCL_PIN)) {
+    // someone is holding the bus
+    if (!bbi2c_recover()) {
+      bus_error = true;
+      return;
+    }
+  }
+
+  in_transfer = true;
+  addr_phase = true;
   bbi2c_set_sda(LOW);
+  busy_wait_us_32 (clock_delay_after);    // START hold time
   bbi2c_set_scl(LOW);
 }
 
@@ -146,41 +462,80 @@ void bbi2c_start(void) {
 void bbi2c_restart(void) 
 {
   /* scl, sda may not be high */
+  bbi2c_bus_clock();
+  addr_phase = true;
   bbi2c_set_sda(HIGH);
   bbi2c_set_scl(HIGH);
+  busy_wait_us_32 (clock_delay_before);   // repeated START setup time
   
   bbi2c_set_sda(LOW);
+  busy_wait_us_32 (clock_delay_after);    // START hold time
   bbi2c_set_scl(LOW);
 }
 
 /* i2c stop condition */
 void bbi2c_stop(void) {
+  if (bus_error) {
+    return;
+  }
+  in_transfer = false;
+  addr_phase = false;
+  bbi2c_bus_clock();
   bbi2c_set_sda(LOW);
   bbi2c_set_scl(HIGH);
   bbi2c_set_sda(HIGH);
+  busy_wait_us_32 (clock_delay_before + clock_delay_after);   // bus free time
 }
 
 /* Write a byte, returns true if acknowledge */
 bool bbi2c_write(uint8_t b) {
-  for (int i = 0; i < 8; i++) {
-    bbi2c_set_sda(b & 0x80);
-    bbi2c_scl_toggle();
-    b = b << 1;
+  uint8_t addr = b;
+
+  if (bus_error) {
+    return false;
   }
-  
-  bbi2c_set_sda(HIGH);
-  bbi2c_set_scl(HIGH);
 
-  bool ack = !bbi2c_get_sda();   // get the ACK bit (0 = ACK)
-  bbi2c_set_scl(LOW);
+  bool ack;
+  if (fast_low) {
+    ack = bbi2c_fast_write(b);
+  } else {
+    for (int i = 0; i < 8; i++) {
+      bbi2c_set_sda(b & 0x80);
+      bbi2c_scl_toggle();
+      b = b << 1;
+    }
+    
+    bbi2c_set_sda(HIGH);
+    bbi2c_set_scl(HIGH);
 
-  return ack;
+    ack = !bbi2c_get_sda();   // get the ACK bit (0 = ACK)
+    bbi2c_set_scl(LOW);
+  }
+
+  if (addr_phase) {
+    // address sent, switch to the target clock for the data
+    addr_phase = false;
+    uint8_t period = target_period[addr >> 1];
+    if (ack && period) {
+      bbi2c_calc_delays(period, &clock_delay_before, &clock_delay_after);
+      bbi2c_calc_fast(period, &fast_low, &fast_high);
+    }
+  }
+
+  return ack && !bus_error;
 }
 
 /* Read a byte */
 uint8_t bbi2c_read(bool last) {
   uint8_t b = 0;
 
+  if (bus_error) {
+    return 0xFF;
+  }
+  if (fast_low) {
+    return bbi2c_fast_read(last);
+  }
+
   bbi2c_set_sda(HIGH);
   bbi2c_set_scl(LOW);
 
@@ -2,10 +2,28 @@
  * Definitions for bit-banged I2C
  */
 
+/* Error counters */
+struct bbi2c_stats {
+  uint32_t stretch_timeouts;    // SCL held low for too long
+  uint32_t recoveries;          // bus recovery sequences sent
+  uint32_t recovery_failures;   // bus still stuck after recovery
+};
+
 void bbi2c_init(uint16_t clock_period_us);
 void bbi2c_set_clock(uint16_t clock_period_us);
+uint16_t bbi2c_get_clock(void);
+void bbi2c_get_delays(uint32_t *before, uint32_t *after);
+void bbi2c_set_target_clock(uint8_t addr, uint16_t clock_period_us);
+uint16_t bbi2c_get_target_clock(uint8_t addr);
+void bbi2c_set_timeout(uint32_t timeout_us);
+uint32_t bbi2c_swap_timeout(uint32_t timeout_us);
+uint32_t bbi2c_get_timeout(void);
 void bbi2c_start(void);
 void bbi2c_restart(void);
 void bbi2c_stop(void);
 bool bbi2c_write(uint8_t b);
 uint8_t bbi2c_read(bool last);
+bool bbi2c_bus_error(void);
+bool bbi2c_busy(void);
+bool bbi2c_recover(void);
+void bbi2c_get_stats(struct bbi2c_stats *st);
@@ -0,0 +1,132 @@
+/**
+ * @file dbglog.c
+ * @author Daniel Quadros
+ * @brief Binary debug log
+ * @date 2024-10-15
+ * 
+ * Formatting the debug messages with printf and sending them to the UART
+ * in the middle of the I2C and USB handling changes the timing of the
+ * bus. When the firmware is built with DEBUG_LOG, dbg_printf() only
+ * stores a record with a timestamp, the address of the format string
+ * and the (integer) arguments. The records are sent in the background,
+ * by DMA to the UART or as RECORD_LOG records through the vendor bulk IN
+ * endpoint, and the host decoder (host/linux/dbglog) formats them using
+ * the strings in the firmware ELF file.
+ * 
+ * The log is a ring with a single producer (dbglog_write, called from the
+ * main loop and the USB callbacks, not from interrupt handlers) and a
+ * single consumer (dbglog_task), so no locks are needed. When the ring
+ * is full new records are dropped; the sequence number is incremented
+ * anyway, so the decoder can show where records were lost.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "hwconfig.h"
+#include "i2cusb.h"
+#include "usbstream.h"
+#include "dbglog.h"
+#if DEBUG_LOG == DBGLOG_UART
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+#include "hardware/uart.h"
+#endif
+
+// Records in the ring (must be a power of 2)
+#define DBGLOG_RECORDS  64
+
+static struct dbglog_record ring[DBGLOG_RECORDS];
+static volatile uint32_t head = 0;    // records written (free running)
+static volatile uint32_t tail = 0;    // records sent (free running)
+static uint16_t seq = 0;
+
+static struct dbglog_stats stats;
+
+#if DEBUG_LOG == DBGLOG_UART
+static int dma_chan;
+static uint32_t dma_count = 0;        // records in the current transfer
+#endif
+
+/* Inits the log output */
+void dbglog_init(void) {
+  #if DEBUG_LOG == DBGLOG_UART
+  uart_init(UART_ID, DBGLOG_BAUD);
+  gpio_set_function(TX_PIN, GPIO_FUNC_UART);
+
+  dma_chan = dma_claim_unused_channel(true);
+  dma_channel_config cfg = dma_channel_get_default_config(dma_chan);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_8);
+  channel_config_set_read_increment(&cfg, true);
+  channel_config_set_write_increment(&cfg, false);
+  channel_config_set_dreq(&cfg, uart_get_dreq(UART_ID, true));
+  dma_channel_configure(dma_chan, &cfg, &uart_get_hw(UART_ID)->dr, ring, 0, false);
+  #endif
+}
+
+/* Stores a record (use through dbg_printf or dbglog) */
+void dbglog_write(int nargs, const char *fmt, ...) {
+  uint16_t rec_seq = seq++;
+
+  if ((head - tail) >= DBGLOG_RECORDS) {
+    stats.dropped++;
+    return;
+  }
+
+  struct dbglog_record *rec = &ring[head & (DBGLOG_RECORDS - 1)];
+  va_list ap;
+  va_start(ap, fmt);
+  rec->magic = DBGLOG_MAGIC;
+  rec->nargs = nargs;
+  rec->seq = rec_seq;
+  rec->time_us = time_us_32();
+  rec->fmt = (uint32_t) (uintptr_t) fmt;
+  for (int i = 0; i < DBGLOG_MAX_ARGS; i++) {
+    rec->arg[i] = (i < nargs) ? va_arg(ap, uint32_t) : 0;
+  }
+  va_end(ap);
+  head++;
+  stats.records++;
+}
+
+/* Sends the records, call from the main loop */
+void dbglog_task(void) {
+  #if DEBUG_LOG == DBGLOG_UART
+  if (dma_channel_is_busy(dma_chan)) {
+    return;
+  }
+  tail += dma_count;
+  stats.sent += dma_count;
+  dma_count = 0;
+
+  // the DMA reads a contiguous part of the ring
+  uint32_t first = tail & (DBGLOG_RECORDS - 1);
+  uint32_t count = head - tail;
+  if ((first + count) > DBGLOG_RECORDS) {
+    count = DBGLOG_RECORDS - first;
+  }
+  if (count) {
+    dma_count = count;
+    dma_channel_transfer_from_buffer_now(dma_chan, &ring[first], count * sizeof(struct dbglog_record));
+  }
+  #else
+  while ((head != tail) && 
+         (usbstream_available() >= (sizeof(struct usb_record_hdr) + sizeof(struct dbglog_record)))) {
+    usbstream_send(RECORD_LOG, &ring[tail & (DBGLOG_RECORDS - 1)], sizeof(struct dbglog_record));
+    tail++;
+    stats.sent++;
+  }
+  #endif
+}
+
+/* Gets the counters */
+void dbglog_get_stats(struct dbglog_stats *st) {
+  *st = stats;
+}
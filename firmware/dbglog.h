@@ -0,0 +1,27 @@
+/*
+ * Binary debug log (firmware built with DEBUG_LOG)
+ */
+
+#define DBGLOG_UART 1   // records sent to the UART by DMA
+#define DBGLOG_USB  2   // records sent through the vendor bulk IN endpoint
+
+/* Counters */
+struct dbglog_stats {
+  uint32_t records;     // records stored
+  uint32_t dropped;     // records discarded (log full)
+  uint32_t sent;        // records sent to the host
+};
+
+/* Number of arguments after the format (up to DBGLOG_MAX_ARGS),
+   5 to 8 arguments expand to an undeclared identifier and fail to compile */
+#define DBGLOG_NARGS(...) DBGLOG_NARGS_(__VA_ARGS__, dbglog_too_many_args, dbglog_too_many_args, \
+                                        dbglog_too_many_args, dbglog_too_many_args, 4, 3, 2, 1, 0)
+#define DBGLOG_NARGS_(fmt, a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+
+/* Replacement for printf: dbglog("format", args...) */
+#define dbglog(...) dbglog_write(DBGLOG_NARGS(__VA_ARGS__), __VA_ARGS__)
+
+void dbglog_init(void);
+void dbglog_write(int nargs, const char *fmt, ...);
+void dbglog_task(void);
+void dbglog_get_stats(struct dbglog_stats *st);
@@ -23,8 +23,30 @@
 #define SDA_PIN 6
 #define SCL_PIN 7
 
+// SMBALERT# (or other open drain, active low, interrupt) inputs
+// Comment out if not used
+#define ALERT_PINS { 8 }
+
+// I2C target emulator (only used if compiled with -DTARGET_EMULATOR=ON)
+// Connect TARGET_SDA_PIN to SDA_PIN and TARGET_SCL_PIN to SCL_PIN
+// The pins must be SDA and SCL for the selected hardware I2C
+#define TARGET_I2C      i2c1
+#define TARGET_SDA_PIN  10
+#define TARGET_SCL_PIN  11
+#define TARGET_ADDR     0x50
+
+// Gang mode buses (only used if compiled with -DGANG_MODE=ON)
+// Up to 8, same transactions on all of them
+#if GANG_MODE
+#define GANG_SDA_PINS { 12, 14, 16, 18, 20, 2, 4, 26 }
+#define GANG_SCL_PINS { 13, 15, 17, 19, 21, 3, 5, 27 }
+#endif
+
 // UART for Debug
 #define UART_ID uart0
 #define TX_PIN  0
 #define RX_PIN  1
 
+// Binary debug log on the UART (DEBUG_LOG=UART in CMake)
+#define DBGLOG_BAUD 921600
+
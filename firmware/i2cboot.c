@@ -0,0 +1,135 @@
+/**
+ * @file i2cboot.c
+ * @author Daniel Quadros
+ * @brief Boot script
+ * @date 2024-10-15
+ * 
+ * An I2C script (see i2cscript.h) can be stored in the last sector of the 
+ * flash. It is executed at power up, before the USB is started, so the
+ * devices on the bus (expanders, PMICs, sensors) are already initialized 
+ * when the host sees the adapter. The host can get the result and 
+ * replace the script.
+ * 
+ * The flash is written with flash_safe_execute(), so it is safe to do it 
+ * while the target emulator is running in the other core.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/flash.h"
+#include "hardware/flash.h"
+
+#include "i2cusb.h"
+#include "i2cscript.h"
+#include "i2cboot.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+// Flash location
+#define BOOT_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#define BOOT_MAGIC        0x54424932    // "2IBT"
+
+struct boot_header {
+  uint32_t magic;
+  uint16_t len;
+  uint16_t crc;
+};
+
+// Image to write, a multiple of the flash page size
+#define BOOT_IMAGE_SIZE \
+  (((sizeof(struct boot_header) + SCRIPT_MAX_LEN + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE)
+
+static uint8_t image[BOOT_IMAGE_SIZE];
+static uint16_t image_len;
+
+static struct boot_result result;
+
+/* CRC-16-CCITT (also used for the data logger configuration) */
+uint16_t i2cboot_crc(const uint8_t *data, uint16_t len) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < len; i++) {
+    crc ^= data[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Returns the stored script, NULL if none
+static const uint8_t *i2cboot_script(uint16_t *len) {
+  const struct boot_header *hdr = (const struct boot_header *) (XIP_BASE + BOOT_FLASH_OFFSET);
+  const uint8_t *code = (const uint8_t *) (hdr + 1);
+  if ((hdr->magic != BOOT_MAGIC) || (hdr->len == 0) || (hdr->len > SCRIPT_MAX_LEN) ||
+      (hdr->crc != i2cboot_crc(code, hdr->len))) {
+    return NULL;
+  }
+  *len = hdr->len;
+  return code;
+}
+
+/* Runs the stored script (if any) */
+void i2cboot_run(void) {
+  uint8_t out[SCRIPT_MAX_OUT];
+  uint16_t len;
+  const uint8_t *code = i2cboot_script(&len);
+
+  memset(&result, 0, sizeof(result));
+  if (code == NULL) {
+    return;
+  }
+  result.stored = true;
+  result.run = true;
+  i2c_script_run(code, len, &result.res, out);
+  dbg_printf("Boot script: status %d, %d steps\n", result.res.status, result.res.steps);
+}
+
+// Erases the sector and writes the image (called with the other core stopped)
+static void i2cboot_flash(void *param) {
+  flash_range_erase(BOOT_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+  if (image_len) {
+    flash_range_program(BOOT_FLASH_OFFSET, image, image_len);
+  }
+}
+
+/* Stores a script in the flash (len = 0 removes the stored script)
+ * Returns false if it could not be written.
+ */
+bool i2cboot_store(const uint8_t *code, uint16_t len) {
+  if (len > SCRIPT_MAX_LEN) {
+    return false;
+  }
+  memset(image, 0xFF, sizeof(image));
+  image_len = 0;
+  if (len) {
+    struct boot_header hdr = { BOOT_MAGIC, len, i2cboot_crc(code, len) };
+    memcpy(image, &hdr, sizeof(hdr));
+    memcpy(image + sizeof(hdr), code, len);
+    image_len = ((sizeof(hdr) + len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE;
+  }
+  if (flash_safe_execute(i2cboot_flash, NULL, 100) != PICO_OK) {
+    dbg_printf("Boot script: flash write failed\n");
+    return false;
+  }
+  result.stored = i2cboot_script(&len) != NULL;
+  dbg_printf("Boot script: %d bytes stored\n", image_len ? len : 0);
+  return true;
+}
+
+/* Gets the result of the script executed at power up */
+void i2cboot_get_result(struct boot_result *res) {
+  *res = result;
+}
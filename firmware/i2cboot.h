@@ -0,0 +1,15 @@
+/*
+ * I2C script stored in flash, executed at power up
+ */
+
+/* Boot script status (returned by CMD_BOOT_SCRIPT IN) */
+struct boot_result {
+  uint8_t stored;               // there is a valid script in the flash
+  uint8_t run;                  // it was executed
+  struct i2c_script_result res; // result of the execution
+} __attribute__((packed));
+
+void i2cboot_run(void);
+bool i2cboot_store(const uint8_t *code, uint16_t len);
+void i2cboot_get_result(struct boot_result *res);
+uint16_t i2cboot_crc(const uint8_t *data, uint16_t len);
@@ -0,0 +1,179 @@
+/**
+ * @file i2cfb.c
+ * @author Daniel Quadros
+ * @brief Framebuffer for I2C OLED displays
+ * @date 2024-10-15
+ * 
+ * The host uploads a full frame (in the controller's memory layout: one
+ * byte for 8 vertical pixels, a page of 'width' bytes for each 8 rows)
+ * and the firmware sends to the display only what changed since the 
+ * previous frame.
+ * 
+ * The previous frame is kept in a shadow buffer. For each page the
+ * changed columns are grouped in ranges (close ranges are merged, as
+ * each range costs a few bytes of addressing) and each range is sent
+ * in a single I2C transaction: page and column address commands followed
+ * by the data. The display must be in page addressing mode (the default
+ * after reset for SSD1306, the only mode in SH1106).
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cfb.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+// Ranges separated by up to this number of unchanged bytes are merged
+// (a new range costs START, address, 7 control/command bytes and STOP)
+#define FB_GAP  8
+
+// Control bytes
+#define CTRL_CMD    0x80    // one command byte follows, then another control byte
+#define CTRL_DATA   0x40    // all bytes that follow are data
+
+// Display
+static uint8_t fb_addr = 0x3C;
+static uint8_t fb_type = FB_SSD1306;
+static uint8_t fb_width = 128;
+static uint8_t fb_pages = 8;
+
+// Frames
+static uint8_t frame[FB_MAX_SIZE];
+static uint8_t shadow[FB_MAX_SIZE];
+static bool shadow_valid = false;
+
+/* Configures the display, the next flush will send the full frame
+ * (up to 128 columns, the SH1106 panel is centered in its 132 columns)
+ */
+bool i2cfb_config(uint8_t addr, uint8_t type, uint8_t width, uint8_t height) {
+  if ((width == 0) || (width > 128) || (height == 0) || (height & 7) || 
+      ((width * (height/8)) > FB_MAX_SIZE) || (type > FB_SH1106)) {
+    return false;
+  }
+  dbg_printf("FB: addr %02X type %d %dx%d\n", addr, type, width, height);
+  fb_addr = addr;
+  fb_type = type;
+  fb_width = width;
+  fb_pages = height / 8;
+  shadow_valid = false;
+  return true;
+}
+
+/* Returns the frame size in bytes */
+uint16_t i2cfb_size(void) {
+  return fb_width * fb_pages;
+}
+
+/* Returns the buffer for the next frame */
+uint8_t *i2cfb_buffer(void) {
+  return frame;
+}
+
+// Sends a range of a page to the display, returns status
+static uint8_t i2cfb_send(uint8_t page, uint8_t col, uint8_t len) {
+  uint8_t c = col + ((fb_type == FB_SH1106) ? 2 : 0);   // SH1106 has 132 columns, centered
+  uint8_t hdr[] = {
+    CTRL_CMD, 0xB0 | page,              // page address
+    CTRL_CMD, 0x00 | (c & 0x0F),        // column address, low nibble
+    CTRL_CMD, 0x10 | (c >> 4),          // column address, high nibble
+    CTRL_DATA
+  };
+  const uint8_t *data = frame + page*fb_width + col;
+  uint8_t st = STATUS_ADDRESS_ACK;
+
+  bbi2c_start();
+  if (!bbi2c_write(fb_addr << 1)) {
+    st = STATUS_ADDRESS_NACK;
+  }
+  for (int i = 0; (st == STATUS_ADDRESS_ACK) && (i < sizeof(hdr)); i++) {
+    if (!bbi2c_write(hdr[i])) {
+      st = STATUS_DATA_NACK;
+    }
+  }
+  for (int i = 0; (st == STATUS_ADDRESS_ACK) && (i < len); i++) {
+    if (!bbi2c_write(data[i])) {
+      st = STATUS_DATA_NACK;
+    }
+  }
+  bbi2c_stop();
+  if (bbi2c_bus_error()) {
+    bbi2c_recover();
+    st = STATUS_BUS_ERROR;
+  }
+  return st;
+}
+
+/* Sends the changes in the frame to the display
+ *
+ * If full is true (or after a configuration or an error) the whole frame
+ * is sent.
+ */
+void i2cfb_flush(bool full, struct fb_result *res) {
+  uint32_t start = time_us_32();
+
+  memset(res, 0, sizeof(*res));
+  res->status = STATUS_ADDRESS_ACK;
+  if (full) {
+    shadow_valid = false;
+  }
+
+  for (int page = 0; page < fb_pages; page++) {
+    const uint8_t *new = frame + page*fb_width;
+    uint8_t *old = shadow + page*fb_width;
+    int col = 0;
+    while (col < fb_width) {
+      // find a change
+      while ((col < fb_width) && shadow_valid && (new[col] == old[col])) {
+        col++;
+      }
+      if (col == fb_width) {
+        break;
+      }
+
+      // find the end of the range
+      int first = col, last = col, same = 0;
+      for (col++; col < fb_width; col++) {
+        if (!shadow_valid || (new[col] != old[col])) {
+          last = col;
+          same = 0;
+        } else if (++same > FB_GAP) {
+          break;
+        }
+      }
+
+      // send it
+      uint8_t st = i2cfb_send(page, first, last - first + 1);
+      if (st != STATUS_ADDRESS_ACK) {
+        dbg_printf("FB: error %d on page %d\n", st, page);
+        res->status = st;
+        shadow_valid = false;   // don't know what is on the display
+        res->time_us = time_us_32() - start;
+        return;
+      }
+      memcpy(old + first, new + first, last - first + 1);
+      res->ranges++;
+      res->bytes += last - first + 1;
+      col = last + 1;
+    }
+  }
+
+  shadow_valid = true;
+  res->time_us = time_us_32() - start;
+  dbg_printf("FB: %d ranges %d bytes %u us\n", res->ranges, res->bytes, res->time_us);
+}
@@ -0,0 +1,8 @@
+/*
+ * Framebuffer for I2C OLED displays (SSD1306/SH1106)
+ */
+
+bool i2cfb_config(uint8_t addr, uint8_t type, uint8_t width, uint8_t height);
+uint16_t i2cfb_size(void);
+uint8_t *i2cfb_buffer(void);
+void i2cfb_flush(bool full, struct fb_result *res);
@@ -0,0 +1,378 @@
+/**
+ * @file i2cgang.c
+ * @author Daniel Quadros
+ * @brief Gang mode (same I2C transactions on several buses)
+ * @date 2024-10-15
+ *
+ * Used for production programming: the same configuration or EEPROM
+ * image is written to identical boards, each one on its own bus.
+ *
+ * The buses (defined in hwconfig.h) are driven in lockstep using the
+ * SIO masked operations, so each bit is put on all buses by a single
+ * register write and all SDA lines are sampled by a single read. Clock
+ * stretching is respected (SCL goes high only when all targets released
+ * it) and the ACK and read data are handled per bus. A bus that fails
+ * gets a STOP and is left out of the rest of the request.
+ *
+ * Timing is the same as the main bus (bus clock and clock stretch timeout).
+ *
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+
+#include "hwconfig.h"
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cgang.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+#define LOW  false
+#define HIGH true
+
+#ifdef GANG_SDA_PINS
+
+// time to wait for the targets to ACK their address (GANG_POLL)
+#define POLL_TIMEOUT_US 20000
+
+static const uint gang_sda_pins[] = GANG_SDA_PINS;
+static const uint gang_scl_pins[] = GANG_SCL_PINS;
+#define GANG_COUNT (sizeof(gang_sda_pins)/sizeof(gang_sda_pins[0]))
+
+static uint32_t sda_mask[GANG_COUNT];
+static uint32_t scl_mask[GANG_COUNT];
+
+// Buses in use in the current request
+static uint8_t active;
+static uint32_t sda_active;
+static uint32_t scl_active;
+
+// Timing (copied from the main bus)
+static uint32_t delay_before;
+static uint32_t delay_after;
+static uint32_t timeout_us;
+
+// Current result
+static struct gang_result *result;
+static uint8_t msg_index;
+
+// Updates the masks of the buses in use
+static void gang_select(uint8_t buses) {
+  active = buses;
+  sda_active = scl_active = 0;
+  for (int i = 0; i < GANG_COUNT; i++) {
+    if (buses & (1 << i)) {
+      sda_active |= sda_mask[i];
+      scl_active |= scl_mask[i];
+    }
+  }
+}
+
+// Set SDA pins to HIGH (floating with pullup) or LOW (output) level
+static inline void gang_set_sda(bool hi, uint32_t mask) {
+  if (hi) {
+    gpio_set_dir_in_masked(mask);
+  } else {
+    gpio_set_dir_out_masked(mask);   // output level is always low
+  }
+}
+
+static void gang_drop(uint8_t buses, uint8_t status, bool stop);
+
+// Set SCL pins of the active buses to HIGH or LOW level
+//
+// When setting to HIGH, waits for the targets to release the lines; buses
+// that are still low after the stretch timeout are dropped
+static void gang_set_scl(bool hi) {
+  busy_wait_us_32 (delay_before);
+  if (hi) {
+    gpio_set_dir_in_masked(scl_active);
+    if ((gpio_get_all() & scl_active) != scl_active) {
+      uint32_t start = time_us_32();
+      while ((gpio_get_all() & scl_active) != scl_active) {
+        if ((time_us_32() - start) > timeout_us) {
+          uint32_t stuck = scl_active & ~gpio_get_all();
+          uint8_t buses = 0;
+          for (int i = 0; i < GANG_COUNT; i++) {
+            if (stuck & scl_mask[i]) {
+              buses |= 1 << i;
+            }
+          }
+          dbg_printf("Gang: SCL stuck low %02X\n", buses);
+          gang_drop(buses, STATUS_BUS_ERROR, false);
+          break;
+        }
+      }
+    }
+  } else {
+    gpio_set_dir_out_masked(scl_active);
+  }
+  busy_wait_us_32 (delay_after);
+}
+
+// Returns the buses (of the active ones) where SDA is high
+static uint8_t gang_get_sda(void) {
+  uint32_t in = gpio_get_all();
+  uint8_t buses = 0;
+  for (int i = 0; i < GANG_COUNT; i++) {
+    if ((active & (1 << i)) && (in & sda_mask[i])) {
+      buses |= 1 << i;
+    }
+  }
+  return buses;
+}
+
+// Removes buses from the request, sending a STOP if asked
+// (must be called with SCL low in this case)
+static void gang_drop(uint8_t buses, uint8_t status, bool stop) {
+  buses &= active;
+  if (buses == 0) {
+    return;
+  }
+  uint32_t sda = 0, scl = 0;
+  for (int i = 0; i < GANG_COUNT; i++) {
+    if (buses & (1 << i)) {
+      result->status[i] = status;
+      result->msg[i] = msg_index;
+      sda |= sda_mask[i];
+      scl |= scl_mask[i];
+    }
+  }
+  dbg_printf("Gang: drop %02X status %d\n", buses, status);
+  gang_select(active & ~buses);
+  if (stop) {
+    gang_set_sda(LOW, sda);
+    busy_wait_us_32 (delay_after);
+    gpio_set_dir_in_masked(scl);
+    busy_wait_us_32 (delay_before + delay_after);
+  }
+  gpio_set_dir_in_masked(sda | scl);
+}
+
+// Start condition, drops the buses that are not free
+static void gang_start(void) {
+  uint32_t in = gpio_get_all();
+  uint8_t busy = 0;
+  for (int i = 0; i < GANG_COUNT; i++) {
+    if (((in & sda_mask[i]) == 0) || ((in & scl_mask[i]) == 0)) {
+      busy |= 1 << i;
+    }
+  }
+  gang_drop(busy, STATUS_BUS_ERROR, false);
+  gang_set_sda(LOW, sda_active);
+  busy_wait_us_32 (delay_after);    // START hold time
+  gang_set_scl(LOW);
+}
+
+// Repeated start condition
+static void gang_restart(void) {
+  gang_set_sda(HIGH, sda_active);
+  gang_set_scl(HIGH);
+  busy_wait_us_32 (delay_before);   // repeated START setup time
+  gang_set_sda(LOW, sda_active);
+  busy_wait_us_32 (delay_after);    // START hold time
+  gang_set_scl(LOW);
+}
+
+// Stop condition
+static void gang_stop(void) {
+  gang_set_sda(LOW, sda_active);
+  gang_set_scl(HIGH);
+  gang_set_sda(HIGH, sda_active);
+  busy_wait_us_32 (delay_before + delay_after);   // bus free time
+}
+
+// Writes a byte, returns the buses that did not ACK
+static uint8_t gang_write(uint8_t b) {
+  for (int i = 0; i < 8; i++) {
+    gang_set_sda(b & 0x80, sda_active);
+    gang_set_scl(HIGH);
+    gang_set_scl(LOW);
+    b = b << 1;
+  }
+  gang_set_sda(HIGH, sda_active);
+  gang_set_scl(HIGH);
+  uint8_t nack = gang_get_sda();
+  gang_set_scl(LOW);
+  return nack;
+}
+
+// Reads a byte from each bus
+static void gang_read(uint8_t *val, bool last) {
+  memset(val, 0, GANG_COUNT);
+  gang_set_sda(HIGH, sda_active);
+  for (int i = 0; i < 8; i++) {
+    gang_set_scl(HIGH);
+    uint8_t hi = gang_get_sda();
+    for (int bus = 0; bus < GANG_COUNT; bus++) {
+      val[bus] = (val[bus] << 1) | ((hi >> bus) & 1);
+    }
+    gang_set_scl(LOW);
+  }
+  gang_set_sda(last, sda_active);   // NAK if last, ACK if more
+  gang_set_scl(HIGH);
+  gang_set_scl(LOW);
+  gang_set_sda(HIGH, sda_active);
+}
+
+// Waits until the target ACKs the address on all active buses
+static void gang_poll(uint8_t addr) {
+  uint8_t waiting = active;
+  uint32_t start = time_us_32();
+  while (waiting) {
+    gang_start();
+    uint8_t nack = gang_write(addr << 1);
+    gang_stop();
+    waiting &= nack & active;
+    if (waiting && ((time_us_32() - start) > POLL_TIMEOUT_US)) {
+      gang_drop(waiting, STATUS_ADDRESS_NACK, false);
+      break;
+    }
+  }
+}
+
+// Inits the gang buses
+void i2cgang_init(void) {
+  for (int i = 0; i < GANG_COUNT; i++) {
+    sda_mask[i] = 1u << gang_sda_pins[i];
+    scl_mask[i] = 1u << gang_scl_pins[i];
+    gpio_init(gang_sda_pins[i]);
+    gpio_set_dir(gang_sda_pins[i], false);
+    gpio_pull_up(gang_sda_pins[i]);
+    gpio_init(gang_scl_pins[i]);
+    gpio_set_dir(gang_scl_pins[i], false);
+    gpio_pull_up(gang_scl_pins[i]);
+  }
+}
+
+/* Returns the number of gang buses */
+uint8_t i2cgang_buses(void) {
+  return GANG_COUNT;
+}
+
+/* Runs a gang request
+ *
+ * buses selects the buses to use (0 = all), req has the list of messages.
+ * Returns false if the request is malformed (nothing is done).
+ */
+bool i2cgang_run(uint8_t buses, const uint8_t *req, uint16_t len,
+                 struct gang_result *res, uint8_t *out) {
+  struct gang_msg msg;
+  bool restart = false;
+
+  // Check the request
+  uint16_t pos = 0;
+  uint32_t out_len = 0;
+  while (pos < len) {
+    if ((len - pos) < sizeof(msg)) {
+      return false;
+    }
+    memcpy(&msg, req + pos, sizeof(msg));
+    pos += sizeof(msg);
+    if (msg.flags & GANG_RD) {
+      out_len += msg.len * GANG_COUNT;
+      if (out_len > GANG_MAX_LEN) {
+        return false;
+      }
+    } else {
+      if (msg.len > (len - pos)) {
+        return false;
+      }
+      pos += msg.len;
+    }
+  }
+
+  // Prepare the result
+  memset(res, 0, sizeof(*res));
+  res->buses = GANG_COUNT;
+  result = res;
+  buses &= (1 << GANG_COUNT) - 1;
+  if (buses == 0) {
+    buses = (1 << GANG_COUNT) - 1;
+  }
+  gang_select(buses);
+  bbi2c_get_delays(&delay_before, &delay_after);
+  timeout_us = bbi2c_get_timeout();
+
+  // Execute
+  pos = 0;
+  for (msg_index = 0; (pos < len) && active; msg_index++) {
+    memcpy(&msg, req + pos, sizeof(msg));
+    pos += sizeof(msg);
+    dbg_printf("Gang: addr %02X flags %02X len %d buses %02X\n", msg.addr, msg.flags, msg.len, active);
+
+    if ((msg.flags & GANG_POLL) && !restart) {
+      gang_poll(msg.addr);
+    }
+    if (restart) {
+      gang_restart();
+    } else {
+      gang_start();
+    }
+    gang_drop(gang_write((msg.addr << 1) | (msg.flags & GANG_RD)), STATUS_ADDRESS_NACK, true);
+
+    if (msg.flags & GANG_RD) {
+      uint8_t val[GANG_COUNT];
+      for (int i = 0; i < msg.len; i++) {
+        gang_read(val, i == (msg.len-1));
+        for (int bus = 0; bus < GANG_COUNT; bus++) {
+          out[res->out_len + bus*msg.len + i] = (active & (1 << bus)) ? val[bus] : 0xFF;
+        }
+      }
+      res->out_len += msg.len * GANG_COUNT;
+    } else {
+      for (int i = 0; (i < msg.len) && active; i++) {
+        gang_drop(gang_write(req[pos+i]), STATUS_DATA_NACK, true);
+      }
+      pos += msg.len;
+    }
+
+    restart = (msg.flags & GANG_NOSTOP) != 0;
+    if (!restart) {
+      gang_stop();
+    }
+  }
+  if (restart) {
+    gang_stop();
+  }
+
+  // Buses that went to the end are ok
+  for (int i = 0; i < GANG_COUNT; i++) {
+    if (active & (1 << i)) {
+      res->status[i] = STATUS_ADDRESS_ACK;
+    }
+  }
+  gang_select(0);
+  return true;
+}
+
+#else
+
+void i2cgang_init(void) {
+}
+
+uint8_t i2cgang_buses(void) {
+  return 0;
+}
+
+bool i2cgang_run(uint8_t buses, const uint8_t *req, uint16_t len,
+                 struct gang_result *res, uint8_t *out) {
+  memset(res, 0, sizeof(*res));
+  return true;
+}
+
+#endif
@@ -0,0 +1,8 @@
+/*
+ * Gang mode: the same I2C transactions on several buses in lockstep
+ */
+
+void i2cgang_init(void);
+uint8_t i2cgang_buses(void);
+bool i2cgang_run(uint8_t buses, const uint8_t *req, uint16_t len,
+                 struct gang_result *res, uint8_t *out);
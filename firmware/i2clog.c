@@ -0,0 +1,454 @@
+/**
+ * @file i2clog.c
+ * @author Daniel Quadros
+ * @brief Standalone data logger
+ * @date 2024-10-15
+ * 
+ * A script (see i2cscript.h) configured by the host is run periodically,
+ * with or without a host connected, and its output is stored with a
+ * timestamp in a log in the flash. The configuration is also stored in
+ * the flash, so logging resumes after a power up.
+ * 
+ * The log uses LOG_SECTORS sectors as a ring: records are appended to a
+ * page in RAM, that is programmed when full, and the sectors are used in
+ * sequence, erasing the oldest one when the log wraps around. This way
+ * all sectors get the same number of erase cycles. Each sector starts
+ * with a header with a sequence number (used to find the newest sector at
+ * power up) and a "sent" word, that is cleared when all its records were
+ * sent to the host. A record never crosses a page boundary, the rest of
+ * the page is left erased.
+ * 
+ * Records not yet sent are sent through the vendor bulk IN endpoint,
+ * starting from the oldest unsent sector when the host connects. A
+ * partial page is also programmed from time to time (only erased bytes
+ * are changed) so little is lost if the power goes off.
+ * 
+ * The flash is written with flash_safe_execute(), as in i2cboot.c.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/flash.h"
+#include "hardware/flash.h"
+
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cscript.h"
+#include "i2cboot.h"
+#include "i2cprefetch.h"
+#include "usbstream.h"
+#include "i2clog.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+// Flash location: the configuration is in the sector before the boot
+// script (the last one) and the log in the LOG_SECTORS before it
+#define LOG_SECTORS         32
+#define LOG_CONFIG_OFFSET   (PICO_FLASH_SIZE_BYTES - 2*FLASH_SECTOR_SIZE)
+#define LOG_FLASH_OFFSET    (LOG_CONFIG_OFFSET - LOG_SECTORS*FLASH_SECTOR_SIZE)
+
+#define CONFIG_MAGIC        0x474C4932    // "2ILG"
+#define SECTOR_MAGIC        0x534C4932    // "2ILS"
+#define NOT_SENT            0xFFFFFFFF
+
+// a partial page is programmed when it has records older than this
+#define LOG_FLUSH_MS        10000
+
+struct config_header {
+  uint32_t magic;
+  uint32_t period_ms;
+  uint16_t len;
+  uint16_t crc;
+};
+
+struct sector_header {
+  uint32_t magic;
+  uint32_t seq;       // sector sequence number (physical sector = seq % LOG_SECTORS)
+  uint32_t sent;      // NOT_SENT until all records were sent
+};
+
+// Configuration image to write, a multiple of the flash page size
+#define CONFIG_IMAGE_SIZE \
+  (((sizeof(struct config_header) + SCRIPT_MAX_LEN + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE)
+
+// Configuration
+static const uint8_t *code = NULL;    // script (in flash), NULL = not logging
+static uint16_t code_len;
+static uint32_t period_ms;
+static uint64_t next_run_us;
+
+// Write position: sector wr_seq, page at page_off (in RAM, page_len bytes used)
+static uint32_t wr_seq;
+static uint32_t page_off;
+static uint32_t page_len;
+static uint32_t page_saved;           // bytes of the page already in the flash
+static uint64_t page_dirty_us;        // when the first unsaved record was added
+static uint8_t page[FLASH_PAGE_SIZE];
+
+// Next record to send
+static uint32_t rd_seq;
+static uint32_t rd_off;
+
+// LOG_ERASE: requested, sectors still to erase (erase_seq to erase_end - 1)
+static bool erase_requested;
+static uint32_t erase_seq;
+static uint32_t erase_end;
+
+static struct log_status status;
+
+// Flash operations (called with the other core stopped)
+struct flash_op {
+  uint32_t offset;
+  const uint8_t *data;    // NULL to erase a sector
+  uint32_t len;
+};
+
+static void i2clog_flash(void *param) {
+  struct flash_op *op = (struct flash_op *) param;
+  if (op->data == NULL) {
+    flash_range_erase(op->offset, FLASH_SECTOR_SIZE);
+  } else {
+    flash_range_program(op->offset, op->data, op->len);
+  }
+}
+
+static bool i2clog_flash_op(uint32_t offset, const uint8_t *data, uint32_t len) {
+  struct flash_op op = { offset, data, len };
+  if (flash_safe_execute(i2clog_flash, &op, 100) != PICO_OK) {
+    dbg_printf("Log: flash error at %08X\n", offset);
+    status.flash_errors++;
+    return false;
+  }
+  return true;
+}
+
+// Flash offset of a log sector
+static inline uint32_t i2clog_sector_offset(uint32_t seq) {
+  return LOG_FLASH_OFFSET + (seq % LOG_SECTORS) * FLASH_SECTOR_SIZE;
+}
+
+// Header of a log sector
+static inline const struct sector_header *i2clog_sector(uint32_t seq) {
+  return (const struct sector_header *) (XIP_BASE + i2clog_sector_offset(seq));
+}
+
+// Checks if a sector has the records with a sequence number
+static bool i2clog_sector_valid(uint32_t seq) {
+  const struct sector_header *hdr = i2clog_sector(seq);
+  return (hdr->magic == SECTOR_MAGIC) && (hdr->seq == seq);
+}
+
+// Returns a pointer to the log at an offset of a sector (the page being
+// written is in RAM)
+static const uint8_t *i2clog_ptr(uint32_t seq, uint32_t off) {
+  if ((seq == wr_seq) && (off >= page_off)) {
+    return page + (off - page_off);
+  }
+  return (const uint8_t *) i2clog_sector(seq) + off;
+}
+
+// Starts writing a new sector, erasing the oldest records if needed
+static void i2clog_new_sector(uint32_t seq) {
+  if ((seq >= LOG_SECTORS) && (rd_seq <= (seq - LOG_SECTORS))) {
+    dbg_printf("Log: sector %u overwritten before sent\n", seq - LOG_SECTORS);
+    status.overwritten++;
+    rd_seq = seq - LOG_SECTORS + 1;
+    rd_off = 0;
+  }
+  wr_seq = seq;
+  page_off = 0;
+  memset(page, 0xFF, sizeof(page));
+  struct sector_header hdr = { SECTOR_MAGIC, seq, NOT_SENT };
+  memcpy(page, &hdr, sizeof(hdr));
+  page_len = sizeof(hdr);
+
+  // the header is programmed right away, so the sector is found at power up
+  if (i2clog_flash_op(i2clog_sector_offset(seq), NULL, 0)) {
+    i2clog_flash_op(i2clog_sector_offset(seq), page, sizeof(page));
+  }
+  page_saved = page_len;
+}
+
+// Programs the page in RAM, moving to the next one if full
+static void i2clog_save_page(bool next) {
+  if (page_len > page_saved) {
+    i2clog_flash_op(i2clog_sector_offset(wr_seq) + page_off, page, sizeof(page));
+    page_saved = page_len;
+  }
+  if (next) {
+    page_off += FLASH_PAGE_SIZE;
+    if (page_off == FLASH_SECTOR_SIZE) {
+      i2clog_new_sector(wr_seq + 1);
+    } else {
+      memset(page, 0xFF, sizeof(page));
+      page_len = page_saved = 0;
+    }
+  }
+}
+
+// Adds a record to the log
+static void i2clog_append(const struct log_record *rec, const uint8_t *data) {
+  uint32_t size = sizeof(*rec) + rec->len;
+  if ((page_len + size) > FLASH_PAGE_SIZE) {
+    i2clog_save_page(true);
+  }
+  if (page_len == page_saved) {
+    page_dirty_us = time_us_64();
+  }
+  memcpy(page + page_len, rec, sizeof(*rec));
+  memcpy(page + page_len + sizeof(*rec), data, rec->len);
+  page_len += size;
+  status.records++;
+}
+
+// Moves a position to the next record, returns the current one (NULL
+// if there are no more records)
+static const struct log_record *i2clog_next(uint32_t *seq, uint32_t *off) {
+  for (;;) {
+    if (*off == 0) {
+      *off = sizeof(struct sector_header);
+    }
+    if ((*seq == wr_seq) && (*off >= (page_off + page_len))) {
+      return NULL;
+    }
+    uint32_t left = FLASH_PAGE_SIZE - (*off % FLASH_PAGE_SIZE);
+    const struct log_record *rec = (const struct log_record *) i2clog_ptr(*seq, *off);
+    if ((left < sizeof(struct log_record)) || (rec->len == 0xFF)) {
+      // end of the records in this page
+      *off += left;
+      if (*off == FLASH_SECTOR_SIZE) {
+        if (*seq == wr_seq) {
+          return NULL;
+        }
+        (*seq)++;
+        *off = 0;
+      }
+      continue;
+    }
+    *off += sizeof(struct log_record) + rec->len;
+    return rec;
+  }
+}
+
+// Marks a sector as sent
+static void i2clog_mark_sent(uint32_t seq) {
+  uint8_t buf[FLASH_PAGE_SIZE];
+  uint32_t sent = 0;
+  memset(buf, 0xFF, sizeof(buf));
+  memcpy(buf + offsetof(struct sector_header, sent), &sent, sizeof(sent));
+  i2clog_flash_op(i2clog_sector_offset(seq), buf, sizeof(buf));
+}
+
+// Moves the send position to the first sector not sent
+static void i2clog_rewind(bool all) {
+  uint32_t first = (wr_seq >= (LOG_SECTORS - 1)) ? wr_seq - (LOG_SECTORS - 1) : 0;
+  if (first < erase_end) {
+    first = erase_end;    // erased, or still being erased
+  }
+  for (rd_seq = first; rd_seq < wr_seq; rd_seq++) {
+    if (i2clog_sector_valid(rd_seq) && (all || (i2clog_sector(rd_seq)->sent == NOT_SENT))) {
+      break;
+    }
+  }
+  rd_off = 0;
+}
+
+// Sends the records not yet sent (as many as fit in the USB FIFO)
+static void i2clog_send(void) {
+  while (usbstream_available() >= (sizeof(struct usb_record_hdr) + sizeof(struct log_record) + LOG_MAX_DATA)) {
+    uint32_t seq = rd_seq;
+    const struct log_record *rec = i2clog_next(&rd_seq, &rd_off);
+    if ((rd_seq != seq) && (i2clog_sector(seq)->sent == NOT_SENT)) {
+      i2clog_mark_sent(seq);
+    }
+    if (rec == NULL) {
+      break;
+    }
+    usbstream_send(RECORD_DATALOG, rec, sizeof(*rec) + rec->len);
+    status.sent++;
+  }
+}
+
+// Finds the end of the log after a power up
+static void i2clog_find_end(void) {
+  bool found = false;
+  for (uint32_t i = 0; i < LOG_SECTORS; i++) {
+    const struct sector_header *hdr = (const struct sector_header *) 
+                                      (XIP_BASE + LOG_FLASH_OFFSET + i*FLASH_SECTOR_SIZE);
+    if ((hdr->magic == SECTOR_MAGIC) && ((hdr->seq % LOG_SECTORS) == i) && 
+        (!found || (hdr->seq > wr_seq))) {
+      wr_seq = hdr->seq;
+      found = true;
+    }
+  }
+  if (!found) {
+    rd_seq = rd_off = 0;
+    i2clog_new_sector(0);
+    return;
+  }
+
+  // Walk the log to find the last record (all pages are in the flash)
+  page_off = FLASH_SECTOR_SIZE;
+  page_len = 0;
+  i2clog_rewind(true);
+  uint32_t seq = rd_seq, off = 0, end = sizeof(struct sector_header);
+  const struct log_record *rec;
+  while ((rec = i2clog_next(&seq, &off)) != NULL) {
+    status.boot = rec->boot + 1;
+    if (seq == wr_seq) {
+      end = off;
+    }
+  }
+  i2clog_rewind(false);
+
+  // Continue in the page of the last record (only the erased part is programmed)
+  page_off = (end / FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE;
+  if (page_off == FLASH_SECTOR_SIZE) {
+    i2clog_new_sector(wr_seq + 1);
+  } else {
+    memcpy(page, (const uint8_t *) i2clog_sector(wr_seq) + page_off, sizeof(page));
+    page_len = page_saved = end - page_off;
+  }
+}
+
+/* Inits the logger: loads the configuration and finds the end of the log */
+void i2clog_init(void) {
+  const struct config_header *hdr = (const struct config_header *) (XIP_BASE + LOG_CONFIG_OFFSET);
+  const uint8_t *cfg_code = (const uint8_t *) (hdr + 1);
+
+  i2clog_find_end();
+  if ((hdr->magic == CONFIG_MAGIC) && (hdr->len != 0) && (hdr->len <= SCRIPT_MAX_LEN) &&
+      (hdr->period_ms != 0) && (hdr->crc == i2cboot_crc(cfg_code, hdr->len))) {
+    code = cfg_code;
+    code_len = hdr->len;
+    period_ms = hdr->period_ms;
+    next_run_us = time_us_64();
+    dbg_printf("Log: script %d bytes every %u ms\n", code_len, period_ms);
+  }
+}
+
+/* Configures the logger and stores the configuration in the flash
+ * (len = 0 stops logging). Returns false if it could not be stored.
+ */
+bool i2clog_config(const uint8_t *new_code, uint16_t len, uint32_t new_period_ms) {
+  static uint8_t image[CONFIG_IMAGE_SIZE];
+
+  if ((len > SCRIPT_MAX_LEN) || (len && (new_period_ms == 0))) {
+    return false;
+  }
+  code = NULL;
+  memset(image, 0xFF, sizeof(image));
+  uint32_t image_len = 0;
+  if (len) {
+    struct config_header hdr = { CONFIG_MAGIC, new_period_ms, len, i2cboot_crc(new_code, len) };
+    memcpy(image, &hdr, sizeof(hdr));
+    memcpy(image + sizeof(hdr), new_code, len);
+    image_len = ((sizeof(hdr) + len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE;
+  }
+  if (!i2clog_flash_op(LOG_CONFIG_OFFSET, NULL, 0) ||
+      (image_len && !i2clog_flash_op(LOG_CONFIG_OFFSET, image, image_len))) {
+    return false;
+  }
+  if (len) {
+    code = (const uint8_t *) (XIP_BASE + LOG_CONFIG_OFFSET + sizeof(struct config_header));
+    code_len = len;
+    period_ms = new_period_ms;
+    next_run_us = time_us_64();
+  }
+  dbg_printf("Log: script %d bytes every %u ms\n", len, new_period_ms);
+  return true;
+}
+
+/* Executes a LOG_xxx operation, returns false if invalid */
+bool i2clog_ctrl(uint8_t op) {
+  switch (op) {
+    case LOG_FLUSH:
+      i2clog_save_page(false);
+      return true;
+    case LOG_REWIND:
+      i2clog_rewind(true);
+      return true;
+    case LOG_ERASE:
+      erase_requested = true;   // done by i2clog_task, erasing takes too long here
+      return true;
+  }
+  return false;
+}
+
+/* Called when the host connects: sends again the sectors not marked as
+ * sent (records queued before a disconnect may have been lost)
+ */
+void i2clog_mount(void) {
+  i2clog_rewind(false);
+}
+
+// Erases the log: the new records go to a new sector right away and the old
+// sectors are erased one on each call (the sequence numbers continue, so
+// the sectors are still used in turn)
+static void i2clog_erase(void) {
+  if (erase_requested) {
+    erase_requested = false;
+    erase_seq = wr_seq + 2 - LOG_SECTORS;   // the new sector replaces the oldest one
+    erase_end = wr_seq + 1;
+    rd_seq = wr_seq + 1;
+    rd_off = 0;
+    i2clog_new_sector(wr_seq + 1);
+  } else if (erase_seq != erase_end) {
+    if (i2clog_sector_valid(erase_seq)) {
+      i2clog_flash_op(i2clog_sector_offset(erase_seq), NULL, 0);
+    }
+    erase_seq++;
+  }
+}
+
+/* Runs the script when it is time and sends the records, call from the main loop */
+void i2clog_task(void) {
+  uint64_t now = time_us_64();
+
+  i2clog_erase();
+
+  if ((code != NULL) && (now >= next_run_us) && !bbi2c_busy()) {
+    uint8_t out[SCRIPT_MAX_OUT];
+    struct i2c_script_result res;
+    next_run_us += period_ms * 1000ULL;
+    if (next_run_us <= now) {
+      next_run_us = now + period_ms * 1000ULL;    // late, skip the missed runs
+    }
+    i2cprefetch_invalidate(PREFETCH_ALL);
+    i2c_script_run(code, code_len, &res, out);
+    struct log_record rec;
+    rec.len = (res.out_len > LOG_MAX_DATA) ? LOG_MAX_DATA : res.out_len;
+    rec.status = res.status;
+    rec.boot = status.boot;
+    rec.time_ms = (uint32_t) (now / 1000);
+    i2clog_append(&rec, out);
+  }
+
+  if ((page_len > page_saved) && ((now - page_dirty_us) >= (LOG_FLUSH_MS * 1000ULL))) {
+    i2clog_save_page(false);
+  }
+  i2clog_send();
+}
+
+/* Gets the logger status */
+void i2clog_get_status(struct log_status *st) {
+  *st = status;
+  st->enabled = code != NULL;
+  st->sectors = LOG_SECTORS;
+  st->period_ms = code ? period_ms : 0;
+  uint32_t off = rd_off ? rd_off : sizeof(struct sector_header);
+  st->backlog = (wr_seq - rd_seq) * FLASH_SECTOR_SIZE + page_off + page_len - off;
+}
@@ -0,0 +1,10 @@
+/*
+ * Standalone data logger (periodic script, records stored in flash)
+ */
+
+void i2clog_init(void);
+bool i2clog_config(const uint8_t *code, uint16_t len, uint32_t period_ms);
+bool i2clog_ctrl(uint8_t op);
+void i2clog_mount(void);
+void i2clog_task(void);
+void i2clog_get_status(struct log_status *st);
@@ -0,0 +1,209 @@
+/**
+ * @file i2cops.c
+ * @author Daniel Quadros
+ * @brief Higher level I2C operations
+ * @date 2024-10-15
+ * 
+ * Operations that would need several USB requests if done by the host,
+ * executed in the firmware with no gaps between the I2C messages.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cops.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+// Sends (re)start and address, returns status
+static uint8_t i2c_address(uint8_t addr, bool rd, bool first) {
+  if (first) {
+    bbi2c_start();
+  } else {
+    bbi2c_restart();
+  }
+  bool ack = bbi2c_write((addr << 1) | (rd ? 1 : 0));
+  if (bbi2c_bus_error()) {
+    return STATUS_BUS_ERROR;
+  }
+  return ack ? STATUS_ADDRESS_ACK : STATUS_ADDRESS_NACK;
+}
+
+// Writes a 8 or 16 bit value (MSB first), returns status
+static uint8_t i2c_write_value(uint16_t val, bool word) {
+  if (word && !bbi2c_write(val >> 8)) {
+    return bbi2c_bus_error() ? STATUS_BUS_ERROR : STATUS_DATA_NACK;
+  }
+  if (!bbi2c_write(val & 0xFF)) {
+    return bbi2c_bus_error() ? STATUS_BUS_ERROR : STATUS_DATA_NACK;
+  }
+  return STATUS_ADDRESS_ACK;
+}
+
+// Ends an operation, freeing the bus if something went wrong
+static uint8_t i2c_finish(uint8_t status) {
+  if (status == STATUS_BUS_ERROR) {
+    bbi2c_recover();
+  } else {
+    bbi2c_stop();
+    if (bbi2c_bus_error()) {
+      bbi2c_recover();
+      status = STATUS_BUS_ERROR;
+    }
+  }
+  return status;
+}
+
+/* Read-modify-write of a register
+ *
+ * S addr+W reg Sr addr+R old Sr addr+W reg new P
+ */
+uint8_t i2c_rmw(const struct i2c_rmw *op, struct i2c_rmw_result *res) {
+  bool reg16 = op->flags & RMW_REG16;
+  bool val16 = op->flags & RMW_VAL16;
+  uint8_t st;
+
+  dbg_printf("RMW addr=%02X reg=%04X mask=%04X val=%04X\n", op->addr, op->reg, op->mask, op->value);
+  res->old_value = res->new_value = 0;
+
+  // Register pointer
+  st = i2c_address(op->addr, false, true);
+  if (st == STATUS_ADDRESS_ACK) {
+    st = i2c_write_value(op->reg, reg16);
+  }
+
+  // Current value
+  if (st == STATUS_ADDRESS_ACK) {
+    st = i2c_address(op->addr, true, false);
+  }
+  if (st == STATUS_ADDRESS_ACK) {
+    uint16_t old = bbi2c_read(!val16);
+    if (val16) {
+      old = (old << 8) | bbi2c_read(true);
+    }
+    if (bbi2c_bus_error()) {
+      st = STATUS_BUS_ERROR;
+    }
+    res->old_value = old;
+  }
+
+  // New value
+  if (st == STATUS_ADDRESS_ACK) {
+    res->new_value = (res->old_value & ~op->mask) | (op->value & op->mask);
+    st = i2c_address(op->addr, false, false);
+    if (st == STATUS_ADDRESS_ACK) {
+      st = i2c_write_value(op->reg, reg16);
+    }
+    if (st == STATUS_ADDRESS_ACK) {
+      st = i2c_write_value(res->new_value, val16);
+    }
+  }
+
+  res->status = i2c_finish(st);
+  return res->status;
+}
+
+/* Reads the SMBus Alert Response Address
+ *
+ * Returns the address of the device that was asserting SMBALERT#, 
+ * 0xFF if no device answered
+ */
+uint8_t i2c_ara(void) {
+  uint8_t addr = 0xFF;
+  uint8_t st = i2c_address(SMBUS_ARA, true, true);
+  if (st == STATUS_ADDRESS_ACK) {
+    addr = bbi2c_read(true) >> 1;
+    if (bbi2c_bus_error()) {
+      st = STATUS_BUS_ERROR;
+    }
+  }
+  if (i2c_finish(st) != STATUS_ADDRESS_ACK) {
+    addr = 0xFF;
+  }
+  dbg_printf("ARA: %02X\n", addr);
+  return addr;
+}
+
+// Reads 'len' bytes from a register, returns status
+static uint8_t i2c_read_reg(uint8_t addr, uint8_t reg, uint8_t *buf, uint8_t len) {
+  uint8_t st = i2c_address(addr, false, true);
+  if (st == STATUS_ADDRESS_ACK) {
+    st = i2c_write_value(reg, false);
+  }
+  if (st == STATUS_ADDRESS_ACK) {
+    st = i2c_address(addr, true, false);
+  }
+  if (st == STATUS_ADDRESS_ACK) {
+    for (int i = 0; i < len; i++) {
+      buf[i] = bbi2c_read(i == (len-1));
+    }
+    if (bbi2c_bus_error()) {
+      st = STATUS_BUS_ERROR;
+    }
+  }
+  return i2c_finish(st);
+}
+
+/* Finds the fastest clock for a target
+ *
+ * Reads 'len' bytes from register 'reg' at the bus clock and then at 
+ * faster clocks, one step at a time, down to min_period. Each step is
+ * read PROBE_VERIFY times and must return the same data as the bus 
+ * clock. The fastest clock that passed is stored in the target clock 
+ * table and returned; returns 0 if the target did not answer.
+ */
+#define PROBE_VERIFY  4
+
+uint16_t i2c_clock_probe(uint8_t addr, uint8_t reg, uint8_t len, uint16_t min_period) {
+  uint8_t ref[PROBE_MAX_LEN], buf[PROBE_MAX_LEN];
+  uint16_t best = bbi2c_get_clock();
+
+  if (len == 0) {
+    len = 1;
+  } else if (len > PROBE_MAX_LEN) {
+    len = PROBE_MAX_LEN;
+  }
+  if (min_period == 0) {
+    min_period = 1;
+  }
+
+  // Reference read at the bus clock
+  bbi2c_set_target_clock(addr, 0);
+  if (i2c_read_reg(addr, reg, ref, len) != STATUS_ADDRESS_ACK) {
+    dbg_printf("Probe: no answer from %02X\n", addr);
+    return 0;
+  }
+
+  // Try faster clocks (int, so a bus clock period of 0 does not wrap)
+  for (int period = best - 1; period >= min_period; period--) {
+    bool ok = true;
+    bbi2c_set_target_clock(addr, period);
+    for (int i = 0; ok && (i < PROBE_VERIFY); i++) {
+      ok = (i2c_read_reg(addr, reg, buf, len) == STATUS_ADDRESS_ACK) &&
+           (memcmp(buf, ref, len) == 0);
+    }
+    if (!ok) {
+      break;
+    }
+    best = period;
+  }
+
+  bbi2c_set_target_clock(addr, best < bbi2c_get_clock() ? best : 0);
+  dbg_printf("Probe: %02X period %d\n", addr, best);
+  return best;
+}
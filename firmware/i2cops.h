@@ -0,0 +1,9 @@
+/*
+ * Higher level I2C operations, built on the bit-banged primitives
+ */
+
+#define SMBUS_ARA 0x0C    // SMBus Alert Response Address
+
+uint8_t i2c_rmw(const struct i2c_rmw *op, struct i2c_rmw_result *res);
+uint8_t i2c_ara(void);
+uint16_t i2c_clock_probe(uint8_t addr, uint8_t reg, uint8_t len, uint16_t min_period);
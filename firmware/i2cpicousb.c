@@ -13,7 +13,6 @@
  * 
  * TODO:
  * 
- * - Support CMD_SET_DELAY
  * - Support I2C_FUNC_10BIT_ADDR
  * 
  * @copyright Copyright (c) 2024, Daniel Quadros
@@ -31,9 +30,30 @@
 
 #include "bbi2c.h"
 #include "i2cusb.h"
+#include "i2cops.h"
+#include "i2cscript.h"
+#include "usbstream.h"
+#include "alert.h"
+#include "i2csniff.h"
+#include "i2cgang.h"
+#include "i2cfb.h"
+#include "i2cboot.h"
+#include "i2csched.h"
+#include "i2cprefetch.h"
+#include "i2clog.h"
+#include "i2csof.h"
+#if TARGET_EMULATOR
+#include "i2ctarget.h"
+#endif
+#if PROFILE
+#include "i2cprof.h"
+#endif
 #include "hwconfig.h"
+#include "dbglog.h"
 
-#if LIB_PICO_STDIO_UART
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
 #define dbg_printf(...) printf(__VA_ARGS__)
 #else
 #define dbg_printf(...)
@@ -42,7 +62,9 @@
 // Uncomment to send to serial the transfered data
 //#define DEBUG_DATA
 
-#if DEBUG_DATA
+#if DEBUG_DATA && DEBUG_LOG
+#define data_printf(...) dbglog(__VA_ARGS__)
+#elif DEBUG_DATA
 #define data_printf(...) printf(__VA_ARGS__)
 #else
 #define data_printf(...)
@@ -51,11 +73,6 @@
 /* the currently support capability is quite limited */
 const unsigned long func = I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL | I2C_FUNC_NOSTART;
 
-/* I2C status */
-#define STATUS_IDLE	   0
-#define STATUS_ADDRESS_ACK 1
-#define STATUS_ADDRESS_NACK 2
-
 static const uint16_t DEFAULT_PERIOD_US = 10; // 100kHz
 
 static uint8_t status = STATUS_IDLE;
@@ -65,12 +82,81 @@ static uint8_t reply_buf[64];
 // Current command
 static struct i2c_cmd cmd;
 
+// Memory address write held back for a prefetch target (see usb_i2c_setup)
+static struct {
+  bool pending;
+  uint8_t addr;
+  uint8_t len;
+  uint8_t ptr[2];
+} held;
+
+// Retry policy for each target, attempts used and time waited in the current transaction
+#define RETRY_MAX_BACKOFF_US  10000
+#define RETRY_MAX_WAIT_US     200000    // total, well below the host timeout
+static struct i2c_retry retry_policy[128];
+static uint8_t attempts;
+static uint32_t retry_wait_us;
+
+// Start prefetch at the end of the current read
+static bool prefetch_arm;
+static uint16_t prefetch_next;
+
+// Read-modify-write requests and results
+#define RMW_MAX_OPS 32
+static struct i2c_rmw rmw_ops[RMW_MAX_OPS];
+static struct i2c_rmw_result rmw_results[RMW_MAX_OPS];
+static uint8_t rmw_count = 0;
+
+// Script and the result of its execution
+static uint8_t script_code[SCRIPT_MAX_LEN];
+static struct {
+  struct i2c_script_result res;
+  uint8_t out[SCRIPT_MAX_OUT];
+} __attribute__((packed)) script_reply;
+
+// Gang request and its result
+static uint8_t gang_req[GANG_MAX_LEN];
+static struct {
+  struct gang_result res;
+  uint8_t out[GANG_MAX_LEN];
+} __attribute__((packed)) gang_reply;
+
+// Result of the last display update
+static struct fb_result fb_reply;
+
+// SOF sampling request (configuration and script)
+static uint8_t sof_req[sizeof(struct sof_sample_config) + SCRIPT_MAX_LEN];
+
 //--------------------------------------------------------------------+
 // Local routines
 //--------------------------------------------------------------------+
 
 static bool usb_i2c_setup(uint8_t rhport, tusb_control_request_t const* request);
 static bool usb_i2c_data(void);
+static bool usb_i2c_abort(void);
+static bool usb_i2c_held_write(void);
+static bool usb_i2c_address(void);
+static bool usb_get_stats(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_rmw_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_rmw_data(void);
+static bool usb_script_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_script_data(uint16_t len);
+static bool usb_clock_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_gang_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_gang_data(tusb_control_request_t const* request);
+static bool usb_fb_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_fb_data(tusb_control_request_t const* request);
+static bool usb_boot_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_boot_data(tusb_control_request_t const* request);
+static bool usb_retry_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_retry_data(tusb_control_request_t const* request);
+static bool usb_log_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_log_data(tusb_control_request_t const* request);
+static bool usb_sof_setup(uint8_t rhport, tusb_control_request_t const* request);
+static bool usb_sof_data(tusb_control_request_t const* request);
+#if PROFILE
+static bool usb_prof_setup(uint8_t rhport, tusb_control_request_t const* request);
+#endif
 
 //--------------------------------------------------------------------+
 // Main Program
@@ -82,6 +168,16 @@ int main(void)
   stdio_uart_init_full(UART_ID, 115200, TX_PIN, RX_PIN);
   #endif
 
+  // Initialize the binary debug log (if enabled in CMakeList.txt)
+  #if DEBUG_LOG
+  dbglog_init();
+  #endif
+
+  // Initialize the sampling profiler (if enabled in CMakeList.txt)
+  #if PROFILE
+  i2cprof_init();
+  #endif
+
   // Initialize the LED (if available)
   #ifdef LED_PIN
   gpio_init(LED_PIN);
@@ -91,6 +187,15 @@ int main(void)
 
   // Initialize I2C interface
   bbi2c_init(DEFAULT_PERIOD_US);
+  alert_init();
+  i2cgang_init();
+  #if TARGET_EMULATOR
+  i2ctarget_init();
+  #endif
+
+  // Initialize the devices on the bus and the data logger
+  i2cboot_run();
+  i2clog_init();
 
   // Initialize the USB Stack
   dbg_printf("Starting USB\n");
@@ -101,6 +206,16 @@ int main(void)
   while (1)
   {
     tud_task();
+    i2csof_task();
+    alert_task();
+    i2csniff_task();
+    i2csched_task();
+    i2cprefetch_task();
+    i2clog_task();
+    usbstream_task();
+    #if DEBUG_LOG
+    dbglog_task();
+    #endif
   }
 
   return 0;
@@ -116,6 +231,7 @@ void tud_mount_cb(void) {
   gpio_put(LED_PIN, LED_ON);
   #endif
   dbg_printf("Device mounted\n");
+  i2clog_mount();
 }
 
 // Invoked when device is unmounted
@@ -155,15 +271,20 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
           memcpy(reply_buf, &func, sizeof(func));
           return tud_control_xfer(rhport, request, reply_buf, sizeof(func));
 
-        case CMD_SET_DELAY: // TODO
+        case CMD_SET_DELAY:
           /* This was used in i2c-tiny-usb to choose the clock
-           * frequency by specifying the shortest time between
-           * clock edges.
+           * frequency by specifying the clock period in us.
            *
-           * This implementation silently ignores delay requests. We
-           * run the hardware as fast as we are permitted.
+           * Here it selects the bus clock, used for START, address
+           * and STOP and for the data of targets without their
+           * own clock (see CMD_SET_CLOCK). There is no clock with
+           * a period of 0.
            */
           dbg_printf("Set Delay %d\n", request->wValue);
+          if (request->wValue == 0) {
+            return false;
+          }
+          bbi2c_set_clock(request->wValue);
           return tud_control_status(rhport, request);
 
         case CMD_I2C_IO:
@@ -173,9 +294,124 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
           return usb_i2c_setup(rhport, request);
 
         case CMD_GET_STATUS:
+          /* The second byte (not read by the kernel driver) is the
+           * number of attempts used in the last I2C_IO request
+           */
           dbg_printf("Get status\n");
-          memcpy(reply_buf, &status, sizeof(status));
-          return tud_control_xfer(rhport, request, reply_buf, sizeof(status));
+          reply_buf[0] = status;
+          reply_buf[1] = attempts;
+          return tud_control_xfer(rhport, request, reply_buf, (request->wLength < 2) ? 1 : 2);
+
+        case CMD_SET_TIMEOUT: {
+          // 0 would abort on any clock stretching
+          uint32_t timeout_us = ((uint32_t) request->wIndex << 16) | request->wValue;
+          if (timeout_us < TIMEOUT_MIN_US) {
+            return false;
+          }
+          bbi2c_set_timeout(timeout_us);
+          return tud_control_status(rhport, request);
+        }
+
+        case CMD_GET_STATS:
+          return usb_get_stats(rhport, request);
+
+        case CMD_I2C_RMW:
+          i2cprefetch_invalidate(PREFETCH_ALL);
+          return usb_rmw_setup(rhport, request);
+
+        case CMD_I2C_SCRIPT:
+          i2cprefetch_invalidate(PREFETCH_ALL);
+          return usb_script_setup(rhport, request);
+
+        case CMD_SET_ALERT:
+          if (!alert_config(request->wIndex, request->wValue)) {
+            return false;
+          }
+          return tud_control_status(rhport, request);
+
+        case CMD_SET_CLOCK:
+          return usb_clock_setup(rhport, request);
+
+        case CMD_PROBE_CLOCK: {
+          i2cprefetch_invalidate(PREFETCH_ALL);
+          uint16_t period = i2c_clock_probe(request->wIndex & 0x7F, request->wIndex >> 8,
+                                            request->wValue >> 8, request->wValue & 0xFF);
+          memcpy(reply_buf, &period, sizeof(period));
+          return tud_control_xfer(rhport, request, reply_buf, sizeof(period));
+        }
+
+        case CMD_I2C_GANG:
+          return usb_gang_setup(rhport, request);
+
+        case CMD_FB_CONFIG:
+          if (!i2cfb_config(request->wIndex & 0x7F, request->wIndex >> 8, 
+                            request->wValue & 0xFF, request->wValue >> 8)) {
+            return false;
+          }
+          return tud_control_status(rhport, request);
+
+        case CMD_FB_WRITE:
+          i2cprefetch_invalidate(PREFETCH_ALL);
+          return usb_fb_setup(rhport, request);
+
+        case CMD_BOOT_SCRIPT:
+          i2cprefetch_invalidate(PREFETCH_ALL);
+          return usb_boot_setup(rhport, request);
+
+        case CMD_SET_RETRY:
+          return usb_retry_setup(rhport, request);
+
+        case CMD_LOG_CONFIG:
+          return usb_log_setup(rhport, request);
+
+        case CMD_SOF_SAMPLE:
+          return usb_sof_setup(rhport, request);
+
+        case CMD_LOG_CTRL:
+          if (!i2clog_ctrl(request->wValue)) {
+            return false;
+          }
+          return tud_control_status(rhport, request);
+
+        case CMD_SET_PREFETCH:
+          i2cprefetch_config(request->wIndex & 0x7F, request->wIndex >> 8, request->wValue);
+          return tud_control_status(rhport, request);
+
+        case CMD_JOB_ABORT:
+          /* Cancels queued jobs and, if asked, ends the transaction
+           * started by CMD_I2C_IO (the host gave up on it)
+           */
+          dbg_printf("Abort job %d\n", request->wValue & 0xFF);
+          i2csched_abort(request->wValue & 0xFF);
+          if ((request->wIndex & JOB_ABORT_I2C_IO) && bbi2c_busy()) {
+            bbi2c_stop();
+            if (bbi2c_bus_error()) {
+              bbi2c_recover();
+            }
+            status = STATUS_IDLE;
+          }
+          return tud_control_status(rhport, request);
+
+        case CMD_SNIFF:
+          if (request->wValue) {
+            if (!i2csniff_start()) {
+              return false;
+            }
+          } else {
+            i2csniff_stop();
+          }
+          return tud_control_status(rhport, request);
+
+        #if TARGET_EMULATOR
+        case CMD_SET_TARGET:
+          i2ctarget_config(request->wIndex & 0xFF, request->wIndex >> 8, request->wValue);
+          return tud_control_status(rhport, request);
+        #endif
+
+        #if PROFILE
+        case CMD_PROFILE:
+          return usb_prof_setup(rhport, request);
+        #endif
 
       }
       return false; // unsuported request
@@ -186,6 +422,30 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
         case CMD_I2C_IO | CMD_I2C_END:
         case CMD_I2C_IO | CMD_I2C_BEGIN | CMD_I2C_END:
           return usb_i2c_data();
+
+        case CMD_I2C_RMW:
+          return usb_rmw_data();
+
+        case CMD_I2C_SCRIPT:
+          return usb_script_data(request->wLength);
+
+        case CMD_I2C_GANG:
+          return usb_gang_data(request);
+
+        case CMD_FB_WRITE:
+          return usb_fb_data(request);
+
+        case CMD_BOOT_SCRIPT:
+          return usb_boot_data(request);
+
+        case CMD_SET_RETRY:
+          return usb_retry_data(request);
+
+        case CMD_LOG_CONFIG:
+          return usb_log_data(request);
+
+        case CMD_SOF_SAMPLE:
+          return usb_sof_data(request);
       }
       return true;
     default:
@@ -205,25 +465,53 @@ static bool usb_i2c_setup(uint8_t rhport, tusb_control_request_t const* req) {
 	cmd.len = req->wLength;
   dbg_printf("I2CIO Cmd: %d, Addr: %04x, Flags: %04x, Len: %d\n", cmd.cmd, cmd.addr, cmd.flags, cmd.len);
 
-  // Send (re)start
-  if (cmd.cmd & CMD_I2C_BEGIN) {
-    bbi2c_start();
-  } else {
-    bbi2c_restart();
+  // For a prefetch target, the write of the memory address that starts
+  // a read is held until we know if the read can use the prefetch buffer
+  uint8_t awidth = i2cprefetch_awidth(cmd.addr);
+  bool rd = (cmd.flags & I2C_M_RD) != 0;
+  prefetch_arm = false;
+  attempts = 0;
+  retry_wait_us = 0;
+  if (awidth && !rd && (cmd.cmd == (CMD_I2C_IO | CMD_I2C_BEGIN)) && (cmd.len == awidth)) {
+    held.pending = true;
+    held.addr = cmd.addr;
+    held.len = cmd.len;
+    status = STATUS_ADDRESS_ACK;
+    return tud_control_xfer(rhport, req, held.ptr, cmd.len);
+  }
+  if (held.pending) {
+    held.pending = false;
+    if (rd && (cmd.addr == held.addr) && (cmd.cmd & CMD_I2C_END) && (cmd.len != 0)) {
+      uint16_t ptr = (held.len == 2) ? ((held.ptr[0] << 8) | held.ptr[1]) : held.ptr[0];
+      if ((cmd.len <= sizeof(reply_buf)) && i2cprefetch_read(cmd.addr, ptr, reply_buf, cmd.len)) {
+        dbg_printf("Prefetch hit %04X\n", ptr);
+        status = STATUS_ADDRESS_ACK;
+        return tud_control_xfer(rhport, req, reply_buf, cmd.len);
+      }
+      prefetch_arm = true;
+      prefetch_next = ptr + cmd.len;
+    }
+    if (!usb_i2c_held_write()) {
+      return false;
+    }
   }
 
-  // Send Address
-  uint8_t addr = ( cmd.addr << 1 );
-  if (cmd.flags & I2C_M_RD )
-    addr |= 1;  
-  data_printf("Addr = %02X\n", addr);
-  if (bbi2c_write(addr)) {
+  // The address pointer of the target will change
+  i2cprefetch_invalidate(cmd.addr);
+
+  // Send (re)start and address
+  if (usb_i2c_address()) {
     status = STATUS_ADDRESS_ACK;
     if ((cmd.cmd & CMD_I2C_END) && (cmd.len == 0)) {
       // pediu para enviar stop e não tem dados
       dbg_printf("STOP \n");
       bbi2c_stop();  
+      if (bbi2c_bus_error()) {
+        return usb_i2c_abort();
+      }
     }
+  } else if (bbi2c_bus_error()) {
+    return usb_i2c_abort();
   } else {
     status = STATUS_ADDRESS_NACK;
     bbi2c_stop();
@@ -253,6 +541,9 @@ static bool usb_i2c_setup(uint8_t rhport, tusb_control_request_t const* req) {
         data_printf("%02X ",reply_buf[i]);
       }
       data_printf("\n");
+      if (bbi2c_bus_error()) {
+        return usb_i2c_abort();
+      }
       if (!tud_control_xfer(rhport, req, reply_buf, len)) {
         bbi2c_stop();
         dbg_printf("Error in tud_control_xfer\n");
@@ -263,6 +554,12 @@ static bool usb_i2c_setup(uint8_t rhport, tusb_control_request_t const* req) {
       dbg_printf("STOP \n");
       bbi2c_stop();
     }
+    if (bbi2c_bus_error()) {
+      return usb_i2c_abort();
+    }
+    if (prefetch_arm) {
+      i2cprefetch_start(cmd.addr, prefetch_next);
+    }
     return true;
   } else {
     // On writing, we request the data from the USB stack
@@ -275,8 +572,65 @@ static bool usb_i2c_setup(uint8_t rhport, tusb_control_request_t const* req) {
   }
 }
 
+/* Wait before the next attempt: the backoff doubles at each attempt */
+static uint32_t usb_retry_backoff(const struct i2c_retry *policy) {
+  uint32_t backoff = (uint32_t) policy->backoff_us << ((attempts > 8) ? 8 : attempts-1);
+  return (backoff > RETRY_MAX_BACKOFF_US) ? RETRY_MAX_BACKOFF_US : backoff;
+}
+
+/* Checks if the policy allows another attempt (attempts and total wait) */
+static bool usb_retry_more(const struct i2c_retry *policy) {
+  return (attempts < policy->attempts) &&
+         ((retry_wait_us + usb_retry_backoff(policy)) <= RETRY_MAX_WAIT_US);
+}
+
+/* Ends the failed attempt with a STOP and waits before the next one */
+static void usb_retry_wait(const struct i2c_retry *policy) {
+  uint32_t backoff = usb_retry_backoff(policy);
+  bbi2c_stop();
+  busy_wait_us_32(backoff);
+  retry_wait_us += backoff;
+}
+
+/* Sends (re)start and the address of the current command
+ *
+ * An address NACK at the start of a transaction is retried (after a STOP
+ * and a wait that doubles at each attempt) if the target has a retry policy.
+ * Returns true if the address was ACKed.
+ */
+static bool usb_i2c_address(void) {
+  uint8_t addr = ( cmd.addr << 1 );
+  if (cmd.flags & I2C_M_RD )
+    addr |= 1;  
+  struct i2c_retry *policy = &retry_policy[cmd.addr & 0x7F];
+  bool retry = (cmd.cmd & CMD_I2C_BEGIN) && (policy->phases & RETRY_ADDR);
+
+  while (true) {
+    if (attempts) {
+      usb_retry_wait(policy);
+    }
+    attempts++;
+    if (cmd.cmd & CMD_I2C_BEGIN) {
+      bbi2c_start();
+    } else {
+      bbi2c_restart();
+    }
+    data_printf("Addr = %02X\n", addr);
+    if (bbi2c_write(addr)) {
+      return true;
+    }
+    if (!retry || bbi2c_bus_error() || !usb_retry_more(policy)) {
+      return false;
+    }
+    dbg_printf("Retry addr %02X\n", cmd.addr);
+  }
+}
+
 /* Handles an I2C I/O request in the data stage */
 static bool usb_i2c_data() {
+  if (held.pending) {
+    return true;    // memory address was saved in held.ptr
+  }
   if ((cmd.flags & I2C_M_RD) == 0) {
     // We are only interest in writing requests
     // reply_buf has the data from the host
@@ -284,10 +638,27 @@ static bool usb_i2c_data() {
     if (len > sizeof(reply_buf)) {
       len = sizeof(reply_buf);
     }
+    struct i2c_retry *policy = &retry_policy[cmd.addr & 0x7F];
+    bool retry = (cmd.cmd & CMD_I2C_BEGIN) && (policy->phases & RETRY_DATA);
     dbg_printf("Writing %d\n", len);
     for (int i = 0; i < len; i++) {
       data_printf("%02X ",reply_buf[i]);
       if (!bbi2c_write(reply_buf[i])) {
+        if (bbi2c_bus_error()) {
+          return usb_i2c_abort();
+        }
+        if (retry && usb_retry_more(policy)) {
+          // send the message again (the address phase does the wait)
+          dbg_printf("Retry data %02X\n", cmd.addr);
+          if (usb_i2c_address()) {
+            i = -1;
+            continue;
+          }
+          if (bbi2c_bus_error()) {
+            return usb_i2c_abort();
+          }
+          status = STATUS_ADDRESS_NACK;
+        }
         bbi2c_stop();
         dbg_printf("Error in bbi2c_write\n");
         return false;
@@ -297,7 +668,448 @@ static bool usb_i2c_data() {
     if (cmd.cmd & CMD_I2C_END) {
       dbg_printf("STOP \n");
       bbi2c_stop();
+      if (bbi2c_bus_error()) {
+        return usb_i2c_abort();
+      }
+    }
+  }
+  return true;
+}
+
+/* Aborts the current I2C I/O request after a bus error */
+static bool usb_i2c_abort(void) {
+  dbg_printf("Bus error, aborting\n");
+  status = STATUS_BUS_ERROR;
+  bbi2c_recover();
+  return false;
+}
+
+/* Sends the memory address write that was held for a prefetch target
+ * (it starts the transaction, so the retry policy of the target applies)
+ * Returns false (after ending the transaction) if it was not accepted
+ */
+static bool usb_i2c_held_write(void) {
+  struct i2c_retry *policy = &retry_policy[held.addr & 0x7F];
+  i2cprefetch_invalidate(held.addr);
+  while (true) {
+    if (attempts) {
+      usb_retry_wait(policy);
+    }
+    attempts++;
+    status = STATUS_ADDRESS_ACK;
+    bbi2c_start();
+    if (!bbi2c_write(held.addr << 1)) {
+      status = STATUS_ADDRESS_NACK;
+    } else {
+      for (int i = 0; i < held.len; i++) {
+        if (!bbi2c_write(held.ptr[i])) {
+          status = STATUS_DATA_NACK;
+          break;
+        }
+      }
+    }
+    if (bbi2c_bus_error()) {
+      return usb_i2c_abort();
+    }
+    if (status == STATUS_ADDRESS_ACK) {
+      return true;
+    }
+    uint8_t phase = (status == STATUS_ADDRESS_NACK) ? RETRY_ADDR : RETRY_DATA;
+    if (!(policy->phases & phase) || !usb_retry_more(policy)) {
+      break;
+    }
+    dbg_printf("Retry held write %02X\n", held.addr);
+  }
+  bbi2c_stop();
+  dbg_printf("NAK on held write %02X\n", held.addr);
+  return false;
+}
+
+/* Handles a read-modify-write request in the setup stage */
+static bool usb_rmw_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the results from the last request
+    uint16_t len = rmw_count * sizeof(struct i2c_rmw_result);
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    return tud_control_xfer(rhport, req, rmw_results, len);
+  }
+
+  // Get the operations from the host, they will be executed in the DATA stage
+  if ((req->wLength == 0) || (req->wLength > sizeof(rmw_ops)) || 
+      (req->wLength % sizeof(struct i2c_rmw))) {
+    return false;
+  }
+  rmw_count = req->wLength / sizeof(struct i2c_rmw);
+  memset(rmw_results, 0, sizeof(rmw_results));
+  return tud_control_xfer(rhport, req, rmw_ops, req->wLength);
+}
+
+/* Executes the read-modify-write operations received from the host
+ * Stops at the first error, the status of each operation is in the results
+ */
+static bool usb_rmw_data(void) {
+  dbg_printf("RMW %d operations\n", rmw_count);
+  for (int i = 0; i < rmw_count; i++) {
+    status = i2c_rmw(&rmw_ops[i], &rmw_results[i]);
+    if (status != STATUS_ADDRESS_ACK) {
+      break;
+    }
+  }
+  return true;
+}
+
+/* Handles a script request in the setup stage */
+static bool usb_script_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the result from the last execution
+    uint16_t len = sizeof(script_reply.res) + script_reply.res.out_len;
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    return tud_control_xfer(rhport, req, &script_reply, len);
+  }
+
+  // Get the script from the host, it will be executed in the DATA stage
+  if ((req->wLength == 0) || (req->wLength > sizeof(script_code))) {
+    return false;
+  }
+  memset(&script_reply, 0, sizeof(script_reply));
+  return tud_control_xfer(rhport, req, script_code, req->wLength);
+}
+
+/* Runs the script received from the host */
+static bool usb_script_data(uint16_t len) {
+  i2c_script_run(script_code, len, &script_reply.res, script_reply.out);
+  return true;
+}
+
+/* Handles a gang request in the setup stage */
+static bool usb_gang_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the result from the last request
+    uint16_t len = sizeof(gang_reply.res) + gang_reply.res.out_len;
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    return tud_control_xfer(rhport, req, &gang_reply, len);
+  }
+
+  // Get the messages from the host, they will be executed in the DATA stage
+  if ((req->wLength == 0) || (req->wLength > sizeof(gang_req))) {
+    return false;
+  }
+  memset(&gang_reply.res, 0, sizeof(gang_reply.res));
+  return tud_control_xfer(rhport, req, gang_req, req->wLength);
+}
+
+/* Runs the gang request received from the host */
+static bool usb_gang_data(tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    return true;
+  }
+  return i2cgang_run(req->wValue, gang_req, req->wLength, &gang_reply.res, gang_reply.out);
+}
+
+/* Handles a framebuffer request in the setup stage */
+static bool usb_fb_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the result from the last update
+    uint16_t len = sizeof(fb_reply);
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    return tud_control_xfer(rhport, req, &fb_reply, len);
+  }
+
+  if (req->wLength == 0) {
+    // No data, just update the display
+    if (req->wValue & FB_FLUSH) {
+      i2cfb_flush(req->wValue & FB_FULL, &fb_reply);
+    }
+    return tud_control_status(rhport, req);
+  }
+
+  // Get the frame data, the display is updated in the DATA stage
+  if (((uint32_t) req->wIndex + req->wLength) > i2cfb_size()) {
+    return false;
+  }
+  return tud_control_xfer(rhport, req, i2cfb_buffer() + req->wIndex, req->wLength);
+}
+
+/* Updates the display after receiving frame data */
+static bool usb_fb_data(tusb_control_request_t const* req) {
+  if (!(req->bmRequestType & TUSB_DIR_IN_MASK) && (req->wValue & FB_FLUSH)) {
+    i2cfb_flush(req->wValue & FB_FULL, &fb_reply);
+  }
+  return true;
+}
+
+/* Handles a boot script request in the setup stage */
+static bool usb_boot_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the status and the result of the last execution
+    struct boot_result res;
+    i2cboot_get_result(&res);
+    uint16_t len = sizeof(res);
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    memcpy(reply_buf, &res, len);
+    return tud_control_xfer(rhport, req, reply_buf, len);
+  }
+
+  if (req->wLength == 0) {
+    if (req->wValue & BOOT_RUN) {
+      i2cboot_run();
+    } else if (!i2cboot_store(NULL, 0)) {
+      return false;
+    }
+    return tud_control_status(rhport, req);
+  }
+
+  // Get the script, it will be stored in the DATA stage
+  if (req->wLength > sizeof(script_code)) {
+    return false;
+  }
+  return tud_control_xfer(rhport, req, script_code, req->wLength);
+}
+
+/* Stores the boot script received from the host */
+static bool usb_boot_data(tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    return true;
+  }
+  return i2cboot_store(script_code, req->wLength);
+}
+
+/* Handles a data logger configuration request in the setup stage */
+static bool usb_log_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the logger status
+    struct log_status st;
+    i2clog_get_status(&st);
+    uint16_t len = sizeof(st);
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    memcpy(reply_buf, &st, len);
+    return tud_control_xfer(rhport, req, reply_buf, len);
+  }
+
+  if (req->wLength == 0) {
+    // stop logging
+    if (!i2clog_config(NULL, 0, 0)) {
+      return false;
+    }
+    return tud_control_status(rhport, req);
+  }
+
+  // Get the script, it will be stored in the DATA stage
+  if (req->wLength > sizeof(script_code)) {
+    return false;
+  }
+  return tud_control_xfer(rhport, req, script_code, req->wLength);
+}
+
+/* Stores the data logger script received from the host */
+static bool usb_log_data(tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    return true;
+  }
+  return i2clog_config(script_code, req->wLength, req->wValue | ((uint32_t) req->wIndex << 16));
+}
+
+/* Handles a SOF sampling request in the setup stage */
+static bool usb_sof_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the sampling status (with the current frame)
+    struct sof_status st;
+    i2csof_get_status(&st);
+    uint16_t len = sizeof(st);
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    memcpy(reply_buf, &st, len);
+    return tud_control_xfer(rhport, req, reply_buf, len);
+  }
+
+  if (req->wLength == 0) {
+    // stop sampling
+    i2csof_stop();
+    return tud_control_status(rhport, req);
+  }
+
+  // Get the configuration and the script, sampling is started in the DATA stage
+  if ((req->wLength <= sizeof(struct sof_sample_config)) || (req->wLength > sizeof(sof_req))) {
+    return false;
+  }
+  return tud_control_xfer(rhport, req, sof_req, req->wLength);
+}
+
+/* Starts the SOF sampling received from the host */
+static bool usb_sof_data(tusb_control_request_t const* req) {
+  struct sof_sample_config cfg;
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    return true;
+  }
+  memcpy(&cfg, sof_req, sizeof(cfg));
+  return i2csof_start(&cfg, sof_req + sizeof(cfg), req->wLength - sizeof(cfg));
+}
+
+#if PROFILE
+/* Handles a profiler request in the setup stage */
+static bool usb_prof_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return a piece of the profile, sent from where it is
+    const uint8_t *data = NULL;
+    uint16_t len = i2cprof_read(req->wIndex, &data);
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    return tud_control_xfer(rhport, req, (void *) data, len);
+  }
+
+  if (req->wValue == 0) {
+    i2cprof_stop();
+  } else if (!i2cprof_start(req->wValue, req->wIndex)) {
+    return false;
+  }
+  return tud_control_status(rhport, req);
+}
+#endif
+
+/* Handles a retry policy request in the setup stage */
+static bool usb_retry_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  uint8_t addr = req->wIndex & 0xFF;
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the policy for a target
+    uint16_t len = sizeof(struct i2c_retry);
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    memcpy(reply_buf, &retry_policy[addr & 0x7F], len);
+    return tud_control_xfer(rhport, req, reply_buf, len);
+  }
+
+  // Get the policy, it will be set in the DATA stage
+  if (req->wLength != sizeof(struct i2c_retry)) {
+    return false;
+  }
+  return tud_control_xfer(rhport, req, reply_buf, req->wLength);
+}
+
+/* Sets the retry policy for a target (or all targets) */
+static bool usb_retry_data(tusb_control_request_t const* req) {
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    return true;
+  }
+  uint8_t addr = req->wIndex & 0xFF;
+  for (int i = 0; i < 128; i++) {
+    if ((addr == RETRY_ALL) || (addr == i)) {
+      memcpy(&retry_policy[i], reply_buf, sizeof(struct i2c_retry));
     }
   }
   return true;
+}
+
+/* Handles a per target clock request */
+static bool usb_clock_setup(uint8_t rhport, tusb_control_request_t const* req) {
+  static uint8_t table[128];
+
+  if (req->bmRequestType & TUSB_DIR_IN_MASK) {
+    // Return the clock table
+    uint16_t len = sizeof(table);
+    for (int i = 0; i < len; i++) {
+      table[i] = bbi2c_get_target_clock(i);
+    }
+    if (len > req->wLength) {
+      len = req->wLength;
+    }
+    return tud_control_xfer(rhport, req, table, len);
+  }
+
+  bbi2c_set_target_clock(req->wIndex & 0x7F, req->wValue);
+  return tud_control_status(rhport, req);
+}
+
+/* Returns the selected counters */
+static bool usb_get_stats(uint8_t rhport, tusb_control_request_t const* req) {
+  uint16_t len;
+  switch (req->wIndex) {
+    case STATS_BUS: {
+      struct bbi2c_stats st;
+      bbi2c_get_stats(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    case STATS_STREAM: {
+      struct usbstream_stats st;
+      usbstream_get_stats(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    case STATS_SNIFF: {
+      struct i2csniff_stats st;
+      i2csniff_get_stats(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    case STATS_SCHED: {
+      struct i2csched_stats st;
+      i2csched_get_stats(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    case STATS_PREFETCH: {
+      struct i2cprefetch_stats st;
+      i2cprefetch_get_stats(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    case STATS_DATALOG: {
+      struct log_status st;
+      i2clog_get_status(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    case STATS_SOF: {
+      struct sof_status st;
+      i2csof_get_status(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    #if DEBUG_LOG
+    case STATS_LOG: {
+      struct dbglog_stats st;
+      dbglog_get_stats(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    #endif
+    #if TARGET_EMULATOR
+    case STATS_TARGET: {
+      struct i2ctarget_stats st;
+      i2ctarget_get_stats(&st);
+      len = sizeof(st);
+      memcpy(reply_buf, &st, len);
+      break;
+    }
+    #endif
+    default:
+      return false;
+  }
+  if (len > req->wLength) {
+    len = req->wLength;
+  }
+  return tud_control_xfer(rhport, req, reply_buf, len);
 }
\ No newline at end of file
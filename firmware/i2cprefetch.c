@@ -0,0 +1,161 @@
+/**
+ * @file i2cprefetch.c
+ * @author Daniel Quadros
+ * @brief Sequential read prefetch for memories
+ * @date 2024-10-15
+ * 
+ * When the host reads a memory in chunks (write the memory address, read
+ * some bytes) the bus is idle while the host processes a chunk and asks
+ * for the next one. For targets where prefetch is enabled, the end of a
+ * read arms a buffer and, in the main loop, the next bytes are read
+ * (with current address reads, a few bytes at a time) while the bus is
+ * free. If the next read starts at an address in the buffer it is served
+ * without using the bus.
+ * 
+ * There is only one buffer. Any write to the target (and any access to
+ * it by other requests, that would move its address pointer) discards
+ * the buffer.
+ *
+ * The read ahead moves the address pointer of the target past the bytes
+ * the host has read, so a current address read (a read without the
+ * memory address write) would get the bytes after the read ahead. Enable
+ * prefetch only for targets that are always read with the address.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cprefetch.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+// bytes read in each call to i2cprefetch_task (limits the delay
+// of the requests that arrive while reading)
+#define PREFETCH_CHUNK  16
+
+// Configuration
+static uint16_t target_len[128];    // bytes to read ahead, 0 = disabled
+static uint8_t target_awidth[128];  // memory address size (1 or 2 bytes)
+
+// The buffer
+#define NO_TARGET 0xFF
+static uint8_t buffer[PREFETCH_MAX];
+static uint8_t buf_target = NO_TARGET;
+static uint16_t buf_ptr;            // memory address of buffer[0]
+static uint16_t buf_count;          // bytes in the buffer
+static bool buf_stop;               // stop reading ahead (error)
+
+static struct i2cprefetch_stats stats;
+
+/* Configures prefetch for a target (len = 0 disables it) */
+void i2cprefetch_config(uint8_t addr, uint8_t awidth, uint16_t len) {
+  addr &= 0x7F;
+  if (len > PREFETCH_MAX) {
+    len = PREFETCH_MAX;
+  }
+  target_len[addr] = len;
+  target_awidth[addr] = (awidth == 2) ? 2 : 1;
+  i2cprefetch_invalidate(addr);
+  dbg_printf("Prefetch %02X: %d bytes\n", addr, len);
+}
+
+/* Returns the memory address size for a target, 0 if prefetch is not enabled */
+uint8_t i2cprefetch_awidth(uint8_t addr) {
+  addr &= 0x7F;
+  return target_len[addr] ? target_awidth[addr] : 0;
+}
+
+/* Tries to get data from the buffer, returns false if not there */
+bool i2cprefetch_read(uint8_t addr, uint16_t ptr, uint8_t *data, uint16_t len) {
+  if ((addr != buf_target) || (ptr < buf_ptr) ||
+      ((uint32_t) ptr + len > (uint32_t) buf_ptr + buf_count)) {
+    if (target_len[addr & 0x7F]) {
+      stats.misses++;
+    }
+    return false;
+  }
+  memcpy(data, buffer + (ptr - buf_ptr), len);
+
+  // discard up to the end of this read
+  uint16_t used = ptr + len - buf_ptr;
+  buf_count -= used;
+  memmove(buffer, buffer + used, buf_count);
+  buf_ptr += used;
+  stats.hits++;
+  return true;
+}
+
+/* Starts reading ahead (the last read of the target ended at ptr) */
+void i2cprefetch_start(uint8_t addr, uint16_t ptr) {
+  addr &= 0x7F;
+  if (target_len[addr]) {
+    buf_target = addr;
+    buf_ptr = ptr;
+    buf_count = 0;
+    buf_stop = false;
+  }
+}
+
+/* Discards the buffer if it is for addr (PREFETCH_ALL = any) */
+void i2cprefetch_invalidate(uint8_t addr) {
+  if ((buf_target != NO_TARGET) && ((addr == PREFETCH_ALL) || ((addr & 0x7F) == buf_target))) {
+    buf_target = NO_TARGET;
+    stats.invalidations++;
+  }
+}
+
+/* Reads ahead when the bus is free, call from the main loop */
+void i2cprefetch_task(void) {
+  if ((buf_target == NO_TARGET) || buf_stop || bbi2c_busy() ||
+      (buf_count >= target_len[buf_target])) {
+    return;
+  }
+  uint16_t len = target_len[buf_target] - buf_count;
+  if (len > PREFETCH_CHUNK) {
+    len = PREFETCH_CHUNK;
+  }
+
+  // current address read: the target pointer is at buf_ptr + buf_count
+  bbi2c_start();
+  bool ack = bbi2c_write((buf_target << 1) | 1);
+  if (ack) {
+    for (int i = 0; i < len; i++) {
+      buffer[buf_count + i] = bbi2c_read(i == (len-1));
+    }
+  }
+  if (!bbi2c_bus_error()) {
+    bbi2c_stop();
+  }
+  if (bbi2c_bus_error()) {
+    bbi2c_recover();
+    ack = false;
+  }
+  if (ack) {
+    buf_count += len;
+    stats.bytes += len;
+  } else {
+    // the target is busy or not answering, the next read will go to the bus
+    dbg_printf("Prefetch %02X failed\n", buf_target);
+    buf_stop = true;
+  }
+}
+
+/* Gets the counters */
+void i2cprefetch_get_stats(struct i2cprefetch_stats *st) {
+  *st = stats;
+}
@@ -0,0 +1,25 @@
+/*
+ * Sequential read prefetch for memories
+ *
+ * The read ahead moves the address pointer of the target, so prefetch is
+ * only for targets that are always read with a memory address write
+ * (current address reads by the host would skip the bytes read ahead).
+ */
+
+/* Counters */
+struct i2cprefetch_stats {
+  uint32_t hits;          // reads served from the buffer
+  uint32_t misses;        // reads of prefetch targets done on the bus
+  uint32_t bytes;         // bytes read ahead
+  uint32_t invalidations; // buffer discarded (write or other access to the target)
+};
+
+#define PREFETCH_ALL  0xFF  // for i2cprefetch_invalidate
+
+void i2cprefetch_config(uint8_t addr, uint8_t awidth, uint16_t len);
+uint8_t i2cprefetch_awidth(uint8_t addr);
+bool i2cprefetch_read(uint8_t addr, uint16_t ptr, uint8_t *data, uint16_t len);
+void i2cprefetch_start(uint8_t addr, uint16_t ptr);
+void i2cprefetch_invalidate(uint8_t addr);
+void i2cprefetch_task(void);
+void i2cprefetch_get_stats(struct i2cprefetch_stats *st);
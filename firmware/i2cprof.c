@@ -0,0 +1,222 @@
+/**
+ * @file i2cprof.c
+ * @author Daniel Quadros
+ * @brief Sampling profiler
+ * @date 2024-10-15
+ * 
+ * When the firmware is built with PROFILE, a hardware timer alarm
+ * interrupts each core at about period_us and the address where the core
+ * was interrupted (the PC saved in the exception frame) is counted in a
+ * histogram. The histogram has buckets of 1 << shift bytes covering the
+ * code in flash and the code copied to RAM (__not_in_flash_func), for
+ * each core; the host gets it with CMD_PROFILE and finds the functions
+ * in the ELF file (host/linux/prof).
+ * 
+ * The interrupt has the highest priority, so the USB and I2C interrupt
+ * handlers are also sampled; code that runs with the interrupts disabled
+ * is counted in the instruction where they are enabled again. The time
+ * to the next sample is randomized (period_us +/- 25%), so code that runs
+ * at a fixed rate (for example, in each USB frame) is not always hit or
+ * always missed.
+ * 
+ * Core 1 (used by the target emulator) is sampled only if it called
+ * i2cprof_core_init.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/timer.h"
+#include "hardware/irq.h"
+#include "hardware/flash.h"
+
+#include "i2cusb.h"
+#include "i2cprof.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+#if !defined(__arm__)
+#error "The profiler reads the Arm exception frame"
+#endif
+
+#define MAX_CORES   2
+
+// Code areas (from the SDK linker scripts, the RAM functions are in .data)
+extern char __flash_binary_end;
+extern char __data_start__;
+extern char __data_end__;
+
+// Header and counters, sent as they are to the host
+static struct {
+  struct prof_header hdr;
+  uint32_t count[PROF_BUCKETS];
+} prof;
+
+static uint32_t flash_size;
+static uint32_t ram_size;
+static uint32_t *core_count[MAX_CORES];
+static volatile bool running = false;
+
+// Alarm used in each core (-1 = core not sampled)
+static int alarm_num[MAX_CORES] = { -1, -1 };
+
+// Time to the next sample: base + (random & jitter_mask)
+static uint32_t delay_base;
+static uint32_t jitter_mask;
+static uint16_t lfsr[MAX_CORES] = { 0xACE1, 0x1D0F };
+
+// Counts a sample, called from the interrupt entry with the exception frame
+void __not_in_flash_func(i2cprof_sample)(const uint32_t *frame) {
+  uint core = get_core_num();
+  uint alarm = alarm_num[core];
+
+  timer_hw->intr = 1u << alarm;
+  if (!running) {
+    return;
+  }
+  uint16_t r = lfsr[core];
+  r = (r >> 1) ^ (-(r & 1u) & 0xB400u);
+  lfsr[core] = r;
+  timer_hw->alarm[alarm] = timer_hw->timerawl + delay_base + (r & jitter_mask);
+
+  uint32_t pc = frame[6];
+  uint32_t *count = core_count[core];
+  if ((pc - XIP_BASE) < flash_size) {
+    count[(pc - XIP_BASE) >> prof.hdr.shift]++;
+  } else if ((pc - prof.hdr.ram_base) < ram_size) {
+    count[prof.hdr.flash_buckets + ((pc - prof.hdr.ram_base) >> prof.hdr.shift)]++;
+  } else {
+    prof.hdr.other[core]++;
+  }
+  prof.hdr.samples[core]++;
+}
+
+// Interrupt entry: gets the stack with the exception frame (bit 2 of
+// EXC_RETURN in LR) and goes to i2cprof_sample, that returns from the
+// exception
+static void __attribute__((naked)) __not_in_flash_func(i2cprof_isr)(void) {
+  __asm volatile (
+    "movs r0, #4\n"
+    "mov r1, lr\n"
+    "tst r0, r1\n"
+    "beq 1f\n"
+    "mrs r0, psp\n"
+    "b 2f\n"
+    "1:\n"
+    "mrs r0, msp\n"
+    "2:\n"
+    "ldr r1, =i2cprof_sample\n"
+    "bx r1\n"
+    ".ltorg\n"
+  );
+}
+
+/* Sets up sampling in core 0 */
+void i2cprof_init(void) {
+  memset(&prof, 0, sizeof(prof));
+  prof.hdr.flash_base = XIP_BASE;
+  prof.hdr.ram_base = (uint32_t) &__data_start__;
+  flash_size = (uint32_t) &__flash_binary_end - XIP_BASE;
+  ram_size = (uint32_t) &__data_end__ - (uint32_t) &__data_start__;
+  i2cprof_core_init();
+}
+
+/* Sets up sampling in the calling core */
+void i2cprof_core_init(void) {
+  uint core = get_core_num();
+  int alarm = hardware_alarm_claim_unused(false);
+  if (alarm < 0) {
+    dbg_printf("PROF: no alarm for core %u\n", core);
+    return;
+  }
+  uint irq = hardware_alarm_get_irq_num(alarm);
+  irq_set_exclusive_handler(irq, i2cprof_isr);
+  irq_set_priority(irq, PICO_HIGHEST_IRQ_PRIORITY);
+  hw_set_bits(&timer_hw->inte, 1u << alarm);
+  alarm_num[core] = alarm;
+  irq_set_enabled(irq, true);
+}
+
+/* Clears the histogram and starts sampling
+ * shift = log2 of the bucket size (0 = smallest that fits)
+ */
+bool i2cprof_start(uint16_t period_us, uint8_t shift) {
+  if ((period_us < PROF_MIN_PERIOD_US) || (shift > PROF_MAX_SHIFT)) {
+    return false;
+  }
+  i2cprof_stop();
+
+  // Buckets for each core
+  uint8_t cores = (alarm_num[1] >= 0) ? 2 : 1;
+  if (shift < 1) {
+    shift = 1;    // Thumb instructions are at least 2 bytes
+  }
+  uint32_t nflash, nram;
+  for (;; shift++) {
+    nflash = (flash_size + (1u << shift) - 1) >> shift;
+    nram = (ram_size + (1u << shift) - 1) >> shift;
+    if ((cores * (nflash + nram)) <= PROF_BUCKETS) {
+      break;
+    }
+  }
+  memset(prof.count, 0, sizeof(prof.count));
+  memset(prof.hdr.samples, 0, sizeof(prof.hdr.samples));
+  memset(prof.hdr.other, 0, sizeof(prof.hdr.other));
+  prof.hdr.flash_buckets = nflash;
+  prof.hdr.ram_buckets = nram;
+  prof.hdr.shift = shift;
+  prof.hdr.cores = cores;
+  core_count[0] = prof.count;
+  core_count[1] = prof.count + nflash + nram;
+
+  // +/- 25% (rounded to a power of 2)
+  jitter_mask = 1;
+  while ((jitter_mask << 1) <= (period_us / 2)) {
+    jitter_mask <<= 1;
+  }
+  delay_base = period_us - jitter_mask / 2;
+  jitter_mask--;
+
+  dbg_printf("PROF: start %uus, %u cores\n", period_us, cores);
+  dbg_printf("PROF: %u+%u buckets of %u bytes\n", nflash, nram, 1u << shift);
+  prof.hdr.period_us = period_us;
+  running = true;
+  for (int core = 0; core < cores; core++) {
+    timer_hw->alarm[alarm_num[core]] = timer_hw->timerawl + period_us;
+  }
+  return true;
+}
+
+/* Stops sampling (the histogram is kept) */
+void i2cprof_stop(void) {
+  running = false;
+  for (int core = 0; core < MAX_CORES; core++) {
+    if (alarm_num[core] >= 0) {
+      timer_hw->armed = 1u << alarm_num[core];
+    }
+  }
+}
+
+/* Gets the header and the histogram from an offset, returns the size */
+uint16_t i2cprof_read(uint16_t offset, const uint8_t **data) {
+  uint32_t size = sizeof(prof.hdr) + 
+                  (uint32_t) prof.hdr.cores * (prof.hdr.flash_buckets + prof.hdr.ram_buckets) * sizeof(uint32_t);
+  if (offset >= size) {
+    return 0;
+  }
+  *data = (const uint8_t *) &prof + offset;
+  size -= offset;
+  return (size > 0xFFFF) ? 0xFFFF : size;
+}
@@ -0,0 +1,9 @@
+/*
+ * Sampling profiler (firmware built with PROFILE)
+ */
+
+void i2cprof_init(void);
+void i2cprof_core_init(void);
+bool i2cprof_start(uint16_t period_us, uint8_t shift);
+void i2cprof_stop(void);
+uint16_t i2cprof_read(uint16_t offset, const uint8_t **data);
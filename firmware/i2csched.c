@@ -0,0 +1,514 @@
+/**
+ * @file i2csched.c
+ * @author Daniel Quadros
+ * @brief Job scheduler with priority classes
+ * @date 2024-10-15
+ * 
+ * Jobs received through the bulk OUT endpoint are put in a queue for 
+ * their priority class. Each call to i2csched_task() executes one chunk
+ * (a complete I2C transaction) of a job in the highest priority queue
+ * that has a job ready to run. Long jobs (memory reads and writes) are
+ * split in chunks at points where a STOP is allowed (read chunks and
+ * memory pages), so high priority jobs and control requests are served
+ * between the chunks.
+ * 
+ * Each job selects a bus: the main bus or one of the gang buses (used
+ * one at a time through i2cgang_run). Jobs for the same bus are done in
+ * order, but jobs for different buses take turns, one chunk each, so
+ * they end (and are reported) in any order. While a memory is busy
+ * writing a page (NACKs its address) its job waits and the jobs of the
+ * other buses (or the next ones in the same bus, for other targets) use
+ * the time.
+ *
+ * Jobs with a deadline are checked before each chunk and, during a chunk,
+ * the clock stretch timeout is limited to the time left (not less than
+ * TIMEOUT_MIN_US, a shorter one would fail on normal stretching). As
+ * the bus is always released between chunks, aborting a job just removes
+ * it from the queue.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tusb.h"
+#include "pico/stdlib.h"
+
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "usbstream.h"
+#include "i2csched.h"
+#include "i2cprefetch.h"
+#include "i2cgang.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+#define QUEUE_DEPTH 8
+
+// maximum time for a memory page write
+#define WRITE_TIMEOUT_US 20000
+
+// interval to check if a memory finished writing a page
+#define WRITE_POLL_US 200
+
+// main bus + gang buses
+#define MAX_BUSES (1 + GANG_MAX_BUSES)
+
+struct job {
+  struct job_req req;
+  uint8_t data[JOB_MAX_DATA];
+  uint16_t done;          // bytes transferred
+  bool started;
+  uint32_t rx_time;       // when it was received
+  uint32_t wait_us;       // time until the first chunk
+  uint32_t write_time;    // when the last page was written
+  uint32_t next_try;      // when to check again a busy memory
+  uint32_t bus_us;        // time spent in the chunks
+};
+
+// Time left to the deadline of a job, 0 if expired (UINT32_MAX if no deadline)
+static uint32_t i2csched_time_left(struct job *job) {
+  if (job->req.deadline_us == 0) {
+    return UINT32_MAX;
+  }
+  uint32_t elapsed = time_us_32() - job->rx_time;
+  return (elapsed >= job->req.deadline_us) ? 0 : job->req.deadline_us - elapsed;
+}
+
+static struct {
+  struct job job[QUEUE_DEPTH];
+  uint8_t head;
+  uint8_t count;
+} queue[JOB_CLASSES];
+
+// Bus of the last chunk (buses take turns)
+static uint8_t last_bus;
+
+// Job being received
+static uint8_t rx_buf[sizeof(struct job_req) + JOB_MAX_DATA];
+static uint16_t rx_len;
+static uint16_t rx_discard;   // data of a rejected job still in the stream
+
+static struct i2csched_stats stats;
+
+// Sends the end of a job
+static void i2csched_done(struct job *job, uint8_t status) {
+  struct job_done_record rec;
+  rec.id = job->req.id;
+  rec.status = status;
+  rec.count = job->done;
+  rec.wait_us = job->wait_us;
+  rec.total_us = time_us_32() - job->rx_time;
+  rec.bus_us = job->bus_us;
+  usbstream_send(RECORD_JOB_DONE, &rec, sizeof(rec));
+  dbg_printf("Job %d done: status %d, %d bytes\n", rec.id, status, rec.count);
+}
+
+// Checks a job
+static bool i2csched_valid(const struct job_req *req) {
+  if ((req->prio >= JOB_CLASSES) || (req->wlen > JOB_MAX_DATA) ||
+      (req->bus > i2cgang_buses())) {
+    return false;
+  }
+  switch (req->op) {
+    case JOB_XFER:
+      return ((req->wlen != 0) || (req->rlen != 0)) && (req->rlen <= JOB_MAX_CHUNK);
+    case JOB_MEM_READ:
+      return (req->rlen != 0) && (req->chunk != 0) && (req->chunk <= JOB_MAX_CHUNK);
+    case JOB_MEM_WRITE:
+      return (req->wlen != 0) && (req->chunk != 0);
+  }
+  return false;
+}
+
+// Gets jobs from the bulk OUT endpoint
+static void i2csched_receive(void) {
+  while (true) {
+    // Drop the rest of a rejected job to stay in sync
+    if (rx_discard != 0) {
+      uint32_t n = tud_vendor_available();
+      if (n == 0) {
+        return;
+      }
+      if (n > rx_discard) {
+        n = rx_discard;
+      }
+      if (n > sizeof(rx_buf)) {
+        n = sizeof(rx_buf);
+      }
+      rx_discard -= tud_vendor_read(rx_buf, n);
+      continue;
+    }
+
+    // Get the header, then the data
+    uint16_t need = sizeof(struct job_req);
+    if (rx_len >= need) {
+      need += ((struct job_req *) rx_buf)->wlen;
+      if (need > sizeof(rx_buf)) {
+        need = sizeof(rx_buf);    // will be rejected
+      }
+    }
+    if (rx_len < need) {
+      uint32_t n = tud_vendor_available();
+      if (n == 0) {
+        return;
+      }
+      if (n > (need - rx_len)) {
+        n = need - rx_len;
+      }
+      rx_len += tud_vendor_read(rx_buf + rx_len, n);
+      continue;
+    }
+
+    // Got a job
+    struct job_req *req = (struct job_req *) rx_buf;
+    if (!i2csched_valid(req)) {
+      struct job job;
+      memset(&job, 0, sizeof(job));
+      job.req = *req;
+      job.rx_time = time_us_32();
+      i2csched_done(&job, JOB_STATUS_REJECTED);
+      rx_discard = sizeof(struct job_req) + req->wlen - rx_len;
+      rx_len = 0;
+      continue;
+    }
+    uint8_t cls = req->prio;
+    if (queue[cls].count == QUEUE_DEPTH) {
+      return;   // keep it until there is space
+    }
+    struct job *job = &queue[cls].job[(queue[cls].head + queue[cls].count) % QUEUE_DEPTH];
+    memset(job, 0, sizeof(*job));
+    memcpy(&job->req, rx_buf, need);
+    job->rx_time = time_us_32();
+    queue[cls].count++;
+    stats.cls[cls].depth = queue[cls].count;
+    if (queue[cls].count > stats.cls[cls].max_depth) {
+      stats.cls[cls].max_depth = queue[cls].count;
+    }
+    rx_len = 0;
+  }
+}
+
+// Does a transaction on the main bus: write wlen bytes and/or read rlen
+// bytes (with a repeated start), returns the status
+static uint8_t i2csched_xfer_main(uint8_t addr, const uint8_t *wbuf, uint16_t wlen,
+                                  uint8_t *rbuf, uint16_t rlen) {
+  uint8_t st = STATUS_ADDRESS_ACK;
+  bool first = true;
+
+  if (wlen) {
+    bbi2c_start();
+    first = false;
+    if (!bbi2c_write(addr << 1)) {
+      st = STATUS_ADDRESS_NACK;
+    }
+    for (int i = 0; (i < wlen) && (st == STATUS_ADDRESS_ACK); i++) {
+      if (!bbi2c_write(wbuf[i])) {
+        st = STATUS_DATA_NACK;
+      }
+    }
+  }
+  if ((st == STATUS_ADDRESS_ACK) && rlen) {
+    if (first) {
+      bbi2c_start();
+    } else {
+      bbi2c_restart();
+    }
+    if (bbi2c_write((addr << 1) | 1)) {
+      for (int i = 0; i < rlen; i++) {
+        rbuf[i] = bbi2c_read(i == (rlen-1));
+      }
+    } else {
+      st = STATUS_ADDRESS_NACK;
+    }
+  }
+
+  // End the transaction
+  if (!bbi2c_bus_error()) {
+    bbi2c_stop();
+  }
+  if (bbi2c_bus_error()) {
+    bbi2c_recover();
+    st = STATUS_BUS_ERROR;
+  }
+  return st;
+}
+
+// Does a transaction on a gang bus (1 to GANG_MAX_BUSES), returns the status
+static uint8_t i2csched_xfer_gang(uint8_t bus, uint8_t addr, const uint8_t *wbuf, uint16_t wlen,
+                                  uint8_t *rbuf, uint16_t rlen) {
+  static uint8_t req[2*sizeof(struct gang_msg) + 2 + JOB_MAX_DATA];
+  static uint8_t out[GANG_MAX_LEN];
+  struct gang_result res;
+  uint16_t len = 0;
+
+  if (wlen) {
+    struct gang_msg msg = { addr, rlen ? GANG_NOSTOP : 0, wlen };
+    memcpy(req, &msg, sizeof(msg));
+    memcpy(req + sizeof(msg), wbuf, wlen);
+    len = sizeof(msg) + wlen;
+  }
+  if (rlen) {
+    struct gang_msg msg = { addr, GANG_RD, rlen };
+    memcpy(req + len, &msg, sizeof(msg));
+    len += sizeof(msg);
+  }
+  if (!i2cgang_run(1 << (bus-1), req, len, &res, out)) {
+    return STATUS_BUS_ERROR;
+  }
+  if (rlen) {
+    memcpy(rbuf, out + (bus-1)*rlen, rlen);   // read data is grouped by bus
+  }
+  return res.status[bus-1];
+}
+
+// Does a transaction on the bus of a job
+static uint8_t i2csched_xfer(struct job *job, const uint8_t *wbuf, uint16_t wlen,
+                             uint8_t *rbuf, uint16_t rlen) {
+  if (job->req.bus == 0) {
+    i2cprefetch_invalidate(job->req.addr);
+    return i2csched_xfer_main(job->req.addr, wbuf, wlen, rbuf, rlen);
+  }
+  return i2csched_xfer_gang(job->req.bus, job->req.addr, wbuf, wlen, rbuf, rlen);
+}
+
+// Sends read data
+static void i2csched_send_data(struct job *job, const uint8_t *data, uint16_t len) {
+  uint8_t rec[sizeof(struct job_data_record) + JOB_MAX_CHUNK];
+  struct job_data_record hdr = { job->req.id, 0, job->done };
+  memcpy(rec, &hdr, sizeof(hdr));
+  memcpy(rec + sizeof(hdr), data, len);
+  usbstream_send(RECORD_JOB_DATA, rec, sizeof(hdr) + len);
+}
+
+// Executes a chunk of a job, returns true if the job ended
+static bool i2csched_chunk(struct job *job, uint8_t *status) {
+  struct job_req *req = &job->req;
+  uint8_t buf[2 + JOB_MAX_DATA];
+  uint8_t st;
+
+  switch (req->op) {
+    case JOB_XFER: {
+      st = i2csched_xfer(job, job->data, req->wlen, buf, req->rlen);
+      if (st == STATUS_ADDRESS_ACK) {
+        if (req->rlen) {
+          i2csched_send_data(job, buf, req->rlen);
+        }
+        job->done = req->wlen + req->rlen;
+      }
+      *status = st;
+      return true;
+    }
+
+    case JOB_MEM_READ: {
+      uint16_t len = req->rlen - job->done;
+      if (len > req->chunk) {
+        len = req->chunk;
+      }
+      uint16_t mem = req->mem_addr + job->done;
+      uint8_t maddr[2] = { mem >> 8, mem & 0xFF };
+      bool mem16 = req->flags & JOB_MEM16;
+      st = i2csched_xfer(job, mem16 ? maddr : maddr+1, mem16 ? 2 : 1, buf, len);
+      if (st == STATUS_ADDRESS_ACK) {
+        i2csched_send_data(job, buf, len);
+        job->done += len;
+      }
+      *status = st;
+      return (st != STATUS_ADDRESS_ACK) || (job->done == req->rlen);
+    }
+
+    case JOB_MEM_WRITE: {
+      uint16_t mem = req->mem_addr + job->done;
+      uint16_t len = req->chunk - (mem % req->chunk);   // up to the end of the page
+      if (len > (req->wlen - job->done)) {
+        len = req->wlen - job->done;
+      }
+      bool mem16 = req->flags & JOB_MEM16;
+      uint8_t alen = 0;
+      if (mem16) {
+        buf[alen++] = mem >> 8;
+      }
+      buf[alen++] = mem & 0xFF;
+      memcpy(buf + alen, job->data + job->done, len);
+      st = i2csched_xfer(job, buf, alen + len, NULL, 0);
+      if ((st == STATUS_ADDRESS_NACK) && (job->done != 0) &&
+          ((time_us_32() - job->write_time) < WRITE_TIMEOUT_US)) {
+        job->next_try = time_us_32() + WRITE_POLL_US;
+        return false;   // still writing the previous page
+      }
+      if (st == STATUS_ADDRESS_ACK) {
+        job->done += len;
+        job->write_time = time_us_32();
+      }
+      *status = st;
+      return (st != STATUS_ADDRESS_ACK) || (job->done == req->wlen);
+    }
+  }
+  *status = JOB_STATUS_REJECTED;
+  return true;
+}
+
+// Removes a job from a queue
+static void i2csched_delete(int cls, int i) {
+  for (; i < (queue[cls].count - 1); i++) {
+    queue[cls].job[(queue[cls].head + i) % QUEUE_DEPTH] = 
+      queue[cls].job[(queue[cls].head + i + 1) % QUEUE_DEPTH];
+  }
+  queue[cls].count--;
+  stats.cls[cls].depth = queue[cls].count;
+}
+
+// Checks if a job is waiting for a memory write
+static bool i2csched_waiting(const struct job *job) {
+  return (job->next_try != 0) && ((int32_t) (time_us_32() - job->next_try) < 0);
+}
+
+// Checks if a job of a class comes after a job for the same target
+static bool i2csched_after_target(int cls, int i) {
+  const struct job *job = &queue[cls].job[(queue[cls].head + i) % QUEUE_DEPTH];
+  for (int j = 0; j < i; j++) {
+    const struct job *prev = &queue[cls].job[(queue[cls].head + j) % QUEUE_DEPTH];
+    if ((prev->req.bus == job->req.bus) && (prev->req.addr == job->req.addr)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Chooses the next job to run in a class, returns its index or -1
+//
+// Only the first job of each bus can run. A job waiting for a memory
+// write is passed over, so the next job of its bus can run (if it is not
+// for the same target). The bus after the one used in the last chunk is
+// preferred, so the buses take turns.
+static int i2csched_select(int cls) {
+  int best = -1;
+  int best_dist = MAX_BUSES;
+  uint16_t seen = 0;
+  for (int i = 0; i < queue[cls].count; i++) {
+    struct job *job = &queue[cls].job[(queue[cls].head + i) % QUEUE_DEPTH];
+    uint8_t bus = job->req.bus;
+    if (seen & (1 << bus)) {
+      continue;   // jobs for a bus are done in order
+    }
+    if (i2csched_waiting(job) || i2csched_after_target(cls, i)) {
+      continue;   // the bus is free for the next job
+    }
+    seen |= 1 << bus;
+    if ((bus == 0) && bbi2c_busy()) {
+      continue;
+    }
+    int dist = (bus + MAX_BUSES - last_bus - 1) % MAX_BUSES;
+    if (dist < best_dist) {
+      best = i;
+      best_dist = dist;
+    }
+  }
+  return best;
+}
+
+// Removes from the queues the jobs with an id (or, if id < 0, the jobs
+// past their deadline), returns the number of jobs removed
+static int i2csched_remove(int id, uint8_t status) {
+  int removed = 0;
+  for (int cls = 0; cls < JOB_CLASSES; cls++) {
+    for (int i = 0; i < queue[cls].count; i++) {
+      struct job *job = &queue[cls].job[(queue[cls].head + i) % QUEUE_DEPTH];
+      if ((id < 0) ? (i2csched_time_left(job) == 0) : (job->req.id == id)) {
+        i2csched_done(job, status);
+        if (status == JOB_STATUS_DEADLINE) {
+          stats.cls[cls].expired++;
+        } else {
+          stats.cls[cls].aborted++;
+        }
+        removed++;
+        i2csched_delete(cls, i);
+        i--;
+      }
+    }
+  }
+  return removed;
+}
+
+/* Receives and executes jobs, call from the main loop */
+void i2csched_task(void) {
+  i2csched_receive();
+  i2csched_remove(-1, JOB_STATUS_DEADLINE);
+
+  // Wait for space for the records
+  if (usbstream_available() < (sizeof(struct usb_record_hdr) + sizeof(struct job_data_record) +
+                               JOB_MAX_CHUNK + sizeof(struct usb_record_hdr) + sizeof(struct job_done_record))) {
+    return;
+  }
+
+  for (int cls = 0; cls < JOB_CLASSES; cls++) {
+    int i = i2csched_select(cls);
+    if (i < 0) {
+      continue;
+    }
+    struct job *job = &queue[cls].job[(queue[cls].head + i) % QUEUE_DEPTH];
+
+    if (!job->started) {
+      job->started = true;
+      job->wait_us = time_us_32() - job->rx_time;
+      stats.cls[cls].wait_us_total += job->wait_us;
+      if (job->wait_us > stats.cls[cls].wait_us_max) {
+        stats.cls[cls].wait_us_max = job->wait_us;
+      }
+    }
+    // a stuck target must not hold the bus beyond the deadline
+    uint8_t status = JOB_STATUS_REJECTED;
+    uint32_t timeout = bbi2c_get_timeout();
+    uint32_t left = i2csched_time_left(job);
+    if (left < TIMEOUT_MIN_US) {
+      left = TIMEOUT_MIN_US;
+    }
+    bool limited = left < timeout;
+    if (limited) {
+      bbi2c_swap_timeout(left);
+    }
+    stats.cls[cls].chunks++;
+    last_bus = job->req.bus;
+    uint32_t start = time_us_32();
+    bool end = i2csched_chunk(job, &status);
+    job->bus_us += time_us_32() - start;
+    if (limited) {
+      bbi2c_swap_timeout(timeout);
+    }
+    if (i2csched_time_left(job) == 0) {
+      if (!end || (status == STATUS_BUS_ERROR)) {
+        status = JOB_STATUS_DEADLINE;
+        end = true;
+      }
+    }
+    if (end) {
+      if (status == JOB_STATUS_DEADLINE) {
+        stats.cls[cls].expired++;
+      }
+      i2csched_done(job, status);
+      i2csched_delete(cls, i);
+      stats.cls[cls].jobs++;
+    }
+    return;
+  }
+}
+
+/* Cancels the queued jobs with an id, returns the number of jobs removed */
+int i2csched_abort(uint8_t id) {
+  return i2csched_remove(id, JOB_STATUS_ABORTED);
+}
+
+/* Gets the counters */
+void i2csched_get_stats(struct i2csched_stats *st) {
+  *st = stats;
+}
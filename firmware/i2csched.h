@@ -0,0 +1,23 @@
+/*
+ * Job scheduler (jobs received through the bulk OUT endpoint)
+ */
+
+/* Counters for each priority class */
+struct i2csched_class_stats {
+  uint32_t jobs;          // jobs ended by execution (not aborted or expired in the queue)
+  uint32_t chunks;        // I2C transactions executed
+  uint32_t depth;         // jobs in the queue now
+  uint32_t max_depth;     // maximum jobs in the queue
+  uint32_t wait_us_total; // sum of the time waiting for the first chunk
+  uint32_t wait_us_max;   // maximum time waiting for the first chunk
+  uint32_t aborted;       // jobs cancelled by the host
+  uint32_t expired;       // jobs not done before their deadline
+};
+
+struct i2csched_stats {
+  struct i2csched_class_stats cls[JOB_CLASSES];
+};
+
+void i2csched_task(void);
+int i2csched_abort(uint8_t id);
+void i2csched_get_stats(struct i2csched_stats *st);
@@ -0,0 +1,286 @@
+/**
+ * @file i2cscript.c
+ * @author Daniel Quadros
+ * @brief I2C script interpreter
+ * @date 2024-10-15
+ * 
+ * Runs a small bytecode uploaded by the host, so a sequence of I2C
+ * operations (with waits, polling and decisions) can be done in the 
+ * device with no USB round trips.
+ * 
+ * Every instruction and operand is checked against the script length and 
+ * the number of instructions and the execution time are limited, so a 
+ * bad script cannot hang the adapter. The bus is always released at the end.
+ * 
+ * This uses only the bbi2c primitives and the SDK timer, so it can be
+ * tested in a PC (see tests/linux/tscript).
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "bbi2c.h"
+#include "i2cscript.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+// Wait between the attempts of OP_POLL
+#define POLL_WAIT_US  100
+
+// Interpreter state
+struct script_ctx {
+  const uint8_t *code;
+  uint16_t len;
+  uint16_t pc;
+  uint8_t rd_buf[SCRIPT_MAX_READ];
+  uint8_t rd_len;
+  uint16_t counter[SCRIPT_COUNTERS];
+  bool in_transfer;   // START sent and no STOP
+  uint32_t start_us;  // when the script started
+};
+
+// Gets operands for the current instruction, returns NULL if past the end
+static const uint8_t *script_operands(struct script_ctx *ctx, uint16_t n) {
+  if ((uint32_t) ctx->pc + 1 + n > ctx->len) {
+    return NULL;
+  }
+  const uint8_t *p = ctx->code + ctx->pc + 1;
+  ctx->pc += 1 + n;
+  return p;
+}
+
+// Gets a 16-bit operand
+static inline uint16_t get16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+// Evaluates a branch condition
+static bool script_cond(uint8_t cond, uint8_t b, uint8_t val, bool *ok) {
+  *ok = true;
+  switch (cond) {
+    case COND_EQ:     return b == val;
+    case COND_NE:     return b != val;
+    case COND_GT:     return b > val;
+    case COND_LT:     return b < val;
+    case COND_SET:    return (b & val) != 0;
+    case COND_CLEAR:  return (b & val) == 0;
+  }
+  *ok = false;
+  return false;
+}
+
+// Executes one instruction, returns SCRIPT_OK to continue
+static uint8_t script_step(struct script_ctx *ctx, struct i2c_script_result *res, 
+                           uint8_t *out, bool *end) {
+  const uint8_t *op;
+  uint8_t opcode = ctx->code[ctx->pc];
+  bool ok;
+
+  switch (opcode) {
+    case OP_END:
+      *end = true;
+      return SCRIPT_OK;
+
+    case OP_START:
+    case OP_RESTART:
+      ctx->pc++;
+      if (ctx->in_transfer) {
+        bbi2c_restart();
+      } else {
+        bbi2c_start();
+      }
+      ctx->in_transfer = true;
+      break;
+
+    case OP_STOP:
+      ctx->pc++;
+      if (ctx->in_transfer) {
+        bbi2c_stop();
+        ctx->in_transfer = false;
+      }
+      break;
+
+    case OP_ADDR:
+      if (!ctx->in_transfer || ((op = script_operands(ctx, 1)) == NULL)) {
+        return SCRIPT_BAD_CODE;
+      }
+      if (!bbi2c_write(op[0])) {
+        return bbi2c_bus_error() ? SCRIPT_BUS_ERROR : SCRIPT_ADDRESS_NACK;
+      }
+      break;
+
+    case OP_WRITE:
+      if (!ctx->in_transfer || (ctx->pc + 1 >= ctx->len) || 
+          ((op = script_operands(ctx, 1 + ctx->code[ctx->pc + 1])) == NULL)) {
+        return SCRIPT_BAD_CODE;
+      }
+      for (int i = 0; i < op[0]; i++) {
+        if (!bbi2c_write(op[1+i])) {
+          return bbi2c_bus_error() ? SCRIPT_BUS_ERROR : SCRIPT_DATA_NACK;
+        }
+      }
+      break;
+
+    case OP_READ:
+      if (!ctx->in_transfer || ((op = script_operands(ctx, 1)) == NULL) || 
+          (op[0] == 0) || (op[0] > SCRIPT_MAX_READ)) {
+        return SCRIPT_BAD_CODE;
+      }
+      ctx->rd_len = op[0];
+      for (int i = 0; i < ctx->rd_len; i++) {
+        ctx->rd_buf[i] = bbi2c_read(i == (ctx->rd_len - 1));
+      }
+      if (bbi2c_bus_error()) {
+        return SCRIPT_BUS_ERROR;
+      }
+      break;
+
+    case OP_WAIT_US:
+      if ((op = script_operands(ctx, 2)) == NULL) {
+        return SCRIPT_BAD_CODE;
+      }
+      if (((time_us_32() - ctx->start_us) + get16(op)) > SCRIPT_MAX_TIME_US) {
+        return SCRIPT_LIMIT;    // the wait would go past the time limit
+      }
+      busy_wait_us_32(get16(op));
+      break;
+
+    case OP_OUT:
+      if (((op = script_operands(ctx, 2)) == NULL) || 
+          ((op[0] + op[1]) > ctx->rd_len) ||
+          ((res->out_len + op[1]) > SCRIPT_MAX_OUT)) {
+        return SCRIPT_BAD_CODE;
+      }
+      memcpy(out + res->out_len, ctx->rd_buf + op[0], op[1]);
+      res->out_len += op[1];
+      break;
+
+    case OP_JMP:
+      if ((op = script_operands(ctx, 2)) == NULL) {
+        return SCRIPT_BAD_CODE;
+      }
+      ctx->pc = get16(op);
+      break;
+
+    case OP_BRANCH:
+      if (((op = script_operands(ctx, 5)) == NULL) || (op[1] >= ctx->rd_len)) {
+        return SCRIPT_BAD_CODE;
+      }
+      if (script_cond(op[0], ctx->rd_buf[op[1]], op[2], &ok)) {
+        ctx->pc = get16(op+3);
+      }
+      if (!ok) {
+        return SCRIPT_BAD_CODE;
+      }
+      break;
+
+    case OP_SETCNT:
+      if (((op = script_operands(ctx, 3)) == NULL) || (op[0] >= SCRIPT_COUNTERS)) {
+        return SCRIPT_BAD_CODE;
+      }
+      ctx->counter[op[0]] = get16(op+1);
+      break;
+
+    case OP_LOOP:
+      if (((op = script_operands(ctx, 3)) == NULL) || (op[0] >= SCRIPT_COUNTERS)) {
+        return SCRIPT_BAD_CODE;
+      }
+      if ((ctx->counter[op[0]] != 0) && (--ctx->counter[op[0]] != 0)) {
+        ctx->pc = get16(op+1);
+      }
+      break;
+
+    case OP_FAIL:
+      if ((op = script_operands(ctx, 1)) == NULL) {
+        return SCRIPT_BAD_CODE;
+      }
+      res->fail_code = op[0];
+      return SCRIPT_FAIL;
+
+    case OP_POLL: {
+      if (ctx->in_transfer || ((op = script_operands(ctx, 3)) == NULL)) {
+        return SCRIPT_BAD_CODE;
+      }
+      // a device busy with a write cycle NACKs its address
+      uint32_t poll_start = time_us_32();
+      while (true) {
+        bbi2c_start();
+        bool ack = bbi2c_write(op[0]);
+        bbi2c_stop();
+        if (bbi2c_bus_error()) {
+          return SCRIPT_BUS_ERROR;
+        }
+        if (ack) {
+          break;
+        }
+        uint32_t now = time_us_32();
+        if (((now - poll_start) >= get16(op+1)) ||
+            (((now - ctx->start_us) + POLL_WAIT_US) > SCRIPT_MAX_TIME_US)) {
+          return SCRIPT_LIMIT;
+        }
+        busy_wait_us_32(POLL_WAIT_US);
+      }
+      break;
+    }
+
+    default:
+      return SCRIPT_BAD_CODE;
+  }
+
+  if (ctx->pc >= ctx->len) {
+    *end = true;    // ran out of code, same as OP_END
+  }
+  return SCRIPT_OK;
+}
+
+/* Runs a script, output bytes are stored in out (SCRIPT_MAX_OUT bytes) */
+void i2c_script_run(const uint8_t *code, uint16_t len, struct i2c_script_result *res, uint8_t *out) {
+  struct script_ctx ctx;
+  bool end = (len == 0);
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.code = code;
+  ctx.len = len;
+  ctx.start_us = time_us_32();
+  memset(res, 0, sizeof(*res));
+  res->status = SCRIPT_OK;
+
+  while (!end) {
+    if ((res->steps >= SCRIPT_MAX_STEPS) || 
+        ((time_us_32() - ctx.start_us) > SCRIPT_MAX_TIME_US)) {
+      res->status = SCRIPT_LIMIT;
+      break;
+    }
+    res->pc = ctx.pc;
+    res->steps++;
+    res->status = script_step(&ctx, res, out, &end);
+    if (res->status != SCRIPT_OK) {
+      break;
+    }
+  }
+  dbg_printf("Script: status=%d pc=%d steps=%d out=%d\n", res->status, res->pc, res->steps, res->out_len);
+
+  // Release the bus
+  if (res->status == SCRIPT_BUS_ERROR) {
+    bbi2c_recover();
+  } else if (ctx.in_transfer) {
+    bbi2c_stop();
+    if (bbi2c_bus_error()) {
+      bbi2c_recover();
+      res->status = SCRIPT_BUS_ERROR;
+    }
+  }
+}
@@ -0,0 +1,60 @@
+/*
+ * Definitions for the I2C script interpreter
+ *
+ * A script is a sequence of instructions (opcode followed by its operands,
+ * 16-bit operands are little endian). Jump targets are offsets from the
+ * start of the script.
+ */
+
+#define SCRIPT_MAX_LEN    512   // maximum script size
+#define SCRIPT_MAX_OUT    256   // maximum number of output bytes
+#define SCRIPT_MAX_READ   32    // maximum bytes in a single OP_READ
+#define SCRIPT_COUNTERS   4     // number of loop counters
+#define SCRIPT_MAX_STEPS  20000 // maximum executed instructions
+#define SCRIPT_MAX_TIME_US 200000 // maximum execution time
+
+/* opcodes */
+#define OP_END      0x00  //                        end of script
+#define OP_START    0x01  //                        start condition
+#define OP_RESTART  0x02  //                        repeated start
+#define OP_STOP     0x03  //                        stop condition
+#define OP_ADDR     0x04  // addr                   send address (addr<<1 | rd), after a start
+#define OP_WRITE    0x05  // n, data[n]             write bytes, after a start
+#define OP_READ     0x06  // n                      read n bytes (NAK on last) into read buffer, after a start
+#define OP_WAIT_US  0x07  // us(16)                 wait (SCRIPT_LIMIT if past the time limit)
+#define OP_OUT      0x08  // idx, n                 copy read buffer[idx..idx+n-1] to output
+#define OP_JMP      0x09  // target(16)             jump
+#define OP_BRANCH   0x0A  // cond, idx, val, target(16)  jump if read buffer[idx] cond val
+#define OP_SETCNT   0x0B  // c, n(16)               counter[c] = n
+#define OP_LOOP     0x0C  // c, target(16)          if (--counter[c] != 0) jump
+#define OP_FAIL     0x0D  // code                   abort with status SCRIPT_FAIL
+#define OP_POLL     0x0E  // addr, us(16)           start, addr, stop until ACK (outside a transfer,
+                          //                        SCRIPT_LIMIT if no ACK in us)
+
+/* conditions for OP_BRANCH */
+#define COND_EQ     0     // byte == val
+#define COND_NE     1     // byte != val
+#define COND_GT     2     // byte > val
+#define COND_LT     3     // byte < val
+#define COND_SET    4     // (byte & val) != 0
+#define COND_CLEAR  5     // (byte & val) == 0
+
+/* execution status */
+#define SCRIPT_OK           0
+#define SCRIPT_ADDRESS_NACK 1
+#define SCRIPT_DATA_NACK    2
+#define SCRIPT_BUS_ERROR    3
+#define SCRIPT_BAD_CODE     4   // invalid opcode or operand, bus operation without a start
+#define SCRIPT_LIMIT        5   // too many steps or too much time
+#define SCRIPT_FAIL         6   // OP_FAIL executed
+
+/* execution result */
+struct i2c_script_result {
+  uint8_t status;
+  uint8_t fail_code;    // operand of OP_FAIL
+  uint16_t pc;          // offset of the last instruction executed
+  uint16_t steps;       // number of instructions executed
+  uint16_t out_len;     // number of bytes in output
+} __attribute__((packed));
+
+void i2c_script_run(const uint8_t *code, uint16_t len, struct i2c_script_result *res, uint8_t *out);
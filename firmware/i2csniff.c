@@ -0,0 +1,304 @@
+/**
+ * @file i2csniff.c
+ * @author Daniel Quadros
+ * @brief Passive I2C monitor
+ * @date 2024-10-15
+ * 
+ * A PIO state machine watches SDA and SCL and generates symbols (START,
+ * STOP and bits, see i2csniff.pio). The symbols are stored by DMA in a 
+ * ring buffer, so nothing is lost while the CPU is busy. In the main loop
+ * the symbols are decoded into events (START, STOP, address and data 
+ * bytes with ACK/NAK) that are sent to the host as RECORD_SNIFF records.
+ * 
+ * The monitor only reads the pins, so the adapter can still be used as
+ * a master (its own transfers will be captured).
+ * 
+ * If the host does not read the records fast enough the decoding is 
+ * stopped and the symbols accumulate in the ring buffer. If it overflows
+ * the oldest symbols are discarded, a SNIFF_OVERFLOW event is sent and 
+ * the overflow counter is incremented.
+ *
+ * The timestamps are capture times: at each call of the task, even when
+ * the decoding is stopped, the number of words written by the DMA is
+ * saved with the time, and the events get the time of the first mark
+ * that includes their word (so the resolution is a pass of the main loop).
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+
+#include "hwconfig.h"
+#include "i2cusb.h"
+#include "usbstream.h"
+#include "i2csniff.h"
+#include "i2csniff.pio.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+// Ring buffer (must be aligned to its size for the DMA)
+#define RING_BITS   14
+#define RING_WORDS  ((1 << RING_BITS) / sizeof(uint32_t))
+static uint32_t ring[RING_WORDS] __attribute__((aligned(1 << RING_BITS)));
+
+// Words that may be written by the DMA while we are decoding
+#define RING_MARGIN 16
+
+// DMA transfer count (rearmed when the channel stops)
+#define DMA_COUNT 0x0FFFFFFF
+
+// Maximum words decoded in each call to i2csniff_task
+#define MAX_WORDS_TASK 64
+
+// Capture marks: the words before count were in the ring at time_us
+#define MAX_MARKS 32
+static struct {
+  uint32_t count;
+  uint32_t time_us;
+} marks[MAX_MARKS];
+static uint8_t mark_first, mark_count;
+
+// Capture
+static PIO pio;
+static int sm = -1;
+static uint offset;
+static int dma_chan = -1;
+static uint32_t dma_base;     // words written before the current DMA arm
+static uint32_t rd_count;     // words decoded
+
+// Decoder
+static struct {
+  bool in_transfer;     // START seen
+  bool addr_next;       // next byte is an address
+  uint8_t bits;         // bits received in the current byte (including ACK)
+  uint8_t byte;
+} dec;
+
+// Record being assembled
+static struct {
+  uint32_t timestamp_us;  // when the first event was captured
+  uint8_t ev[2*SNIFF_MAX_EVENTS];
+} __attribute__((packed)) rec;
+static uint8_t rec_events = 0;
+
+// Current word being decoded (symbols not yet decoded) and its capture time
+static uint32_t cur_word;
+static uint8_t cur_symbols = 0;
+static uint32_t cur_time_us;
+
+static struct i2csniff_stats stats;
+
+// Words written by the DMA
+static uint32_t i2csniff_written(void) {
+  return dma_base + (DMA_COUNT - dma_channel_hw_addr(dma_chan)->transfer_count);
+}
+
+// Saves the number of words written and the time (if the marks are
+// full, the last one is moved forward)
+static void i2csniff_mark(void) {
+  uint32_t written = i2csniff_written();
+  uint8_t last = (mark_first + mark_count - 1) % MAX_MARKS;
+  if ((mark_count != 0) && (marks[last].count == written)) {
+    return;
+  }
+  if (mark_count < MAX_MARKS) {
+    last = (mark_first + mark_count) % MAX_MARKS;
+    mark_count++;
+  }
+  marks[last].count = written;
+  marks[last].time_us = time_us_32();
+}
+
+// Capture time of a word, discards the marks of the words already decoded
+static uint32_t i2csniff_word_time(uint32_t word) {
+  while ((mark_count != 0) && ((int32_t) (marks[mark_first].count - word) <= 0)) {
+    mark_first = (mark_first + 1) % MAX_MARKS;
+    mark_count--;
+  }
+  return mark_count ? marks[mark_first].time_us : time_us_32();
+}
+
+// Sends the record, returns false if there is no space for it
+static bool i2csniff_flush(void) {
+  if (rec_events == 0) {
+    return true;
+  }
+  uint8_t len = sizeof(rec.timestamp_us) + 2*rec_events;
+  if (usbstream_available() < (sizeof(struct usb_record_hdr) + len)) {
+    return false;
+  }
+  usbstream_send(RECORD_SNIFF, &rec, len);
+  stats.events += rec_events;
+  rec_events = 0;
+  return true;
+}
+
+// Adds an event to the record
+static void i2csniff_event(uint8_t event, uint8_t data) {
+  if (rec_events == 0) {
+    rec.timestamp_us = cur_time_us;
+  }
+  rec.ev[2*rec_events] = event;
+  rec.ev[2*rec_events+1] = data;
+  rec_events++;
+}
+
+// Decodes a symbol
+static void i2csniff_symbol(uint8_t sym) {
+  if (sym == 0x1) {
+    // START, discards the bit generated by the SCL rising edge
+    i2csniff_event(dec.in_transfer ? SNIFF_RESTART : SNIFF_START, 0);
+    dec.in_transfer = true;
+    dec.addr_next = true;
+    dec.bits = 0;
+  } else if (sym == 0x2) {
+    // STOP
+    i2csniff_event(SNIFF_STOP, 0);
+    dec.in_transfer = false;
+    dec.bits = 0;
+  } else if ((sym & 0x8) && dec.in_transfer) {
+    // Bit
+    if (dec.bits < 8) {
+      dec.byte = (dec.byte << 1) | (sym & 1);
+      dec.bits++;
+    } else {
+      // ACK bit
+      uint8_t event = dec.addr_next ? SNIFF_ADDR : SNIFF_DATA;
+      if (sym & 1) {
+        event |= SNIFF_NACK;
+      }
+      i2csniff_event(event, dec.byte);
+      dec.addr_next = false;
+      dec.bits = 0;
+    }
+  }
+}
+
+// Starts capturing
+bool i2csniff_start(void) {
+  if (sm >= 0) {
+    return true;    // already running
+  }
+
+  pio = pio0;
+  if (!pio_can_add_program(pio, &i2c_sniff_program) || 
+      ((sm = pio_claim_unused_sm(pio, false)) < 0)) {
+    pio = pio1;
+    if (!pio_can_add_program(pio, &i2c_sniff_program) || 
+        ((sm = pio_claim_unused_sm(pio, false)) < 0)) {
+      dbg_printf("No PIO available for monitor\n");
+      return false;
+    }
+  }
+  if ((dma_chan = dma_claim_unused_channel(false)) < 0) {
+    pio_sm_unclaim(pio, sm);
+    sm = -1;
+    return false;
+  }
+  offset = pio_add_program(pio, &i2c_sniff_program);
+  i2c_sniff_program_init(pio, sm, offset, SDA_PIN, SCL_PIN);
+
+  dma_channel_config c = dma_channel_get_default_config(dma_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, true);
+  channel_config_set_ring(&c, true, RING_BITS);
+  channel_config_set_dreq(&c, pio_get_dreq(pio, sm, false));
+  dma_channel_configure(dma_chan, &c, ring, &pio->rxf[sm], DMA_COUNT, true);
+
+  memset(&dec, 0, sizeof(dec));
+  dma_base = rd_count = 0;
+  rec_events = cur_symbols = 0;
+  mark_first = mark_count = 0;
+  pio_sm_set_enabled(pio, sm, true);
+  dbg_printf("Monitor started\n");
+  return true;
+}
+
+// Stops capturing
+void i2csniff_stop(void) {
+  if (sm < 0) {
+    return;
+  }
+  pio_sm_set_enabled(pio, sm, false);
+  dma_channel_abort(dma_chan);
+  dma_channel_unclaim(dma_chan);
+  pio_remove_program(pio, &i2c_sniff_program, offset);
+  pio_sm_unclaim(pio, sm);
+  sm = dma_chan = -1;
+  dbg_printf("Monitor stopped\n");
+}
+
+// Decodes the captured symbols, call from the main loop
+void i2csniff_task(void) {
+  if (sm < 0) {
+    return;
+  }
+
+  // Rearm the DMA if it reached the end of the count
+  if (!dma_channel_is_busy(dma_chan)) {
+    dma_base += DMA_COUNT;
+    dma_channel_set_trans_count(dma_chan, DMA_COUNT, true);
+  }
+  i2csniff_mark();
+
+  for (int n = 0; n < MAX_WORDS_TASK; n++) {
+    // Decode the current word
+    while (cur_symbols) {
+      if ((rec_events == SNIFF_MAX_EVENTS) && !i2csniff_flush()) {
+        return;   // wait for space in the USB FIFO
+      }
+      uint8_t sym = cur_word >> 28;
+      cur_word <<= 4;
+      cur_symbols--;
+      if (sym) {
+        i2csniff_symbol(sym);
+        if (sym == 0x2) {
+          i2csniff_flush();   // send what we have at the end of a transaction
+        }
+      }
+    }
+
+    // Get next word
+    uint32_t written = i2csniff_written();
+    if (written == rd_count) {
+      break;
+    }
+    if ((written - rd_count) > (RING_WORDS - RING_MARGIN)) {
+      // Overflow, skip to the middle of the buffer
+      stats.overflows++;
+      rd_count = written - RING_WORDS/2;
+      dec.in_transfer = false;
+      dec.bits = 0;
+      if ((rec_events == SNIFF_MAX_EVENTS) && !i2csniff_flush()) {
+        return;
+      }
+      cur_time_us = i2csniff_word_time(rd_count);
+      i2csniff_event(SNIFF_OVERFLOW, 0);
+    }
+    cur_time_us = i2csniff_word_time(rd_count);
+    cur_word = ring[rd_count % RING_WORDS];
+    cur_symbols = 8;
+    rd_count++;
+    stats.words++;
+  }
+}
+
+// Gets the counters
+void i2csniff_get_stats(struct i2csniff_stats *st) {
+  *st = stats;
+}
@@ -0,0 +1,15 @@
+/*
+ * Passive I2C monitor
+ */
+
+/* Counters */
+struct i2csniff_stats {
+  uint32_t words;       // words captured by the PIO
+  uint32_t events;      // events sent to the host
+  uint32_t overflows;   // times the capture buffer overflowed
+};
+
+bool i2csniff_start(void);
+void i2csniff_stop(void);
+void i2csniff_task(void);
+void i2csniff_get_stats(struct i2csniff_stats *st);
@@ -0,0 +1,205 @@
+/**
+ * @file i2csof.c
+ * @author Daniel Quadros
+ * @brief Sampling synchronised to the USB start of frame
+ * @date 2024-10-15
+ * 
+ * A script configured by the host is run at a fixed offset from the SOF
+ * of selected frames (see sof_sample_config in i2cusb.h), so adapters
+ * connected to the same host take their samples at the same time.
+ * 
+ * The SOF is found by reading the frame number register of the USB
+ * controller: when the frame before a sample is seen in the main loop,
+ * the register is read in a tight loop until it changes, giving the time
+ * of the SOF with a precision of a fraction of a microsecond (the SOF
+ * interrupt belongs to TinyUSB and is not enabled). If the main loop is
+ * delayed past the SOF the sample is taken as soon as possible and the
+ * offset is estimated from the last SOF seen; samples more than a period
+ * late are skipped. Sampling stops if the host stops sending SOFs
+ * (suspend or disconnect).
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/structs/usb.h"
+
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cscript.h"
+#include "i2cprefetch.h"
+#include "usbstream.h"
+#include "i2csof.h"
+#include "dbglog.h"
+
+#if DEBUG_LOG
+#define dbg_printf(...) dbglog(__VA_ARGS__)
+#elif LIB_PICO_STDIO_UART
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+#define FRAME_MASK      USB_SOF_RD_BITS   // 11-bit frame number
+#define FRAME_HALF      ((FRAME_MASK + 1) / 2)
+#define FRAME_US        1000
+
+// give up waiting for the SOF after this (host stopped sending SOFs)
+#define SOF_TIMEOUT_US  (FRAME_US + 100)
+
+// Configuration
+static bool active = false;
+static struct sof_sample_config config;
+static uint8_t code[SCRIPT_MAX_LEN];
+static uint16_t code_len;
+
+// Last SOF seen in the tight loop
+static uint16_t sof_frame;
+static uint32_t sof_us;
+static bool sof_valid = false;
+
+static struct sof_status status;
+
+// Current frame number
+static inline uint16_t i2csof_frame(void) {
+  return usb_hw->sof_rd & FRAME_MASK;
+}
+
+// Frame of a sample
+static inline uint16_t i2csof_due(uint32_t seq) {
+  return (config.start_frame + seq * config.period) & FRAME_MASK;
+}
+
+// Waits for the SOF of a frame, returns false on timeout
+static bool i2csof_wait_sof(uint16_t frame) {
+  uint32_t start = time_us_32();
+  while (i2csof_frame() != frame) {
+    if ((time_us_32() - start) > SOF_TIMEOUT_US) {
+      return false;
+    }
+  }
+  sof_us = time_us_32();
+  sof_frame = frame;
+  sof_valid = true;
+  return true;
+}
+
+// Runs the script and sends the sample
+static void i2csof_sample(uint16_t frame, uint32_t offset_us, uint8_t flags) {
+  uint8_t out[SCRIPT_MAX_OUT];
+  struct i2c_script_result res;
+  uint8_t buf[sizeof(struct sof_sample_record) + SOF_MAX_DATA];
+  struct sof_sample_record *rec = (struct sof_sample_record *) buf;
+
+  i2cprefetch_invalidate(PREFETCH_ALL);
+  i2c_script_run(code, code_len, &res, out);
+  rec->seq = status.seq;
+  rec->frame = frame;
+  rec->offset_us = (offset_us < FRAME_US) ? offset_us : FRAME_US - 1;
+  rec->status = res.status;
+  rec->flags = flags;
+  uint16_t len = (res.out_len > SOF_MAX_DATA) ? SOF_MAX_DATA : res.out_len;
+  memcpy(buf + sizeof(*rec), out, len);
+  usbstream_send(RECORD_SOF_SAMPLE, buf, sizeof(*rec) + len);
+
+  status.samples++;
+  if (flags & SOF_LATE) {
+    status.late++;
+  }
+}
+
+// Moves to the next sample, returns false if done
+static bool i2csof_next(uint32_t n) {
+  status.seq += n;
+  if (config.count && (status.seq >= config.count)) {
+    dbg_printf("SOF: done, %u samples %u late %u skipped\n", status.samples, status.late, status.skipped);
+    active = false;
+  }
+  return active;
+}
+
+/* Starts sampling, returns false if the configuration is invalid */
+bool i2csof_start(const struct sof_sample_config *cfg, const uint8_t *new_code, uint16_t len) {
+  if ((len == 0) || (len > SCRIPT_MAX_LEN) || (cfg->offset_us >= FRAME_US) || 
+      (cfg->period == 0) || (cfg->period > SOF_MAX_PERIOD)) {
+    return false;
+  }
+  config = *cfg;
+  config.start_frame &= FRAME_MASK;
+  memcpy(code, new_code, len);
+  code_len = len;
+  memset(&status, 0, sizeof(status));
+
+  // skip the samples whose SOF was missed
+  uint16_t late = (i2csof_frame() - config.start_frame) & FRAME_MASK;
+  if (late < FRAME_HALF) {
+    status.seq = late / config.period + 1;
+    status.skipped = status.seq;
+  }
+  dbg_printf("SOF: start frame %u offset %u period %u first %u\n", config.start_frame, 
+             config.offset_us, config.period, status.seq);
+  active = true;
+  i2csof_next(0);
+  return true;
+}
+
+/* Stops sampling */
+void i2csof_stop(void) {
+  active = false;
+}
+
+/* Takes the samples when it is time, call from the main loop */
+void i2csof_task(void) {
+  if (!active || bbi2c_busy()) {
+    return;
+  }
+
+  uint16_t frame = i2csof_frame();
+  uint16_t ahead = (i2csof_due(status.seq) - frame) & FRAME_MASK;
+  if (ahead == 1) {
+    // the next frame has a sample, wait for its SOF
+    if (!i2csof_wait_sof((frame + 1) & FRAME_MASK)) {
+      dbg_printf("SOF: no SOF from the host, stopped\n");
+      active = false;
+      return;
+    }
+    busy_wait_us_32(config.offset_us);
+    i2csof_sample(sof_frame, time_us_32() - sof_us, 0);
+    i2csof_next(1);
+  } else if ((ahead == 0) || (ahead >= FRAME_HALF)) {
+    // missed the SOF: skip the samples more than a period late and
+    // take the last one now
+    uint16_t late = (frame - i2csof_due(status.seq)) & FRAME_MASK;
+    uint32_t skip = late / config.period;
+    if (skip) {
+      status.skipped += skip;
+      if (!i2csof_next(skip)) {
+        return;
+      }
+    }
+    uint32_t offset_us = 0;
+    if (sof_valid) {
+      uint32_t elapsed = time_us_32() - sof_us - ((frame - sof_frame) & FRAME_MASK) * FRAME_US;
+      offset_us = (elapsed < FRAME_US) ? elapsed : FRAME_US - 1;
+    }
+    if (offset_us < config.offset_us) {
+      // still before the offset in this frame
+      busy_wait_us_32(config.offset_us - offset_us);
+      offset_us = config.offset_us;
+    }
+    i2csof_sample(frame, offset_us, SOF_LATE);
+    i2csof_next(1);
+  }
+}
+
+/* Gets the sampling status */
+void i2csof_get_status(struct sof_status *st) {
+  *st = status;
+  st->frame = i2csof_frame();
+  st->active = active;
+}
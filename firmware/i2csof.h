@@ -0,0 +1,8 @@
+/*
+ * Sampling synchronised to the USB start of frame
+ */
+
+bool i2csof_start(const struct sof_sample_config *cfg, const uint8_t *code, uint16_t len);
+void i2csof_stop(void);
+void i2csof_task(void);
+void i2csof_get_status(struct sof_status *st);
@@ -0,0 +1,141 @@
+/**
+ * @file i2ctarget.c
+ * @author Daniel Quadros
+ * @brief I2C target emulator for loopback tests
+ * @date 2024-10-15
+ * 
+ * Emulates a memory device (like a 24C32), so the adapter can be tested
+ * and benchmarked with no external hardware: just connect the target pins
+ * to the I2C pins (see hwconfig.h).
+ * 
+ * The target uses a hardware I2C controller (that supports up to 1MHz)
+ * running on core 1, so it does not interfere with the timing of the 
+ * bit-banged master and leaves the PIO free. The master can be tested 
+ * under clock stretching by delaying the bytes sent to it (the controller 
+ * holds SCL low until the byte is supplied).
+ *
+ * Only included if the firmware is compiled with -DTARGET_EMULATOR=ON
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/flash.h"
+#include "pico/i2c_slave.h"
+#include "hardware/gpio.h"
+#include "hardware/i2c.h"
+
+#include "hwconfig.h"
+#include "i2cusb.h"
+#include "i2ctarget.h"
+#if PROFILE
+#include "i2cprof.h"
+#endif
+
+#define TARGET_MEM_SIZE 4096      // like a 24C32
+
+// Emulated device
+static struct {
+  uint8_t mem[TARGET_MEM_SIZE];
+  uint16_t ptr;
+  uint8_t ptr_bytes;    // address bytes received in the current write
+  bool first_read;      // next byte is the first read in this transfer
+} target;
+
+// Configuration (changed by core 0)
+static volatile uint8_t target_profile = STRETCH_NONE;
+static volatile uint8_t target_flags = 0;
+static volatile uint16_t target_stretch_us = 0;
+
+static struct i2ctarget_stats stats;
+
+// Called (in core 1) by the I2C interrupt
+static void i2ctarget_handler(i2c_inst_t *i2c, i2c_slave_event_t event) {
+  uint16_t mask = (target_flags & TARGET_ADDR16) ? (TARGET_MEM_SIZE - 1) : 0xFF;
+
+  switch (event) {
+    case I2C_SLAVE_RECEIVE: {
+      uint8_t b = i2c_read_byte_raw(i2c);
+      uint8_t ptr_len = (target_flags & TARGET_ADDR16) ? 2 : 1;
+      if (target.ptr_bytes < ptr_len) {
+        target.ptr = (target.ptr_bytes == 0) ? b : ((target.ptr << 8) | b);
+        target.ptr &= mask;
+        target.ptr_bytes++;
+      } else {
+        target.mem[target.ptr] = b;
+        target.ptr = (target.ptr + 1) & mask;
+        stats.bytes_written++;
+      }
+      break;
+    }
+
+    case I2C_SLAVE_REQUEST:
+      if ((target_profile == STRETCH_READ) || 
+          ((target_profile == STRETCH_FIRST_READ) && target.first_read)) {
+        busy_wait_us_32(target_stretch_us);
+        stats.stretches++;
+      }
+      target.first_read = false;
+      i2c_write_byte_raw(i2c, target.mem[target.ptr]);
+      target.ptr = (target.ptr + 1) & mask;
+      stats.bytes_read++;
+      break;
+
+    case I2C_SLAVE_FINISH:
+      target.ptr_bytes = 0;
+      target.first_read = true;
+      stats.transactions++;
+      break;
+  }
+}
+
+// Core 1 main
+static void i2ctarget_main(void) {
+  gpio_init(TARGET_SDA_PIN);
+  gpio_set_function(TARGET_SDA_PIN, GPIO_FUNC_I2C);
+  gpio_pull_up(TARGET_SDA_PIN);
+  gpio_init(TARGET_SCL_PIN);
+  gpio_set_function(TARGET_SCL_PIN, GPIO_FUNC_I2C);
+  gpio_pull_up(TARGET_SCL_PIN);
+
+  i2c_init(TARGET_I2C, 1000000);
+  i2c_slave_init(TARGET_I2C, TARGET_ADDR, i2ctarget_handler);
+
+  // Allow core0 to stop this core while writing the flash
+  flash_safe_execute_core_init();
+
+  // Sample this core too (if the profiler is enabled in CMakeList.txt)
+  #if PROFILE
+  i2cprof_core_init();
+  #endif
+
+  // Everything is done in the interrupt
+  while (1) {
+    tight_loop_contents();
+  }
+}
+
+// Starts the target emulator
+void i2ctarget_init(void) {
+  memset(&target, 0, sizeof(target));
+  target.first_read = true;
+  multicore_launch_core1(i2ctarget_main);
+}
+
+// Changes the emulator configuration
+void i2ctarget_config(uint8_t profile, uint8_t flags, uint16_t stretch_us) {
+  target_stretch_us = stretch_us;
+  target_flags = flags;
+  target_profile = profile;
+}
+
+// Gets the counters
+void i2ctarget_get_stats(struct i2ctarget_stats *st) {
+  *st = stats;
+}
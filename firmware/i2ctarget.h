@@ -0,0 +1,15 @@
+/*
+ * I2C target emulator for loopback tests
+ */
+
+/* Counters */
+struct i2ctarget_stats {
+  uint32_t transactions;  // STOP or restart seen
+  uint32_t bytes_written; // data bytes received from the master
+  uint32_t bytes_read;    // data bytes sent to the master
+  uint32_t stretches;     // bytes delayed by clock stretching
+};
+
+void i2ctarget_init(void);
+void i2ctarget_config(uint8_t profile, uint8_t flags, uint16_t stretch_us);
+void i2ctarget_get_stats(struct i2ctarget_stats *st);
@@ -19,13 +19,107 @@
 #define CMD_I2C_BEGIN  1  // flag fo I2C_IO
 #define CMD_I2C_END    2  // flag fo I2C_IO
 
-/* linux kernel flags */
+/* extensions to the i2c-tiny-usb protocol (not used by the kernel driver) */
+#define CMD_SET_TIMEOUT 16  // clock stretch timeout in us = wIndex:wValue
+#define CMD_GET_STATS   17  // wIndex selects the counters to read
+#define CMD_I2C_RMW     18  // OUT: list of struct i2c_rmw, IN: results
+#define CMD_I2C_SCRIPT  19  // OUT: script to run, IN: result and output
+#define CMD_SET_ALERT   20  // wIndex = alert input, wValue = ALERT_xxx flags
+#define CMD_SET_TARGET  21  // target emulator: wIndex = STRETCH_xxx | TARGET_xxx << 8, wValue = stretch us
+#define CMD_SNIFF       22  // passive monitor: wValue = 1 to start, 0 to stop
+#define CMD_SET_CLOCK   23  // OUT: wIndex = address, wValue = clock period in us (0 = bus clock), IN: table
+#define CMD_PROBE_CLOCK 24  // IN: wIndex = address | reg << 8, wValue = min period | len << 8
+#define CMD_I2C_GANG    25  // OUT: messages for the gang buses (wValue = bus mask), IN: results
+#define CMD_FB_CONFIG   26  // display: wIndex = address | FB_xxx type << 8, wValue = width | height << 8
+#define CMD_FB_WRITE    27  // OUT: frame data at offset wIndex, wValue = FB_FLUSH | FB_FULL, IN: struct fb_result
+#define CMD_BOOT_SCRIPT 28  // OUT: script to store in flash (none = remove, wValue = BOOT_RUN to run it), IN: struct boot_result
+#define CMD_JOB_ABORT   29  // OUT: wValue = job id, wIndex = JOB_ABORT_xxx flags
+#define CMD_SET_PREFETCH 30 // OUT: wIndex = address | memory address bytes << 8, wValue = bytes to read ahead (0 = off)
+#define CMD_SET_RETRY   31  // OUT: struct i2c_retry for address wIndex (RETRY_ALL = all), IN: policy for wIndex
+#define CMD_LOG_CONFIG  32  // OUT: script to run every wValue | wIndex << 16 ms (no script = stop), IN: struct log_status
+#define CMD_LOG_CTRL    33  // OUT: wValue = LOG_xxx operation
+#define CMD_SOF_SAMPLE  34  // OUT: struct sof_sample_config and script (no data = stop), IN: struct sof_status
+#define CMD_PROFILE     35  // OUT: wValue = sample period in us (0 = stop), wIndex = bucket shift, IN: profile from offset wIndex
+
+/* counters for CMD_GET_STATS */
+#define STATS_BUS       0   // struct bbi2c_stats
+#define STATS_STREAM    1   // struct usbstream_stats
+#define STATS_TARGET    2   // struct i2ctarget_stats
+#define STATS_SNIFF     3   // struct i2csniff_stats
+#define STATS_SCHED     4   // struct i2csched_stats
+#define STATS_PREFETCH  5   // struct i2cprefetch_stats
+#define STATS_LOG       6   // struct dbglog_stats (firmware built with DEBUG_LOG)
+#define STATS_DATALOG   7   // struct log_status
+#define STATS_SOF       8   // struct sof_status
+
+/* flags for CMD_SET_ALERT */
+#define ALERT_ENABLE    0x01  // send RECORD_ALERT when the input goes low
+#define ALERT_ARA       0x02  // read the SMBus Alert Response Address
+
+/* flags for CMD_BOOT_SCRIPT */
+#define BOOT_RUN        0x01  // run the stored script now (no data)
+
+/* Retry policy for CMD_I2C_IO (CMD_SET_RETRY)
+ *
+ * A NACK in the first message of a transaction is retried on the device:
+ * STOP, wait (backoff_us, doubled at each attempt up to 10ms) and send the
+ * message again. CMD_GET_STATUS with wLength = 2 returns the attempts used
+ * in the second byte.
+ */
+#define RETRY_ADDR      0x01  // retry address NACK
+#define RETRY_DATA      0x02  // retry data NACK (write messages up to 64 bytes)
+#define RETRY_ALL       0xFF  // wIndex to set the policy for all addresses
+
+struct i2c_retry {
+  uint8_t attempts;     // maximum attempts (0 or 1 = no retry)
+  uint8_t phases;       // RETRY_xxx
+  uint16_t backoff_us;  // wait before the second attempt
+} __attribute__((packed));
+
+/* maximum read ahead for CMD_SET_PREFETCH */
+#define PREFETCH_MAX    256
+
+/* operations for CMD_LOG_CTRL */
+#define LOG_FLUSH       1   // write the records still in RAM to the flash
+#define LOG_REWIND      2   // send again all the records in the flash
+#define LOG_ERASE       3   // discard all the records
+
+/* flags for CMD_JOB_ABORT */
+#define JOB_ABORT_I2C_IO  0x01  // also end (with STOP) an open CMD_I2C_IO transaction
+
+/* clock stretch profiles for CMD_SET_TARGET */
+#define STRETCH_NONE        0
+#define STRETCH_READ        1   // every byte read by the master
+#define STRETCH_FIRST_READ  2   // first byte read in each transfer
+
+/* flags for CMD_SET_TARGET */
+#define TARGET_ADDR16   0x01  // 16-bit memory address (default is 8-bit)
+
+/* CMD_SET_CLOCK IN returns the clock period (uint8_t) for each of the
+ * 128 addresses, CMD_PROBE_CLOCK returns the period found (uint16_t), 0 if
+ * the target did not answer at the bus clock
+ */
+#define PROBE_MAX_LEN   8   // max bytes read by CMD_PROBE_CLOCK
+
+/* minimum clock stretch timeout (smaller values of CMD_SET_TIMEOUT are rejected) */
+#define TIMEOUT_MIN_US  100
+
+/* I2C status (returned by CMD_GET_STATUS) */
+#define STATUS_IDLE         0
+#define STATUS_ADDRESS_ACK  1
+#define STATUS_ADDRESS_NACK 2
+#define STATUS_BUS_ERROR    3   // SCL stuck low, transaction aborted
+#define STATUS_DATA_NACK    4   // NACK after a data byte
+
+/* linux kernel flags (already defined if used in a PC with <linux/i2c.h>) */
+#ifndef _LINUX_I2C_H
 #define I2C_M_TEN		        0x10	/* we have a ten bit chip address */
 #define I2C_M_RD		        0x01
 #define I2C_M_NOSTART		    0x4000
 #define I2C_M_REV_DIR_ADDR	0x2000
 #define I2C_M_IGNORE_NAK	  0x1000
 #define I2C_M_NO_RD_ACK		  0x0800
+#endif
 
 /* I/O command */
 struct i2c_cmd {
@@ -36,7 +130,308 @@ struct i2c_cmd {
   uint16_t len;  
 };
 
+/* Read-modify-write of a register (CMD_I2C_RMW)
+ *
+ * Done as S addr+W reg Sr addr+R old Sr addr+W reg new P, so the bus
+ * is not released between the read and the write. 
+ * new = (old & ~mask) | (value & mask)
+ */
+#define RMW_REG16  0x01   // 16-bit register address
+#define RMW_VAL16  0x02   // 16-bit register value (MSB first on the bus)
+
+struct i2c_rmw {
+  uint8_t addr;
+  uint8_t flags;
+  uint16_t reg;
+  uint16_t mask;
+  uint16_t value;
+} __attribute__((packed));
+
+struct i2c_rmw_result {
+  uint8_t status;     // STATUS_ADDRESS_ACK if ok, STATUS_IDLE if not executed
+  uint8_t reserved;
+  uint16_t old_value;
+  uint16_t new_value;
+} __attribute__((packed));
+
+/* Gang mode (CMD_I2C_GANG)
+ *
+ * The OUT data is a list of messages, each is a struct gang_msg followed
+ * (for writes) by the data. A message starts with START (repeated START
+ * if the previous one had GANG_NOSTOP) and ends with STOP unless
+ * GANG_NOSTOP is set. The messages are sent to all buses selected in
+ * wValue (0 = all); a bus that fails gets a STOP and is left out of the
+ * remaining messages.
+ *
+ * The IN data is a struct gang_result followed, for each read message,
+ * by the bytes read from each bus (len bytes from bus 0, then bus 1...).
+ */
+#define GANG_MAX_BUSES  8
+#define GANG_MAX_LEN    512   // maximum OUT data and read data
+
+#define GANG_RD       0x01    // read
+#define GANG_NOSTOP   0x02    // no STOP at the end
+#define GANG_POLL     0x04    // first wait (up to 20ms) for the target to ACK its address
+
+struct gang_msg {
+  uint8_t addr;
+  uint8_t flags;
+  uint16_t len;
+} __attribute__((packed));
+
+struct gang_result {
+  uint8_t buses;                    // number of gang buses
+  uint8_t reserved;
+  uint16_t out_len;                 // bytes of read data that follow
+  uint8_t status[GANG_MAX_BUSES];   // STATUS_ADDRESS_ACK if ok, STATUS_IDLE if not used
+  uint8_t msg[GANG_MAX_BUSES];      // index of the message where the bus failed
+} __attribute__((packed));
+
+/* Framebuffer (CMD_FB_CONFIG, CMD_FB_WRITE) */
+#define FB_MAX_SIZE   1024    // 128x64
+
+#define FB_SSD1306    0       // display controllers
+#define FB_SH1106     1
+
+#define FB_FLUSH      0x01    // update the display after receiving the data
+#define FB_FULL       0x02    // send the full frame, not only the changes
+
+struct fb_result {
+  uint8_t status;     // STATUS_ADDRESS_ACK if ok
+  uint8_t reserved;
+  uint16_t ranges;    // I2C transactions
+  uint16_t bytes;     // data bytes sent
+  uint32_t time_us;
+} __attribute__((packed));
+
+/* Records sent through the bulk IN endpoint */
+struct usb_record_hdr {
+  uint8_t type;
+  uint8_t len;        // payload length
+} __attribute__((packed));
+
+#define RECORD_ALERT    1
+
+struct usb_alert_record {
+  uint8_t input;          // index of the alert input
+  uint8_t addr;           // address from ARA, 0xFF if none
+  uint32_t timestamp_us;  // when the input went low
+} __attribute__((packed));
+
+#define RECORD_SNIFF    2
+
+/* RECORD_SNIFF payload is a 32-bit timestamp (in us, when the first event
+ * was captured, with the resolution of a pass of the main loop) followed by
+ * up to SNIFF_MAX_EVENTS pairs of bytes (event, data)
+ */
+#define SNIFF_MAX_EVENTS  28
+
+#define SNIFF_START     1
+#define SNIFF_RESTART   2
+#define SNIFF_STOP      3
+#define SNIFF_ADDR      4   // data = address byte (address << 1 | R/W)
+#define SNIFF_DATA      5   // data = byte
+#define SNIFF_OVERFLOW  6   // events were lost
+#define SNIFF_NACK      0x80  // flag for SNIFF_ADDR and SNIFF_DATA
+
+/* Jobs
+ *
+ * Jobs are sent by the host through the bulk OUT endpoint: a struct
+ * job_req followed by wlen bytes of data. They are queued by priority
+ * and executed one chunk at a time (a complete I2C transaction, ending
+ * with STOP), always choosing the highest priority job, so a short
+ * high priority job waits at most for one chunk of a long low priority
+ * one. Control requests are also handled between chunks.
+ *
+ * Each job is for one bus (the main bus or one of the gang buses). Jobs
+ * for the same bus are executed in order, jobs for different buses take
+ * turns and can end in any order; the id is used to match the records.
+ *
+ * Read data is sent in RECORD_JOB_DATA records and the end of each job
+ * in a RECORD_JOB_DONE record.
+ *
+ * A job can have a deadline (in us, from its reception): it is ended
+ * with JOB_STATUS_DEADLINE if it is not done by then, and the clock
+ * stretch timeout is shortened so a stuck target does not hold the bus
+ * past the deadline. Queued jobs (including one that is between chunks)
+ * can be cancelled with CMD_JOB_ABORT.
+ */
+#define JOB_PRIO_HIGH   0
+#define JOB_PRIO_LOW    1
+#define JOB_CLASSES     2
+
+#define JOB_XFER        1   // write wlen bytes and/or read rlen bytes (up to JOB_MAX_CHUNK)
+#define JOB_MEM_READ    2   // read rlen bytes from a memory, in chunks of 'chunk' bytes
+#define JOB_MEM_WRITE   3   // write wlen bytes to a memory, in pages of 'chunk' bytes
+
+#define JOB_MEM16       0x01  // 16-bit memory address (default is 8-bit)
+
+#define JOB_MAX_DATA    128   // max data in a job
+#define JOB_MAX_CHUNK   64    // max bytes read in a chunk
+
+struct job_req {
+  uint8_t id;         // returned in the records
+  uint8_t prio;       // JOB_PRIO_xxx
+  uint8_t op;         // JOB_xxx
+  uint8_t addr;       // I2C address
+  uint8_t flags;
+  uint8_t wlen;       // bytes of data after this header
+  uint16_t rlen;      // bytes to read
+  uint16_t mem_addr;  // JOB_MEM_xxx: start address
+  uint8_t chunk;      // JOB_MEM_xxx: chunk (read) or page (write) size
+  uint8_t bus;        // 0 = main bus, 1 to GANG_MAX_BUSES = gang bus
+  uint32_t deadline_us; // 0 = no deadline
+} __attribute__((packed));
+
+#define RECORD_JOB_DATA 3
+
+struct job_data_record {
+  uint8_t id;
+  uint8_t reserved;
+  uint16_t offset;    // offset of the data in the job
+  // followed by the data
+} __attribute__((packed));
+
+#define RECORD_JOB_DONE 4
+
+#define JOB_STATUS_REJECTED 0x80  // invalid job (other values as in CMD_GET_STATUS)
+#define JOB_STATUS_ABORTED  0x81  // cancelled by CMD_JOB_ABORT
+#define JOB_STATUS_DEADLINE 0x82  // not done before the deadline
+
+struct job_done_record {
+  uint8_t id;
+  uint8_t status;     // STATUS_ADDRESS_ACK if ok
+  uint16_t count;     // bytes transferred
+  uint32_t wait_us;   // time in the queue before the first chunk
+  uint32_t total_us;  // time from reception to the end
+  uint32_t bus_us;    // time executing the chunks
+} __attribute__((packed));
+
+/* Binary debug log (firmware built with DEBUG_LOG)
+ *
+ * Each dbg_printf() generates a record with the address of the format
+ * string and the arguments, the host decoder gets the string from the
+ * firmware ELF file. Records are sent to the UART as they are (the magic
+ * byte is used to find the start of a record) or in RECORD_LOG records.
+ */
+#define RECORD_LOG      5
+
+#define DBGLOG_MAGIC    0xDB
+#define DBGLOG_MAX_ARGS 4
+
+struct dbglog_record {
+  uint8_t magic;      // DBGLOG_MAGIC
+  uint8_t nargs;      // arguments used
+  uint16_t seq;       // incremented for each message, gaps are dropped records
+  uint32_t time_us;
+  uint32_t fmt;       // address of the format string
+  uint32_t arg[DBGLOG_MAX_ARGS];
+} __attribute__((packed));
+
+/* Data logger
+ *
+ * The script configured with CMD_LOG_CONFIG is run periodically, even
+ * with no host, and its output is stored in the flash. The records not
+ * yet sent are sent as RECORD_DATALOG records when the host connects
+ * (and as they are generated while it stays connected).
+ */
+#define RECORD_DATALOG  6
+
+#define LOG_MAX_DATA    240   // script output bytes stored in a record
+
+struct log_record {
+  uint8_t len;        // bytes of script output that follow the header
+  uint8_t status;     // script status (SCRIPT_xxx)
+  uint16_t boot;      // power up count (the time restarts at each power up)
+  uint32_t time_ms;   // time since power up
+  // followed by the script output
+} __attribute__((packed));
+
+struct log_status {
+  uint8_t enabled;      // a script is configured
+  uint8_t sectors;      // flash sectors used by the log
+  uint16_t boot;        // current power up count
+  uint32_t period_ms;
+  uint32_t records;     // records stored since power up
+  uint32_t sent;        // records sent since power up
+  uint32_t backlog;     // bytes of records not yet sent
+  uint32_t overwritten; // sectors erased before being sent
+  uint32_t flash_errors;
+} __attribute__((packed));
+
+/* SOF synchronised sampling
+ *
+ * The USB start of frame (every 1ms, full speed devices have no
+ * microframes) is seen at the same time by all the adapters connected
+ * to a host controller, so the 11-bit frame number is a common
+ * timebase. The script configured with CMD_SOF_SAMPLE is run offset_us
+ * after the SOF of the frames start_frame + n * period; sample n is sent
+ * in a RECORD_SOF_SAMPLE with seq = n, the frame and the offset where the
+ * script really started. Adapters configured with the same values take
+ * samples with the same seq at the same time.
+ */
+#define RECORD_SOF_SAMPLE 7
+
+#define SOF_MAX_DATA    240   // script output bytes sent in a record
+#define SOF_MAX_PERIOD  1000  // frames (keeps the frame numbers unambiguous)
+
+struct sof_sample_config {
+  uint16_t start_frame;   // frame of the first sample (11 bits)
+  uint16_t offset_us;     // time after the SOF (0 to 999)
+  uint16_t period;        // frames between samples (1 to SOF_MAX_PERIOD)
+  uint16_t count;         // number of samples (0 = until stopped)
+  // followed by the script
+} __attribute__((packed));
+
+#define SOF_LATE        0x01  // the SOF was missed, offset is estimated
+
+struct sof_sample_record {
+  uint32_t seq;       // sample number
+  uint16_t frame;     // frame where the script started
+  uint16_t offset_us; // time from the SOF of that frame
+  uint8_t status;     // script status (SCRIPT_xxx)
+  uint8_t flags;      // SOF_xxx
+  // followed by the script output
+} __attribute__((packed));
+
+struct sof_status {
+  uint16_t frame;     // current frame
+  uint8_t active;     // sampling
+  uint8_t reserved;
+  uint32_t seq;       // next sample
+  uint32_t samples;   // samples taken
+  uint32_t late;      // samples taken after missing the SOF
+  uint32_t skipped;   // samples not taken (more than a period late)
+} __attribute__((packed));
+
+/* Sampling profiler (firmware built with PROFILE)
+ *
+ * A timer interrupt counts the address where each core was interrupted
+ * in a histogram with buckets of 1 << shift bytes of the code in flash
+ * (from flash_base) and of the code in RAM (from ram_base). An IN
+ * CMD_PROFILE returns a struct prof_header followed by the counters
+ * (uint32_t): for each core, the flash buckets and then the RAM buckets.
+ * The profile can be larger than a control transfer, so it is read in
+ * pieces, wIndex is the byte offset of the piece.
+ */
+#define PROF_BUCKETS        2048  // counters (for all the cores)
+#define PROF_MIN_PERIOD_US  20
+#define PROF_MAX_SHIFT      12
+
+struct prof_header {
+  uint32_t flash_base;    // address of the first flash bucket
+  uint32_t ram_base;      // address of the first RAM bucket
+  uint16_t flash_buckets; // buckets for the flash, for each core
+  uint16_t ram_buckets;   // buckets for the RAM, for each core
+  uint16_t period_us;     // sample period (0 = never started)
+  uint8_t shift;          // bucket size is 1 << shift bytes
+  uint8_t cores;          // cores sampled
+  uint32_t samples[2];    // samples taken in each core
+  uint32_t other[2];      // samples outside the flash and RAM code (boot ROM)
+} __attribute__((packed));
+
 /* To determine what functionality is present */
+#ifndef _LINUX_I2C_H
 #define I2C_FUNC_I2C			                  0x00000001
 #define I2C_FUNC_10BIT_ADDR		              0x00000002
 #define I2C_FUNC_PROTOCOL_MANGLING	        0x00000004 /* I2C_M_{REV_DIR_ADDR,NOSTART,..} */
@@ -83,3 +478,4 @@ struct i2c_cmd {
                             I2C_FUNC_SMBUS_WRITE_BLOCK_DATA | \
                             I2C_FUNC_SMBUS_WRITE_BLOCK_DATA_PEC | \
                             I2C_FUNC_SMBUS_I2C_BLOCK
+#endif
@@ -101,10 +101,10 @@
 #define CFG_TUD_MIDI              0
 #define CFG_TUD_VENDOR            1
 
-#define CFG_TUD_VENDOR_EPSIZE     32
+#define CFG_TUD_VENDOR_EPSIZE     64
 #define CFG_TUD_VENDOR_EP_BUFSIZE 512
 #define CFG_TUD_VENDOR_RX_BUFSIZE 512
-#define CFG_TUD_VENDOR_TX_BUFSIZE 512
+#define CFG_TUD_VENDOR_TX_BUFSIZE 2048
 
 #ifdef __cplusplus
  }
@@ -71,16 +71,19 @@ static const tusb_desc_device_t usbd_desc_device = {
 // Configuration Descriptor
 //--------------------------------------------------------------------+
 
-#define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + sizeof(tusb_desc_interface_t))
+// i2c-tiny-usb uses only the control endpoint, the bulk endpoints
+// are used for the extensions (and ignored by the Linux driver)
+#define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_VENDOR_DESC_LEN)
 
-#define TUD_CTRLITF_DESCRIPTOR(_itfnum, _itfclass, _itfsclass, _itfprotocol, _stridx) \
-    sizeof(tusb_desc_interface_t), TUSB_DESC_INTERFACE, _itfnum, 0, 0, _itfclass, _itfsclass, _itfprotocol, _stridx
+#define EPNUM_VENDOR_OUT  0x01
+#define EPNUM_VENDOR_IN   0x81
 
 static uint8_t const desc_configuration[] =
 {
   // Config number, interface count, string index, total length, attribute, power in mA
   TUD_CONFIG_DESCRIPTOR(1, 1, 0, CONFIG_TOTAL_LEN, 0, 100),
-  TUD_CTRLITF_DESCRIPTOR(0, 0xFF, 0, 0, USBD_STR_0)
+  // Interface number, string index, EP Out & IN address, EP size
+  TUD_VENDOR_DESCRIPTOR(0, USBD_STR_0, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, CFG_TUD_VENDOR_EPSIZE)
 };
 
 static char usbd_serial_str[PICO_UNIQUE_BOARD_ID_SIZE_BYTES * 2 + 1];
@@ -0,0 +1,62 @@
+/**
+ * @file usbstream.c
+ * @author Daniel Quadros
+ * @brief Records sent to the host through the bulk IN endpoint
+ * @date 2024-10-15
+ * 
+ * The control endpoint is used for the i2c-tiny-usb requests. Information
+ * generated by the firmware on its own (like alerts) is sent as records 
+ * through the vendor bulk IN endpoint. Each record has a two byte header 
+ * (type and payload length, see struct usb_record_hdr in i2cusb.h).
+ * 
+ * A record is never split: if there is no space in the TinyUSB FIFO
+ * it is discarded and counted.
+ *  
+ * @copyright Copyright (c) 2024, Daniel Quadros
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tusb.h"
+#include "pico/stdlib.h"
+
+#include "i2cusb.h"
+#include "usbstream.h"
+
+static struct usbstream_stats stats;
+
+/* Returns the space available for records */
+uint32_t usbstream_available(void) {
+  return tud_mounted() ? tud_vendor_write_available() : 0;
+}
+
+/* Queues a record to be sent, returns false if discarded */
+bool usbstream_send(uint8_t type, const void *data, uint8_t len) {
+  struct usb_record_hdr hdr = { type, len };
+
+  if (!tud_mounted() || (tud_vendor_write_available() < (sizeof(hdr) + len))) {
+    stats.dropped++;
+    return false;
+  }
+  tud_vendor_write(&hdr, sizeof(hdr));
+  if (len) {
+    tud_vendor_write(data, len);
+  }
+  stats.records++;
+  return true;
+}
+
+/* Sends whatever is in the FIFO, call from the main loop */
+void usbstream_task(void) {
+  if (tud_mounted()) {
+    tud_vendor_write_flush();
+  }
+}
+
+/* Gets the counters */
+void usbstream_get_stats(struct usbstream_stats *st) {
+  *st = stats;
+}
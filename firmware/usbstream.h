@@ -0,0 +1,14 @@
+/*
+ * Records sent to the host through the vendor bulk IN endpoint
+ */
+
+/* Counters */
+struct usbstream_stats {
+  uint32_t records;     // records sent
+  uint32_t dropped;     // records discarded (no space or host not connected)
+};
+
+uint32_t usbstream_available(void);
+bool usbstream_send(uint8_t type, const void *data, uint8_t len);
+void usbstream_task(void);
+void usbstream_get_stats(struct usbstream_stats *st);
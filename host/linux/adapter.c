@@ -0,0 +1,103 @@
+/*
+   Helpers for the adapter access
+
+   Transactions (lists of i2c_msg) can be converted to a script, so
+   several of them are done with just two USB transfers.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "adapter.h"
+
+// Converts a script status to -errno
+int adapter_script_errno(uint8_t status) {
+  switch (status) {
+    case SCRIPT_OK:           return 0;
+    case SCRIPT_ADDRESS_NACK: return -ENXIO;
+    case SCRIPT_DATA_NACK:    return -EREMOTEIO;
+    case SCRIPT_BUS_ERROR:    return -ETIMEDOUT;
+  }
+  return -EIO;
+}
+
+// Starts a new script
+void script_init(struct script_buf *sb) {
+  sb->len = 0;
+  sb->out_len = 0;
+}
+
+// Adds a transaction to a script
+//
+// Returns 0 if ok, -E2BIG if the script has no space for it (the script
+// is not changed) and -EINVAL if it cannot be done by a script
+int script_add_xfer(struct script_buf *sb, const struct i2c_msg *msgs, int nmsgs) {
+  uint16_t code_len = 1;    // OP_STOP
+  uint16_t out_len = 0;
+
+  // Check if possible and the space needed
+  if (nmsgs == 0) {
+    return -EINVAL;
+  }
+  for (int i = 0; i < nmsgs; i++) {
+    if (msgs[i].flags & ~I2C_M_RD) {
+      return -EINVAL;
+    }
+    code_len += 3;    // (RE)START, ADDR addr
+    if (msgs[i].flags & I2C_M_RD) {
+      if (msgs[i].len > SCRIPT_MAX_READ) {
+        return -EINVAL;
+      }
+      if (msgs[i].len) {
+        code_len += 5;  // READ n, OUT 0 n
+        out_len += msgs[i].len;
+      }
+    } else {
+      code_len += msgs[i].len + 2*((msgs[i].len + 254) / 255);
+    }
+  }
+  if (((sb->len + code_len) > SCRIPT_MAX_LEN) || ((sb->out_len + out_len) > SCRIPT_MAX_OUT)) {
+    return -E2BIG;
+  }
+
+  // Generate the code
+  uint8_t *p = sb->code + sb->len;
+  for (int i = 0; i < nmsgs; i++) {
+    *p++ = (i == 0) ? OP_START : OP_RESTART;
+    *p++ = OP_ADDR;
+    *p++ = (msgs[i].addr << 1) | ((msgs[i].flags & I2C_M_RD) ? 1 : 0);
+    if (msgs[i].flags & I2C_M_RD) {
+      if (msgs[i].len) {
+        *p++ = OP_READ;
+        *p++ = msgs[i].len;
+        *p++ = OP_OUT;
+        *p++ = 0;
+        *p++ = msgs[i].len;
+      }
+    } else {
+      for (int pos = 0; pos < msgs[i].len; pos += 255) {
+        uint8_t n = (msgs[i].len - pos) > 255 ? 255 : (msgs[i].len - pos);
+        *p++ = OP_WRITE;
+        *p++ = n;
+        memcpy(p, msgs[i].buf + pos, n);
+        p += n;
+      }
+    }
+  }
+  *p++ = OP_STOP;
+  sb->len += code_len;
+  sb->out_len += out_len;
+  return 0;
+}
+
+// Copies the script output to the read messages of a transaction
+void script_copy_out(struct i2c_msg *msgs, int nmsgs, const uint8_t *out) {
+  for (int i = 0; i < nmsgs; i++) {
+    if (msgs[i].flags & I2C_M_RD) {
+      memcpy(msgs[i].buf, out, msgs[i].len);
+      out += msgs[i].len;
+    }
+  }
+}
@@ -0,0 +1,49 @@
+/*
+   Access to an I2C-Pico-USB adapter from a PC
+
+   An adapter can be a real one (accessed through libusb) or a
+   simulated one (with some simulated devices), so host software
+   can be tested with no hardware.
+*/
+
+#ifndef _ADAPTER_H
+#define _ADAPTER_H
+
+#include <stdint.h>
+#include <linux/i2c.h>
+
+#include "i2cscript.h"
+
+struct adapter {
+  // Does a transaction (like the I2C_RDWR ioctl), returns 0 or -errno
+  int (*xfer)(struct adapter *ad, struct i2c_msg *msgs, int nmsgs);
+
+  // Runs a script (CMD_I2C_SCRIPT), returns 0 or -errno if the
+  // script could not be sent (script errors are in res)
+  int (*script)(struct adapter *ad, const uint8_t *code, uint16_t len,
+                struct i2c_script_result *res, uint8_t *out);
+
+  void (*close)(struct adapter *ad);
+
+  // Number of USB control transfers done
+  uint64_t usb_transfers;
+};
+
+struct adapter *adapter_usb_open(const char *serial);
+struct adapter *adapter_sim_open(uint32_t usb_latency_us, uint32_t clock_khz);
+
+// Converts a script status to -errno
+int adapter_script_errno(uint8_t status);
+
+// Builds scripts with several transactions
+struct script_buf {
+  uint8_t code[SCRIPT_MAX_LEN];
+  uint16_t len;
+  uint16_t out_len;     // output bytes the script will generate
+};
+
+void script_init(struct script_buf *sb);
+int script_add_xfer(struct script_buf *sb, const struct i2c_msg *msgs, int nmsgs);
+void script_copy_out(struct i2c_msg *msgs, int nmsgs, const uint8_t *out);
+
+#endif
@@ -0,0 +1,214 @@
+/*
+   Simulated I2C-Pico-USB adapter
+
+   Simulates the adapter and two devices:
+     0x48 - 256 registers with 8-bit register pointer (like a sensor)
+     0x50 - 4K bytes memory with 16-bit address and 32 byte pages (like
+            a 24C32, writes wrap at the end of the page)
+
+   Scripts are executed by the firmware interpreter (firmware/i2cscript.c),
+   running over a simulated bus. Each USB control transfer takes
+   usb_latency_us and each byte on the bus takes 9 clock periods.
+
+   Only one simulated adapter can be used in a program.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pico/stdlib.h"
+#include "bbi2c.h"
+#include "adapter.h"
+
+#define SIM_REG_ADDR  0x48
+#define SIM_MEM_ADDR  0x50
+#define SIM_MEM_SIZE  4096
+#define SIM_MEM_PAGE  32
+
+struct adapter_sim {
+  struct adapter ad;
+  uint32_t usb_latency_us;
+  uint32_t byte_ns;       // time to transfer a byte
+};
+
+static struct adapter_sim *sim;
+
+// Simulated bus
+enum { BUS_IDLE, BUS_ADDR, BUS_PTR_HI, BUS_PTR_LO, BUS_WRITE, BUS_READ, BUS_OTHER };
+
+static struct {
+  int state;
+  uint8_t dev;
+  uint8_t regs[256];
+  uint8_t mem[SIM_MEM_SIZE];
+  uint16_t ptr;
+  uint64_t bus_ns;      // bus time not yet accounted
+} bus;
+
+// Waits for the simulated time
+static void sim_wait(uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  nanosleep(&ts, NULL);
+}
+
+// Ends a simulated USB transfer
+static void sim_usb_transfer(void) {
+  sim->ad.usb_transfers++;
+  sim_wait(bus.bus_ns + 1000ULL * sim->usb_latency_us);
+  bus.bus_ns = 0;
+}
+
+// Pico SDK timer
+void busy_wait_us_32(uint32_t delay_us) {
+  bus.bus_ns += 1000ULL * delay_us;
+}
+
+uint32_t time_us_32(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000) + (uint32_t) (bus.bus_ns / 1000);
+}
+
+// Bit-banged I2C primitives
+void bbi2c_start(void) {
+  bus.state = BUS_ADDR;
+}
+
+void bbi2c_restart(void) {
+  bus.state = BUS_ADDR;
+}
+
+void bbi2c_stop(void) {
+  bus.state = BUS_IDLE;
+}
+
+bool bbi2c_bus_error(void) {
+  return false;
+}
+
+bool bbi2c_recover(void) {
+  bus.state = BUS_IDLE;
+  return true;
+}
+
+bool bbi2c_write(uint8_t b) {
+  bus.bus_ns += sim->byte_ns;
+  switch (bus.state) {
+    case BUS_ADDR:
+      bus.dev = b >> 1;
+      if ((bus.dev != SIM_REG_ADDR) && (bus.dev != SIM_MEM_ADDR)) {
+        bus.state = BUS_OTHER;
+        return false;
+      }
+      if (b & 1) {
+        bus.state = BUS_READ;
+      } else {
+        bus.state = (bus.dev == SIM_MEM_ADDR) ? BUS_PTR_HI : BUS_PTR_LO;
+      }
+      return true;
+    case BUS_PTR_HI:
+      bus.ptr = b << 8;
+      bus.state = BUS_PTR_LO;
+      return true;
+    case BUS_PTR_LO:
+      bus.ptr = (bus.dev == SIM_MEM_ADDR) ? ((bus.ptr | b) % SIM_MEM_SIZE) : b;
+      bus.state = BUS_WRITE;
+      return true;
+    case BUS_WRITE:
+      if (bus.dev == SIM_MEM_ADDR) {
+        bus.mem[bus.ptr] = b;
+        bus.ptr = (bus.ptr & ~(SIM_MEM_PAGE - 1)) | ((bus.ptr + 1) & (SIM_MEM_PAGE - 1));
+      } else {
+        bus.regs[bus.ptr] = b;
+        bus.ptr = (bus.ptr + 1) & 0xFF;
+      }
+      return true;
+  }
+  return false;
+}
+
+uint8_t bbi2c_read(bool last) {
+  uint8_t b = 0xFF;
+  bus.bus_ns += sim->byte_ns;
+  if (bus.state == BUS_READ) {
+    if (bus.dev == SIM_MEM_ADDR) {
+      b = bus.mem[bus.ptr];
+      bus.ptr = (bus.ptr + 1) % SIM_MEM_SIZE;
+    } else {
+      b = bus.regs[bus.ptr];
+      bus.ptr = (bus.ptr + 1) & 0xFF;
+    }
+  }
+  return b;
+}
+
+// Adapter operations
+static int sim_xfer(struct adapter *ad, struct i2c_msg *msgs, int nmsgs) {
+  int ret = 0;
+
+  // Same as i2cpicousb.c: one USB transfer for each message
+  for (int i = 0; (i < nmsgs) && (ret == 0); i++) {
+    if (i == 0) {
+      bbi2c_start();
+    } else {
+      bbi2c_restart();
+    }
+    bool rd = msgs[i].flags & I2C_M_RD;
+    if (!bbi2c_write((msgs[i].addr << 1) | (rd ? 1 : 0))) {
+      ret = -ENXIO;
+    } else if (rd) {
+      for (int j = 0; j < msgs[i].len; j++) {
+        msgs[i].buf[j] = bbi2c_read(j == (msgs[i].len - 1));
+      }
+    } else {
+      for (int j = 0; (j < msgs[i].len) && (ret == 0); j++) {
+        if (!bbi2c_write(msgs[i].buf[j])) {
+          ret = -EREMOTEIO;
+        }
+      }
+    }
+    if ((ret != 0) || (i == (nmsgs - 1))) {
+      bbi2c_stop();
+    }
+    sim_usb_transfer();
+  }
+  return ret;
+}
+
+static int sim_script(struct adapter *ad, const uint8_t *code, uint16_t len,
+                      struct i2c_script_result *res, uint8_t *out) {
+  if (len > SCRIPT_MAX_LEN) {
+    return -EIO;
+  }
+  sim_usb_transfer();
+  i2c_script_run(code, len, res, out);
+  sim_usb_transfer();
+  return 0;
+}
+
+static void sim_close(struct adapter *ad) {
+  free(sim);
+  sim = NULL;
+}
+
+struct adapter *adapter_sim_open(uint32_t usb_latency_us, uint32_t clock_khz) {
+  if ((sim != NULL) || (clock_khz == 0)) {
+    return NULL;
+  }
+  sim = calloc(1, sizeof(struct adapter_sim));
+  if (sim == NULL) {
+    return NULL;
+  }
+  memset(&bus, 0, sizeof(bus));
+  sim->usb_latency_us = usb_latency_us;
+  sim->byte_ns = 9000000 / clock_khz;
+  sim->ad.xfer = sim_xfer;
+  sim->ad.script = sim_script;
+  sim->ad.close = sim_close;
+  return &sim->ad;
+}
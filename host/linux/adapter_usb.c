@@ -0,0 +1,148 @@
+/*
+   Access to a real I2C-Pico-USB adapter through libusb
+
+   Transactions are done as in the Linux i2c-tiny-usb driver (one
+   control transfer for each message). The kernel driver is detached 
+   while the adapter is in use.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libusb-1.0/libusb.h>
+
+#include "i2cusb.h"
+#include "adapter.h"
+
+#define USB_VID 0x0403
+#define USB_PID 0xc631
+
+#define USB_TIMEOUT_MS 1000
+
+#define REQ_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+#define REQ_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+
+struct adapter_usb {
+  struct adapter ad;
+  libusb_context *ctx;
+  libusb_device_handle *handle;
+};
+
+// Gets the adapter status after an error and converts to -errno
+static int usb_status_errno(struct adapter_usb *usb) {
+  uint8_t status;
+  usb->ad.usb_transfers++;
+  if (libusb_control_transfer(usb->handle, REQ_IN, CMD_GET_STATUS, 0, 0, &status, 1, USB_TIMEOUT_MS) != 1) {
+    return -EIO;
+  }
+  switch (status) {
+    case STATUS_ADDRESS_NACK:  return -ENXIO;
+    case STATUS_BUS_ERROR:     return -ETIMEDOUT;
+  }
+  return -EREMOTEIO;
+}
+
+static int usb_xfer(struct adapter *ad, struct i2c_msg *msgs, int nmsgs) {
+  struct adapter_usb *usb = (struct adapter_usb *) ad;
+
+  for (int i = 0; i < nmsgs; i++) {
+    uint8_t cmd = CMD_I2C_IO;
+    if (i == 0) {
+      cmd |= CMD_I2C_BEGIN;
+    }
+    if (i == (nmsgs - 1)) {
+      cmd |= CMD_I2C_END;
+    }
+    uint8_t type = (msgs[i].flags & I2C_M_RD) ? REQ_IN : REQ_OUT;
+    ad->usb_transfers++;
+    int ret = libusb_control_transfer(usb->handle, type, cmd, msgs[i].flags, msgs[i].addr,
+                                      msgs[i].buf, msgs[i].len, USB_TIMEOUT_MS);
+    if (ret != msgs[i].len) {
+      return (ret == LIBUSB_ERROR_PIPE) ? usb_status_errno(usb) : -EIO;
+    }
+  }
+  return 0;
+}
+
+static int usb_script(struct adapter *ad, const uint8_t *code, uint16_t len,
+                      struct i2c_script_result *res, uint8_t *out) {
+  struct adapter_usb *usb = (struct adapter_usb *) ad;
+  uint8_t reply[sizeof(*res) + SCRIPT_MAX_OUT];
+
+  ad->usb_transfers += 2;
+  if (libusb_control_transfer(usb->handle, REQ_OUT, CMD_I2C_SCRIPT, 0, 0, 
+                              (uint8_t *) code, len, USB_TIMEOUT_MS) != len) {
+    return -EIO;
+  }
+  int ret = libusb_control_transfer(usb->handle, REQ_IN, CMD_I2C_SCRIPT, 0, 0, 
+                                    reply, sizeof(reply), USB_TIMEOUT_MS);
+  if (ret < (int) sizeof(*res)) {
+    return -EIO;
+  }
+  memcpy(res, reply, sizeof(*res));
+  memcpy(out, reply + sizeof(*res), ret - sizeof(*res));
+  return 0;
+}
+
+static void usb_close(struct adapter *ad) {
+  struct adapter_usb *usb = (struct adapter_usb *) ad;
+  libusb_release_interface(usb->handle, 0);
+  libusb_close(usb->handle);
+  libusb_exit(usb->ctx);
+  free(usb);
+}
+
+// Opens an adapter, if serial is not NULL opens the adapter with that serial number
+static libusb_device_handle *usb_find(libusb_context *ctx, const char *serial) {
+  libusb_device **list;
+  libusb_device_handle *handle = NULL;
+  ssize_t n = libusb_get_device_list(ctx, &list);
+
+  for (ssize_t i = 0; (i < n) && (handle == NULL); i++) {
+    struct libusb_device_descriptor desc;
+    if ((libusb_get_device_descriptor(list[i], &desc) != 0) || 
+        (desc.idVendor != USB_VID) || (desc.idProduct != USB_PID) ||
+        (libusb_open(list[i], &handle) != 0)) {
+      continue;
+    }
+    if (serial != NULL) {
+      unsigned char str[64];
+      if ((libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, str, sizeof(str)) < 0) ||
+          (strcmp((char *) str, serial) != 0)) {
+        libusb_close(handle);
+        handle = NULL;
+      }
+    }
+  }
+  libusb_free_device_list(list, 1);
+  return handle;
+}
+
+struct adapter *adapter_usb_open(const char *serial) {
+  struct adapter_usb *usb = calloc(1, sizeof(struct adapter_usb));
+  if (usb == NULL) {
+    return NULL;
+  }
+  if (libusb_init(&usb->ctx) != 0) {
+    free(usb);
+    return NULL;
+  }
+  usb->handle = usb_find(usb->ctx, serial);
+  if (usb->handle == NULL) {
+    libusb_exit(usb->ctx);
+    free(usb);
+    return NULL;
+  }
+  libusb_set_auto_detach_kernel_driver(usb->handle, 1);
+  if (libusb_claim_interface(usb->handle, 0) != 0) {
+    libusb_close(usb->handle);
+    libusb_exit(usb->ctx);
+    free(usb);
+    return NULL;
+  }
+  usb->ad.xfer = usb_xfer;
+  usb->ad.script = usb_script;
+  usb->ad.close = usb_close;
+  return &usb->ad;
+}
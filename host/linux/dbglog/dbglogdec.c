@@ -0,0 +1,345 @@
+/*
+   dbglogdec - decoder for the binary debug log of the firmware
+
+   The firmware built with DEBUG_LOG does not format the debug messages,
+   it sends records with the address of the format string and the
+   arguments (struct dbglog_record in i2cusb.h). This program gets the
+   format strings from the firmware ELF file and prints the messages,
+   with the timestamp (in seconds) and a note where records were dropped.
+
+   The records can be read
+   - from the UART (DEBUG_LOG=UART), through a serial device or from a
+     file with a capture
+   - from the vendor bulk IN endpoint (DEBUG_LOG=USB), through libusb
+     (the kernel driver is detached)
+
+   Compile with
+     gcc -Wall -O2 -I../../../firmware -o dbglogdec dbglogdec.c -lusb-1.0
+   or, without libusb, add -DNO_LIBUSB and remove -lusb-1.0
+
+   Use
+     dbglogdec -e firmware.elf [-b baud] device_or_file
+     dbglogdec -e firmware.elf -u [-d serial]
+       -e   firmware ELF file (build/i2cpicousb.elf)
+       -b   baud rate for a serial device (default 921600)
+       -u   read the records from the adapter through libusb
+       -d   serial number of the adapter
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <termios.h>
+#ifndef NO_LIBUSB
+#include <libusb-1.0/libusb.h>
+#endif
+
+#include "i2cusb.h"
+
+#define USB_VID 0x0403
+#define USB_PID 0xc631
+#define EP_IN   0x81
+
+// The firmware ELF file
+static uint8_t *elf;
+static size_t elf_size;
+
+// Loads the ELF file, returns false if it is not an ARM ELF
+static bool elf_load(const char *fname) {
+  FILE *f = fopen(fname, "rb");
+  if (f == NULL) {
+    perror(fname);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  elf_size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  elf = malloc(elf_size);
+  if ((elf == NULL) || (fread(elf, 1, elf_size, f) != elf_size)) {
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  Elf32_Ehdr *eh = (Elf32_Ehdr *) elf;
+  if ((elf_size < sizeof(*eh)) || (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0) ||
+      (eh->e_ident[EI_CLASS] != ELFCLASS32) || (eh->e_machine != EM_ARM) ||
+      ((eh->e_shoff + (uint64_t) eh->e_shnum * sizeof(Elf32_Shdr)) > elf_size)) {
+    fprintf (stderr, "%s: not a firmware ELF file\n", fname);
+    return false;
+  }
+  return true;
+}
+
+// Gets the string at an address of the firmware (NULL if not found)
+static const char *elf_string(uint32_t addr) {
+  Elf32_Ehdr *eh = (Elf32_Ehdr *) elf;
+  Elf32_Shdr *sh = (Elf32_Shdr *) (elf + eh->e_shoff);
+
+  for (int i = 0; i < eh->e_shnum; i++) {
+    if (!(sh[i].sh_flags & SHF_ALLOC) || (sh[i].sh_type == SHT_NOBITS) ||
+        (addr < sh[i].sh_addr) || (addr >= (sh[i].sh_addr + sh[i].sh_size)) ||
+        ((sh[i].sh_offset + (uint64_t) sh[i].sh_size) > elf_size)) {
+      continue;
+    }
+    const char *s = (const char *) elf + sh[i].sh_offset + (addr - sh[i].sh_addr);
+    size_t max = sh[i].sh_size - (addr - sh[i].sh_addr);
+    return memchr(s, 0, max) ? s : NULL;
+  }
+  return NULL;
+}
+
+// Formats a message (the firmware only uses integer conversions)
+static void format(char *out, size_t size, const char *fmt, const uint32_t *arg, int nargs) {
+  size_t pos = 0;
+  int n = 0;
+
+  while (*fmt && (pos < (size - 1))) {
+    if (*fmt != '%') {
+      out[pos++] = *fmt++;
+      continue;
+    }
+    if (fmt[1] == '%') {
+      out[pos++] = '%';
+      fmt += 2;
+      continue;
+    }
+
+    // copy the flags, width and precision, skip the length modifiers
+    char spec[16];
+    int len = 0;
+    const char *p = fmt + 1;
+    spec[len++] = '%';
+    while (*p && strchr("-+ #0123456789.hlzjt", *p)) {
+      if (!strchr("hlzjt", *p) && (len < (sizeof(spec) - 2))) {
+        spec[len++] = *p;
+      }
+      p++;
+    }
+    if ((*p == 0) || !strchr("diouxXc", *p)) {
+      out[pos++] = *fmt++;    // not a conversion we know, copy as is
+      continue;
+    }
+    spec[len++] = *p;
+    spec[len] = 0;
+    uint32_t val = (n < nargs) ? arg[n] : 0;
+    n++;
+    if (strchr("dic", *p)) {
+      snprintf (out + pos, size - pos, spec, (int) val);
+    } else {
+      snprintf (out + pos, size - pos, spec, (unsigned) val);
+    }
+    pos += strlen(out + pos);
+    fmt = p + 1;
+  }
+  out[pos] = 0;
+}
+
+// Prints a record, returns false if it is not valid
+static bool print_record(const struct dbglog_record *rec) {
+  static bool first = true;
+  static uint16_t next_seq;
+  char text[512];
+
+  const char *fmt = elf_string(rec->fmt);
+  if ((rec->magic != DBGLOG_MAGIC) || (rec->nargs > DBGLOG_MAX_ARGS) || (fmt == NULL)) {
+    return false;
+  }
+  if (!first && (rec->seq != next_seq)) {
+    printf ("--- %u records dropped ---\n", (uint16_t) (rec->seq - next_seq));
+  }
+  first = false;
+  next_seq = rec->seq + 1;
+
+  uint32_t arg[DBGLOG_MAX_ARGS];
+  memcpy(arg, rec->arg, sizeof(arg));
+  format(text, sizeof(text), fmt, arg, rec->nargs);
+  size_t len = strlen(text);
+  printf ("%4u.%06u %s%s", rec->time_us / 1000000, rec->time_us % 1000000, text,
+          ((len == 0) || (text[len-1] != '\n')) ? "\n" : "");
+  fflush(stdout);
+  return true;
+}
+
+// Decodes the records in a byte stream (UART), returns the bytes used
+static size_t decode_stream(const uint8_t *buf, size_t len) {
+  size_t pos = 0;
+  while ((len - pos) >= sizeof(struct dbglog_record)) {
+    struct dbglog_record rec;
+    memcpy(&rec, buf + pos, sizeof(rec));
+    if (print_record(&rec)) {
+      pos += sizeof(rec);
+    } else {
+      pos++;    // lost sync, look for the next magic
+    }
+  }
+  return pos;
+}
+
+#ifndef NO_LIBUSB
+// Decodes the RECORD_LOG records from the vendor endpoint, returns the bytes used
+static size_t decode_usb(const uint8_t *buf, size_t len) {
+  size_t pos = 0;
+  while ((len - pos) >= sizeof(struct usb_record_hdr)) {
+    struct usb_record_hdr hdr;
+    memcpy(&hdr, buf + pos, sizeof(hdr));
+    if ((len - pos) < (sizeof(hdr) + hdr.len)) {
+      break;
+    }
+    if ((hdr.type == RECORD_LOG) && (hdr.len == sizeof(struct dbglog_record))) {
+      struct dbglog_record rec;
+      memcpy(&rec, buf + pos + sizeof(hdr), sizeof(rec));
+      if (!print_record(&rec)) {
+        printf ("--- invalid record ---\n");
+      }
+    }
+    pos += sizeof(hdr) + hdr.len;
+  }
+  return pos;
+}
+#endif
+
+// Configures a serial device
+static void set_serial(int fd, int baud) {
+  struct termios tio;
+  if (tcgetattr(fd, &tio) != 0) {
+    return;   // not a serial device
+  }
+  cfmakeraw(&tio);
+  cfsetspeed(&tio, baud);
+  if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+    perror("tcsetattr");
+  }
+}
+
+// Reads records from a serial device or file
+static int read_stream(const char *fname, int baud) {
+  static uint8_t buf[4096];
+  size_t len = 0;
+
+  int fd = open(fname, O_RDONLY | O_NOCTTY);
+  if (fd < 0) {
+    perror(fname);
+    return 1;
+  }
+  set_serial(fd, baud);
+  for (;;) {
+    ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+    size_t used = decode_stream(buf, len);
+    memmove(buf, buf + used, len - used);
+    len -= used;
+  }
+  close(fd);
+  return 0;
+}
+
+#ifndef NO_LIBUSB
+// Reads records from the adapter
+static int read_usb(const char *serial) {
+  static uint8_t buf[4096];
+  size_t len = 0;
+  libusb_context *ctx;
+  libusb_device_handle *handle = NULL;
+
+  if (libusb_init(&ctx) != 0) {
+    return 1;
+  }
+  libusb_device **list;
+  ssize_t ndev = libusb_get_device_list(ctx, &list);
+  for (ssize_t i = 0; (i < ndev) && (handle == NULL); i++) {
+    struct libusb_device_descriptor desc;
+    if ((libusb_get_device_descriptor(list[i], &desc) != 0) || 
+        (desc.idVendor != USB_VID) || (desc.idProduct != USB_PID) ||
+        (libusb_open(list[i], &handle) != 0)) {
+      continue;
+    }
+    if (serial != NULL) {
+      unsigned char str[64];
+      if ((libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, str, sizeof(str)) < 0) ||
+          (strcmp((char *) str, serial) != 0)) {
+        libusb_close(handle);
+        handle = NULL;
+      }
+    }
+  }
+  libusb_free_device_list(list, 1);
+  if (handle == NULL) {
+    fprintf (stderr, "Adapter not found\n");
+    libusb_exit(ctx);
+    return 1;
+  }
+  libusb_set_auto_detach_kernel_driver(handle, 1);
+  if (libusb_claim_interface(handle, 0) != 0) {
+    fprintf (stderr, "Cannot claim the interface\n");
+    libusb_close(handle);
+    libusb_exit(ctx);
+    return 1;
+  }
+
+  for (;;) {
+    int n;
+    int ret = libusb_bulk_transfer(handle, EP_IN, buf + len, sizeof(buf) - len, &n, 1000);
+    if ((ret != 0) && (ret != LIBUSB_ERROR_TIMEOUT)) {
+      fprintf (stderr, "USB error %s\n", libusb_error_name(ret));
+      break;
+    }
+    len += n;
+    size_t used = decode_usb(buf, len);
+    memmove(buf, buf + used, len - used);
+    len -= used;
+  }
+
+  libusb_release_interface(handle, 0);
+  libusb_close(handle);
+  libusb_exit(ctx);
+  return 1;
+}
+#endif
+
+// Main program
+int main (int argc, char **argv) {
+  const char *elf_file = NULL;
+  const char *serial = NULL;
+  bool usb = false;
+  int baud = 921600;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "e:b:ud:")) != -1) {
+    switch (opt) {
+      case 'e': elf_file = optarg; break;
+      case 'b': baud = atoi(optarg); break;
+      case 'u': usb = true; break;
+      case 'd': serial = optarg; break;
+      default:
+        elf_file = NULL;
+        break;
+    }
+  }
+  if ((elf_file == NULL) || (!usb && (optind >= argc))) {
+    printf ("Use: dbglogdec -e firmware.elf [-b baud] device_or_file\n");
+    printf ("     dbglogdec -e firmware.elf -u [-d serial]\n");
+    return 1;
+  }
+  if (!elf_load(elf_file)) {
+    return 1;
+  }
+
+  if (usb) {
+    #ifndef NO_LIBUSB
+    return read_usb(serial);
+    #else
+    (void) serial;
+    fprintf (stderr, "Compiled without libusb\n");
+    return 1;
+    #endif
+  }
+  return read_stream(argv[optind], baud);
+}
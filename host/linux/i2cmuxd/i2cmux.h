@@ -0,0 +1,52 @@
+/*
+   Protocol between i2cmuxd and its clients
+
+   Clients connect to a Unix SOCK_SEQPACKET socket, each packet is 
+   a request or a response. 
+
+   Request:  struct i2cmux_req, nmsgs x struct i2cmux_msg, data for the 
+             write messages (in the order of the messages)
+   Response: struct i2cmux_resp, data (read messages for I2CMUX_XFER,
+             text for I2CMUX_STATS)
+*/
+
+#ifndef _I2CMUX_H
+#define _I2CMUX_H
+
+#include <stdint.h>
+
+#define I2CMUX_DEFAULT_SOCKET "/tmp/i2cmuxd.sock"
+
+#define I2CMUX_MAX_MSGS   8
+#define I2CMUX_MAX_DATA   1024
+#define I2CMUX_MAX_PACKET 8192
+
+// Request types
+#define I2CMUX_XFER   1   // do a transaction
+#define I2CMUX_STATS  2   // get statistics (as text)
+
+// Request flags
+#define I2CMUX_F_NOMERGE  0x01  // do not merge with identical requests
+
+struct i2cmux_req {
+  uint32_t id;        // returned in the response
+  uint8_t type;
+  uint8_t flags;
+  uint8_t nmsgs;
+  uint8_t reserved;
+} __attribute__((packed));
+
+struct i2cmux_msg {
+  uint16_t addr;
+  uint16_t flags;     // I2C_M_xxx
+  uint16_t len;
+} __attribute__((packed));
+
+struct i2cmux_resp {
+  uint32_t id;
+  int32_t status;     // 0 or -errno
+  uint16_t len;       // bytes after the header
+  uint16_t reserved;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,122 @@
+/*
+   Client access to i2cmuxd
+
+   i2cmux_transfer works like the I2C_RDWR ioctl, returning 0 or -errno.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "i2cmux.h"
+#include "i2cmux_client.h"
+
+static uint32_t next_id = 1;
+
+// Connects to the daemon, returns the socket or -errno
+int i2cmux_connect(const char *path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path ? path : I2CMUX_DEFAULT_SOCKET, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  return fd;
+}
+
+// Sends a request and waits for the response, returns the response length or -errno
+static int i2cmux_request(int fd, const uint8_t *req, int req_len, uint8_t *resp, int resp_size) {
+  uint32_t id;
+  memcpy(&id, req, sizeof(id));
+  if (send(fd, req, req_len, MSG_NOSIGNAL) != req_len) {
+    return -EIO;
+  }
+  while (1) {
+    ssize_t n = recv(fd, resp, resp_size, 0);
+    if (n < (ssize_t) sizeof(struct i2cmux_resp)) {
+      return -EIO;
+    }
+    struct i2cmux_resp hdr;
+    memcpy(&hdr, resp, sizeof(hdr));
+    if (hdr.id == id) {
+      return n;
+    }
+  }
+}
+
+// Does a transaction
+int i2cmux_transfer(int fd, struct i2c_msg *msgs, int nmsgs, int flags) {
+  uint8_t buf[I2CMUX_MAX_PACKET];
+  struct i2cmux_req req = { next_id++, I2CMUX_XFER, flags, nmsgs, 0 };
+  int len = sizeof(req) + nmsgs * sizeof(struct i2cmux_msg);
+
+  if ((nmsgs <= 0) || (nmsgs > I2CMUX_MAX_MSGS)) {
+    return -EINVAL;
+  }
+  memcpy(buf, &req, sizeof(req));
+  for (int i = 0; i < nmsgs; i++) {
+    struct i2cmux_msg m = { msgs[i].addr, msgs[i].flags, msgs[i].len };
+    memcpy(buf + sizeof(req) + i * sizeof(m), &m, sizeof(m));
+    if (!(msgs[i].flags & I2C_M_RD)) {
+      if ((len + msgs[i].len) > (int) sizeof(buf)) {
+        return -EINVAL;
+      }
+      memcpy(buf + len, msgs[i].buf, msgs[i].len);
+      len += msgs[i].len;
+    }
+  }
+
+  int n = i2cmux_request(fd, buf, len, buf, sizeof(buf));
+  if (n < 0) {
+    return n;
+  }
+  struct i2cmux_resp resp;
+  memcpy(&resp, buf, sizeof(resp));
+  if (resp.status != 0) {
+    return resp.status;
+  }
+
+  // Copy the data read
+  uint8_t *p = buf + sizeof(resp);
+  for (int i = 0; i < nmsgs; i++) {
+    if (msgs[i].flags & I2C_M_RD) {
+      memcpy(msgs[i].buf, p, msgs[i].len);
+      p += msgs[i].len;
+    }
+  }
+  return 0;
+}
+
+// Gets the daemon statistics (as text)
+int i2cmux_stats(int fd, char *text, int size) {
+  uint8_t buf[I2CMUX_MAX_PACKET];
+  struct i2cmux_req req = { next_id++, I2CMUX_STATS, 0, 0, 0 };
+
+  memcpy(buf, &req, sizeof(req));
+  int n = i2cmux_request(fd, buf, sizeof(req), buf, sizeof(buf));
+  if (n < 0) {
+    return n;
+  }
+  int len = n - sizeof(struct i2cmux_resp);
+  if (len >= size) {
+    len = size - 1;
+  }
+  memcpy(text, buf + sizeof(struct i2cmux_resp), len);
+  text[len] = 0;
+  return 0;
+}
+
+void i2cmux_close(int fd) {
+  close(fd);
+}
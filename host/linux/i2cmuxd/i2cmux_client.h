@@ -0,0 +1,15 @@
+/*
+   Client access to i2cmuxd
+*/
+
+#ifndef _I2CMUX_CLIENT_H
+#define _I2CMUX_CLIENT_H
+
+#include <linux/i2c.h>
+
+int i2cmux_connect(const char *path);
+int i2cmux_transfer(int fd, struct i2c_msg *msgs, int nmsgs, int flags);
+int i2cmux_stats(int fd, char *buf, int size);
+void i2cmux_close(int fd);
+
+#endif
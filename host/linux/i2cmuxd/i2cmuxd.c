@@ -0,0 +1,528 @@
+/*
+   i2cmuxd - shares an I2C-Pico-USB adapter between many processes
+
+   The daemon owns the adapter (through libusb) and serves clients 
+   connected to a Unix socket (see i2cmux.h and i2cmux_client.c).
+
+   Requests that arrive together (or within a configurable window) 
+   are handled as a batch:
+   - identical read transactions (optional register pointer writes of
+     up to 2 bytes followed by reads) are done only once and the result
+     is sent to all the clients that asked for it
+   - the other transactions are grouped in scripts (CMD_I2C_SCRIPT), so
+     many transactions are done with only two USB transfers
+
+   Per client statistics (including latency percentiles) can be
+   requested by the clients.
+
+   Compile with
+     gcc -Wall -O2 -I.. -I../../../firmware -I../../../tests/linux/picohost -o i2cmuxd \
+         i2cmuxd.c ../adapter.c ../adapter_sim.c ../adapter_usb.c ../../../firmware/i2cscript.c -lusb-1.0
+   or, to use only the simulated adapter (no libusb), add -DNO_LIBUSB and
+   remove ../adapter_usb.c and -lusb-1.0
+
+   Use
+     i2cmuxd [-s] [-l usb_latency_us] [-k clock_khz] [-d serial] [-p socket] [-w window_us]
+       -s   use a simulated adapter (see adapter_sim.c)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "adapter.h"
+#include "i2cmux.h"
+
+#define MAX_CLIENTS 64
+#define MAX_PENDING 256
+
+// Latency histogram: 4 buckets per power of two (in us)
+#define HIST_BUCKETS 128
+
+struct client {
+  int fd;
+  int num;
+  uint64_t requests;
+  uint64_t merged;
+  uint64_t errors;
+  uint64_t lat_total_us;
+  uint64_t lat_max_us;
+  uint32_t hist[HIST_BUCKETS];
+};
+
+struct pending {
+  struct client *cl;
+  uint64_t arrival_us;
+  struct i2cmux_req req;
+  struct i2c_msg msgs[I2CMUX_MAX_MSGS];
+  uint8_t data[I2CMUX_MAX_DATA];
+  int status;
+  struct pending *same;   // identical request that will be executed
+};
+
+static struct adapter *ad;
+static struct client clients[MAX_CLIENTS];
+static struct pending pending[MAX_PENDING];
+static int npending = 0;
+static int next_client_num = 1;
+static uint32_t window_us = 0;
+
+static uint64_t batches, scripts, merged_total;
+
+// Current time in us
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Latency histogram bucket
+static int hist_bucket(uint64_t us) {
+  if (us < 4) {
+    return us;
+  }
+  int exp = 63 - __builtin_clzll(us);
+  int b = 4*(exp - 1) + ((us >> (exp - 2)) & 3);
+  return (b < HIST_BUCKETS) ? b : (HIST_BUCKETS - 1);
+}
+
+// Upper limit (us) of a bucket
+static uint64_t hist_limit(int b) {
+  if (b < 4) {
+    return b;
+  }
+  int exp = b/4 + 1;
+  return ((4ULL + (b % 4) + 1) << (exp - 2)) - 1;
+}
+
+// Latency percentile from the histogram
+static uint64_t hist_percentile(struct client *cl, int pct) {
+  uint64_t total = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    total += cl->hist[b];
+  }
+  uint64_t count = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    count += cl->hist[b];
+    if ((count * 100) >= (total * pct)) {
+      return hist_limit(b);
+    }
+  }
+  return 0;
+}
+
+// Sends a response
+static void send_resp(struct client *cl, uint32_t id, int status, const void *data, uint16_t len) {
+  uint8_t buf[I2CMUX_MAX_PACKET];
+  struct i2cmux_resp resp = { id, status, len, 0 };
+  memcpy(buf, &resp, sizeof(resp));
+  memcpy(buf + sizeof(resp), data, len);
+  send(cl->fd, buf, sizeof(resp) + len, MSG_NOSIGNAL);
+}
+
+// Statistics as text
+static void send_stats(struct client *cl, uint32_t id) {
+  char buf[I2CMUX_MAX_PACKET - sizeof(struct i2cmux_resp)];
+  int len = snprintf(buf, sizeof(buf), 
+                     "usb_transfers %llu\nbatches %llu\nscripts %llu\nmerged %llu\n",
+                     (unsigned long long) ad->usb_transfers, (unsigned long long) batches, 
+                     (unsigned long long) scripts, (unsigned long long) merged_total);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    struct client *c = &clients[i];
+    if ((c->fd < 0) || (len >= (int) sizeof(buf))) {
+      continue;
+    }
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    "client %d requests %llu merged %llu errors %llu mean_us %llu "
+                    "p50_us %llu p90_us %llu p99_us %llu max_us %llu\n",
+                    c->num, (unsigned long long) c->requests, (unsigned long long) c->merged, 
+                    (unsigned long long) c->errors,
+                    (unsigned long long) (c->requests ? c->lat_total_us / c->requests : 0),
+                    (unsigned long long) hist_percentile(c, 50), (unsigned long long) hist_percentile(c, 90),
+                    (unsigned long long) hist_percentile(c, 99), (unsigned long long) c->lat_max_us);
+  }
+  if (len >= (int) sizeof(buf)) {
+    len = sizeof(buf) - 1;
+  }
+  send_resp(cl, id, 0, buf, len);
+}
+
+// Reads a request, returns false if the client disconnected
+static bool read_request(struct client *cl) {
+  uint8_t buf[I2CMUX_MAX_PACKET];
+  ssize_t n = recv(cl->fd, buf, sizeof(buf), 0);
+  if (n <= 0) {
+    return false;
+  }
+  if (n < (ssize_t) sizeof(struct i2cmux_req)) {
+    return true;    // ignore
+  }
+
+  struct i2cmux_req req;
+  memcpy(&req, buf, sizeof(req));
+  if (req.type == I2CMUX_STATS) {
+    send_stats(cl, req.id);
+    return true;
+  }
+  if ((req.type != I2CMUX_XFER) || (req.nmsgs == 0) || (req.nmsgs > I2CMUX_MAX_MSGS) || 
+      (npending == MAX_PENDING)) {
+    send_resp(cl, req.id, (npending == MAX_PENDING) ? -EAGAIN : -EINVAL, NULL, 0);
+    return true;
+  }
+
+  // Unpack the messages
+  struct pending *p = &pending[npending];
+  ssize_t pos = sizeof(req) + req.nmsgs * sizeof(struct i2cmux_msg);
+  size_t data_len = 0;
+  bool ok = pos <= n;
+  for (int i = 0; ok && (i < req.nmsgs); i++) {
+    struct i2cmux_msg m;
+    memcpy(&m, buf + sizeof(req) + i * sizeof(m), sizeof(m));
+    if ((m.len > I2CMUX_MAX_DATA) || ((data_len + m.len) > sizeof(p->data))) {
+      ok = false;
+      break;
+    }
+    p->msgs[i].addr = m.addr;
+    p->msgs[i].flags = m.flags;
+    p->msgs[i].len = m.len;
+    p->msgs[i].buf = p->data + data_len;
+    data_len += m.len;
+    if (!(m.flags & I2C_M_RD)) {
+      if ((pos + m.len) > n) {
+        ok = false;
+      } else {
+        memcpy(p->msgs[i].buf, buf + pos, m.len);
+        pos += m.len;
+      }
+    }
+  }
+  if (!ok) {
+    send_resp(cl, req.id, -EINVAL, NULL, 0);
+    return true;
+  }
+  p->req = req;
+  p->cl = cl;
+  p->arrival_us = now_us();
+  p->status = 0;
+  p->same = NULL;
+  npending++;
+  return true;
+}
+
+// Checks if a request can be merged with identical ones
+static bool mergeable(struct pending *p) {
+  if (p->req.flags & I2CMUX_F_NOMERGE) {
+    return false;
+  }
+  if (!(p->msgs[p->req.nmsgs - 1].flags & I2C_M_RD)) {
+    return false;   // must end with a read
+  }
+  for (int i = 0; i < p->req.nmsgs; i++) {
+    if (!(p->msgs[i].flags & I2C_M_RD) && (p->msgs[i].len > 2)) {
+      return false; // only register pointer writes
+    }
+  }
+  return true;
+}
+
+// Checks if two requests are identical
+static bool same_xfer(struct pending *a, struct pending *b) {
+  if (a->req.nmsgs != b->req.nmsgs) {
+    return false;
+  }
+  for (int i = 0; i < a->req.nmsgs; i++) {
+    if ((a->msgs[i].addr != b->msgs[i].addr) || (a->msgs[i].flags != b->msgs[i].flags) ||
+        (a->msgs[i].len != b->msgs[i].len)) {
+      return false;
+    }
+    if (!(a->msgs[i].flags & I2C_M_RD) && memcmp(a->msgs[i].buf, b->msgs[i].buf, a->msgs[i].len)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks if a request between pending[j] and pending[i] can change what they read
+// (any request to one of the addresses that is not a plain read)
+static bool changed_between(int j, int i) {
+  for (int k = j + 1; k < i; k++) {
+    if (mergeable(&pending[k])) {
+      continue;
+    }
+    for (int m = 0; m < pending[k].req.nmsgs; m++) {
+      for (int n = 0; n < pending[i].req.nmsgs; n++) {
+        if (pending[k].msgs[m].addr == pending[i].msgs[n].addr) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+// Runs the pending requests
+static void run_batch(void) {
+  static struct pending *uniq[MAX_PENDING];
+  static uint16_t code_end[MAX_PENDING], out_start[MAX_PENDING];
+  static struct script_buf sb;
+  static uint8_t out[SCRIPT_MAX_OUT];
+  int nu = 0;
+
+  batches++;
+
+  // Find identical requests from other clients, a client that pipelines a write and
+  // a read must get what the device returns after its own write
+  for (int i = 0; i < npending; i++) {
+    struct pending *p = &pending[i];
+    if (mergeable(p)) {
+      for (int j = 0; j < i; j++) {
+        if ((pending[j].same == NULL) && (pending[j].cl != p->cl) && mergeable(&pending[j]) &&
+            same_xfer(p, &pending[j]) && !changed_between(j, i)) {
+          p->same = &pending[j];
+          p->cl->merged++;
+          merged_total++;
+          break;
+        }
+      }
+    }
+    if (p->same == NULL) {
+      uniq[nu++] = p;
+    }
+  }
+
+  // Execute the unique requests, grouped in scripts
+  int i = 0;
+  while (i < nu) {
+    int first = i;
+    script_init(&sb);
+    while (i < nu) {
+      out_start[i] = sb.out_len;
+      if (script_add_xfer(&sb, uniq[i]->msgs, uniq[i]->req.nmsgs) != 0) {
+        break;
+      }
+      code_end[i] = sb.len;
+      i++;
+    }
+    int count = i - first;
+    if ((count == 0) || ((count == 1) && (uniq[first]->req.nmsgs <= 2))) {
+      // Not possible with a script or no advantage
+      uniq[first]->status = ad->xfer(ad, uniq[first]->msgs, uniq[first]->req.nmsgs);
+      i = first + 1;
+      continue;
+    }
+
+    struct i2c_script_result res;
+    scripts++;
+    int ret = ad->script(ad, sb.code, sb.len, &res, out);
+    if (ret != 0) {
+      for (int t = first; t < i; t++) {
+        uniq[t]->status = ret;
+      }
+      continue;
+    }
+    for (int t = first; t < i; t++) {
+      if ((res.status == SCRIPT_OK) || (res.pc >= code_end[t])) {
+        script_copy_out(uniq[t]->msgs, uniq[t]->req.nmsgs, out + out_start[t]);
+      } else {
+        // This one failed, the rest will go in the next script
+        uniq[t]->status = adapter_script_errno(res.status);
+        i = t + 1;
+        break;
+      }
+    }
+  }
+
+  // Send the responses
+  uint64_t now = now_us();
+  for (int i = 0; i < npending; i++) {
+    struct pending *p = &pending[i];
+    struct pending *src = p->same ? p->same : p;
+    uint8_t data[I2CMUX_MAX_DATA];
+    uint16_t len = 0;
+
+    if (src->status == 0) {
+      for (int m = 0; m < src->req.nmsgs; m++) {
+        if (src->msgs[m].flags & I2C_M_RD) {
+          memcpy(data + len, src->msgs[m].buf, src->msgs[m].len);
+          len += src->msgs[m].len;
+        }
+      }
+    }
+    send_resp(p->cl, p->req.id, src->status, data, len);
+
+    struct client *cl = p->cl;
+    uint64_t lat = now - p->arrival_us;
+    cl->requests++;
+    if (src->status != 0) {
+      cl->errors++;
+    }
+    cl->lat_total_us += lat;
+    if (lat > cl->lat_max_us) {
+      cl->lat_max_us = lat;
+    }
+    cl->hist[hist_bucket(lat)]++;
+  }
+  npending = 0;
+}
+
+// Removes the pending requests from a client that disconnected
+static void drop_client(struct client *cl) {
+  int n = 0;
+  for (int i = 0; i < npending; i++) {
+    if (pending[i].cl != cl) {
+      pending[n++] = pending[i];
+    }
+  }
+  // fix the pointers to the data in the messages that were moved
+  for (int i = 0; i < n; i++) {
+    uint16_t pos = 0;
+    for (int m = 0; m < pending[i].req.nmsgs; m++) {
+      pending[i].msgs[m].buf = pending[i].data + pos;
+      pos += pending[i].msgs[m].len;
+    }
+  }
+  npending = n;
+  close(cl->fd);
+  cl->fd = -1;
+}
+
+// Creates the listening socket
+static int open_socket(const char *path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if ((bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) || (listen(fd, 16) < 0)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static volatile bool stop = false;
+
+static void on_signal(int sig) {
+  stop = true;
+}
+
+// Main program
+int main (int argc, char **argv) {
+  bool simulated = false;
+  uint32_t latency_us = 500;
+  uint32_t clock_khz = 100;
+  const char *serial = NULL;
+  const char *path = I2CMUX_DEFAULT_SOCKET;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "sl:k:d:p:w:")) != -1) {
+    switch (opt) {
+      case 's': simulated = true; break;
+      case 'l': latency_us = atoi(optarg); break;
+      case 'k': clock_khz = atoi(optarg); break;
+      case 'd': serial = optarg; break;
+      case 'p': path = optarg; break;
+      case 'w': window_us = atoi(optarg); break;
+      default:
+        printf ("Use: i2cmuxd [-s] [-l usb_latency_us] [-k clock_khz] [-d serial] [-p socket] [-w window_us]\n");
+        return 1;
+    }
+  }
+
+  // open adapter
+  if (simulated) {
+    ad = adapter_sim_open(latency_us, clock_khz);
+  } else {
+    #ifndef NO_LIBUSB
+    ad = adapter_usb_open(serial);
+    #else
+    (void) serial;
+    printf ("Compiled without libusb, only the simulated adapter (-s) is available.\n");
+    #endif
+  }
+  if (ad == NULL) {
+    printf ("Error opening adapter.\n");
+    return 2;
+  }
+
+  int lfd = open_socket(path);
+  if (lfd < 0) {
+    printf ("Error creating socket %s.\n", path);
+    ad->close(ad);
+    return 3;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+
+  while (!stop) {
+    struct pollfd fds[MAX_CLIENTS + 1];
+    struct client *fd_client[MAX_CLIENTS + 1];
+    int nfds = 0;
+
+    fds[nfds].fd = lfd;
+    fds[nfds++].events = POLLIN;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      if (clients[i].fd >= 0) {
+        fd_client[nfds] = &clients[i];
+        fds[nfds].fd = clients[i].fd;
+        fds[nfds++].events = POLLIN;
+      }
+    }
+
+    // wait for requests (or the end of the window)
+    int timeout = -1;
+    if (npending) {
+      uint64_t elapsed = now_us() - pending[0].arrival_us;
+      timeout = (elapsed >= window_us) ? 0 : (window_us - elapsed + 999) / 1000;
+    }
+    if (poll(fds, nfds, timeout) < 0) {
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(lfd, NULL, NULL);
+      int i;
+      for (i = 0; (i < MAX_CLIENTS) && (clients[i].fd >= 0); i++) {
+      }
+      if ((fd >= 0) && (i < MAX_CLIENTS)) {
+        memset(&clients[i], 0, sizeof(struct client));
+        clients[i].fd = fd;
+        clients[i].num = next_client_num++;
+      } else if (fd >= 0) {
+        close(fd);
+      }
+    }
+    for (int i = 1; i < nfds; i++) {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (!read_request(fd_client[i])) {
+          drop_client(fd_client[i]);
+        }
+      }
+    }
+
+    if (npending && 
+        ((npending == MAX_PENDING) || ((now_us() - pending[0].arrival_us) >= window_us))) {
+      run_batch();
+    }
+  }
+
+  close(lfd);
+  unlink(path);
+  ad->close(ad);
+  return 0;
+}
@@ -0,0 +1,222 @@
+/*
+   i2ctrace - records the I2C traffic of an application (LD_PRELOAD)
+
+   Wraps the i2c-dev accesses of a program (ioctl I2C_RDWR and I2C_SMBUS,
+   read and write after I2C_SLAVE, close) and writes each transaction, with the
+   time it was requested, to a trace file that can be replayed with
+   tests/linux/treplay. The application runs unchanged, on any I2C
+   adapter.
+
+   Trace format (text, one transaction per line, '#' starts a comment)
+     <time_us> <msg> [<msg> ...]
+   where time_us is counted from the first transaction and each message is
+     <addr>w<data>   write (address and data in hex, data may be empty)
+     <addr>r<len>    read of len bytes (address in hex, len in decimal)
+   for example "120340 48w00 48r2" (register pointer write and 2 byte read).
+
+   SMBus block and process call transfers are not recorded.
+
+   Compile with
+     gcc -Wall -O2 -shared -fPIC -o i2ctrace.so i2ctrace.c -ldl -lpthread
+
+   Use
+     I2CTRACE=trace.txt LD_PRELOAD=./i2ctrace.so application [args]
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#define I2C_MAJOR   89
+#define MAX_FDS     1024
+
+static int (*real_ioctl)(int fd, unsigned long request, ...);
+static ssize_t (*real_read)(int fd, void *buf, size_t count);
+static ssize_t (*real_write)(int fd, const void *buf, size_t count);
+static int (*real_close)(int fd);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace;
+static uint64_t t_first;
+static bool started;
+
+// Target address selected with I2C_SLAVE for each fd (0 = none)
+static uint16_t slave_addr[MAX_FDS];
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+__attribute__((constructor))
+static void i2ctrace_init(void) {
+  real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+  real_read = dlsym(RTLD_NEXT, "read");
+  real_write = dlsym(RTLD_NEXT, "write");
+  real_close = dlsym(RTLD_NEXT, "close");
+  const char *name = getenv("I2CTRACE");
+  trace = fopen(name ? name : "i2ctrace.txt", "w");
+  if (trace != NULL) {
+    fprintf (trace, "# i2ctrace\n");
+  }
+}
+
+__attribute__((destructor))
+static void i2ctrace_end(void) {
+  if (trace != NULL) {
+    fclose(trace);
+    trace = NULL;
+  }
+}
+
+// Checks if a file descriptor is an i2c-dev device
+static bool is_i2c(int fd) {
+  struct stat st;
+  return (fd >= 0) && (fstat(fd, &st) == 0) && S_ISCHR(st.st_mode) && (major(st.st_rdev) == I2C_MAJOR);
+}
+
+// Writes a transaction to the trace
+static void record(const struct i2c_msg *msgs, int nmsgs) {
+  if ((trace == NULL) || (nmsgs <= 0)) {
+    return;
+  }
+  uint64_t t = now_us();
+  pthread_mutex_lock(&lock);
+  if (!started) {
+    t_first = t;
+    started = true;
+  }
+  fprintf (trace, "%llu", (unsigned long long) (t - t_first));
+  for (int i = 0; i < nmsgs; i++) {
+    if (msgs[i].flags & I2C_M_RD) {
+      fprintf (trace, " %02xr%u", msgs[i].addr, msgs[i].len);
+    } else {
+      fprintf (trace, " %02xw", msgs[i].addr);
+      for (int j = 0; j < msgs[i].len; j++) {
+        fprintf (trace, "%02x", msgs[i].buf[j]);
+      }
+    }
+  }
+  fprintf (trace, "\n");
+  fflush(trace);
+  pthread_mutex_unlock(&lock);
+}
+
+// Converts an SMBus transfer to I2C messages and records it
+static void record_smbus(uint16_t addr, const struct i2c_smbus_ioctl_data *d) {
+  uint8_t wbuf[I2C_SMBUS_BLOCK_MAX + 1];
+  struct i2c_msg m[2] = {
+    { addr, 0, 0, wbuf },
+    { addr, I2C_M_RD, 0, NULL }
+  };
+  int n = 1;
+  bool rd = d->read_write == I2C_SMBUS_READ;
+
+  wbuf[0] = d->command;
+  switch (d->size) {
+    case I2C_SMBUS_QUICK:
+      m[0].flags = rd ? I2C_M_RD : 0;
+      break;
+    case I2C_SMBUS_BYTE:
+      m[0].flags = rd ? I2C_M_RD : 0;
+      m[0].len = 1;
+      break;
+    case I2C_SMBUS_BYTE_DATA:
+    case I2C_SMBUS_WORD_DATA: {
+      uint16_t len = (d->size == I2C_SMBUS_BYTE_DATA) ? 1 : 2;
+      if (rd) {
+        m[0].len = 1;
+        m[1].len = len;
+        n = 2;
+      } else {
+        memcpy(wbuf + 1, d->data->block, len);    // byte and word are at the start of the union
+        m[0].len = 1 + len;
+      }
+      break;
+    }
+    case I2C_SMBUS_I2C_BLOCK_DATA: {
+      uint8_t len = d->data->block[0];
+      if (len > I2C_SMBUS_BLOCK_MAX) {
+        return;
+      }
+      if (rd) {
+        m[0].len = 1;
+        m[1].len = len;
+        n = 2;
+      } else {
+        memcpy(wbuf + 1, d->data->block + 1, len);
+        m[0].len = 1 + len;
+      }
+      break;
+    }
+    default:
+      return;
+  }
+  record(m, n);
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+  va_list ap;
+  va_start(ap, request);
+  void *arg = va_arg(ap, void *);
+  va_end(ap);
+
+  if ((request == I2C_RDWR) || (request == I2C_SMBUS) ||
+      (request == I2C_SLAVE) || (request == I2C_SLAVE_FORCE)) {
+    if (is_i2c(fd)) {
+      if (request == I2C_RDWR) {
+        struct i2c_rdwr_ioctl_data *d = arg;
+        record(d->msgs, d->nmsgs);
+      } else if (request == I2C_SMBUS) {
+        if ((fd < MAX_FDS) && slave_addr[fd]) {
+          record_smbus(slave_addr[fd], arg);
+        }
+      } else {
+        int ret = real_ioctl(fd, request, arg);
+        if ((ret == 0) && (fd < MAX_FDS)) {
+          slave_addr[fd] = (uint16_t) (uintptr_t) arg;
+        }
+        return ret;
+      }
+    }
+  }
+  return real_ioctl(fd, request, arg);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+  if ((fd >= 0) && (fd < MAX_FDS) && slave_addr[fd] && (count <= 0xFFFF) && is_i2c(fd)) {
+    struct i2c_msg m = { slave_addr[fd], I2C_M_RD, count, buf };
+    record(&m, 1);
+  }
+  return real_read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+  if ((fd >= 0) && (fd < MAX_FDS) && slave_addr[fd] && (count <= 0xFFFF) && is_i2c(fd)) {
+    struct i2c_msg m = { slave_addr[fd], 0, count, (uint8_t *) buf };
+    record(&m, 1);
+  }
+  return real_write(fd, buf, count);
+}
+
+int close(int fd) {
+  if ((fd >= 0) && (fd < MAX_FDS)) {
+    slave_addr[fd] = 0;   // the fd may be reused for another file
+  }
+  return real_close(fd);
+}
@@ -0,0 +1,407 @@
+/*
+   profdump - reads the sampling profiler of the firmware
+
+   The firmware built with PROFILE counts the addresses where the cores
+   were interrupted by a timer in a histogram of address ranges (see
+   struct prof_header in i2cusb.h). This program starts the profiler,
+   waits, reads the histogram and shows, for each core, the functions
+   (from the symbols in the firmware ELF file) with the number and the
+   percentage of the samples, most sampled first. The samples in a range
+   shared by several functions are divided among them by size.
+
+   The histogram can be saved (-w) and shown later (-f), without the
+   adapter.
+
+   Compile with
+     gcc -Wall -O2 -I../../../firmware -o profdump profdump.c -lusb-1.0
+   or, without libusb (only -f), add -DNO_LIBUSB and remove -lusb-1.0
+
+   Use
+     profdump -e firmware.elf [-d serial] [-p period_us] [-s shift] [-t seconds] [-r] [-w file] [-n lines] [-j]
+     profdump -e firmware.elf -f file [-n lines] [-j]
+       -e   firmware ELF file (build/i2cpicousb.elf)
+       -d   serial number of the adapter
+       -p   sample period (default 97us)
+       -s   log2 of the bucket size (default 0 = smallest that fits)
+       -t   time to profile (default 10s)
+       -r   only read the histogram (the profiler was started before)
+       -w   save the histogram to a file
+       -f   read the histogram from a file
+       -n   functions shown for each core (default all)
+       -j   output in JSON (default is CSV)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <elf.h>
+#ifndef NO_LIBUSB
+#include <libusb-1.0/libusb.h>
+#endif
+
+#include "i2cusb.h"
+
+#define USB_VID 0x0403
+#define USB_PID 0xc631
+
+#define USB_TIMEOUT_MS 1000
+#define PIECE_SIZE     4096   // the Linux usbfs limit for control transfers
+
+#define MAX_PROFILE    (sizeof(struct prof_header) + PROF_BUCKETS * sizeof(uint32_t))
+
+// The firmware ELF file
+static uint8_t *elf;
+static size_t elf_size;
+
+// Functions
+struct func {
+  uint32_t addr;
+  uint32_t size;
+  const char *name;
+  double samples;
+};
+
+static struct func *funcs;
+static int nfuncs;
+
+// Loads the ELF file, returns false if it is not an ARM ELF
+static bool elf_load(const char *fname) {
+  FILE *f = fopen(fname, "rb");
+  if (f == NULL) {
+    perror(fname);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  elf_size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  elf = malloc(elf_size);
+  if ((elf == NULL) || (fread(elf, 1, elf_size, f) != elf_size)) {
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  Elf32_Ehdr *eh = (Elf32_Ehdr *) elf;
+  if ((elf_size < sizeof(*eh)) || (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0) ||
+      (eh->e_ident[EI_CLASS] != ELFCLASS32) || (eh->e_machine != EM_ARM) ||
+      ((eh->e_shoff + (uint64_t) eh->e_shnum * sizeof(Elf32_Shdr)) > elf_size)) {
+    fprintf (stderr, "%s: not a firmware ELF file\n", fname);
+    return false;
+  }
+  return true;
+}
+
+static int func_cmp(const void *a, const void *b) {
+  const struct func *fa = a, *fb = b;
+  return (fa->addr > fb->addr) - (fa->addr < fb->addr);
+}
+
+// Gets the functions from the symbol table, sorted by address
+static bool elf_funcs(void) {
+  Elf32_Ehdr *eh = (Elf32_Ehdr *) elf;
+  Elf32_Shdr *sh = (Elf32_Shdr *) (elf + eh->e_shoff);
+
+  for (int i = 0; i < eh->e_shnum; i++) {
+    if ((sh[i].sh_type != SHT_SYMTAB) || (sh[i].sh_link >= eh->e_shnum) ||
+        ((sh[i].sh_offset + (uint64_t) sh[i].sh_size) > elf_size)) {
+      continue;
+    }
+    Elf32_Shdr *str = &sh[sh[i].sh_link];
+    if ((str->sh_offset + (uint64_t) str->sh_size) > elf_size) {
+      continue;
+    }
+    Elf32_Sym *sym = (Elf32_Sym *) (elf + sh[i].sh_offset);
+    int nsyms = sh[i].sh_size / sizeof(Elf32_Sym);
+    funcs = calloc(nsyms, sizeof(struct func));
+    if (funcs == NULL) {
+      return false;
+    }
+    for (int j = 0; j < nsyms; j++) {
+      if ((ELF32_ST_TYPE(sym[j].st_info) != STT_FUNC) || (sym[j].st_size == 0) ||
+          (sym[j].st_name >= str->sh_size)) {
+        continue;
+      }
+      funcs[nfuncs].addr = sym[j].st_value & ~1;    // Thumb bit
+      funcs[nfuncs].size = sym[j].st_size;
+      funcs[nfuncs].name = (const char *) elf + str->sh_offset + sym[j].st_name;
+      nfuncs++;
+    }
+    qsort(funcs, nfuncs, sizeof(struct func), func_cmp);
+    return true;
+  }
+  fprintf (stderr, "No symbol table in the ELF file\n");
+  return false;
+}
+
+// Divides the samples of a bucket among the functions in it, returns the
+// samples not in a function
+static double count_bucket(uint32_t start, uint32_t size, uint32_t count) {
+  double left = count;
+  // first function that can overlap (they do not overlap each other)
+  int lo = 0, hi = nfuncs;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((funcs[mid].addr + funcs[mid].size) <= start) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (int i = lo; (i < nfuncs) && (funcs[i].addr < (start + size)); i++) {
+    uint32_t a = (funcs[i].addr > start) ? funcs[i].addr : start;
+    uint32_t b = ((funcs[i].addr + funcs[i].size) < (start + size)) ? (funcs[i].addr + funcs[i].size) : (start + size);
+    if (b > a) {
+      double n = (double) count * (b - a) / size;
+      funcs[i].samples += n;
+      left -= n;
+    }
+  }
+  return left;
+}
+
+static int samples_cmp(const void *a, const void *b) {
+  const struct func *fa = a, *fb = b;
+  return (fa->samples < fb->samples) - (fa->samples > fb->samples);
+}
+
+// Shows the profile
+static void show(const uint8_t *data, size_t len, int lines, bool json) {
+  struct prof_header hdr;
+  memcpy(&hdr, data, sizeof(hdr));
+  const uint32_t *count = (const uint32_t *) (data + sizeof(hdr));
+  uint32_t nbuckets = hdr.flash_buckets + hdr.ram_buckets;
+
+  if (json) {
+    printf ("{\"period_us\": %u, \"bucket_size\": %u, \"cores\": [", hdr.period_us, 1u << hdr.shift);
+  } else {
+    printf ("core,function,samples,percent\n");
+  }
+  for (int core = 0; (core < hdr.cores) && (core < 2); core++) {
+    double unknown = 0;
+    for (int i = 0; i < nfuncs; i++) {
+      funcs[i].samples = 0;
+    }
+    for (uint32_t i = 0; i < nbuckets; i++) {
+      uint32_t n = count[core * nbuckets + i];
+      if (n == 0) {
+        continue;
+      }
+      uint32_t addr = (i < hdr.flash_buckets) ? hdr.flash_base + (i << hdr.shift) :
+                                                hdr.ram_base + ((i - hdr.flash_buckets) << hdr.shift);
+      unknown += count_bucket(addr, 1u << hdr.shift, n);
+    }
+    qsort(funcs, nfuncs, sizeof(struct func), samples_cmp);
+
+    double total = hdr.samples[core] ? hdr.samples[core] : 1;
+    if (json) {
+      printf ("%s\n  {\"core\": %d, \"samples\": %u, \"other\": %u, \"unknown\": %.0f, \"functions\": [",
+              core ? "," : "", core, hdr.samples[core], hdr.other[core], unknown);
+    } else {
+      printf ("%d,[other],%u,%.2f\n", core, hdr.other[core], 100.0 * hdr.other[core] / total);
+      printf ("%d,[unknown],%.0f,%.2f\n", core, unknown, 100.0 * unknown / total);
+    }
+    for (int i = 0; (i < nfuncs) && ((lines == 0) || (i < lines)) && (funcs[i].samples >= 0.5); i++) {
+      if (json) {
+        printf ("%s\n    {\"function\": \"%s\", \"samples\": %.0f, \"percent\": %.2f}", i ? "," : "",
+                funcs[i].name, funcs[i].samples, 100.0 * funcs[i].samples / total);
+      } else {
+        printf ("%d,%s,%.0f,%.2f\n", core, funcs[i].name, funcs[i].samples, 100.0 * funcs[i].samples / total);
+      }
+    }
+    if (json) {
+      printf ("]}");
+    }
+    qsort(funcs, nfuncs, sizeof(struct func), func_cmp);
+  }
+  if (json) {
+    printf ("\n]}\n");
+  }
+}
+
+// Checks that a profile is complete
+static bool profile_ok(const uint8_t *data, size_t len) {
+  struct prof_header hdr;
+  if (len < sizeof(hdr)) {
+    return false;
+  }
+  memcpy(&hdr, data, sizeof(hdr));
+  return (hdr.cores <= 2) &&
+         (len == sizeof(hdr) + (size_t) hdr.cores * (hdr.flash_buckets + hdr.ram_buckets) * sizeof(uint32_t));
+}
+
+#ifndef NO_LIBUSB
+#define REQ_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+#define REQ_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+
+// Opens an adapter, if serial is not NULL opens the adapter with that serial number
+static libusb_device_handle *usb_find(libusb_context *ctx, const char *serial) {
+  libusb_device **list;
+  libusb_device_handle *handle = NULL;
+  ssize_t n = libusb_get_device_list(ctx, &list);
+
+  for (ssize_t i = 0; (i < n) && (handle == NULL); i++) {
+    struct libusb_device_descriptor desc;
+    if ((libusb_get_device_descriptor(list[i], &desc) != 0) || 
+        (desc.idVendor != USB_VID) || (desc.idProduct != USB_PID) ||
+        (libusb_open(list[i], &handle) != 0)) {
+      continue;
+    }
+    if (serial != NULL) {
+      unsigned char str[64];
+      if ((libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, str, sizeof(str)) < 0) ||
+          (strcmp((char *) str, serial) != 0)) {
+        libusb_close(handle);
+        handle = NULL;
+      }
+    }
+  }
+  libusb_free_device_list(list, 1);
+  return handle;
+}
+
+// Profiles the firmware, returns the size of the profile or 0
+static size_t profile_usb(const char *serial, int period_us, int shift, int seconds, bool start,
+                          uint8_t *data) {
+  libusb_context *ctx;
+  size_t len = 0;
+
+  if (libusb_init(&ctx) != 0) {
+    return 0;
+  }
+  libusb_device_handle *handle = usb_find(ctx, serial);
+  if (handle == NULL) {
+    fprintf (stderr, "Adapter not found\n");
+    libusb_exit(ctx);
+    return 0;
+  }
+
+  if (start) {
+    if (libusb_control_transfer(handle, REQ_OUT, CMD_PROFILE, period_us, shift, NULL, 0, USB_TIMEOUT_MS) != 0) {
+      fprintf (stderr, "Cannot start the profiler (firmware built without PROFILE?)\n");
+      goto done;
+    }
+    sleep(seconds);
+    libusb_control_transfer(handle, REQ_OUT, CMD_PROFILE, 0, 0, NULL, 0, USB_TIMEOUT_MS);
+  }
+
+  // Read in pieces
+  for (;;) {
+    int n = libusb_control_transfer(handle, REQ_IN, CMD_PROFILE, 0, len, data + len,
+                                    (MAX_PROFILE - len) > PIECE_SIZE ? PIECE_SIZE : (MAX_PROFILE - len),
+                                    USB_TIMEOUT_MS);
+    if (n < 0) {
+      fprintf (stderr, "USB error %s\n", libusb_error_name(n));
+      len = 0;
+      break;
+    }
+    len += n;
+    if ((n < PIECE_SIZE) || (len == MAX_PROFILE)) {
+      break;
+    }
+  }
+
+done:
+  libusb_close(handle);
+  libusb_exit(ctx);
+  return len;
+}
+#endif
+
+// Main program
+int main (int argc, char **argv) {
+  static uint8_t data[MAX_PROFILE];
+  size_t len = 0;
+  const char *elf_file = NULL;
+  const char *serial = NULL;
+  const char *in_file = NULL;
+  const char *out_file = NULL;
+  int period_us = 97;
+  int shift = 0;
+  int seconds = 10;
+  int lines = 0;
+  bool start = true;
+  bool json = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "e:d:p:s:t:rw:f:n:j")) != -1) {
+    switch (opt) {
+      case 'e':
+        elf_file = optarg;
+        break;
+      case 'd':
+        serial = optarg;
+        break;
+      case 'p':
+        period_us = atoi(optarg);
+        break;
+      case 's':
+        shift = atoi(optarg);
+        break;
+      case 't':
+        seconds = atoi(optarg);
+        break;
+      case 'r':
+        start = false;
+        break;
+      case 'w':
+        out_file = optarg;
+        break;
+      case 'f':
+        in_file = optarg;
+        break;
+      case 'n':
+        lines = atoi(optarg);
+        break;
+      case 'j':
+        json = true;
+        break;
+      default:
+        return 1;
+    }
+  }
+  if ((elf_file == NULL) || (period_us < PROF_MIN_PERIOD_US) || (period_us > 0xFFFF) ||
+      (shift < 0) || (shift > PROF_MAX_SHIFT) || (seconds < 1)) {
+    fprintf (stderr, "Use: profdump -e firmware.elf [-d serial] [-p period_us] [-s shift] [-t seconds] [-r] [-w file] [-n lines] [-j]\n");
+    fprintf (stderr, "     profdump -e firmware.elf -f file [-n lines] [-j]\n");
+    return 1;
+  }
+  if (!elf_load(elf_file) || !elf_funcs()) {
+    return 1;
+  }
+
+  if (in_file != NULL) {
+    FILE *f = fopen(in_file, "rb");
+    if (f == NULL) {
+      perror(in_file);
+      return 1;
+    }
+    len = fread(data, 1, sizeof(data), f);
+    fclose(f);
+  } else {
+    #ifndef NO_LIBUSB
+    len = profile_usb(serial, period_us, shift, seconds, start, data);
+    #else
+    (void) serial;
+    (void) start;
+    fprintf (stderr, "Compiled without libusb, use -f\n");
+    return 1;
+    #endif
+  }
+  if (!profile_ok(data, len)) {
+    fprintf (stderr, "Invalid profile\n");
+    return 1;
+  }
+
+  if (out_file != NULL) {
+    FILE *f = fopen(out_file, "wb");
+    if ((f == NULL) || (fwrite(data, 1, len, f) != len)) {
+      perror(out_file);
+      return 1;
+    }
+    fclose(f);
+  }
+  show(data, len, lines, json);
+  return 0;
+}
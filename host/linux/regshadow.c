@@ -0,0 +1,373 @@
+/*
+   Register shadow for devices accessed through an adapter
+
+   Dirty registers are written in blocks: a block is extended over a few
+   clean registers (with known values, not volatile) if this joins it to
+   the next dirty register, as rewriting them costs less than a new
+   transaction. All the blocks (and the volatile access that caused the
+   flush, if any) go in the same script, so a flush needs two USB
+   transfers. If a script fails, the blocks before the failing one are
+   marked clean and the others stay dirty.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "regshadow.h"
+
+#define REG_VALID     0x01    // value known
+#define REG_DIRTY     0x02    // value not yet written to the device
+#define REG_VOLATILE  0x04    // always accessed in the device
+
+#define MAX_GAP       2       // clean registers rewritten to join two blocks
+#define MAX_BLOCK     240     // bytes of values in a block (fits in a script)
+#define MAX_BLOCKS    (SCRIPT_MAX_LEN / 6)
+
+struct regshadow {
+  struct adapter *ad;
+  uint8_t addr;
+  uint8_t reg_bytes;
+  uint8_t val_bytes;
+  uint16_t nregs;
+  uint16_t max_burst;     // registers in a block
+  uint16_t page;          // blocks do not cross a multiple of page (0 = no pages)
+  uint8_t *val;
+  uint8_t *flags;
+  struct regshadow_stats stats;
+};
+
+// Blocks in the script being built
+struct block {
+  uint16_t reg;
+  uint16_t count;
+  uint16_t end;           // offset of the end of the block in the script
+};
+
+struct regshadow *regshadow_open(struct adapter *ad, uint8_t addr, uint8_t reg_bytes,
+                                 uint8_t val_bytes, uint16_t nregs, uint16_t max_burst) {
+  if ((reg_bytes < 1) || (reg_bytes > 2) || (val_bytes < 1) || (val_bytes > 2) || (nregs == 0) ||
+      ((reg_bytes == 1) && (nregs > 256))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct regshadow *rs = calloc(1, sizeof(struct regshadow));
+  if (rs == NULL) {
+    return NULL;
+  }
+  rs->val = calloc(nregs, val_bytes);
+  rs->flags = calloc(nregs, 1);
+  if ((rs->val == NULL) || (rs->flags == NULL)) {
+    free(rs->val);
+    free(rs->flags);
+    free(rs);
+    return NULL;
+  }
+  rs->ad = ad;
+  rs->addr = addr;
+  rs->reg_bytes = reg_bytes;
+  rs->val_bytes = val_bytes;
+  rs->nregs = nregs;
+  rs->max_burst = MAX_BLOCK / val_bytes;
+  if (max_burst && (max_burst < rs->max_burst)) {
+    rs->max_burst = max_burst;
+  }
+  rs->page = max_burst;
+  return rs;
+}
+
+// Writes back the dirty registers and frees the shadow
+void regshadow_close(struct regshadow *rs) {
+  regshadow_flush(rs);
+  free(rs->val);
+  free(rs->flags);
+  free(rs);
+}
+
+void regshadow_set_volatile(struct regshadow *rs, uint16_t reg, uint16_t count, bool vol) {
+  for (uint32_t r = reg; (r < (uint32_t) reg + count) && (r < rs->nregs); r++) {
+    if (vol) {
+      rs->flags[r] = REG_VOLATILE;    // the value is no longer kept
+    } else {
+      rs->flags[r] &= ~REG_VOLATILE;
+    }
+  }
+}
+
+void regshadow_invalidate(struct regshadow *rs) {
+  for (int r = 0; r < rs->nregs; r++) {
+    rs->flags[r] &= REG_VOLATILE;
+  }
+}
+
+void regshadow_get_stats(struct regshadow *rs, struct regshadow_stats *st) {
+  *st = rs->stats;
+}
+
+// Checks a register range
+static bool range_ok(struct regshadow *rs, uint16_t reg, uint16_t count) {
+  return (count > 0) && (((uint32_t) reg + count) <= rs->nregs);
+}
+
+// Puts the register address at the start of a buffer, returns its size
+static int put_reg(struct regshadow *rs, uint8_t *buf, uint16_t reg) {
+  if (rs->reg_bytes == 2) {
+    buf[0] = reg >> 8;
+    buf[1] = reg & 0xFF;
+  } else {
+    buf[0] = reg;
+  }
+  return rs->reg_bytes;
+}
+
+// Can a clean register be rewritten to join two blocks?
+static bool gap_ok(struct regshadow *rs, uint16_t r) {
+  return (rs->flags[r] & (REG_VALID | REG_VOLATILE)) == REG_VALID;
+}
+
+// Finds the next block to write, starting at register *reg
+// Returns false if there are no more dirty registers
+static bool next_block(struct regshadow *rs, uint16_t *reg, uint16_t *count) {
+  uint16_t r = *reg;
+  while ((r < rs->nregs) && !(rs->flags[r] & REG_DIRTY)) {
+    r++;
+  }
+  if (r == rs->nregs) {
+    return false;
+  }
+  *reg = r;
+  // up to max_burst registers, ending at the end of the page
+  uint16_t max = rs->max_burst;
+  if (rs->page && ((rs->page - (r % rs->page)) < max)) {
+    max = rs->page - (r % rs->page);
+  }
+  uint16_t n = 1;
+  while ((n < max) && ((r + n) < rs->nregs)) {
+    if (rs->flags[r + n] & REG_DIRTY) {
+      n++;
+      continue;
+    }
+    // clean registers followed by a dirty one
+    int gap = 0;
+    while ((gap < MAX_GAP) && ((r + n + gap) < rs->nregs) && gap_ok(rs, r + n + gap)) {
+      gap++;
+    }
+    if ((gap == 0) || ((r + n + gap) == rs->nregs) || !(rs->flags[r + n + gap] & REG_DIRTY) ||
+        ((n + gap) >= max)) {
+      break;
+    }
+    n += gap;
+  }
+  *count = n;
+  return true;
+}
+
+// Runs a script and marks the blocks written as clean, returns 0 or -errno
+static int run_script(struct regshadow *rs, struct script_buf *sb, struct block *blocks, int nblocks,
+                      uint8_t *out) {
+  struct i2c_script_result res;
+
+  int ret = rs->ad->script(rs->ad, sb->code, sb->len, &res, out);
+  if (ret < 0) {
+    return ret;
+  }
+  rs->stats.scripts++;
+  for (int i = 0; i < nblocks; i++) {
+    if ((res.status != SCRIPT_OK) && (blocks[i].end > res.pc)) {
+      break;
+    }
+    for (int r = blocks[i].reg; r < blocks[i].reg + blocks[i].count; r++) {
+      rs->flags[r] &= ~REG_DIRTY;
+    }
+    rs->stats.regs_written += blocks[i].count;
+    rs->stats.blocks_written++;
+  }
+  return adapter_script_errno(res.status);
+}
+
+// Writes the dirty registers and then does a transaction (if msgs is not NULL),
+// returns 0 or -errno
+static int shadow_run(struct regshadow *rs, struct i2c_msg *msgs, int nmsgs) {
+  static struct block blocks[MAX_BLOCKS];
+  struct script_buf sb;
+  uint8_t buf[2 + MAX_BLOCK];
+  uint8_t out[SCRIPT_MAX_OUT];
+  int nblocks = 0;
+  uint16_t reg = 0, count;
+  int ret;
+
+  script_init(&sb);
+  while (next_block(rs, &reg, &count)) {
+    int len = put_reg(rs, buf, reg);
+    memcpy(buf + len, rs->val + reg * rs->val_bytes, count * rs->val_bytes);
+    struct i2c_msg m = { rs->addr, 0, len + count * rs->val_bytes, buf };
+    if ((nblocks == MAX_BLOCKS) || (script_add_xfer(&sb, &m, 1) == -E2BIG)) {
+      ret = run_script(rs, &sb, blocks, nblocks, out);
+      if (ret < 0) {
+        return ret;
+      }
+      script_init(&sb);
+      nblocks = 0;
+      script_add_xfer(&sb, &m, 1);
+    }
+    blocks[nblocks].reg = reg;
+    blocks[nblocks].count = count;
+    blocks[nblocks].end = sb.len;
+    nblocks++;
+    reg += count;
+  }
+  if (msgs != NULL) {
+    ret = script_add_xfer(&sb, msgs, nmsgs);
+    if (ret == -E2BIG) {
+      ret = run_script(rs, &sb, blocks, nblocks, out);
+      if (ret < 0) {
+        return ret;
+      }
+      script_init(&sb);
+      nblocks = 0;
+      ret = script_add_xfer(&sb, msgs, nmsgs);
+    }
+    if (ret < 0) {
+      // not possible in a script
+      if (sb.len > 0) {
+        ret = run_script(rs, &sb, blocks, nblocks, out);
+        if (ret < 0) {
+          return ret;
+        }
+      }
+      return rs->ad->xfer(rs->ad, msgs, nmsgs);
+    }
+  }
+  if (sb.len == 0) {
+    return 0;
+  }
+  ret = run_script(rs, &sb, blocks, nblocks, out);
+  if ((ret == 0) && (msgs != NULL)) {
+    script_copy_out(msgs, nmsgs, out);
+  }
+  return ret;
+}
+
+int regshadow_flush(struct regshadow *rs) {
+  return shadow_run(rs, NULL, 0);
+}
+
+// Reads registers, the known values come from the shadow and the others
+// (from the first to the last unknown one) from the device
+int regshadow_read(struct regshadow *rs, uint16_t reg, uint8_t *val, uint16_t count) {
+  if (!range_ok(rs, reg, count)) {
+    return -EINVAL;
+  }
+  int first = -1, last = -1;
+  for (int r = reg; r < reg + count; r++) {
+    if ((rs->flags[r] & (REG_VALID | REG_VOLATILE)) != REG_VALID) {
+      if (first < 0) {
+        first = r;
+      }
+      last = r;
+    }
+  }
+  if (first >= 0) {
+    // dirty registers are written first, the device may depend on them
+    uint8_t buf[2];
+    uint16_t n = last - first + 1;
+    struct i2c_msg msgs[2] = {
+      { rs->addr, 0, put_reg(rs, buf, first), buf },
+      { rs->addr, I2C_M_RD, n * rs->val_bytes, val + (first - reg) * rs->val_bytes }
+    };
+    int ret = shadow_run(rs, msgs, 2);
+    if (ret < 0) {
+      return ret;
+    }
+    for (int r = first; r <= last; r++) {
+      if (!(rs->flags[r] & REG_VOLATILE)) {
+        memcpy(rs->val + r * rs->val_bytes, val + (r - reg) * rs->val_bytes, rs->val_bytes);
+        rs->flags[r] |= REG_VALID;
+      }
+    }
+    rs->stats.reads_device += n;
+  }
+  for (int r = reg; r < reg + count; r++) {
+    if ((first < 0) || (r < first) || (r > last)) {
+      memcpy(val + (r - reg) * rs->val_bytes, rs->val + r * rs->val_bytes, rs->val_bytes);
+      rs->stats.reads_cached++;
+    }
+  }
+  return 0;
+}
+
+// Writes registers; if the range has a volatile register it is written to the
+// device (after the dirty registers), else only the shadow is changed
+int regshadow_write(struct regshadow *rs, uint16_t reg, const uint8_t *val, uint16_t count) {
+  if (!range_ok(rs, reg, count)) {
+    return -EINVAL;
+  }
+  bool vol = false;
+  for (int r = reg; r < reg + count; r++) {
+    vol = vol || (rs->flags[r] & REG_VOLATILE);
+  }
+  rs->stats.writes += count;
+
+  if (vol) {
+    uint8_t *buf = malloc(2 + count * rs->val_bytes);
+    if (buf == NULL) {
+      return -ENOMEM;
+    }
+    int len = put_reg(rs, buf, reg);
+    memcpy(buf + len, val, count * rs->val_bytes);
+    struct i2c_msg m = { rs->addr, 0, len + count * rs->val_bytes, buf };
+    // the registers in the range are written by the transaction
+    for (int r = reg; r < reg + count; r++) {
+      rs->flags[r] &= ~REG_DIRTY;
+    }
+    int ret = shadow_run(rs, &m, 1);
+    free(buf);
+    if (ret < 0) {
+      // the values in the range are not known
+      for (int r = reg; r < reg + count; r++) {
+        rs->flags[r] &= REG_VOLATILE;
+      }
+      return ret;
+    }
+    for (int r = reg; r < reg + count; r++) {
+      if (!(rs->flags[r] & REG_VOLATILE)) {
+        memcpy(rs->val + r * rs->val_bytes, val + (r - reg) * rs->val_bytes, rs->val_bytes);
+        rs->flags[r] |= REG_VALID;
+      }
+    }
+    rs->stats.regs_written += count;
+    rs->stats.blocks_written++;
+    return 0;
+  }
+
+  for (int r = reg; r < reg + count; r++) {
+    uint8_t *v = rs->val + r * rs->val_bytes;
+    const uint8_t *nv = val + (r - reg) * rs->val_bytes;
+    if ((rs->flags[r] & REG_VALID) && !memcmp(v, nv, rs->val_bytes)) {
+      rs->stats.writes_skipped++;
+      continue;
+    }
+    memcpy(v, nv, rs->val_bytes);
+    rs->flags[r] |= REG_VALID | REG_DIRTY;
+  }
+  return 0;
+}
+
+// Changes some bits of a register (16-bit values are big endian)
+int regshadow_update_bits(struct regshadow *rs, uint16_t reg, uint16_t mask, uint16_t val) {
+  uint8_t buf[2];
+  int ret = regshadow_read(rs, reg, buf, 1);
+  if (ret < 0) {
+    return ret;
+  }
+  uint16_t old = (rs->val_bytes == 2) ? (buf[0] << 8) | buf[1] : buf[0];
+  uint16_t nv = (old & ~mask) | (val & mask);
+  if (rs->val_bytes == 2) {
+    buf[0] = nv >> 8;
+    buf[1] = nv & 0xFF;
+  } else {
+    buf[0] = nv;
+  }
+  return regshadow_write(rs, reg, buf, 1);
+}
@@ -0,0 +1,60 @@
+/*
+   Register shadow for devices accessed through an adapter
+
+   Keeps a copy of the registers of a device (with auto-increment of the
+   register address). Writes only update the copy and mark the registers
+   dirty; reads of registers already known are answered from the copy.
+   Dirty registers are written back in blocks of contiguous registers, all
+   of them in a single script, when the shadow is flushed. Registers
+   declared volatile (status, data, commands) are always accessed in the
+   device, after the dirty registers are written back, so the device sees
+   the writes in the order needed.
+*/
+
+#ifndef _REGSHADOW_H
+#define _REGSHADOW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "adapter.h"
+
+struct regshadow_stats {
+  uint64_t reads_cached;      // registers read from the shadow
+  uint64_t reads_device;      // registers read from the device
+  uint64_t writes;            // registers written by the user
+  uint64_t writes_skipped;    // writes that did not change a known value
+  uint64_t regs_written;      // registers written to the device
+  uint64_t blocks_written;    // write transactions done
+  uint64_t scripts;           // scripts sent to the adapter
+};
+
+struct regshadow;
+
+// reg_bytes and val_bytes are the sizes (1 or 2 bytes) of the register
+// address and value, max_burst is the maximum number of registers in a
+// write, writes do not cross a multiple of max_burst registers (a page of
+// an EEPROM; 0 = no limit)
+struct regshadow *regshadow_open(struct adapter *ad, uint8_t addr, uint8_t reg_bytes,
+                                 uint8_t val_bytes, uint16_t nregs, uint16_t max_burst);
+void regshadow_close(struct regshadow *rs);
+
+// Declares registers volatile (or not), should be done before they are
+// used: a pending write to a register that becomes volatile is discarded
+void regshadow_set_volatile(struct regshadow *rs, uint16_t reg, uint16_t count, bool vol);
+
+// Values are count * val_bytes bytes, in the device order; return 0 or -errno
+int regshadow_read(struct regshadow *rs, uint16_t reg, uint8_t *val, uint16_t count);
+int regshadow_write(struct regshadow *rs, uint16_t reg, const uint8_t *val, uint16_t count);
+int regshadow_update_bits(struct regshadow *rs, uint16_t reg, uint16_t mask, uint16_t val);
+
+// Writes the dirty registers to the device (a barrier)
+int regshadow_flush(struct regshadow *rs);
+
+// Forgets the values (for example, after a device reset); dirty
+// registers are discarded
+void regshadow_invalidate(struct regshadow *rs);
+
+void regshadow_get_stats(struct regshadow *rs, struct regshadow_stats *st);
+
+#endif
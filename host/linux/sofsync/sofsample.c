@@ -0,0 +1,188 @@
+/*
+   sofsample - samples I2C devices on several adapters at the same time
+
+   Runs the same transaction on all the adapters, offset_us after the SOF
+   of every period frames (see sofsync.c), and prints one CSV line for
+   each sample: the sequence number, the skew (time between the first and
+   the last adapter, in us) and, for each adapter, the frame, the offset,
+   the flags (L = late, time estimated), the script status and the data
+   read (in hex). An adapter that skipped the sample has empty fields.
+
+   The transaction uses the i2ctrace notation, for example "48w00 48r2"
+   (register pointer write and 2 byte read at address 0x48).
+
+   Compile with
+     gcc -Wall -O2 -I.. -I../../../firmware -o sofsample sofsample.c sofsync.c ../adapter.c -lusb-1.0
+
+   Use
+     sofsample -d serial [-d serial ...] [-p period] [-o offset_us] [-n count] transaction
+       -d   serial number of an adapter (all on the same host controller)
+       -p   frames between samples (default 1)
+       -o   time from the SOF to the start of the transaction (default 100us)
+       -n   number of samples (default 0 = until interrupted)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "adapter.h"
+#include "sofsync.h"
+
+#define MAX_MSGS  16
+
+static volatile bool stop;
+
+static void on_signal(int sig) {
+  stop = true;
+}
+
+// Converts hex digits to bytes, returns the number of bytes or -1
+static int hex_bytes(const char *s, uint8_t *buf, int max) {
+  int n = 0;
+  while (s[0] && s[1]) {
+    unsigned int b;
+    if ((n == max) || (sscanf(s, "%2x", &b) != 1)) {
+      return -1;
+    }
+    buf[n++] = b;
+    s += 2;
+  }
+  return *s ? -1 : n;
+}
+
+// Converts the transaction to a script, returns false if invalid
+static bool parse_xfer(int argc, char **argv, struct script_buf *sb) {
+  static uint8_t data[SCRIPT_MAX_LEN];
+  struct i2c_msg msgs[MAX_MSGS];
+  int nmsgs = 0;
+  int used = 0;
+
+  for (int i = 0; i < argc; i++) {
+    for (char *tok = strtok(argv[i], " "); tok != NULL; tok = strtok(NULL, " ")) {
+      char *end;
+      if (nmsgs == MAX_MSGS) {
+        return false;
+      }
+      struct i2c_msg *m = &msgs[nmsgs++];
+      m->addr = strtoul(tok, &end, 16);
+      if ((end == tok) || (m->addr > 0x7F)) {
+        return false;
+      }
+      if (*end == 'r') {
+        m->flags = I2C_M_RD;
+        m->len = strtoul(end + 1, &end, 10);
+        m->buf = NULL;
+        if (*end) {
+          return false;
+        }
+      } else if (*end == 'w') {
+        m->flags = 0;
+        m->buf = data + used;
+        int n = hex_bytes(end + 1, m->buf, sizeof(data) - used);
+        if (n < 0) {
+          return false;
+        }
+        m->len = n;
+        used += n;
+      } else {
+        return false;
+      }
+    }
+  }
+  script_init(sb);
+  return (script_add_xfer(sb, msgs, nmsgs) == 0) && (sb->out_len <= SOF_MAX_DATA);
+}
+
+// Main program
+int main (int argc, char **argv) {
+  const char *serials[SOFSYNC_MAX_ADAPTERS];
+  int nserials = 0;
+  int period = 1;
+  int offset_us = 100;
+  int count = 0;
+  struct script_buf sb;
+  static struct sofsync_row row;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:p:o:n:")) != -1) {
+    switch (opt) {
+      case 'd':
+        if (nserials == SOFSYNC_MAX_ADAPTERS) {
+          fprintf (stderr, "Too many adapters\n");
+          return 1;
+        }
+        serials[nserials++] = optarg;
+        break;
+      case 'p':
+        period = atoi(optarg);
+        break;
+      case 'o':
+        offset_us = atoi(optarg);
+        break;
+      case 'n':
+        count = atoi(optarg);
+        break;
+      default:
+        return 1;
+    }
+  }
+  if ((nserials == 0) || (optind >= argc) || (period < 1) || (period > SOF_MAX_PERIOD) ||
+      (offset_us < 0) || (offset_us > 999) || (count < 0) || (count > 0xFFFF)) {
+    fprintf (stderr, "Use: sofsample -d serial [-d serial ...] [-p period] [-o offset_us] [-n count] transaction\n");
+    return 1;
+  }
+  if (!parse_xfer(argc - optind, argv + optind, &sb)) {
+    fprintf (stderr, "Invalid transaction\n");
+    return 1;
+  }
+
+  struct sofsync *s = sofsync_open(serials, nserials);
+  if (s == NULL) {
+    perror("Cannot open the adapters");
+    return 1;
+  }
+  signal(SIGINT, on_signal);
+  int ret = sofsync_start(s, sb.code, sb.len, period, offset_us, count);
+  if (ret < 0) {
+    fprintf (stderr, "Cannot start sampling: %s\n", strerror(-ret));
+    sofsync_close(s);
+    return 1;
+  }
+
+  printf ("seq,skew_us");
+  for (int i = 0; i < nserials; i++) {
+    printf (",frame%d,offset%d,flags%d,status%d,data%d", i, i, i, i, i);
+  }
+  printf ("\n");
+  while (!stop) {
+    ret = sofsync_read(s, &row, 2 * period + 100);
+    if (ret <= 0) {
+      if (ret < 0) {
+        fprintf (stderr, "USB error\n");
+      }
+      break;
+    }
+    printf ("%u,%lld", row.seq, (long long) row.skew_us);
+    for (int i = 0; i < nserials; i++) {
+      struct sofsync_sample *smp = &row.sample[i];
+      if (!smp->valid) {
+        printf (",,,,,");
+        continue;
+      }
+      printf (",%u,%u,%s,%u,", smp->frame, smp->offset_us, (smp->flags & SOF_LATE) ? "L" : "", smp->status);
+      for (int j = 0; j < smp->len; j++) {
+        printf ("%02x", smp->data[j]);
+      }
+    }
+    printf ("\n");
+    fflush(stdout);
+  }
+
+  sofsync_stop(s);
+  sofsync_close(s);
+  return 0;
+}
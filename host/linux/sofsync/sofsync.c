@@ -0,0 +1,311 @@
+/*
+   SOF synchronised sampling with several I2C-Pico-USB adapters
+
+   All adapters get the same script, start frame, period and offset
+   (CMD_SOF_SAMPLE), so sample n is taken by every adapter offset_us after
+   the SOF of frame start + n * period. The records (RECORD_SOF_SAMPLE)
+   are read from the vendor bulk IN endpoint of each adapter and merged by
+   their sequence number; a sample an adapter skipped (it was too late)
+   shows up as a gap in its sequence numbers.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libusb-1.0/libusb.h>
+
+#include "i2cscript.h"
+#include "sofsync.h"
+
+#define USB_VID 0x0403
+#define USB_PID 0xc631
+#define EP_IN   0x81
+
+#define USB_TIMEOUT_MS 1000
+
+#define REQ_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+#define REQ_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+
+#define FRAME_MASK      0x7FF
+#define LEAD_FRAMES     200     // time to configure all the adapters before the first sample
+#define QUEUE_SIZE      64      // samples kept for each adapter, waiting for the others
+#define POLL_MS         2       // bulk read timeout for each adapter
+
+struct sofsync_adapter {
+  libusb_device_handle *handle;
+  uint8_t buf[4096];
+  size_t len;
+  struct sofsync_sample queue[QUEUE_SIZE];
+  uint32_t seq[QUEUE_SIZE];
+  int head, count;
+  uint32_t last_seq;    // seq of the last sample received (+1), 0 if none
+};
+
+struct sofsync {
+  libusb_context *ctx;
+  int n;
+  struct sofsync_adapter ad[SOFSYNC_MAX_ADAPTERS];
+  uint16_t start_frame;
+  uint16_t period;
+  uint16_t count;
+  uint32_t next_seq;    // seq of the next row
+};
+
+// Opens the adapter with a serial number
+static libusb_device_handle *usb_find(libusb_context *ctx, const char *serial, uint8_t *bus) {
+  libusb_device **list;
+  libusb_device_handle *handle = NULL;
+  ssize_t n = libusb_get_device_list(ctx, &list);
+
+  for (ssize_t i = 0; (i < n) && (handle == NULL); i++) {
+    struct libusb_device_descriptor desc;
+    if ((libusb_get_device_descriptor(list[i], &desc) != 0) || 
+        (desc.idVendor != USB_VID) || (desc.idProduct != USB_PID) ||
+        (libusb_open(list[i], &handle) != 0)) {
+      continue;
+    }
+    unsigned char str[64];
+    if ((libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, str, sizeof(str)) < 0) ||
+        (strcmp((char *) str, serial) != 0)) {
+      libusb_close(handle);
+      handle = NULL;
+    } else {
+      *bus = libusb_get_bus_number(list[i]);
+    }
+  }
+  libusb_free_device_list(list, 1);
+  return handle;
+}
+
+// Opens the adapters, all of them must be on the same bus (host controller)
+struct sofsync *sofsync_open(const char * const *serials, int n) {
+  if ((n < 1) || (n > SOFSYNC_MAX_ADAPTERS)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct sofsync *s = calloc(1, sizeof(struct sofsync));
+  if (s == NULL) {
+    return NULL;
+  }
+  if (libusb_init(&s->ctx) != 0) {
+    free(s);
+    errno = EIO;
+    return NULL;
+  }
+  uint8_t bus0 = 0;
+  for (int i = 0; i < n; i++) {
+    uint8_t bus;
+    libusb_device_handle *handle = usb_find(s->ctx, serials[i], &bus);
+    if (handle == NULL) {
+      sofsync_close(s);
+      errno = ENODEV;
+      return NULL;
+    }
+    libusb_set_auto_detach_kernel_driver(handle, 1);
+    if (libusb_claim_interface(handle, 0) != 0) {
+      libusb_close(handle);
+      sofsync_close(s);
+      errno = EBUSY;
+      return NULL;
+    }
+    s->ad[i].handle = handle;
+    s->n = i + 1;
+    if (i == 0) {
+      bus0 = bus;
+    } else if (bus != bus0) {
+      // different frame numbers
+      sofsync_close(s);
+      errno = EXDEV;
+      return NULL;
+    }
+  }
+  return s;
+}
+
+void sofsync_close(struct sofsync *s) {
+  for (int i = 0; i < s->n; i++) {
+    libusb_release_interface(s->ad[i].handle, 0);
+    libusb_close(s->ad[i].handle);
+  }
+  libusb_exit(s->ctx);
+  free(s);
+}
+
+// Starts sampling, returns 0 or -errno
+// count = 0 samples until sofsync_stop
+int sofsync_start(struct sofsync *s, const uint8_t *code, uint16_t len,
+                  uint16_t period, uint16_t offset_us, uint16_t count) {
+  uint8_t req[sizeof(struct sof_sample_config) + SCRIPT_MAX_LEN];
+  struct sof_status st;
+
+  if ((len == 0) || (len > SCRIPT_MAX_LEN)) {
+    return -EINVAL;
+  }
+
+  // Discard old records
+  for (int i = 0; i < s->n; i++) {
+    struct sofsync_adapter *ad = &s->ad[i];
+    int n;
+    while ((libusb_bulk_transfer(ad->handle, EP_IN, ad->buf, sizeof(ad->buf), &n, POLL_MS) == 0) && (n > 0)) {
+    }
+    ad->len = 0;
+    ad->head = ad->count = 0;
+    ad->last_seq = 0;
+  }
+
+  // First sample a little ahead of the current frame
+  if (libusb_control_transfer(s->ad[0].handle, REQ_IN, CMD_SOF_SAMPLE, 0, 0,
+                              (uint8_t *) &st, sizeof(st), USB_TIMEOUT_MS) != sizeof(st)) {
+    return -EIO;
+  }
+  struct sof_sample_config *cfg = (struct sof_sample_config *) req;
+  s->start_frame = cfg->start_frame = (st.frame + LEAD_FRAMES) & FRAME_MASK;
+  s->period = cfg->period = period;
+  s->count = cfg->count = count;
+  cfg->offset_us = offset_us;
+  s->next_seq = 0;
+  memcpy(req + sizeof(*cfg), code, len);
+
+  for (int i = 0; i < s->n; i++) {
+    int ret = libusb_control_transfer(s->ad[i].handle, REQ_OUT, CMD_SOF_SAMPLE, 0, 0,
+                                      req, sizeof(*cfg) + len, USB_TIMEOUT_MS);
+    if (ret != (int) (sizeof(*cfg) + len)) {
+      sofsync_stop(s);
+      return (ret == LIBUSB_ERROR_PIPE) ? -EINVAL : -EIO;   // invalid configuration or USB error
+    }
+  }
+  return 0;
+}
+
+// Stops sampling in all the adapters
+int sofsync_stop(struct sofsync *s) {
+  int ret = 0;
+  for (int i = 0; i < s->n; i++) {
+    if (libusb_control_transfer(s->ad[i].handle, REQ_OUT, CMD_SOF_SAMPLE, 0, 0,
+                                NULL, 0, USB_TIMEOUT_MS) != 0) {
+      ret = -EIO;
+    }
+  }
+  return ret;
+}
+
+// Queues the samples received from an adapter, returns the bytes used
+static size_t decode(struct sofsync_adapter *ad) {
+  size_t pos = 0;
+  while ((ad->len - pos) >= sizeof(struct usb_record_hdr)) {
+    struct usb_record_hdr hdr;
+    memcpy(&hdr, ad->buf + pos, sizeof(hdr));
+    if ((ad->len - pos) < (sizeof(hdr) + hdr.len)) {
+      break;
+    }
+    if ((hdr.type == RECORD_SOF_SAMPLE) && (hdr.len >= sizeof(struct sof_sample_record)) &&
+        (ad->count < QUEUE_SIZE)) {
+      struct sof_sample_record rec;
+      memcpy(&rec, ad->buf + pos + sizeof(hdr), sizeof(rec));
+      int i = (ad->head + ad->count) % QUEUE_SIZE;
+      struct sofsync_sample *smp = &ad->queue[i];
+      smp->valid = true;
+      smp->status = rec.status;
+      smp->flags = rec.flags;
+      smp->frame = rec.frame;
+      smp->offset_us = rec.offset_us;
+      smp->len = hdr.len - sizeof(rec);
+      memcpy(smp->data, ad->buf + pos + sizeof(hdr) + sizeof(rec), smp->len);
+      ad->seq[i] = rec.seq;
+      ad->count++;
+      ad->last_seq = rec.seq + 1;
+    }
+    pos += sizeof(hdr) + hdr.len;
+  }
+  return pos;
+}
+
+// Reads the records available from an adapter, returns 0 or -errno
+static int poll_adapter(struct sofsync_adapter *ad) {
+  int n;
+  if (ad->count >= QUEUE_SIZE / 2) {
+    return 0;   // enough waiting
+  }
+  int ret = libusb_bulk_transfer(ad->handle, EP_IN, ad->buf + ad->len, sizeof(ad->buf) - ad->len, &n, POLL_MS);
+  if ((ret != 0) && (ret != LIBUSB_ERROR_TIMEOUT)) {
+    return -EIO;
+  }
+  ad->len += n;
+  size_t used = decode(ad);
+  memmove(ad->buf, ad->buf + used, ad->len - used);
+  ad->len -= used;
+  return 0;
+}
+
+// Checks if all the adapters have a sample waiting or have sent the last one
+// (samples arrive in seq order, so the oldest seq waiting is complete)
+static bool row_ready(struct sofsync *s) {
+  for (int i = 0; i < s->n; i++) {
+    struct sofsync_adapter *ad = &s->ad[i];
+    if ((ad->count == 0) && !(s->count && (ad->last_seq >= s->count))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Gets the next row of samples, returns 1 if a row was read, 0 if timeout
+// (or the last sample was read) or -errno
+int sofsync_read(struct sofsync *s, struct sofsync_row *row, int timeout_ms) {
+  if (s->count && (s->next_seq >= s->count)) {
+    return 0;
+  }
+  for (int t = 0; !row_ready(s); t += POLL_MS) {
+    if (t >= timeout_ms) {
+      // the adapters that sent nothing are late or stopped, the row is complete
+      // only when some adapter has it
+      bool any = false;
+      for (int i = 0; i < s->n; i++) {
+        any = any || (s->ad[i].count > 0);
+      }
+      if (!any) {
+        return 0;
+      }
+      break;
+    }
+    for (int i = 0; i < s->n; i++) {
+      int ret = poll_adapter(&s->ad[i]);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+  }
+
+  // Oldest seq waiting
+  uint32_t seq = 0xFFFFFFFF;
+  for (int i = 0; i < s->n; i++) {
+    struct sofsync_adapter *ad = &s->ad[i];
+    if ((ad->count > 0) && (ad->seq[ad->head] < seq)) {
+      seq = ad->seq[ad->head];
+    }
+  }
+  s->next_seq = seq + 1;
+
+  // Samples with this seq, times counted from the SOF of the start frame
+  uint32_t due = s->start_frame + seq * s->period;
+  int64_t t_min = INT64_MAX, t_max = INT64_MIN;
+  row->seq = seq;
+  for (int i = 0; i < s->n; i++) {
+    struct sofsync_adapter *ad = &s->ad[i];
+    struct sofsync_sample *smp = &row->sample[i];
+    if ((ad->count > 0) && (ad->seq[ad->head] == seq)) {
+      *smp = ad->queue[ad->head];
+      ad->head = (ad->head + 1) % QUEUE_SIZE;
+      ad->count--;
+      uint32_t frames = seq * s->period + ((smp->frame - due) & FRAME_MASK);
+      smp->t_us = frames * 1000LL + smp->offset_us;
+      t_min = (smp->t_us < t_min) ? smp->t_us : t_min;
+      t_max = (smp->t_us > t_max) ? smp->t_us : t_max;
+    } else {
+      smp->valid = false;
+    }
+  }
+  row->skew_us = t_max - t_min;
+  return 1;
+}
@@ -0,0 +1,46 @@
+/*
+   SOF synchronised sampling with several I2C-Pico-USB adapters
+
+   The adapters must be connected to the same USB host controller (they
+   can be behind hubs), so they see the same frame numbers.
+*/
+
+#ifndef _SOFSYNC_H
+#define _SOFSYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "i2cusb.h"
+
+#define SOFSYNC_MAX_ADAPTERS  16
+
+// Sample from one adapter
+struct sofsync_sample {
+  bool valid;           // false if the adapter skipped this sample
+  uint8_t status;       // script status (SCRIPT_OK, SCRIPT_ADDRESS_NACK, ...)
+  uint8_t flags;        // SOF_LATE if the time is estimated
+  uint16_t frame;
+  uint16_t offset_us;
+  int64_t t_us;         // time from the first sample (frame * 1000 + offset)
+  uint8_t len;
+  uint8_t data[SOF_MAX_DATA];
+};
+
+// Samples with the same seq from all the adapters
+struct sofsync_row {
+  uint32_t seq;
+  int64_t skew_us;      // time between the first and the last sample
+  struct sofsync_sample sample[SOFSYNC_MAX_ADAPTERS];
+};
+
+struct sofsync;
+
+struct sofsync *sofsync_open(const char * const *serials, int n);
+int sofsync_start(struct sofsync *s, const uint8_t *code, uint16_t len,
+                  uint16_t period, uint16_t offset_us, uint16_t count);
+int sofsync_read(struct sofsync *s, struct sofsync_row *row, int timeout_ms);
+int sofsync_stop(struct sofsync *s);
+void sofsync_close(struct sofsync *s);
+
+#endif
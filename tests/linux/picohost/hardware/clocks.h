@@ -0,0 +1,18 @@
+/*
+   Minimal replacement for the Pico SDK clocks header, used to compile
+   firmware modules in a PC for testing.
+   The test program must supply the functions.
+*/
+
+#ifndef _PICOHOST_CLOCKS_H
+#define _PICOHOST_CLOCKS_H
+
+#include "pico/stdlib.h"
+
+enum clock_index {
+  clk_sys = 5
+};
+
+uint32_t clock_get_hz(enum clock_index clk_index);
+
+#endif
@@ -0,0 +1,25 @@
+/*
+   Minimal replacement for the Pico SDK flash header, used to compile
+   firmware modules in a PC for testing.
+   The flash is an array supplied by the test program, as are the
+   functions.
+*/
+
+#ifndef _PICOHOST_HARDWARE_FLASH_H
+#define _PICOHOST_HARDWARE_FLASH_H
+
+#include "pico/stdlib.h"
+
+#define FLASH_PAGE_SIZE       256
+#define FLASH_SECTOR_SIZE     4096
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES (64 * FLASH_SECTOR_SIZE)
+#endif
+
+extern uint8_t *picohost_flash;
+#define XIP_BASE ((uintptr_t) picohost_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+#endif
@@ -0,0 +1,28 @@
+/*
+   Minimal replacement for the Pico SDK GPIO header, used to compile
+   firmware modules in a PC for testing.
+   The test program must supply the functions.
+*/
+
+#ifndef _PICOHOST_GPIO_H
+#define _PICOHOST_GPIO_H
+
+#include "pico/stdlib.h"
+
+enum gpio_slew_rate {
+  GPIO_SLEW_RATE_SLOW = 0,
+  GPIO_SLEW_RATE_FAST = 1
+};
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_pull_up(uint gpio);
+void gpio_set_slew_rate(uint gpio, enum gpio_slew_rate slew);
+void gpio_set_input_hysteresis_enabled(uint gpio, bool enabled);
+void gpio_set_dir_in_masked(uint32_t mask);
+void gpio_set_dir_out_masked(uint32_t mask);
+uint32_t gpio_get_all(void);
+
+#endif
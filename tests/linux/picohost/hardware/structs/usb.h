@@ -0,0 +1,20 @@
+/*
+   Minimal replacement for the Pico SDK USB registers header, used to
+   compile firmware modules in a PC for testing.
+   The test program must supply the registers (usb_hw).
+*/
+
+#ifndef _PICOHOST_STRUCTS_USB_H
+#define _PICOHOST_STRUCTS_USB_H
+
+#include "pico/stdlib.h"
+
+#define USB_SOF_RD_BITS 0x000007ff
+
+typedef struct {
+  volatile uint32_t sof_rd;
+} usb_hw_t;
+
+extern usb_hw_t *usb_hw;
+
+#endif
@@ -0,0 +1,16 @@
+/*
+   Minimal replacement for the Pico SDK flash header, used to compile
+   firmware modules in a PC for testing.
+   The test program must supply the functions.
+*/
+
+#ifndef _PICOHOST_PICO_FLASH_H
+#define _PICOHOST_PICO_FLASH_H
+
+#include "pico/stdlib.h"
+
+#define PICO_OK 0
+
+int flash_safe_execute(void (*func)(void *), void *param, uint32_t enter_exit_timeout_ms);
+
+#endif
@@ -0,0 +1,24 @@
+/*
+   Minimal replacement for the Pico SDK header, used to compile
+   firmware modules in a PC for testing.
+   The test program must supply the functions.
+*/
+
+#ifndef _PICOHOST_STDLIB_H
+#define _PICOHOST_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+
+#define __not_in_flash_func(f) f
+#define __force_inline inline
+
+void busy_wait_us_32(uint32_t delay_us);
+void busy_wait_at_least_cycles(uint32_t cycles);
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+
+#endif
@@ -0,0 +1,20 @@
+/*
+   Minimal replacement for the TinyUSB header, used to compile
+   firmware modules in a PC for testing.
+   The test program must supply the functions.
+*/
+
+#ifndef _PICOHOST_TUSB_H
+#define _PICOHOST_TUSB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool tud_mounted(void);
+uint32_t tud_vendor_available(void);
+uint32_t tud_vendor_read(void *buffer, uint32_t bufsize);
+uint32_t tud_vendor_write_available(void);
+uint32_t tud_vendor_write(const void *buffer, uint32_t bufsize);
+uint32_t tud_vendor_write_flush(void);
+
+#endif
@@ -0,0 +1,619 @@
+/*
+   Timing analyser for the bit-banged I2C (firmware/bbi2c.c)
+
+   Runs in a PC. The GPIO and timer functions are replaced by a virtual
+   time simulation: each GPIO access takes a fixed time, busy waits just
+   advance the clock, released lines rise after a configurable time and
+   a simulated memory at address 0x50 answers on the bus.
+
+   For each clock setting (the clock_period_us passed to bbi2c_set_clock)
+   a few transactions are run, every edge of SCL and SDA is recorded and
+   the timings are checked against the I2C specification (UM10204,
+   table 10) for Standard, Fast and Fast-mode Plus. The highest compliant
+   frequency for each mode is reported at the end.
+
+   Clock periods up to 4us use the fast engine, whose delays are counted
+   in system clock cycles (125MHz by default). Unless the rise time is
+   above the Fast-mode Plus limit, the test fails if 1us is not compliant
+   with Fast-mode Plus or if a byte takes longer than twelve clock periods.
+
+   The per target clock is also tested, including the probe for the
+   fastest clock (the simulated target fails if SCL high time is less
+   than 1.2us).
+
+   Compile with
+     gcc -Wall -I../picohost -I../../../firmware -o tbbtiming tbbtiming.c ../../../firmware/bbi2c.c ../../../firmware/i2cops.c
+
+   Use
+     tbbtiming [-g gpio_ns] [-f sys_mhz] [-r rise_ns] [-n max_period_us] [-c period_us -v file.vcd]
+       -g   time for each GPIO access (default 20ns)
+       -f   system clock (default 125MHz)
+       -r   rise time of the bus lines (default 0)
+       -n   largest clock period to test (default 20us)
+       -c   clock period for the VCD dump (default 10us)
+       -v   write the edges for the period selected with -c to a VCD file
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/clocks.h"
+#include "hwconfig.h"
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cops.h"
+
+#define SDA 0
+#define SCL 1
+
+#define MEM_ADDR 0x50
+
+// Virtual time
+static uint64_t now_ns;
+static uint32_t gpio_ns = 20;   // time for a GPIO access
+static uint32_t rise_ns = 0;    // time for a released line to go high
+static uint32_t sys_mhz = 125;  // system clock
+
+// Bus lines
+static bool host_dir[2];        // true if output
+static bool host_out[2];
+static bool dev_low;            // simulated target holding SDA low
+static bool level[2] = { true, true };
+static bool pending[2];         // released, waiting to rise
+static uint64_t pending_t[2];
+
+// Edge log
+#define MAX_EDGES 20000
+
+struct edge {
+  uint64_t t;
+  uint8_t line;
+  uint8_t level;
+};
+
+static struct edge edges[MAX_EDGES];
+static int nedges;
+
+static void target_edge(int line, bool lvl);
+
+// Changes the level of a line
+static void bus_changed(int line, bool lvl) {
+  level[line] = lvl;
+  if (nedges < MAX_EDGES) {
+    edges[nedges].t = now_ns;
+    edges[nedges].line = line;
+    edges[nedges].level = lvl;
+    nedges++;
+  }
+  target_edge(line, lvl);
+}
+
+// Processes pending rising edges up to time t
+static void bus_settle(uint64_t t) {
+  for (;;) {
+    int line = -1;
+    for (int i = 0; i < 2; i++) {
+      if (pending[i] && (pending_t[i] <= t) && ((line < 0) || (pending_t[i] < pending_t[line]))) {
+        line = i;
+      }
+    }
+    if (line < 0) {
+      break;
+    }
+    pending[line] = false;
+    now_ns = pending_t[line];
+    bus_changed(line, true);
+  }
+}
+
+// Updates a line after one of the drivers changed
+static void bus_update(int line) {
+  bool low = (host_dir[line] && !host_out[line]) || ((line == SDA) && dev_low);
+  if (low) {
+    pending[line] = false;
+    if (level[line]) {
+      bus_changed(line, false);
+    }
+  } else if (!level[line] && !pending[line]) {
+    if (rise_ns == 0) {
+      bus_changed(line, true);
+    } else {
+      pending[line] = true;
+      pending_t[line] = now_ns + rise_ns;
+    }
+  }
+}
+
+// Advances the virtual time
+static void advance(uint64_t ns) {
+  uint64_t end = now_ns + ns;
+  bus_settle(end);
+  now_ns = end;
+}
+
+// Replacements for the SDK functions
+static int gpio_line(uint gpio) {
+  return gpio == SCL_PIN ? SCL : SDA;
+}
+
+void gpio_init(uint gpio) {
+  host_dir[gpio_line(gpio)] = false;
+  host_out[gpio_line(gpio)] = false;
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+  advance(gpio_ns);
+  host_dir[gpio_line(gpio)] = out;
+  bus_update(gpio_line(gpio));
+}
+
+void gpio_put(uint gpio, bool value) {
+  advance(gpio_ns);
+  host_out[gpio_line(gpio)] = value;
+  bus_update(gpio_line(gpio));
+}
+
+bool gpio_get(uint gpio) {
+  advance(gpio_ns);
+  return level[gpio_line(gpio)];
+}
+
+static void gpio_set_dir_mask(uint32_t mask, bool out) {
+  advance(gpio_ns);
+  if (mask & (1u << SDA_PIN)) {
+    host_dir[SDA] = out;
+    bus_update(SDA);
+  }
+  if (mask & (1u << SCL_PIN)) {
+    host_dir[SCL] = out;
+    bus_update(SCL);
+  }
+}
+
+void gpio_set_dir_in_masked(uint32_t mask) {
+  gpio_set_dir_mask(mask, false);
+}
+
+void gpio_set_dir_out_masked(uint32_t mask) {
+  gpio_set_dir_mask(mask, true);
+}
+
+uint32_t gpio_get_all(void) {
+  advance(gpio_ns);
+  return (level[SDA] ? 1u << SDA_PIN : 0) | (level[SCL] ? 1u << SCL_PIN : 0);
+}
+
+void gpio_pull_up(uint gpio) {
+}
+
+void gpio_set_slew_rate(uint gpio, enum gpio_slew_rate slew) {
+}
+
+void gpio_set_input_hysteresis_enabled(uint gpio, bool enabled) {
+}
+
+void busy_wait_us_32(uint32_t delay_us) {
+  advance(delay_us * 1000ULL);
+}
+
+void busy_wait_at_least_cycles(uint32_t cycles) {
+  advance((cycles * 1000ULL) / sys_mhz);
+}
+
+uint32_t clock_get_hz(enum clock_index clk_index) {
+  return sys_mhz * 1000000;
+}
+
+uint32_t time_us_32(void) {
+  advance(gpio_ns);
+  return (uint32_t) (now_ns / 1000);
+}
+
+// Simulated target (256 byte memory with 8-bit address)
+enum { T_IDLE, T_ADDR, T_WRITE, T_READ, T_IGNORE };
+
+static int t_state = T_IDLE;
+static int t_bit;
+static uint8_t t_shift, t_byte, t_ptr;
+static bool t_first, t_nack;
+static uint8_t mem[256];
+static uint64_t t_rise;
+static uint32_t t_min_high_ns;    // shortest SCL high time the target handles
+
+static void target_sda(bool low) {
+  if (dev_low != low) {
+    dev_low = low;
+    bus_update(SDA);
+  }
+}
+
+static void target_edge(int line, bool lvl) {
+  if (line == SDA) {
+    if (level[SCL]) {
+      if (!lvl) {
+        t_state = T_ADDR;     // START
+        t_bit = 0;
+        t_shift = 0;
+      } else {
+        t_state = T_IDLE;     // STOP
+      }
+    }
+    return;
+  }
+
+  if (lvl) {
+    // SCL rising: sample SDA
+    t_rise = now_ns;
+    if ((t_state == T_ADDR) || (t_state == T_WRITE)) {
+      if (t_bit < 8) {
+        t_shift = (t_shift << 1) | level[SDA];
+      }
+      t_bit++;
+    } else if (t_state == T_READ) {
+      if (t_bit == 8) {
+        t_nack = level[SDA];
+      }
+      t_bit++;
+    }
+    return;
+  }
+
+  // SCL falling: change SDA
+  if ((t_state != T_IDLE) && ((now_ns - t_rise) < t_min_high_ns)) {
+    t_state = T_IGNORE;   // too fast, lost track of the bits
+    target_sda(false);
+    return;
+  }
+  switch (t_state) {
+    case T_ADDR:
+      if (t_bit == 8) {
+        if ((t_shift >> 1) == MEM_ADDR) {
+          target_sda(true);
+        } else {
+          t_state = T_IGNORE;
+        }
+      } else if (t_bit == 9) {
+        t_bit = 0;
+        if (t_shift & 1) {
+          t_state = T_READ;
+          t_byte = mem[t_ptr++];
+          target_sda(!(t_byte & 0x80));
+        } else {
+          t_state = T_WRITE;
+          t_first = true;
+          t_shift = 0;
+          target_sda(false);
+        }
+      }
+      break;
+    case T_WRITE:
+      if (t_bit == 8) {
+        target_sda(true);
+      } else if (t_bit == 9) {
+        target_sda(false);
+        if (t_first) {
+          t_ptr = t_shift;
+        } else {
+          mem[t_ptr++] = t_shift;
+        }
+        t_first = false;
+        t_bit = 0;
+        t_shift = 0;
+      }
+      break;
+    case T_READ:
+      if (t_bit < 8) {
+        target_sda(!((t_byte << t_bit) & 0x80));
+      } else if (t_bit == 8) {
+        target_sda(false);
+      } else if (t_nack) {
+        t_state = T_IGNORE;
+      } else {
+        t_byte = mem[t_ptr++];
+        t_bit = 0;
+        target_sda(!(t_byte & 0x80));
+      }
+      break;
+  }
+}
+
+// Timing parameters
+enum { P_LOW, P_HIGH, P_HDSTA, P_SUSTA, P_SUDAT, P_HDDAT, P_SUSTO, P_BUF, NPARAM };
+
+static const char *param_name[NPARAM] = {
+  "tLOW", "tHIGH", "tHD;STA", "tSU;STA", "tSU;DAT", "tHD;DAT", "tSU;STO", "tBUF"
+};
+
+struct mode {
+  const char *name;
+  uint32_t fmax_khz;
+  uint32_t tr_ns;             // maximum rise time
+  int64_t min_ns[NPARAM];
+};
+
+static const struct mode modes[] = {
+  { "Sm",  100, 1000, { 4700, 4000, 4000, 4700, 250, 0, 4000, 4700 } },
+  { "Fm",  400,  300, { 1300,  600,  600,  600, 100, 0,  600, 1300 } },
+  { "Fm+", 1000, 120, {  500,  260,  260,  260,  50, 0,  260,  500 } }
+};
+
+#define NMODES (sizeof(modes)/sizeof(modes[0]))
+
+struct result {
+  bool seen[NPARAM];
+  int64_t min_ns[NPARAM];
+  int64_t period_ns;          // shortest SCL period
+};
+
+static void measure(struct result *res, int param, int64_t ns) {
+  if (!res->seen[param] || (ns < res->min_ns[param])) {
+    res->min_ns[param] = ns;
+    res->seen[param] = true;
+  }
+}
+
+// Extracts the timings from the edge log
+static void analyse(struct result *res) {
+  int64_t t_rise = -1, t_fall = -1, t_start = -1, t_stop = -1, t_data = -1;
+  bool lvl[2] = { true, true };
+  bool hold_pending = false;
+
+  memset(res, 0, sizeof(*res));
+  for (int i = 0; i < nedges; i++) {
+    int64_t t = edges[i].t;
+    if (edges[i].line == SCL) {
+      if (edges[i].level) {
+        if (t_fall >= 0) {
+          measure(res, P_LOW, t - t_fall);
+          if (t_data >= t_fall) {
+            measure(res, P_SUDAT, t - t_data);
+          }
+        }
+        if ((t_rise >= 0) && ((res->period_ns == 0) || ((t - t_rise) < res->period_ns))) {
+          res->period_ns = t - t_rise;
+        }
+        t_rise = t;
+      } else {
+        if (t_rise >= 0) {
+          measure(res, P_HIGH, t - t_rise);
+        }
+        if (t_start > t_rise) {
+          measure(res, P_HDSTA, t - t_start);
+        }
+        t_fall = t;
+        hold_pending = true;
+      }
+    } else if (lvl[SCL]) {
+      if (!edges[i].level) {
+        // START
+        if ((t_stop >= 0) && (t_stop >= t_rise)) {
+          measure(res, P_BUF, t - t_stop);
+        } else if (t_rise >= 0) {
+          measure(res, P_SUSTA, t - t_rise);
+        }
+        t_start = t;
+      } else {
+        // STOP
+        if (t_rise >= 0) {
+          measure(res, P_SUSTO, t - t_rise);
+        }
+        t_stop = t;
+      }
+    } else {
+      if (hold_pending) {
+        measure(res, P_HDDAT, t - t_fall);
+        hold_pending = false;
+      }
+      t_data = t;
+    }
+    lvl[edges[i].line] = edges[i].level;
+  }
+}
+
+// Checks the timings against a mode, returns the first parameter
+// that is not met (NPARAM if compliant, -1 if frequency or rise time
+// are above the maximum)
+static int check(const struct result *res, const struct mode *m) {
+  if ((res->period_ns * m->fmax_khz < 1000000) || (rise_ns > m->tr_ns)) {
+    return -1;
+  }
+  for (int p = 0; p < NPARAM; p++) {
+    if (res->seen[p] && (res->min_ns[p] < m->min_ns[p])) {
+      return p;
+    }
+  }
+  return NPARAM;
+}
+
+// Writes the edge log as a VCD file
+static void write_vcd(const char *fname) {
+  FILE *f = fopen(fname, "w");
+  if (f == NULL) {
+    perror(fname);
+    return;
+  }
+  fprintf (f, "$timescale 1ns $end\n");
+  fprintf (f, "$scope module i2c $end\n");
+  fprintf (f, "$var wire 1 ! SCL $end\n");
+  fprintf (f, "$var wire 1 \" SDA $end\n");
+  fprintf (f, "$upscope $end\n");
+  fprintf (f, "$enddefinitions $end\n");
+  fprintf (f, "#0\n1!\n1\"\n");
+  for (int i = 0; i < nedges; i++) {
+    fprintf (f, "#%llu\n%d%c\n", (unsigned long long) edges[i].t, edges[i].level,
+             edges[i].line == SCL ? '!' : '"');
+  }
+  fclose(f);
+}
+
+// Runs the test transactions, returns false if the data is wrong
+static bool run(uint8_t seed) {
+  uint8_t data[2] = { seed, ~seed };
+  bool ok = true;
+
+  now_ns = 0;
+  nedges = 0;
+
+  // write two bytes at address 0x10
+  bbi2c_start();
+  ok = ok && bbi2c_write(MEM_ADDR << 1);
+  ok = ok && bbi2c_write(0x10);
+  ok = ok && bbi2c_write(data[0]);
+  ok = ok && bbi2c_write(data[1]);
+  bbi2c_stop();
+
+  // read them back with a repeated start
+  bbi2c_start();
+  ok = ok && bbi2c_write(MEM_ADDR << 1);
+  ok = ok && bbi2c_write(0x10);
+  bbi2c_restart();
+  ok = ok && bbi2c_write((MEM_ADDR << 1) | 1);
+  ok = ok && (bbi2c_read(false) == data[0]);
+  ok = ok && (bbi2c_read(true) == data[1]);
+  bbi2c_stop();
+
+  // address that is not there
+  bbi2c_start();
+  ok = ok && !bbi2c_write(0x33 << 1);
+  bbi2c_stop();
+  advance(10000);
+
+  return ok && !bbi2c_bus_error() && !bbi2c_busy();
+}
+
+// Main program
+int main (int argc, char **argv) {
+  int max_period = 20;
+  int vcd_period = 10;
+  char *vcd_file = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "g:f:r:n:c:v:")) != -1) {
+    switch (opt) {
+      case 'g': gpio_ns = atoi(optarg); break;
+      case 'f': sys_mhz = atoi(optarg); break;
+      case 'r': rise_ns = atoi(optarg); break;
+      case 'n': max_period = atoi(optarg); break;
+      case 'c': vcd_period = atoi(optarg); break;
+      case 'v': vcd_file = optarg; break;
+      default:
+        printf ("Use: tbbtiming [-g gpio_ns] [-f sys_mhz] [-r rise_ns] [-n max_period_us] [-c period_us -v file.vcd]\n");
+        return 1;
+    }
+  }
+  if (gpio_ns == 0) {
+    gpio_ns = 1;    // time must advance while waiting for SCL
+  }
+  if (sys_mhz == 0) {
+    sys_mhz = 125;
+  }
+
+  bbi2c_init(10);
+
+  int best[NMODES];
+  uint32_t best_khz[NMODES];
+  int failures = 0;
+  for (int m = 0; m < NMODES; m++) {
+    best[m] = 0;
+    best_khz[m] = 0;
+  }
+
+  printf ("GPIO access %uns, system clock %uMHz, rise time %uns, times in ns\n\n", gpio_ns, sys_mhz, rise_ns);
+  printf ("period   kHz");
+  for (int p = 0; p < NPARAM; p++) {
+    printf (" %7s", param_name[p]);
+  }
+  printf ("  compliance\n");
+
+  for (int period = 1; period <= max_period; period++) {
+    struct result res;
+    bbi2c_set_clock(period);
+    bool ok = run(period);
+    if (!ok) {
+      failures++;
+    }
+    analyse(&res);
+    if (vcd_file && (period == vcd_period)) {
+      write_vcd(vcd_file);
+    }
+
+    uint32_t khz = res.period_ns ? 1000000 / res.period_ns : 0;
+    printf ("%4dus %5u", period, khz);
+    for (int p = 0; p < NPARAM; p++) {
+      printf (" %7lld", (long long) res.min_ns[p]);
+    }
+    printf (" ");
+    for (int m = 0; m < NMODES; m++) {
+      int p = check(&res, &modes[m]);
+      if (p == NPARAM) {
+        printf (" %s:ok", modes[m].name);
+        if (khz > best_khz[m]) {
+          best[m] = period;
+          best_khz[m] = khz;
+        }
+      } else {
+        printf (" %s:%s", modes[m].name, p < 0 ? "fSCL" : param_name[p]);
+        if ((period == 1) && (m == NMODES-1) && (rise_ns <= modes[m].tr_ns)) {
+          failures++;   // the fast engine must reach Fast-mode Plus
+        }
+      }
+    }
+    printf ("%s\n", ok ? "" : "  DATA ERROR");
+  }
+
+  printf ("\nHighest compliant setting:\n");
+  for (int m = 0; m < NMODES; m++) {
+    if (best[m]) {
+      printf ("  %-4s %dus (%ukHz)\n", modes[m].name, best[m], best_khz[m]);
+    } else {
+      printf ("  %-4s none\n", modes[m].name);
+    }
+  }
+
+  // Time for a data byte with the fast engine
+  bbi2c_set_clock(1);
+  now_ns = 0;
+  bbi2c_start();
+  bbi2c_write(MEM_ADDR << 1);
+  uint64_t t0 = now_ns;
+  bbi2c_write(0x10);
+  uint64_t t_byte = now_ns - t0;
+  bbi2c_stop();
+  printf ("\nClock 1us: %lluns per byte%s\n", (unsigned long long) t_byte,
+          t_byte < 12000 ? "" : "  TOO SLOW");
+  if ((t_byte >= 12000) && (rise_ns <= modes[NMODES-1].tr_ns)) {
+    failures++;
+  }
+
+  // Target with its own clock
+  struct result res;
+  bbi2c_set_clock(10);
+  bbi2c_set_target_clock(MEM_ADDR, 3);
+  bool ok = run(10);
+  analyse(&res);
+  printf ("Bus clock 10us, target clock 3us: shortest SCL period %lldns%s\n", 
+          (long long) res.period_ns, ok ? "" : "  DATA ERROR");
+  if (!ok || (res.period_ns > 5000)) {
+    failures++;
+  }
+
+  // Probe for the fastest clock
+  t_min_high_ns = 1200;
+  uint16_t period = i2c_clock_probe(MEM_ADDR, 0x10, 2, 1);
+  printf ("Probe (target needs 1.2us SCL high): %uus, table %uus%s\n", period,
+          bbi2c_get_target_clock(MEM_ADDR), period == 3 ? "" : "  WRONG");
+  if ((period != 3) || (bbi2c_get_target_clock(MEM_ADDR) != 3)) {
+    failures++;
+  }
+  ok = run(10);
+  if (!ok || (i2c_clock_probe(0x33, 0, 1, 1) != 0)) {
+    failures++;
+  }
+
+  printf ("\n%s\n", failures ? "ERRORS" : "ALL TRANSACTIONS OK");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,298 @@
+/*
+   Latency and throughput benchmark
+
+   Sweeps the number of messages and the size of the messages in I2C
+   transactions with a 24C32 (or compatible) memory and reports, for each
+   combination, the latency percentiles of the transactions and the data
+   throughput. Each transaction writes the 16-bit memory address and then
+   does 'messages' reads of 'size' bytes, with repeated starts between
+   them. With -W, the 'messages' writes (address and 'size' bytes, up to
+   a 32 byte page) are transactions of their own, each one in a page and
+   followed by ACK polling until the write cycle ends.
+
+   The adapter can be accessed
+   - through the kernel driver (I2C_RDWR ioctl in /dev/i2c-N)
+   - directly through libusb (the kernel driver is detached)
+   - simulated (see host/linux/adapter_sim.c), so the benchmark can run
+     with no hardware
+
+   Compile with
+     gcc -Wall -O2 -I../../../host/linux -I../../../firmware -I../picohost -o tbench tbench.c \
+         ../../../host/linux/adapter.c ../../../host/linux/adapter_sim.c \
+         ../../../host/linux/adapter_usb.c ../../../firmware/i2cscript.c -lusb-1.0
+   or, without libusb, add -DNO_LIBUSB and remove adapter_usb.c and -lusb-1.0
+
+   Use
+     tbench [-i adapter_nr | -u [-d serial] | -s [-l usb_latency_us] [-k clock_khz]]
+            [-a addr] [-n iterations] [-m max_messages] [-z max_size] [-W] [-j]
+       -i   use /dev/i2c-<adapter_nr> (kernel driver)
+       -u   use libusb
+       -s   use a simulated adapter (default)
+       -W   benchmark writes instead of reads (sizes up to a page)
+       -j   output in JSON (default is CSV)
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#include "adapter.h"
+
+#define MAX_MSGS  8
+#define MAX_SIZE  256
+#define MEM_SIZE  4096
+#define PAGE_SIZE 32
+#define MAX_POLLS 100     // address NACKs accepted during a write cycle
+
+// Backend
+static int i2c_fd = -1;
+static struct adapter *ad;
+
+static int do_xfer(struct i2c_msg *msgs, int nmsgs) {
+  if (i2c_fd >= 0) {
+    struct i2c_rdwr_ioctl_data data = { msgs, nmsgs };
+    return (ioctl(i2c_fd, I2C_RDWR, &data) < 0) ? -errno : 0;
+  }
+  return ad->xfer(ad, msgs, nmsgs);
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of a sorted array
+static uint64_t percentile(const uint64_t *lat, int n, int pct) {
+  int rank = (pct * n + 99) / 100;
+  return lat[(rank > 0) ? rank - 1 : 0];
+}
+
+// Result of a combination
+struct result {
+  int msgs;
+  int size;
+  int errors;
+  uint64_t p50, p90, p99, max;
+  double bytes_s;
+  double usb_per_xfer;
+};
+
+// Waits for the end of a write cycle (the memory NACKs its address until then)
+static int ack_poll(uint8_t addr) {
+  struct i2c_msg m = { .addr = addr, .flags = 0, .len = 0, .buf = NULL };
+  int ret = 0;
+  for (int i = 0; i < MAX_POLLS; i++) {
+    if ((ret = do_xfer(&m, 1)) == 0) {
+      break;
+    }
+  }
+  return ret;
+}
+
+// Runs the transactions for one combination
+static void bench(uint8_t addr, bool write, int msgs, int size, int iterations,
+                  uint64_t *lat, struct result *res) {
+  static uint8_t buf[MAX_MSGS][2 + MAX_SIZE];
+  static uint8_t ptr[2];
+  struct i2c_msg m[MAX_MSGS + 1];
+  int n = 0;
+
+  if (!write) {
+    m[n].addr = addr;
+    m[n].flags = 0;
+    m[n].len = 2;
+    m[n++].buf = ptr;
+  }
+  for (int i = 0; i < msgs; i++) {
+    m[n].addr = addr;
+    m[n].flags = write ? 0 : I2C_M_RD;
+    m[n].len = write ? 2 + size : size;
+    m[n++].buf = buf[i];
+  }
+
+  memset(res, 0, sizeof(*res));
+  res->msgs = msgs;
+  res->size = size;
+  uint64_t usb_before = ad ? ad->usb_transfers : 0;
+  uint64_t total = 0;
+  int ok = 0;
+  for (int it = 0; it < iterations; it++) {
+    // spread the accesses over the memory
+    uint16_t mem = (it * msgs * size) % (MEM_SIZE - msgs * size);
+    ptr[0] = mem >> 8;
+    ptr[1] = mem & 0xFF;
+    if (write) {
+      // a page for each write
+      for (int i = 0; i < msgs; i++) {
+        uint16_t a = ((it * msgs + i) * PAGE_SIZE) % MEM_SIZE;
+        buf[i][0] = a >> 8;
+        buf[i][1] = a & 0xFF;
+        memset(buf[i] + 2, it + i, size);
+      }
+    }
+    uint64_t t0 = now_us();
+    int ret = 0;
+    if (write) {
+      for (int i = 0; (ret == 0) && (i < msgs); i++) {
+        ret = do_xfer(&m[i], 1);
+        if (ret == 0) {
+          ret = ack_poll(addr);
+        }
+      }
+    } else {
+      ret = do_xfer(m, n);
+    }
+    uint64_t t = now_us() - t0;
+    if (ret != 0) {
+      res->errors++;
+      continue;
+    }
+    lat[ok++] = t;
+    total += t;
+  }
+  if (ok == 0) {
+    return;
+  }
+  qsort(lat, ok, sizeof(lat[0]), cmp_u64);
+  res->p50 = percentile(lat, ok, 50);
+  res->p90 = percentile(lat, ok, 90);
+  res->p99 = percentile(lat, ok, 99);
+  res->max = lat[ok - 1];
+  res->bytes_s = total ? (1e6 * ok * msgs * size) / total : 0;
+  if (ad) {
+    res->usb_per_xfer = (double) (ad->usb_transfers - usb_before) / iterations;
+  }
+}
+
+// Main program
+int main (int argc, char **argv) {
+  int adapter_nr = -1;
+  bool use_usb = false;
+  const char *serial = NULL;
+  uint32_t latency_us = 500;
+  uint32_t clock_khz = 100;
+  uint8_t addr = 0x50;
+  int iterations = 100;
+  int max_msgs = 4;
+  int max_size = 64;
+  bool write = false;
+  bool json = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:ud:sl:k:a:n:m:z:Wj")) != -1) {
+    switch (opt) {
+      case 'i': adapter_nr = atoi(optarg); break;
+      case 'u': use_usb = true; break;
+      case 'd': serial = optarg; break;
+      case 's': use_usb = false; adapter_nr = -1; break;
+      case 'l': latency_us = atoi(optarg); break;
+      case 'k': clock_khz = atoi(optarg); break;
+      case 'a': addr = strtol(optarg, NULL, 0); break;
+      case 'n': iterations = atoi(optarg); break;
+      case 'm': max_msgs = atoi(optarg); break;
+      case 'z': max_size = atoi(optarg); break;
+      case 'W': write = true; break;
+      case 'j': json = true; break;
+      default:
+        printf ("Use: tbench [-i adapter_nr | -u [-d serial] | -s [-l usb_latency_us] [-k clock_khz]]\n"
+                "              [-a addr] [-n iterations] [-m max_messages] [-z max_size] [-W] [-j]\n");
+        return 1;
+    }
+  }
+  if ((iterations < 1) || (max_msgs < 1) || (max_msgs > MAX_MSGS) ||
+      (max_size < 1) || (max_size > MAX_SIZE) || ((max_msgs * max_size) >= MEM_SIZE)) {
+    printf ("Invalid parameters.\n");
+    return 1;
+  }
+
+  // open the backend
+  const char *backend;
+  if (adapter_nr >= 0) {
+    char dev[32];
+    snprintf (dev, sizeof(dev), "/dev/i2c-%d", adapter_nr);
+    i2c_fd = open(dev, O_RDWR);
+    if (i2c_fd < 0) {
+      printf ("Error opening %s.\n", dev);
+      return 2;
+    }
+    backend = "i2c-dev";
+  } else if (use_usb) {
+    #ifndef NO_LIBUSB
+    ad = adapter_usb_open(serial);
+    #else
+    (void) serial;
+    printf ("Compiled without libusb, only the simulated adapter (-s) is available.\n");
+    #endif
+    backend = "libusb";
+  } else {
+    ad = adapter_sim_open(latency_us, clock_khz);
+    backend = "sim";
+  }
+  if ((i2c_fd < 0) && (ad == NULL)) {
+    printf ("Error opening adapter.\n");
+    return 2;
+  }
+
+  uint64_t *lat = malloc(iterations * sizeof(uint64_t));
+  if (lat == NULL) {
+    return 3;
+  }
+
+  // sweep
+  const char *op = write ? "write" : "read";
+  if (json) {
+    printf ("[\n");
+  } else {
+    printf ("backend,op,messages,size,iterations,errors,p50_us,p90_us,p99_us,max_us,bytes_s,usb_per_xfer\n");
+  }
+  bool first = true;
+  for (int msgs = 1; msgs <= max_msgs; msgs *= 2) {
+    for (int size = 1; (size <= max_size) && (!write || (size <= PAGE_SIZE)); size *= 4) {
+      struct result res;
+      bench(addr, write, msgs, size, iterations, lat, &res);
+      if (json) {
+        printf ("%s  {\"backend\": \"%s\", \"op\": \"%s\", \"messages\": %d, \"size\": %d, "
+                "\"iterations\": %d, \"errors\": %d, \"p50_us\": %llu, \"p90_us\": %llu, "
+                "\"p99_us\": %llu, \"max_us\": %llu, \"bytes_s\": %.0f, \"usb_per_xfer\": %.2f}",
+                first ? "" : ",\n", backend, op, msgs, size, iterations, res.errors,
+                (unsigned long long) res.p50, (unsigned long long) res.p90,
+                (unsigned long long) res.p99, (unsigned long long) res.max,
+                res.bytes_s, res.usb_per_xfer);
+      } else {
+        printf ("%s,%s,%d,%d,%d,%d,%llu,%llu,%llu,%llu,%.0f,%.2f\n",
+                backend, op, msgs, size, iterations, res.errors,
+                (unsigned long long) res.p50, (unsigned long long) res.p90,
+                (unsigned long long) res.p99, (unsigned long long) res.max,
+                res.bytes_s, res.usb_per_xfer);
+      }
+      first = false;
+    }
+  }
+  if (json) {
+    printf ("\n]\n");
+  }
+
+  free(lat);
+  if (ad) {
+    ad->close(ad);
+  }
+  if (i2c_fd >= 0) {
+    close(i2c_fd);
+  }
+  return 0;
+}
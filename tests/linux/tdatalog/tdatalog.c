@@ -0,0 +1,340 @@
+/*
+   Tests for the standalone data logger (firmware/i2clog.c)
+
+   Runs in a PC. The flash is simulated in shared memory (erase sets all
+   bytes of a sector to 0xFF, programming can only clear bits) and each
+   "power up" of the board runs in a child process, so the logger starts
+   with fresh variables and only the flash survives, as in the real thing.
+   The script "returns" the time in ms, so the records can be checked,
+   and the records sent through usbstream are collected by the test.
+
+   Compile with
+     gcc -Wall -I../picohost -I../../../firmware -o tdatalog tdatalog.c ../../../firmware/i2clog.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "pico/stdlib.h"
+#include "pico/flash.h"
+#include "hardware/flash.h"
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cscript.h"
+#include "i2cboot.h"
+#include "i2cprefetch.h"
+#include "usbstream.h"
+#include "i2clog.h"
+
+#define LOG_SECTORS   32
+#define LOG_FIRST     ((PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE) - 2 - LOG_SECTORS)
+#define PERIOD_MS     100
+#define MAX_RECORDS   (LOG_SECTORS * 400)
+
+// Flash (shared with the child processes)
+struct flash_sim {
+  uint8_t mem[PICO_FLASH_SIZE_BYTES];
+  uint32_t erases[PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE];
+  uint32_t bad_ops;       // misaligned or trying to set bits (0xFF leaves a byte as is)
+};
+
+static struct flash_sim *flash;
+uint8_t *picohost_flash;
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+  if ((flash_offs % FLASH_SECTOR_SIZE) || (count % FLASH_SECTOR_SIZE)) {
+    flash->bad_ops++;
+    return;
+  }
+  memset(flash->mem + flash_offs, 0xFF, count);
+  for (size_t i = 0; i < count; i += FLASH_SECTOR_SIZE) {
+    flash->erases[(flash_offs + i) / FLASH_SECTOR_SIZE]++;
+  }
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+  if ((flash_offs % FLASH_PAGE_SIZE) || (count % FLASH_PAGE_SIZE)) {
+    flash->bad_ops++;
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if ((data[i] != 0xFF) && ((flash->mem[flash_offs + i] & data[i]) != data[i])) {
+      flash->bad_ops++;
+    }
+    flash->mem[flash_offs + i] &= data[i];
+  }
+}
+
+int flash_safe_execute(void (*func)(void *), void *param, uint32_t enter_exit_timeout_ms) {
+  func(param);
+  return PICO_OK;
+}
+
+// Simulated time
+static uint64_t now_us;
+
+uint64_t time_us_64(void) {
+  return now_us;
+}
+
+// Replacements for the other firmware modules
+static int script_runs;
+static int invalidations;
+static const uint8_t script[] = { 0x12, 0x34, 0x56 };
+
+bool bbi2c_busy(void) {
+  return false;
+}
+
+void i2cprefetch_invalidate(uint8_t addr) {
+  invalidations++;
+}
+
+void i2c_script_run(const uint8_t *code, uint16_t len, struct i2c_script_result *res, uint8_t *out) {
+  uint32_t ms = (uint32_t) (now_us / 1000);
+  memset(res, 0, sizeof(*res));
+  if ((len == sizeof(script)) && !memcmp(code, script, len)) {
+    res->status = SCRIPT_OK;
+  } else {
+    res->status = SCRIPT_BUS_ERROR;
+  }
+  memcpy(out, &ms, sizeof(ms));
+  res->out_len = sizeof(ms);
+  script_runs++;
+}
+
+uint16_t i2cboot_crc(const uint8_t *data, uint16_t len) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < len; i++) {
+    crc ^= data[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Host side of usbstream: the records received
+struct rx_record {
+  uint16_t boot;
+  uint8_t status;
+  uint32_t time_ms;
+  uint32_t data;
+};
+
+static bool connected;
+static struct rx_record rx[MAX_RECORDS];
+static int rx_count;
+static int rx_bad;
+
+uint32_t usbstream_available(void) {
+  return connected ? 4096 : 0;
+}
+
+bool usbstream_send(uint8_t type, const void *data, uint8_t len) {
+  struct log_record rec;
+  if ((type != RECORD_DATALOG) || (len < sizeof(rec))) {
+    rx_bad++;
+    return false;
+  }
+  memcpy(&rec, data, sizeof(rec));
+  if ((rec.len != sizeof(uint32_t)) || (len != (sizeof(rec) + rec.len)) || (rx_count == MAX_RECORDS)) {
+    rx_bad++;
+    return false;
+  }
+  rx[rx_count].boot = rec.boot;
+  rx[rx_count].status = rec.status;
+  rx[rx_count].time_ms = rec.time_ms;
+  memcpy(&rx[rx_count].data, (const uint8_t *) data + sizeof(rec), sizeof(uint32_t));
+  rx_count++;
+  return true;
+}
+
+// Runs the logger for some time
+static void run(uint32_t ms) {
+  for (uint32_t i = 0; i < ms; i += 10) {
+    i2clog_task();
+    now_us += 10000;
+  }
+}
+
+// Checks that the records received are consecutive and correct, returns the number of
+// records of a boot
+static int rx_check(int first, int last, uint16_t boot, bool *ok) {
+  int n = 0;
+  for (int i = first; i < last; i++) {
+    if ((rx[i].status != SCRIPT_OK) || (rx[i].data != rx[i].time_ms)) {
+      *ok = false;
+    }
+    if ((i > first) && (rx[i].boot == rx[i-1].boot) && (rx[i].time_ms != rx[i-1].time_ms + PERIOD_MS)) {
+      *ok = false;
+    }
+    if (rx[i].boot == boot) {
+      n++;
+    }
+  }
+  return n;
+}
+
+static int errors = 0;
+
+static void check(bool ok, const char *msg) {
+  printf ("%-50s %s\n", msg, ok ? "ok" : "FAILED");
+  if (!ok) {
+    errors++;
+  }
+}
+
+// First power up: configure and log without a host
+static void boot0(void) {
+  struct log_status st;
+
+  i2clog_init();
+  i2clog_get_status(&st);
+  check(!st.enabled && (st.boot == 0) && (st.sectors == LOG_SECTORS), "empty flash: not logging");
+
+  check(!i2clog_config(script, sizeof(script), 0), "period 0 rejected");
+  check(i2clog_config(script, sizeof(script), PERIOD_MS), "configuration stored");
+  run(100000);
+  i2clog_get_status(&st);
+  check(st.enabled && (st.period_ms == PERIOD_MS) && (st.records == 1000) && (st.sent == 0),
+        "records logged without host");
+  check(invalidations == 1000, "prefetch buffer invalidated before each run");
+  // power goes off, the last records were not yet programmed
+}
+
+// Second power up: send the records, then log until the ring wraps around
+static void boot1(void) {
+  struct log_status st;
+  bool ok = true;
+
+  i2clog_init();
+  i2clog_get_status(&st);
+  check(st.enabled && (st.period_ms == PERIOD_MS) && (st.boot == 1), "configuration and boot count restored");
+
+  connected = true;
+  i2clog_mount();
+  run(1000);
+  int n0 = rx_check(0, rx_count, 0, &ok);
+  int n1 = rx_check(0, rx_count, 1, &ok);
+  printf ("records received: %d from previous boot, %d from this boot\n", n0, n1);
+  check(ok && (rx_bad == 0) && (rx[0].boot == 0) && (rx[0].time_ms == 0), "records received in order");
+  check((n0 >= 1000 - 100) && (n0 <= 1000) && (n1 == 10), "at most 10s lost at power off");
+
+  // Rewind sends everything again
+  int count = rx_count;
+  i2clog_ctrl(LOG_REWIND);
+  run(10);
+  check((rx_count == 2 * count + 1) && !memcmp(rx, rx + count, count * sizeof(rx[0])), "rewind");
+  i2clog_get_status(&st);
+  check(st.backlog == 0, "nothing left to send");
+
+  // Log until the ring wraps around, without the host
+  connected = false;
+  uint32_t runs = (LOG_SECTORS + 4) * 340;
+  run(runs * PERIOD_MS);
+  i2clog_ctrl(LOG_FLUSH);
+  i2clog_get_status(&st);
+  check(st.overwritten > 0, "unsent records overwritten when full");
+  uint32_t min = 0xFFFFFFFF, max = 0;
+  for (int i = 0; i < LOG_SECTORS; i++) {
+    uint32_t n = flash->erases[LOG_FIRST + i];
+    min = (n < min) ? n : min;
+    max = (n > max) ? n : max;
+  }
+  printf ("sector erases: min %u max %u\n", min, max);
+  check((min > 0) && (max - min <= 1), "all sectors used in turn");
+  check(!i2clog_ctrl(99), "invalid operation rejected");
+}
+
+// Sector erases in the log area
+static uint32_t log_erases(void) {
+  uint32_t n = 0;
+  for (int i = 0; i < LOG_SECTORS; i++) {
+    n += flash->erases[LOG_FIRST + i];
+  }
+  return n;
+}
+
+// Third power up: get the records that are still there, erase and stop
+static void boot2(void) {
+  struct log_status st;
+  bool ok = true;
+
+  i2clog_init();
+  i2clog_get_status(&st);
+  check(st.boot == 2, "boot count after wrap around");
+  connected = true;
+  i2clog_mount();
+  run(10);
+  int n1 = rx_check(0, rx_count, 1, &ok);
+  printf ("records received after wrap around: %d\n", n1);
+  check(ok && (n1 > (LOG_SECTORS - 1) * 330) && (n1 < LOG_SECTORS * 340), "newest records kept");
+
+  uint32_t erases = log_erases();
+  i2clog_ctrl(LOG_ERASE);
+  check(log_erases() == erases, "erase done in the main loop");
+  run(10);
+  i2clog_get_status(&st);
+  check(st.backlog == 0, "log erased");
+  i2clog_ctrl(LOG_REWIND);
+  int count = rx_count;
+  run(100);
+  check(rx_count == count + 1, "only new records after erase");
+  run(LOG_SECTORS * 10);
+  check(log_erases() == erases + LOG_SECTORS, "one sector erased in each call");
+
+  check(i2clog_config(NULL, 0, 0), "logging stopped");
+  count = rx_count;
+  int runs = script_runs;
+  run(1000);
+  i2clog_get_status(&st);
+  check(!st.enabled && (script_runs == runs) && (rx_count == count), "no more records");
+}
+
+// Fourth power up: logging stays stopped
+static void boot3(void) {
+  struct log_status st;
+
+  i2clog_init();
+  i2clog_get_status(&st);
+  check(!st.enabled && (st.period_ms == 0), "stop is persistent");
+}
+
+// Runs a power up in a child process, returns the number of errors
+static int power_up(void (*boot)(void)) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    boot();
+    fflush(stdout);
+    exit(errors);
+  }
+  int wstatus;
+  waitpid(pid, &wstatus, 0);
+  return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1;
+}
+
+// Main program
+int main (void) {
+  flash = mmap(NULL, sizeof(struct flash_sim), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (flash == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  memset(flash->mem, 0xFF, sizeof(flash->mem));
+  picohost_flash = flash->mem;
+
+  errors += power_up(boot0);
+  errors += power_up(boot1);
+  errors += power_up(boot2);
+  errors += power_up(boot3);
+  check(flash->bad_ops == 0, "flash only programmed over erased bits");
+
+  printf ("\n%s\n", errors ? "TESTS FAILED" : "ALL TESTS PASSED");
+  return errors ? 1 : 0;
+}
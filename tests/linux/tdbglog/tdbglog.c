@@ -0,0 +1,126 @@
+/*
+   Tests for the binary debug log (firmware/dbglog.c)
+
+   Runs in a PC, with the log sent through the vendor endpoint
+   (DEBUG_LOG=2). usbstream is replaced by a capture of the records and
+   the space in the USB FIFO can be changed to simulate a host that is
+   not reading.
+
+   Compile with
+     gcc -Wall -DDEBUG_LOG=2 -I../picohost -I../../../firmware -o tdbglog tdbglog.c ../../../firmware/dbglog.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "i2cusb.h"
+#include "usbstream.h"
+#include "dbglog.h"
+
+// Virtual time
+static uint32_t now_us;
+
+uint32_t time_us_32(void) {
+  return now_us;
+}
+
+// Replacement for usbstream
+#define MAX_RECORDS 200
+
+static uint32_t fifo_space;
+static struct dbglog_record sent[MAX_RECORDS];
+static int nsent;
+static bool bad_record;
+
+uint32_t usbstream_available(void) {
+  return fifo_space;
+}
+
+bool usbstream_send(uint8_t type, const void *data, uint8_t len) {
+  uint32_t size = sizeof(struct usb_record_hdr) + len;
+  if ((type != RECORD_LOG) || (len != sizeof(struct dbglog_record)) ||
+      (size > fifo_space) || (nsent >= MAX_RECORDS)) {
+    bad_record = true;
+    return false;
+  }
+  fifo_space -= size;
+  memcpy(&sent[nsent++], data, len);
+  return true;
+}
+
+static int errors = 0;
+
+static void check(bool ok, const char *msg) {
+  printf ("%-50s %s\n", msg, ok ? "ok" : "FAILED");
+  if (!ok) {
+    errors++;
+  }
+}
+
+// Main program
+int main (void) {
+  static const char fmt0[] = "Starting USB\n";
+  static const char fmt2[] = "Addr %02X len %d\n";
+  static const char fmt4[] = "Job %d status %02X count %u bus %u\n";
+  struct dbglog_stats st;
+  bool ok;
+
+  dbglog_init();
+
+  // Records and arguments
+  fifo_space = 4096;
+  now_us = 1000;
+  dbglog(fmt0);
+  now_us = 1500;
+  dbglog(fmt2, 0x50, 16);
+  now_us = 2000;
+  dbglog(fmt4, 3, 0x81, 1234, 0xFFFFFFFF);
+  check(nsent == 0, "nothing sent before the task");
+  dbglog_task();
+  ok = (nsent == 3) && !bad_record;
+  for (int i = 0; ok && (i < 3); i++) {
+    ok = (sent[i].magic == DBGLOG_MAGIC) && (sent[i].seq == i);
+  }
+  check(ok, "three records sent in order");
+  ok = (sent[0].nargs == 0) && (sent[0].fmt == (uint32_t) (uintptr_t) fmt0) && (sent[0].time_us == 1000) &&
+       (sent[1].nargs == 2) && (sent[1].fmt == (uint32_t) (uintptr_t) fmt2) && (sent[1].time_us == 1500) &&
+       (sent[1].arg[0] == 0x50) && (sent[1].arg[1] == 16) && (sent[1].arg[2] == 0);
+  check(ok, "format, timestamp and arguments");
+  ok = (sent[2].nargs == 4) && (sent[2].arg[0] == 3) && (sent[2].arg[1] == 0x81) &&
+       (sent[2].arg[2] == 1234) && (sent[2].arg[3] == 0xFFFFFFFF);
+  check(ok, "four arguments");
+
+  // Host not reading: the ring fills and new records are dropped
+  nsent = 0;
+  fifo_space = 0;
+  for (int i = 0; i < 70; i++) {
+    dbglog(fmt2, i, 0);
+  }
+  dbglog_task();
+  dbglog_get_stats(&st);
+  check((nsent == 0) && (st.records == 67) && (st.dropped == 6), "full log drops new records");
+
+  // Space for only some records
+  fifo_space = 10 * (sizeof(struct usb_record_hdr) + sizeof(struct dbglog_record)) + 5;
+  dbglog_task();
+  check((nsent == 10) && !bad_record, "sent only what fits in the FIFO");
+
+  // Space freed in the log can be used again, the gap shows the dropped records
+  dbglog(fmt0);
+  fifo_space = 4096;
+  dbglog_task();
+  ok = (nsent == 65) && !bad_record;
+  for (int i = 0; ok && (i < 64); i++) {
+    ok = (sent[i].seq == 3 + i) && (sent[i].arg[0] == i);
+  }
+  check(ok, "records kept in order across the ring end");
+  check((sent[64].seq == 3 + 70) && (sent[64].fmt == (uint32_t) (uintptr_t) fmt0), "sequence gap after the dropped records");
+
+  dbglog_get_stats(&st);
+  check((st.records == 68) && (st.dropped == 6) && (st.sent == 68), "counters");
+
+  printf ("\n%s\n", errors ? "TESTS FAILED" : "ALL TESTS PASSED");
+  return errors ? 1 : 0;
+}
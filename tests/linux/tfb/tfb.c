@@ -0,0 +1,206 @@
+/*
+   Tests for the display framebuffer (firmware/i2cfb.c)
+
+   Runs in a PC, the bbi2c primitives are replaced by a simulated
+   SSD1306/SH1106 controller at address 0x3C (page addressing mode).
+   Checks that the display memory ends up equal to the frame and that
+   only the changed ranges are sent.
+
+   Compile with
+     gcc -Wall -I../picohost -I../../../firmware -o tfb tfb.c ../../../firmware/i2cfb.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cfb.h"
+
+#define DISP_ADDR 0x3C
+
+// Simulated time
+static uint32_t now_us;
+
+void busy_wait_us_32(uint32_t delay_us) {
+  now_us += delay_us;
+}
+
+uint32_t time_us_32(void) {
+  return now_us;
+}
+
+// Simulated display controller
+enum { BUS_IDLE, BUS_ADDR, BUS_CTRL, BUS_CMD, BUS_DATA, BUS_OTHER };
+
+static int bus_state = BUS_IDLE;
+static bool present = true;
+static bool cont;           // Co bit of the last control byte
+static bool dc;             // D/C bit of the last control byte
+static uint8_t ram[8][132];
+static int page, col;
+static int col_offset;      // 2 for SH1106
+static int bus_bytes;       // bytes written in the bus
+
+void bbi2c_start(void) {
+  bus_state = BUS_ADDR;
+}
+
+void bbi2c_restart(void) {
+  bus_state = BUS_ADDR;
+}
+
+void bbi2c_stop(void) {
+  bus_state = BUS_IDLE;
+}
+
+bool bbi2c_write(uint8_t b) {
+  bus_bytes++;
+  now_us += 90;   // 100kHz
+  switch (bus_state) {
+    case BUS_ADDR:
+      if (present && (b == (DISP_ADDR << 1))) {
+        bus_state = BUS_CTRL;
+        return true;
+      }
+      bus_state = BUS_OTHER;
+      return false;
+    case BUS_CTRL:
+      cont = (b & 0x80) != 0;
+      dc = (b & 0x40) != 0;
+      bus_state = dc ? BUS_DATA : BUS_CMD;
+      return true;
+    case BUS_CMD:
+      if ((b & 0xF0) == 0xB0) {
+        page = b & 0x07;
+      } else if ((b & 0xF0) == 0x00) {
+        col = (col & 0xF0) | (b & 0x0F);
+      } else if ((b & 0xF0) == 0x10) {
+        col = (col & 0x0F) | ((b & 0x0F) << 4);
+      }
+      if (cont) {
+        bus_state = BUS_CTRL;
+      }
+      return true;
+    case BUS_DATA:
+      if (col < 132) {
+        ram[page][col++] = b;
+      }
+      if (cont) {
+        bus_state = BUS_CTRL;
+      }
+      return true;
+  }
+  return false;
+}
+
+uint8_t bbi2c_read(bool last) {
+  return 0xFF;
+}
+
+bool bbi2c_bus_error(void) {
+  return false;
+}
+
+bool bbi2c_recover(void) {
+  return true;
+}
+
+// Compares the display memory with the frame
+static bool display_ok(void) {
+  uint8_t *frame = i2cfb_buffer();
+  for (int p = 0; p < 8; p++) {
+    if (memcmp(&ram[p][col_offset], frame + p*128, 128)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int errors = 0;
+
+static void check(bool ok, const char *msg, struct fb_result *res) {
+  printf ("%-40s ranges %3d bytes %4d bus %4d time %6uus %s\n", msg, res->ranges, res->bytes,
+          bus_bytes, res->time_us, ok ? "ok" : "FAILED");
+  if (!ok) {
+    errors++;
+  }
+  bus_bytes = 0;
+}
+
+// Main program
+int main (void) {
+  struct fb_result res;
+  uint8_t *frame = i2cfb_buffer();
+
+  if (!i2cfb_config(DISP_ADDR, FB_SSD1306, 128, 64) || (i2cfb_size() != 1024)) {
+    printf ("Config failed\n");
+    return 1;
+  }
+
+  // First frame is sent in full
+  srand(1);
+  for (int i = 0; i < 1024; i++) {
+    frame[i] = rand();
+  }
+  i2cfb_flush(false, &res);
+  check((res.status == STATUS_ADDRESS_ACK) && (res.ranges == 8) && (res.bytes == 1024) && display_ok(), 
+        "first frame", &res);
+
+  // No changes
+  i2cfb_flush(false, &res);
+  check((res.ranges == 0) && (bus_bytes == 0), "same frame", &res);
+
+  // One byte
+  frame[3*128 + 50] ^= 0x10;
+  i2cfb_flush(false, &res);
+  check((res.ranges == 1) && (res.bytes == 1) && display_ok(), "one byte", &res);
+
+  // Close changes are merged, far apart are not
+  frame[5*128 + 10] ^= 0xFF;
+  frame[5*128 + 14] ^= 0xFF;
+  frame[5*128 + 100] ^= 0xFF;
+  i2cfb_flush(false, &res);
+  check((res.ranges == 2) && (res.bytes == 6) && display_ok(), "merged ranges", &res);
+
+  // A small area (text line) in two pages
+  for (int i = 0; i < 40; i++) {
+    frame[6*128 + 20 + i] = ~frame[6*128 + 20 + i];
+    frame[7*128 + 20 + i] = ~frame[7*128 + 20 + i];
+  }
+  i2cfb_flush(false, &res);
+  check((res.ranges == 2) && (res.bytes == 80) && display_ok(), "text line", &res);
+
+  // Forced full update
+  i2cfb_flush(true, &res);
+  check((res.ranges == 8) && (res.bytes == 1024) && display_ok(), "full update", &res);
+
+  // Display not answering, next update must be full
+  present = false;
+  frame[0] ^= 1;
+  i2cfb_flush(false, &res);
+  check(res.status == STATUS_ADDRESS_NACK, "no display", &res);
+  present = true;
+  i2cfb_flush(false, &res);
+  check((res.status == STATUS_ADDRESS_ACK) && (res.ranges == 8) && display_ok(), "display back", &res);
+
+  // SH1106 (132 column memory)
+  memset(ram, 0, sizeof(ram));
+  col_offset = 2;
+  i2cfb_config(DISP_ADDR, FB_SH1106, 128, 64);
+  i2cfb_flush(false, &res);
+  check((res.ranges == 8) && display_ok(), "SH1106", &res);
+
+  // Invalid configurations
+  bool ok = !i2cfb_config(DISP_ADDR, FB_SSD1306, 128, 60) && !i2cfb_config(DISP_ADDR, FB_SSD1306, 132, 64) &&
+            !i2cfb_config(DISP_ADDR, FB_SH1106, 132, 32) &&
+            !i2cfb_config(DISP_ADDR, 7, 128, 32) && i2cfb_config(DISP_ADDR, FB_SSD1306, 128, 32) &&
+            (i2cfb_size() == 512);
+  memset(&res, 0, sizeof(res));
+  check(ok, "invalid configurations", &res);
+
+  printf ("\n%s\n", errors ? "TESTS FAILED" : "ALL TESTS PASSED");
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,371 @@
+/*
+   Tests for the gang mode (firmware/i2cgang.c)
+
+   Runs in a PC. The SIO masked GPIO functions are replaced by a virtual
+   time simulation of the buses defined in hwconfig.h, each one with a
+   simulated EEPROM (256 bytes, 8-bit address, 5ms write cycle) at 0x50.
+   - bus 3 has no device
+   - the device in bus 5 does not accept writes above address 0x07
+   - the device in bus 6 stretches the clock after each ACK
+
+   Compile with
+     gcc -Wall -DGANG_MODE=1 -I../picohost -I../../../firmware -o tgang tgang.c ../../../firmware/i2cgang.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hwconfig.h"
+#include "i2cusb.h"
+#include "i2cgang.h"
+
+#define MEM_ADDR  0x50
+
+#define NO_DEVICE     3
+#define WR_PROTECT    5
+#define STRETCH       6
+
+static const uint sda_pins[] = GANG_SDA_PINS;
+static const uint scl_pins[] = GANG_SCL_PINS;
+#define NBUS (sizeof(sda_pins)/sizeof(sda_pins[0]))
+
+// Virtual time
+static uint64_t now_ns;
+
+// Pins
+static uint32_t dir_out;
+
+// Simulated EEPROMs
+enum { T_IDLE, T_ADDR, T_WRITE, T_READ, T_IGNORE };
+
+struct target {
+  bool present;
+  bool sda_low, scl_low;
+  bool sda, scl;          // current bus levels
+  int state, bit;
+  uint8_t shift, byte, ptr;
+  bool first, nack, written;
+  uint64_t busy_until;    // write cycle
+  uint64_t stretch_until;
+  uint8_t mem[256];
+};
+
+static struct target target[NBUS];
+
+static bool bus_level(int bus, bool scl) {
+  uint pin = scl ? scl_pins[bus] : sda_pins[bus];
+  if (dir_out & (1u << pin)) {
+    return false;
+  }
+  return scl ? !target[bus].scl_low : !target[bus].sda_low;
+}
+
+static void target_scl_fall(int bus);
+
+// Checks for level changes on a bus and runs the target
+static void bus_update(int bus) {
+  struct target *t = &target[bus];
+  for (;;) {
+    bool scl = bus_level(bus, true);
+    bool sda = bus_level(bus, false);
+    if (scl != t->scl) {
+      t->scl = scl;
+      if (!t->present) {
+        continue;
+      }
+      if (scl) {
+        // sample SDA
+        if ((t->state == T_ADDR) || (t->state == T_WRITE)) {
+          if (t->bit < 8) {
+            t->shift = (t->shift << 1) | sda;
+          }
+          t->bit++;
+        } else if (t->state == T_READ) {
+          if (t->bit == 8) {
+            t->nack = sda;
+          }
+          t->bit++;
+        }
+      } else {
+        target_scl_fall(bus);
+      }
+    } else if (sda != t->sda) {
+      t->sda = sda;
+      if (t->present && scl) {
+        if (!sda) {
+          t->state = T_ADDR;    // START
+          t->bit = 0;
+          t->shift = 0;
+        } else {
+          if (t->written) {     // STOP after write starts the write cycle
+            t->busy_until = now_ns + 5000000;
+            t->written = false;
+          }
+          t->state = T_IDLE;
+        }
+      }
+    } else {
+      break;
+    }
+  }
+}
+
+static void target_scl_fall(int bus) {
+  struct target *t = &target[bus];
+  switch (t->state) {
+    case T_ADDR:
+      if (t->bit == 8) {
+        if (((t->shift >> 1) == MEM_ADDR) && (now_ns >= t->busy_until)) {
+          t->sda_low = true;
+        } else {
+          t->state = T_IGNORE;
+        }
+      } else if (t->bit == 9) {
+        t->bit = 0;
+        if (bus == STRETCH) {
+          t->scl_low = true;
+          t->stretch_until = now_ns + 20000;
+        }
+        if (t->shift & 1) {
+          t->state = T_READ;
+          t->byte = t->mem[t->ptr++];
+          t->sda_low = !(t->byte & 0x80);
+        } else {
+          t->state = T_WRITE;
+          t->first = true;
+          t->shift = 0;
+          t->sda_low = false;
+        }
+      }
+      break;
+    case T_WRITE:
+      if (t->bit == 8) {
+        if (t->first || (bus != WR_PROTECT) || (t->ptr < 8)) {
+          t->sda_low = true;
+        } else {
+          t->state = T_IGNORE;
+        }
+      } else if (t->bit == 9) {
+        t->sda_low = false;
+        if (t->first) {
+          t->ptr = t->shift;
+        } else {
+          t->mem[t->ptr++] = t->shift;
+          t->written = true;
+        }
+        t->first = false;
+        t->bit = 0;
+        t->shift = 0;
+        if (bus == STRETCH) {
+          t->scl_low = true;
+          t->stretch_until = now_ns + 20000;
+        }
+      }
+      break;
+    case T_READ:
+      if (t->bit < 8) {
+        t->sda_low = !((t->byte << t->bit) & 0x80);
+      } else if (t->bit == 8) {
+        t->sda_low = false;
+      } else if (t->nack) {
+        t->state = T_IGNORE;
+      } else {
+        t->byte = t->mem[t->ptr++];
+        t->bit = 0;
+        t->sda_low = !(t->byte & 0x80);
+      }
+      break;
+  }
+}
+
+static void update_all(void) {
+  for (int bus = 0; bus < NBUS; bus++) {
+    bus_update(bus);
+  }
+}
+
+static void advance(uint64_t ns) {
+  now_ns += ns;
+  for (int bus = 0; bus < NBUS; bus++) {
+    if (target[bus].scl_low && (now_ns >= target[bus].stretch_until)) {
+      target[bus].scl_low = false;
+      bus_update(bus);
+    }
+  }
+}
+
+// Replacements for the SDK functions
+void gpio_init(uint gpio) {
+  dir_out &= ~(1u << gpio);
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+  if (out) {
+    dir_out |= 1u << gpio;
+  } else {
+    dir_out &= ~(1u << gpio);
+  }
+  update_all();
+}
+
+void gpio_pull_up(uint gpio) {
+}
+
+void gpio_set_dir_in_masked(uint32_t mask) {
+  advance(10);
+  dir_out &= ~mask;
+  update_all();
+}
+
+void gpio_set_dir_out_masked(uint32_t mask) {
+  advance(10);
+  dir_out |= mask;
+  update_all();
+}
+
+uint32_t gpio_get_all(void) {
+  uint32_t in = 0;
+  advance(10);
+  for (int bus = 0; bus < NBUS; bus++) {
+    if (bus_level(bus, false)) {
+      in |= 1u << sda_pins[bus];
+    }
+    if (bus_level(bus, true)) {
+      in |= 1u << scl_pins[bus];
+    }
+  }
+  return in;
+}
+
+void busy_wait_us_32(uint32_t delay_us) {
+  advance(delay_us * 1000ULL);
+}
+
+uint32_t time_us_32(void) {
+  advance(10);
+  return (uint32_t) (now_ns / 1000);
+}
+
+// Replacements for the bbi2c functions used (100kHz, 25ms timeout)
+void bbi2c_get_delays(uint32_t *before, uint32_t *after) {
+  *before = 1;
+  *after = 4;
+}
+
+uint32_t bbi2c_get_timeout(void) {
+  return 25000;
+}
+
+// Request builder
+static uint8_t req[GANG_MAX_LEN];
+static uint16_t req_len;
+
+static void add_msg(uint8_t addr, uint8_t flags, uint16_t len, const uint8_t *data) {
+  struct gang_msg msg = { addr, flags, len };
+  memcpy(req + req_len, &msg, sizeof(msg));
+  req_len += sizeof(msg);
+  if (!(flags & GANG_RD)) {
+    memcpy(req + req_len, data, len);
+    req_len += len;
+  }
+}
+
+static int errors = 0;
+
+static void check(bool ok, const char *msg) {
+  printf ("%-50s %s\n", msg, ok ? "ok" : "FAILED");
+  if (!ok) {
+    errors++;
+  }
+}
+
+// Main program
+int main (void) {
+  struct gang_result res;
+  uint8_t out[GANG_MAX_LEN];
+  uint8_t page[9] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 };
+  bool ok;
+
+  for (int bus = 0; bus < NBUS; bus++) {
+    target[bus].present = bus != NO_DEVICE;
+    target[bus].sda = target[bus].scl = true;
+  }
+  i2cgang_init();
+
+  // Write a page
+  req_len = 0;
+  add_msg(MEM_ADDR, 0, sizeof(page), page);
+  uint64_t t0 = now_ns;
+  ok = i2cgang_run(0, req, req_len, &res, out);
+  uint64_t t_all = now_ns - t0;
+  check(ok && (res.buses == NBUS), "write: request accepted");
+  ok = true;
+  for (int bus = 0; bus < NBUS; bus++) {
+    if (bus == NO_DEVICE) {
+      ok = ok && (res.status[bus] == STATUS_ADDRESS_NACK) && (res.msg[bus] == 0);
+    } else {
+      ok = ok && (res.status[bus] == STATUS_ADDRESS_ACK) && !memcmp(target[bus].mem, page+1, 8);
+    }
+  }
+  check(ok, "write: status and data");
+
+  // Read it back, waiting for the write cycle
+  uint8_t zero = 0;
+  req_len = 0;
+  add_msg(MEM_ADDR, GANG_POLL | GANG_NOSTOP, 1, &zero);
+  add_msg(MEM_ADDR, GANG_RD, 8, NULL);
+  ok = i2cgang_run(0, req, req_len, &res, out);
+  check(ok && (res.out_len == 8*NBUS), "read: request accepted");
+  ok = true;
+  for (int bus = 0; bus < NBUS; bus++) {
+    if (bus == NO_DEVICE) {
+      ok = ok && (res.status[bus] == STATUS_ADDRESS_NACK) && (out[bus*8] == 0xFF);
+    } else {
+      ok = ok && (res.status[bus] == STATUS_ADDRESS_ACK) && !memcmp(out + bus*8, page+1, 8);
+    }
+  }
+  check(ok, "read: status and data");
+
+  // Write beyond the protected area
+  uint8_t wr[] = { 0x06, 0xA0, 0xA1, 0xA2, 0xA3 };
+  req_len = 0;
+  add_msg(MEM_ADDR, GANG_POLL, sizeof(wr), wr);
+  ok = i2cgang_run(0, req, req_len, &res, out);
+  ok = ok && (res.status[WR_PROTECT] == STATUS_DATA_NACK) && (res.status[0] == STATUS_ADDRESS_ACK) &&
+       (target[0].mem[9] == 0xA3) && (target[WR_PROTECT].mem[9] == 0);
+  check(ok, "data NACK on one bus");
+
+  // Only some buses
+  req_len = 0;
+  add_msg(MEM_ADDR, GANG_POLL | GANG_RD, 1, NULL);
+  ok = i2cgang_run(0x03, req, req_len, &res, out);
+  ok = ok && (res.status[0] == STATUS_ADDRESS_ACK) && (res.status[1] == STATUS_ADDRESS_ACK);
+  for (int bus = 2; bus < NBUS; bus++) {
+    ok = ok && (res.status[bus] == STATUS_IDLE);
+  }
+  check(ok, "bus selection");
+
+  // Time for one bus compared to all buses
+  req_len = 0;
+  add_msg(MEM_ADDR, GANG_POLL, sizeof(page), page);
+  t0 = now_ns;
+  i2cgang_run(0x01, req, req_len, &res, out);
+  uint64_t t_one = now_ns - t0;
+  printf ("write time: one bus %lluus, %d buses %lluus\n", (unsigned long long) t_one/1000,
+          (int) NBUS, (unsigned long long) t_all/1000);
+  check(t_all < (t_one * 3)/2, "lockstep time");
+
+  // Malformed request
+  req_len = 0;
+  add_msg(MEM_ADDR, 0, 10, page);
+  check(!i2cgang_run(0, req, req_len - 2, &res, out), "malformed request rejected");
+  req_len = 0;
+  add_msg(MEM_ADDR, GANG_RD, GANG_MAX_LEN, NULL);
+  check(!i2cgang_run(0, req, req_len, &res, out), "too much read data rejected");
+
+  printf ("\n%s\n", errors ? "TESTS FAILED" : "ALL TESTS PASSED");
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+/*
+   Test for i2cmuxd using the simulated adapter
+
+   Starts the daemon and some client processes that write and read
+   back the simulated 24C32 (each in its own area) and read the same
+   register from the simulated sensor. Checks the data and that the
+   requests were coalesced (fewer USB transfers than messages). Then
+   checks that a client that pipelines a write and a read of a register
+   gets the new value, even if another client reads it in the same window.
+
+   Compile with
+     gcc -Wall -I../../../host/linux/i2cmuxd -o tmux tmux.c ../../../host/linux/i2cmuxd/i2cmux_client.c
+
+   Use: tmux path_to_i2cmuxd
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/i2c.h>
+
+#include "i2cmux.h"
+#include "i2cmux_client.h"
+
+#define NCLIENTS 8
+#define NITER    20
+
+#define REG_ADDR 0x48
+#define MEM_ADDR 0x50
+
+static char sock_path[64];
+
+// Connects to the daemon, waiting for it to start
+static int connect_daemon(void) {
+  for (int i = 0; i < 100; i++) {
+    int fd = i2cmux_connect(sock_path);
+    if (fd >= 0) {
+      return fd;
+    }
+    usleep(20000);
+  }
+  return -1;
+}
+
+// Client process, returns the number of errors
+static int client(int num) {
+  unsigned char buf[10], data[8], reg[4];
+  int errors = 0;
+  int fd = connect_daemon();
+  if (fd < 0) {
+    return 1;
+  }
+
+  for (int iter = 0; iter < NITER; iter++) {
+    unsigned int mem = num*64 + (iter % 8)*8;
+
+    // Write 8 bytes to the memory
+    buf[0] = mem >> 8; 
+    buf[1] = mem & 0xFF;
+    for (int i = 0; i < 8; i++) {
+      buf[2+i] = num*16 + iter + i;
+    }
+    struct i2c_msg wr[] = { { MEM_ADDR, 0, 10, buf } };
+    if (i2cmux_transfer(fd, wr, 1, 0) != 0) {
+      errors++;
+    }
+
+    // Read them back
+    struct i2c_msg rd[] = { { MEM_ADDR, 0, 2, buf }, { MEM_ADDR, I2C_M_RD, 8, data } };
+    if ((i2cmux_transfer(fd, rd, 2, 0) != 0) || memcmp(data, buf + 2, 8)) {
+      errors++;
+    }
+
+    // Read a register shared by everyone
+    unsigned char ptr = 0x10;
+    struct i2c_msg rr[] = { { REG_ADDR, 0, 1, &ptr }, { REG_ADDR, I2C_M_RD, 4, reg } };
+    if ((i2cmux_transfer(fd, rr, 2, 0) != 0) || (reg[0] != 0xA0) || (reg[3] != 0xA3)) {
+      errors++;
+    }
+  }
+
+  // A device that is not there
+  unsigned char b;
+  struct i2c_msg nd[] = { { 0x33, I2C_M_RD, 1, &b } };
+  if (i2cmux_transfer(fd, nd, 1, 0) == 0) {
+    errors++;
+  }
+
+  i2cmux_close(fd);
+  return errors;
+}
+
+// Sends a register transaction without waiting for the response: writes
+// wr (pointer and data), then reads rd_len bytes if rd_len is not 0
+static void send_reg(int fd, uint32_t id, unsigned char *wr, int wr_len, int rd_len) {
+  uint8_t buf[64];
+  struct i2cmux_req req = { id, I2CMUX_XFER, 0, rd_len ? 2 : 1, 0 };
+  struct i2cmux_msg m[2] = { { REG_ADDR, 0, wr_len }, { REG_ADDR, I2C_M_RD, rd_len } };
+  int len = sizeof(req) + req.nmsgs * sizeof(m[0]);
+  memcpy(buf, &req, sizeof(req));
+  memcpy(buf + sizeof(req), m, req.nmsgs * sizeof(m[0]));
+  memcpy(buf + len, wr, wr_len);
+  send(fd, buf, len + wr_len, MSG_NOSIGNAL);
+}
+
+// Receives the response to a request sent with send_reg, returns the status
+static int recv_reg(int fd, uint32_t id, unsigned char *data, int len) {
+  uint8_t buf[64];
+  struct i2cmux_resp resp;
+  ssize_t n = recv(fd, buf, sizeof(buf), 0);
+  if (n < (ssize_t) sizeof(resp)) {
+    return -1;
+  }
+  memcpy(&resp, buf, sizeof(resp));
+  if ((resp.id != id) || (n != (ssize_t) (sizeof(resp) + resp.len)) || (resp.len != len)) {
+    return -1;
+  }
+  memcpy(data, buf + sizeof(resp), len);
+  return resp.status;
+}
+
+// A client reads a register while another one writes it and reads it back,
+// all in the same window; returns the number of errors
+static int test_pipelined(int fd) {
+  unsigned char ptr = 0x10, wr[] = { 0x10, 0xB0, 0xB1, 0xB2, 0xB3 };
+  unsigned char r1[4], r2[4];
+  int errors = 0;
+  int fd2 = connect_daemon();
+  if (fd2 < 0) {
+    return 1;
+  }
+  send_reg(fd, 1001, &ptr, 1, 4);
+  send_reg(fd2, 1002, wr, sizeof(wr), 0);
+  send_reg(fd2, 1003, &ptr, 1, 4);
+  if ((recv_reg(fd, 1001, r1, 4) != 0) || (r1[0] != 0xA0)) {
+    errors++;
+  }
+  if (recv_reg(fd2, 1002, r2, 0) != 0) {
+    errors++;
+  }
+  if ((recv_reg(fd2, 1003, r2, 4) != 0) || memcmp(r2, wr + 1, 4)) {
+    printf ("Pipelined read got %02X %02X %02X %02X\n", r2[0], r2[1], r2[2], r2[3]);
+    errors++;
+  }
+  i2cmux_close(fd2);
+  return errors;
+}
+
+// Main program
+int main (int argc, char **argv) {
+  if (argc < 2) {
+    printf ("Use: tmux path_to_i2cmuxd\n");
+    return 1;
+  }
+  snprintf(sock_path, sizeof(sock_path), "/tmp/tmux-%d.sock", getpid());
+
+  // Start the daemon
+  pid_t daemon = fork();
+  if (daemon == 0) {
+    execl(argv[1], argv[1], "-s", "-l", "300", "-w", "1000", "-p", sock_path, (char *) NULL);
+    exit(2);
+  }
+  int fd = connect_daemon();
+  if (fd < 0) {
+    printf ("Error connecting to the daemon.\n");
+    kill(daemon, SIGTERM);
+    return 2;
+  }
+
+  // Init the shared registers
+  unsigned char init[] = { 0x10, 0xA0, 0xA1, 0xA2, 0xA3 };
+  struct i2c_msg wr[] = { { REG_ADDR, 0, sizeof(init), init } };
+  i2cmux_transfer(fd, wr, 1, 0);
+
+  // Run the clients
+  for (int i = 0; i < NCLIENTS; i++) {
+    if (fork() == 0) {
+      exit(client(i));
+    }
+  }
+  int failures = 0;
+  for (int i = 0; i < NCLIENTS; i++) {
+    int status;
+    wait(&status);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+      failures++;
+    }
+  }
+
+  // Check the statistics
+  char stats[8192];
+  unsigned long long usb_transfers = 0, merged = 0;
+  if (i2cmux_stats(fd, stats, sizeof(stats)) == 0) {
+    printf ("%s", stats);
+    sscanf (strstr(stats, "usb_transfers"), "usb_transfers %llu", &usb_transfers);
+    sscanf (strstr(stats, "merged"), "merged %llu", &merged);
+  }
+  unsigned long long msgs = 1 + NCLIENTS * (NITER*5 + 1);
+  printf ("%llu messages, %llu USB transfers, %llu merged requests\n", msgs, usb_transfers, merged);
+  if ((usb_transfers == 0) || (usb_transfers >= msgs)) {
+    failures++;
+  }
+  failures += test_pipelined(fd);
+
+  i2cmux_close(fd);
+  kill(daemon, SIGTERM);
+  waitpid(daemon, NULL, 0);
+
+  printf ("%s\n", failures ? "FAILED" : "ALL TESTS PASSED");
+  return failures ? 1 : 0;
+}
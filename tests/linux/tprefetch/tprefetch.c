@@ -0,0 +1,177 @@
+/*
+   Tests for the sequential read prefetch (firmware/i2cprefetch.c)
+
+   Runs in a PC, the bbi2c primitives are replaced by a simulated 24C32
+   (4K bytes, 16-bit address) at 0x50 that can be made busy (NACK its
+   address). The host side (memory address write followed by a read, as
+   done in i2cpicousb.c) is done directly on the simulated memory.
+
+   Compile with
+     gcc -Wall -I../picohost -I../../../firmware -o tprefetch tprefetch.c ../../../firmware/i2cprefetch.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cprefetch.h"
+
+#define MEM_ADDR  0x50
+#define MEM_SIZE  4096
+
+// Simulated time
+static uint32_t now_us;
+
+void busy_wait_us_32(uint32_t delay_us) {
+  now_us += delay_us;
+}
+
+uint32_t time_us_32(void) {
+  return now_us;
+}
+
+// Simulated memory
+static uint8_t mem[MEM_SIZE];
+static uint16_t ptr;
+static bool busy;
+static bool reading;
+static int bus_reads;     // bytes read on the bus
+
+void bbi2c_start(void) {
+  reading = false;
+}
+
+void bbi2c_stop(void) {
+}
+
+bool bbi2c_write(uint8_t b) {
+  if (((b >> 1) != MEM_ADDR) || busy) {
+    return false;
+  }
+  reading = b & 1;
+  return true;
+}
+
+uint8_t bbi2c_read(bool last) {
+  if (!reading) {
+    return 0xFF;
+  }
+  bus_reads++;
+  uint8_t b = mem[ptr];
+  ptr = (ptr + 1) % MEM_SIZE;
+  return b;
+}
+
+bool bbi2c_bus_error(void) {
+  return false;
+}
+
+bool bbi2c_busy(void) {
+  return false;
+}
+
+bool bbi2c_recover(void) {
+  return true;
+}
+
+// Host read (as done by i2cpicousb.c)
+static bool host_read(uint16_t addr, uint8_t *data, uint16_t len) {
+  if (i2cprefetch_read(MEM_ADDR, addr, data, len)) {
+    return true;
+  }
+  i2cprefetch_invalidate(MEM_ADDR);
+  ptr = addr;
+  reading = true;
+  for (int i = 0; i < len; i++) {
+    data[i] = bbi2c_read(false);
+  }
+  i2cprefetch_start(MEM_ADDR, addr + len);
+  return false;
+}
+
+static void run(int steps) {
+  for (int i = 0; i < steps; i++) {
+    i2cprefetch_task();
+  }
+}
+
+static int errors = 0;
+
+static void check(bool ok, const char *msg) {
+  printf ("%-50s %s\n", msg, ok ? "ok" : "FAILED");
+  if (!ok) {
+    errors++;
+  }
+}
+
+// Main program
+int main (void) {
+  uint8_t buf[64];
+  struct i2cprefetch_stats st;
+
+  for (int i = 0; i < MEM_SIZE; i++) {
+    mem[i] = (i * 13) ^ (i >> 8);
+  }
+
+  // Not enabled
+  host_read(0, buf, 32);
+  run(10);
+  check(!host_read(32, buf, 32) && (bus_reads == 64), "prefetch disabled");
+
+  // Sequential reads
+  i2cprefetch_config(MEM_ADDR, 2, 64);
+  check(i2cprefetch_awidth(MEM_ADDR) == 2, "configuration");
+  bus_reads = 0;
+  bool ok = !host_read(0x100, buf, 32) && !memcmp(buf, mem + 0x100, 32);
+  int hits = 0;
+  for (int i = 1; i < 16; i++) {
+    run(10);
+    if (host_read(0x100 + 32*i, buf, 32)) {
+      hits++;
+    }
+    ok = ok && !memcmp(buf, mem + 0x100 + 32*i, 32);
+  }
+  check(ok, "sequential read data");
+  check(hits == 15, "sequential reads served from the buffer");
+  check(bus_reads == 32 + 64 + 14*32, "bytes read ahead");
+
+  // Read inside the buffer but not at the start
+  run(10);
+  ok = host_read(0x100 + 16*32 + 8, buf, 16) && !memcmp(buf, mem + 0x100 + 16*32 + 8, 16);
+  check(ok, "read with a gap");
+
+  // Read before the buffer
+  check(!host_read(0x100, buf, 16) && !memcmp(buf, mem + 0x100, 16), "read out of the buffer");
+
+  // Host turns around faster than the prefetch
+  check(!host_read(0x110, buf, 32) && !memcmp(buf, mem + 0x110, 32), "read before the prefetch");
+
+  // Write invalidates
+  run(10);
+  mem[0x130] = 0xA5;
+  i2cprefetch_invalidate(MEM_ADDR);
+  check(!host_read(0x130, buf, 1) && (buf[0] == 0xA5), "write invalidates the buffer");
+
+  // Busy target
+  busy = true;
+  run(10);
+  busy = false;
+  run(10);
+  check(!host_read(0x131, buf, 8) && !memcmp(buf, mem + 0x131, 8), "busy target stops the prefetch");
+
+  // Other targets are not affected
+  run(10);
+  i2cprefetch_invalidate(0x48);
+  check(host_read(0x139, buf, 8), "other target does not invalidate");
+
+  // Counters
+  i2cprefetch_get_stats(&st);
+  printf ("hits %u, misses %u, bytes %u, invalidations %u\n", st.hits, st.misses, st.bytes, st.invalidations);
+  check((st.hits == 17) && (st.misses == 5), "counters");
+
+  printf ("\n%s\n", errors ? "TESTS FAILED" : "ALL TESTS PASSED");
+  return errors ? 1 : 0;
+}
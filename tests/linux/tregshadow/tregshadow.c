@@ -0,0 +1,249 @@
+/*
+   Tests for the register shadow (host/linux/regshadow.c)
+
+   Uses the simulated adapter (see host/linux/adapter_sim.c): the sensor
+   at 0x48 is a device with 256 8-bit registers and the memory at 0x50 a
+   device with 4096 registers and 16-bit register addresses. The values
+   in the devices are checked with transactions done directly in the
+   adapter, so they do not go through the shadow.
+
+   Compile with
+     gcc -Wall -I../../../host/linux -I../../../firmware -I../picohost -o tregshadow tregshadow.c \
+         ../../../host/linux/regshadow.c ../../../host/linux/adapter.c \
+         ../../../host/linux/adapter_sim.c ../../../firmware/i2cscript.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "adapter.h"
+#include "regshadow.h"
+
+#define REG_ADDR  0x48
+#define MEM_ADDR  0x50
+#define NO_ADDR   0x49
+
+static struct adapter *ad;
+
+// Direct access to the device registers
+static void dev_write(uint8_t reg, const uint8_t *val, int n) {
+  uint8_t buf[257];
+  buf[0] = reg;
+  memcpy(buf + 1, val, n);
+  struct i2c_msg m = { REG_ADDR, 0, n + 1, buf };
+  ad->xfer(ad, &m, 1);
+}
+
+static void dev_read(uint8_t reg, uint8_t *val, int n) {
+  struct i2c_msg m[2] = {
+    { REG_ADDR, 0, 1, &reg },
+    { REG_ADDR, I2C_M_RD, n, val }
+  };
+  ad->xfer(ad, m, 2);
+}
+
+static void mem_read(uint16_t addr, uint8_t *val, int n) {
+  uint8_t buf[2] = { addr >> 8, addr & 0xFF };
+  struct i2c_msg m[2] = {
+    { MEM_ADDR, 0, 2, buf },
+    { MEM_ADDR, I2C_M_RD, n, val }
+  };
+  ad->xfer(ad, m, 2);
+}
+
+static int errors = 0;
+
+static void check(bool ok, const char *msg) {
+  printf ("%-50s %s\n", msg, ok ? "ok" : "FAILED");
+  if (!ok) {
+    errors++;
+  }
+}
+
+// Initialization of a device with 16 configuration registers: each one is
+// changed (read-modify-write) and read back, as a driver would do
+static int init_device(struct regshadow *rs, bool direct) {
+  uint8_t val;
+  for (int r = 0; r < 16; r++) {
+    if (direct) {
+      dev_read(r, &val, 1);
+      val = (val & 0xF0) | r;
+      dev_write(r, &val, 1);
+      dev_read(r, &val, 1);
+    } else {
+      regshadow_update_bits(rs, r, 0x0F, r);
+      regshadow_read(rs, r, &val, 1);
+    }
+    if ((val & 0x0F) != r) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Main program
+int main (void) {
+  uint8_t buf[256], val[256];
+  struct regshadow_stats st;
+
+  ad = adapter_sim_open(0, 1000);
+  if (ad == NULL) {
+    printf ("Cannot open the simulated adapter\n");
+    return 1;
+  }
+  check(regshadow_open(ad, REG_ADDR, 1, 1, 257, 0) == NULL, "invalid configuration rejected");
+
+  // Initialization with and without the shadow
+  for (int i = 0; i < 16; i++) {
+    buf[i] = 0xA5;
+  }
+  dev_write(0, buf, 16);
+  uint64_t n = ad->usb_transfers;
+  init_device(NULL, true);
+  uint64_t direct = ad->usb_transfers - n;
+  dev_write(0, buf, 16);
+  struct regshadow *rs = regshadow_open(ad, REG_ADDR, 1, 1, 256, 0);
+  n = ad->usb_transfers;
+  regshadow_read(rs, 0, val, 16);
+  bool ok = init_device(rs, false) == 0;
+  ok = ok && (regshadow_flush(rs) == 0);
+  uint64_t shadow = ad->usb_transfers - n;
+  dev_read(0, val, 16);
+  for (int i = 0; i < 16; i++) {
+    ok = ok && (val[i] == (0xA0 | i));
+  }
+  regshadow_get_stats(rs, &st);
+  printf ("initialization: %llu USB transfers direct, %llu with the shadow\n",
+          (unsigned long long) direct, (unsigned long long) shadow);
+  check(ok && (st.blocks_written == 1) && (st.regs_written == 16) && (st.writes_skipped == 1),
+        "initialization written in one block");
+  check(shadow * 5 <= direct, "USB transfers reduced");
+
+  // Writes are kept until a flush, then coalesced (one clean register joins two blocks)
+  buf[0] = 0x55;
+  dev_write(0x40, buf, 1);
+  regshadow_read(rs, 0x40, val, 1);
+  regshadow_get_stats(rs, &st);
+  struct regshadow_stats st0 = st;
+  for (int r = 0x3C; r < 0x48; r++) {
+    if (r != 0x40) {
+      buf[0] = r;
+      regshadow_write(rs, r, buf, 1);
+    }
+  }
+  buf[0] = 0x99;
+  regshadow_write(rs, 0x60, buf, 1);
+  dev_read(0x3C, val, 1);
+  ok = val[0] != 0x3C;
+  n = ad->usb_transfers;
+  regshadow_flush(rs);
+  n = ad->usb_transfers - n;
+  regshadow_get_stats(rs, &st);
+  dev_read(0x3C, val, 12);
+  for (int r = 0x3C; r < 0x48; r++) {
+    ok = ok && (val[r - 0x3C] == ((r == 0x40) ? 0x55 : r));
+  }
+  dev_read(0x60, val, 1);
+  ok = ok && (val[0] == 0x99);
+  check(ok && (n == 2) && (st.blocks_written - st0.blocks_written == 2) &&
+        (st.regs_written - st0.regs_written == 13), "dirty registers coalesced in a flush");
+  n = ad->usb_transfers;
+  regshadow_flush(rs);
+  check(ad->usb_transfers == n, "nothing to flush");
+
+  // Volatile registers are read through and written after the dirty registers
+  regshadow_set_volatile(rs, 0x80, 2, true);
+  buf[0] = 1;
+  dev_write(0x80, buf, 1);
+  regshadow_read(rs, 0x80, val, 1);
+  buf[0] = 2;
+  dev_write(0x80, buf, 1);
+  regshadow_read(rs, 0x80, val + 1, 1);
+  check((val[0] == 1) && (val[1] == 2), "volatile register read from the device");
+  buf[0] = 0x77;
+  regshadow_write(rs, 0x10, buf, 1);
+  n = ad->usb_transfers;
+  buf[0] = 0xC0;
+  regshadow_write(rs, 0x81, buf, 1);
+  n = ad->usb_transfers - n;
+  dev_read(0x10, val, 1);
+  dev_read(0x81, val + 1, 1);
+  check((n == 2) && (val[0] == 0x77) && (val[1] == 0xC0),
+        "volatile write flushes the dirty registers first");
+  buf[0] = 0x33;
+  regshadow_write(rs, 0x20, buf, 1);
+  n = ad->usb_transfers;
+  regshadow_read(rs, 0x80, val, 1);
+  n = ad->usb_transfers - n;
+  dev_read(0x20, val + 1, 1);
+  check((n == 2) && (val[1] == 0x33), "volatile read flushes the dirty registers first");
+
+  // Reads mixing known and unknown registers, larger than a script read
+  regshadow_invalidate(rs);
+  for (int i = 0; i < 100; i++) {
+    buf[i] = i * 3;
+  }
+  dev_write(0x90, buf, 100);
+  regshadow_read(rs, 0x90, val, 10);
+  regshadow_read(rs, 0x90, val, 100);
+  regshadow_get_stats(rs, &st0);
+  regshadow_read(rs, 0x90, val + 100, 100);
+  regshadow_get_stats(rs, &st);
+  check(!memcmp(val, buf, 100) && !memcmp(val + 100, buf, 100) &&
+        (st.reads_cached - st0.reads_cached == 100), "reads of known and unknown registers");
+
+  // Redundant writes are not sent
+  regshadow_get_stats(rs, &st0);
+  regshadow_write(rs, 0x90, buf, 100);
+  n = ad->usb_transfers;
+  regshadow_flush(rs);
+  regshadow_get_stats(rs, &st);
+  check((ad->usb_transfers == n) && (st.writes_skipped - st0.writes_skipped == 100), "writes of the same value skipped");
+
+  // Device that does not answer: the registers stay dirty
+  struct regshadow *bad = regshadow_open(ad, NO_ADDR, 1, 1, 16, 0);
+  buf[0] = 1;
+  regshadow_write(bad, 3, buf, 1);
+  check(regshadow_flush(bad) == -ENXIO, "error reported");
+  check(regshadow_flush(bad) == -ENXIO, "registers still dirty after an error");
+  regshadow_invalidate(bad);
+  check(regshadow_flush(bad) == 0, "invalidate discards the dirty registers");
+  regshadow_close(bad);
+  regshadow_close(rs);
+
+  // Device with 16-bit register addresses, writes limited to 32 registers (a page),
+  // the blocks end at the page boundaries (0x0D10-0x0D1F, 15 pages, 0x0F00-0x0F0F)
+  rs = regshadow_open(ad, MEM_ADDR, 2, 1, 4096, 32);
+  for (int i = 0; i < 256; i++) {
+    buf[i] = 255 - i;
+  }
+  regshadow_write(rs, 0x0D10, buf, 256);
+  regshadow_write(rs, 0x0E10, buf, 256);
+  regshadow_write(rs, 0x0100, buf, 1);
+  n = ad->usb_transfers;
+  ok = regshadow_flush(rs) == 0;
+  n = ad->usb_transfers - n;
+  regshadow_get_stats(rs, &st);
+  mem_read(0x0D10, val, 256);
+  ok = ok && !memcmp(val, buf, 256);
+  mem_read(0x0E10, val, 256);
+  ok = ok && !memcmp(val, buf, 256);
+  mem_read(0x0100, val, 1);
+  check(ok && (val[0] == buf[0]) && (st.blocks_written == 18), "16-bit register addresses, page limit");
+  check(n == 4, "flush larger than a script");
+
+  // 16-bit values
+  regshadow_close(rs);
+  rs = regshadow_open(ad, MEM_ADDR, 2, 2, 4096, 0);
+  ok = regshadow_update_bits(rs, 0x0200, 0x0FF0, 0x1234) == 0;
+  ok = ok && (regshadow_update_bits(rs, 0x0200, 0x000F, 0xFFFF) == 0);
+  regshadow_close(rs);
+  mem_read(0x0200, val, 2);
+  check(ok && (val[0] == 0x02) && (val[1] == 0x3F), "16-bit values written on close");
+
+  ad->close(ad);
+  printf ("\n%s\n", errors ? "TESTS FAILED" : "ALL TESTS PASSED");
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,537 @@
+/*
+   Trace driven replay benchmark
+
+   Replays a trace of real I2C traffic against the adapter and reports,
+   for each class of transaction, the latency percentiles and the time
+   the transactions waited because the previous ones were not done.
+
+   The trace can be
+   - recorded from an application with host/linux/i2ctrace (see the
+     format there)
+   - a usbmon text capture (cat /sys/kernel/debug/usb/usbmon/<bus>u) of an
+     application using the kernel driver; the CMD_I2C_IO requests are
+     converted to transactions (usbmon shows at most 32 bytes of data,
+     the rest of a long write is sent as zeros)
+
+   Transactions are started at the time in the trace (divided by the
+   rate, -r 2 replays twice as fast, -r 0 as fast as possible), one at a
+   time as a single application would. When a transaction is late its
+   delay is reported as queueing time; latency is measured from the start
+   of the transaction. The class of a transaction is the sequence of its
+   messages, with the sizes rounded up to a power of two (W2R4 is a 2 byte
+   write followed by a 3 or 4 byte read).
+
+   The adapter can be accessed
+   - through the kernel driver (I2C_RDWR ioctl in /dev/i2c-N)
+   - directly through libusb (the kernel driver is detached)
+   - simulated (see host/linux/adapter_sim.c, only the devices at 0x48
+     and 0x50 answer)
+
+   Compile with
+     gcc -Wall -O2 -I../../../host/linux -I../../../firmware -I../picohost -o treplay treplay.c \
+         ../../../host/linux/adapter.c ../../../host/linux/adapter_sim.c \
+         ../../../host/linux/adapter_usb.c ../../../firmware/i2cscript.c -lusb-1.0
+   or, without libusb, add -DNO_LIBUSB and remove adapter_usb.c and -lusb-1.0
+
+   Use
+     treplay [-i adapter_nr | -u [-d serial] | -s [-l usb_latency_us] [-k clock_khz]]
+             [-r rate] [-n repeat] [-j] trace_file
+       -i   use /dev/i2c-<adapter_nr> (kernel driver)
+       -u   use libusb
+       -s   use a simulated adapter (default)
+       -r   rate multiplier (default 1 = original timing, 0 = no waits)
+       -n   number of times to replay the trace
+       -j   output in JSON (default is CSV)
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#include "adapter.h"
+#include "i2cusb.h"
+
+#define MAX_MSGS      42    // as in the kernel driver (I2C_RDWR_IOCTL_MAX_MSGS)
+#define MAX_LEN       8192
+#define MAX_CLASSES   64
+#define CLASS_LEN     32
+
+// Trace
+struct xfer {
+  uint64_t t_us;
+  int nmsgs;
+  struct i2c_msg *msgs;
+  int cls;
+};
+
+static struct xfer *xfers;
+static int nxfers;
+
+// Classes
+struct xfer_class {
+  char name[CLASS_LEN];
+  int count;
+  int errors;
+  uint64_t *lat;
+  uint64_t *wait;
+};
+
+static struct xfer_class classes[MAX_CLASSES + 1];    // the last one is "other"
+static int nclasses;
+
+// Backend
+static int i2c_fd = -1;
+static struct adapter *ad;
+
+static int do_xfer(struct i2c_msg *msgs, int nmsgs) {
+  if (i2c_fd >= 0) {
+    struct i2c_rdwr_ioctl_data data = { msgs, nmsgs };
+    return (ioctl(i2c_fd, I2C_RDWR, &data) < 0) ? -errno : 0;
+  }
+  return ad->xfer(ad, msgs, nmsgs);
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void wait_until(uint64_t t) {
+  uint64_t now = now_us();
+  if (t > now) {
+    struct timespec ts;
+    ts.tv_sec = (t - now) / 1000000;
+    ts.tv_nsec = ((t - now) % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+  }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of a sorted array
+static uint64_t percentile(const uint64_t *v, int n, int pct) {
+  int rank = (pct * n + 99) / 100;
+  return v[(rank > 0) ? rank - 1 : 0];
+}
+
+// Finds (or creates) the class of a transaction
+static int xfer_class(const struct i2c_msg *msgs, int nmsgs) {
+  char name[CLASS_LEN] = "";
+  for (int i = 0; i < nmsgs; i++) {
+    int size = 1;
+    while (size < msgs[i].len) {
+      size *= 2;
+    }
+    if (msgs[i].len == 0) {
+      size = 0;
+    }
+    size_t l = strlen(name);
+    snprintf (name + l, sizeof(name) - l, "%c%d", (msgs[i].flags & I2C_M_RD) ? 'R' : 'W', size);
+  }
+  for (int i = 0; i < nclasses; i++) {
+    if (strcmp(classes[i].name, name) == 0) {
+      return i;
+    }
+  }
+  if (nclasses == MAX_CLASSES) {
+    strcpy(classes[MAX_CLASSES].name, "other");
+    return MAX_CLASSES;
+  }
+  strcpy(classes[nclasses].name, name);
+  return nclasses++;
+}
+
+// Adds a transaction to the trace (the messages are copied)
+static bool add_xfer(uint64_t t_us, const struct i2c_msg *msgs, int nmsgs) {
+  static int size = 0;
+  if (nxfers == size) {
+    size = size ? 2 * size : 1024;
+    xfers = realloc(xfers, size * sizeof(struct xfer));
+    if (xfers == NULL) {
+      return false;
+    }
+  }
+  struct xfer *x = &xfers[nxfers];
+  x->t_us = t_us;
+  x->nmsgs = nmsgs;
+  x->msgs = malloc(nmsgs * sizeof(struct i2c_msg));
+  if (x->msgs == NULL) {
+    return false;
+  }
+  for (int i = 0; i < nmsgs; i++) {
+    x->msgs[i] = msgs[i];
+    x->msgs[i].buf = malloc(msgs[i].len ? msgs[i].len : 1);
+    if (x->msgs[i].buf == NULL) {
+      return false;
+    }
+    if (!(msgs[i].flags & I2C_M_RD)) {
+      memcpy(x->msgs[i].buf, msgs[i].buf, msgs[i].len);
+    }
+  }
+  x->cls = xfer_class(msgs, nmsgs);
+  classes[x->cls].count++;
+  nxfers++;
+  return true;
+}
+
+// Converts hex digits to bytes, returns the number of bytes (-1 if invalid)
+static int hex_bytes(const char *s, uint8_t *buf, int max) {
+  int n = 0;
+  while (isxdigit((unsigned char) s[0])) {
+    if (!isxdigit((unsigned char) s[1]) || (n == max)) {
+      return -1;
+    }
+    char hex[3] = { s[0], s[1], 0 };
+    buf[n++] = strtoul(hex, NULL, 16);
+    s += 2;
+  }
+  return (*s == 0) ? n : -1;
+}
+
+// Parses a line of an i2ctrace file, returns false if invalid
+static bool parse_trace(char *line, uint64_t *t_us, struct i2c_msg *msgs, int *nmsgs, uint8_t *data) {
+  char *tok = strtok(line, " \t\r\n");
+  char *end;
+  *t_us = strtoull(tok, &end, 10);
+  if (*end) {
+    return false;
+  }
+  *nmsgs = 0;
+  int used = 0;
+  while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+    if (*nmsgs == MAX_MSGS) {
+      return false;
+    }
+    struct i2c_msg *m = &msgs[(*nmsgs)++];
+    m->addr = strtoul(tok, &end, 16);
+    if ((end == tok) || (m->addr > 0x7F)) {
+      return false;
+    }
+    if (*end == 'r') {
+      m->flags = I2C_M_RD;
+      m->len = strtoul(end + 1, &end, 10);
+      m->buf = NULL;
+      if (*end || (m->len > MAX_LEN)) {
+        return false;
+      }
+    } else if (*end == 'w') {
+      m->flags = 0;
+      m->buf = data + used;
+      int n = hex_bytes(end + 1, m->buf, MAX_LEN - used);
+      if (n < 0) {
+        return false;
+      }
+      m->len = n;
+      used += n;
+    } else {
+      return false;
+    }
+  }
+  return *nmsgs > 0;
+}
+
+// Parses a line of a usbmon text capture; returns 1 when a transaction is
+// complete, 0 if the line is not the end of a transaction, -1 if invalid
+static int parse_usbmon(char *line, uint64_t *t_us, struct i2c_msg *msgs, int *nmsgs, uint8_t *data) {
+  static uint64_t t_begin;
+  static int n = 0;
+  static int used = 0;
+  char *tok[64];
+  int ntok = 0;
+
+  for (char *p = strtok(line, " \t\r\n"); p && (ntok < 64); p = strtok(NULL, " \t\r\n")) {
+    tok[ntok++] = p;
+  }
+  // tag time S Cx:bus:dev:ep s type request value index length data_len [= data...]
+  if ((ntok < 11) || strcmp(tok[2], "S") || (tok[3][0] != 'C') || strcmp(tok[4], "s")) {
+    return 0;
+  }
+  uint8_t type = strtoul(tok[5], NULL, 16);
+  uint8_t request = strtoul(tok[6], NULL, 16);
+  if (((type & 0x60) != 0x40) || ((request & ~(CMD_I2C_BEGIN | CMD_I2C_END)) != CMD_I2C_IO)) {
+    return 0;
+  }
+  if ((request & CMD_I2C_BEGIN) || (n == 0) || (n == MAX_MSGS)) {
+    t_begin = strtoull(tok[1], NULL, 10);
+    n = used = 0;
+  }
+  struct i2c_msg *m = &msgs[n++];
+  m->flags = strtoul(tok[7], NULL, 16) & I2C_M_RD;
+  m->addr = strtoul(tok[8], NULL, 16) & 0x7F;
+  m->len = strtoul(tok[9], NULL, 16);
+  if ((m->len > MAX_LEN) || ((used + m->len) > MAX_LEN)) {
+    n = 0;
+    return -1;
+  }
+  if (!(m->flags & I2C_M_RD)) {
+    m->buf = data + used;
+    memset(m->buf, 0, m->len);
+    int pos = 0;
+    for (int i = 12; (i < ntok) && !strcmp(tok[11], "="); i++) {
+      uint8_t word[4];
+      int nb = hex_bytes(tok[i], word, sizeof(word));
+      for (int j = 0; (j < nb) && (pos < m->len); j++) {
+        m->buf[pos++] = word[j];
+      }
+    }
+    used += m->len;
+  }
+  if (!(request & CMD_I2C_END)) {
+    return 0;
+  }
+  *t_us = t_begin;
+  *nmsgs = n;
+  n = 0;
+  return 1;
+}
+
+// Loads a trace file (i2ctrace or usbmon)
+static bool load_trace(const char *name) {
+  static uint8_t data[MAX_LEN];
+  struct i2c_msg msgs[MAX_MSGS];
+  char line[3 * MAX_LEN];
+  uint64_t t_us, t_first = 0;
+  int nmsgs;
+  int lineno = 0;
+  bool usbmon = false;
+  bool first = true;
+
+  FILE *f = fopen(name, "r");
+  if (f == NULL) {
+    printf ("Error opening %s.\n", name);
+    return false;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    char *p = line + strspn(line, " \t");
+    if ((*p == '#') || (*p == '\n') || (*p == '\r') || (*p == 0)) {
+      continue;
+    }
+    if (first) {
+      // usbmon lines start with the URB tag, 8 or 16 hex digits
+      size_t l = strspn(p, "0123456789abcdef");
+      usbmon = (l >= 8) && (p[l] == ' ') && (strchr(p + l, ':') != NULL);
+    }
+    int ret;
+    if (usbmon) {
+      ret = parse_usbmon(p, &t_us, msgs, &nmsgs, data);
+    } else {
+      ret = parse_trace(p, &t_us, msgs, &nmsgs, data) ? 1 : -1;
+    }
+    if (ret < 0) {
+      printf ("%s: invalid line %d.\n", name, lineno);
+      fclose(f);
+      return false;
+    }
+    if (ret == 0) {
+      continue;
+    }
+    if (first) {
+      t_first = t_us;
+      first = false;
+    }
+    if (!add_xfer((t_us >= t_first) ? t_us - t_first : 0, msgs, nmsgs)) {
+      printf ("Out of memory.\n");
+      fclose(f);
+      return false;
+    }
+  }
+  fclose(f);
+  if (nxfers == 0) {
+    printf ("%s: no transactions.\n", name);
+    return false;
+  }
+  return true;
+}
+
+// Replays the trace
+static void replay(double rate, int repeat) {
+  uint64_t t_trace = xfers[nxfers - 1].t_us;
+  for (int i = 0; i <= MAX_CLASSES; i++) {
+    struct xfer_class *c = &classes[i];
+    if (c->count) {
+      c->lat = malloc(c->count * repeat * sizeof(uint64_t));
+      c->wait = malloc(c->count * repeat * sizeof(uint64_t));
+      if ((c->lat == NULL) || (c->wait == NULL)) {
+        printf ("Out of memory.\n");
+        exit(3);
+      }
+      c->count = 0;
+    }
+  }
+
+  uint64_t start = now_us();
+  for (int r = 0; r < repeat; r++) {
+    for (int i = 0; i < nxfers; i++) {
+      struct xfer *x = &xfers[i];
+      struct xfer_class *c = &classes[x->cls];
+      uint64_t due = start;
+      if (rate > 0) {
+        due += (uint64_t) ((r * t_trace + x->t_us) / rate);
+        wait_until(due);
+      }
+      uint64_t t0 = now_us();
+      int ret = do_xfer(x->msgs, x->nmsgs);
+      uint64_t t1 = now_us();
+      if (ret != 0) {
+        c->errors++;
+        continue;
+      }
+      c->lat[c->count] = t1 - t0;
+      c->wait[c->count] = (rate > 0) && (t0 > due) ? t0 - due : 0;
+      c->count++;
+    }
+  }
+}
+
+// Prints the results of a class
+static void report(const char *backend, const char *name, int count, int errors,
+                   uint64_t *lat, uint64_t *wait, bool json, bool first) {
+  uint64_t p50 = 0, p90 = 0, p99 = 0, max = 0, w50 = 0, w99 = 0, wmax = 0;
+  if (count) {
+    qsort(lat, count, sizeof(lat[0]), cmp_u64);
+    qsort(wait, count, sizeof(wait[0]), cmp_u64);
+    p50 = percentile(lat, count, 50);
+    p90 = percentile(lat, count, 90);
+    p99 = percentile(lat, count, 99);
+    max = lat[count - 1];
+    w50 = percentile(wait, count, 50);
+    w99 = percentile(wait, count, 99);
+    wmax = wait[count - 1];
+  }
+  if (json) {
+    printf ("%s  {\"backend\": \"%s\", \"class\": \"%s\", \"count\": %d, \"errors\": %d, "
+            "\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu, "
+            "\"wait_p50_us\": %llu, \"wait_p99_us\": %llu, \"wait_max_us\": %llu}",
+            first ? "" : ",\n", backend, name, count, errors,
+            (unsigned long long) p50, (unsigned long long) p90, (unsigned long long) p99,
+            (unsigned long long) max, (unsigned long long) w50, (unsigned long long) w99,
+            (unsigned long long) wmax);
+  } else {
+    printf ("%s,%s,%d,%d,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+            backend, name, count, errors,
+            (unsigned long long) p50, (unsigned long long) p90, (unsigned long long) p99,
+            (unsigned long long) max, (unsigned long long) w50, (unsigned long long) w99,
+            (unsigned long long) wmax);
+  }
+}
+
+// Main program
+int main (int argc, char **argv) {
+  int adapter_nr = -1;
+  bool use_usb = false;
+  const char *serial = NULL;
+  uint32_t latency_us = 500;
+  uint32_t clock_khz = 100;
+  double rate = 1.0;
+  int repeat = 1;
+  bool json = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:ud:sl:k:r:n:j")) != -1) {
+    switch (opt) {
+      case 'i': adapter_nr = atoi(optarg); break;
+      case 'u': use_usb = true; break;
+      case 'd': serial = optarg; break;
+      case 's': use_usb = false; adapter_nr = -1; break;
+      case 'l': latency_us = atoi(optarg); break;
+      case 'k': clock_khz = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'n': repeat = atoi(optarg); break;
+      case 'j': json = true; break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if ((optind != (argc - 1)) || (rate < 0) || (repeat < 1)) {
+    printf ("Use: treplay [-i adapter_nr | -u [-d serial] | -s [-l usb_latency_us] [-k clock_khz]]\n"
+            "               [-r rate] [-n repeat] [-j] trace_file\n");
+    return 1;
+  }
+  if (!load_trace(argv[optind])) {
+    return 1;
+  }
+
+  // open the backend
+  const char *backend;
+  if (adapter_nr >= 0) {
+    char dev[32];
+    snprintf (dev, sizeof(dev), "/dev/i2c-%d", adapter_nr);
+    i2c_fd = open(dev, O_RDWR);
+    if (i2c_fd < 0) {
+      printf ("Error opening %s.\n", dev);
+      return 2;
+    }
+    backend = "i2c-dev";
+  } else if (use_usb) {
+    #ifndef NO_LIBUSB
+    ad = adapter_usb_open(serial);
+    #else
+    (void) serial;
+    printf ("Compiled without libusb, only the simulated adapter (-s) is available.\n");
+    #endif
+    backend = "libusb";
+  } else {
+    ad = adapter_sim_open(latency_us, clock_khz);
+    backend = "sim";
+  }
+  if ((i2c_fd < 0) && (ad == NULL)) {
+    printf ("Error opening adapter.\n");
+    return 2;
+  }
+
+  replay(rate, repeat);
+
+  // results for each class and for all transactions
+  uint64_t *lat = malloc(nxfers * repeat * sizeof(uint64_t));
+  uint64_t *wait = malloc(nxfers * repeat * sizeof(uint64_t));
+  if ((lat == NULL) || (wait == NULL)) {
+    return 3;
+  }
+  int count = 0, errors = 0;
+  if (json) {
+    printf ("[\n");
+  } else {
+    printf ("backend,class,count,errors,p50_us,p90_us,p99_us,max_us,wait_p50_us,wait_p99_us,wait_max_us\n");
+  }
+  for (int i = 0; i <= MAX_CLASSES; i++) {
+    struct xfer_class *c = &classes[i];
+    if (c->lat == NULL) {
+      continue;
+    }
+    memcpy(lat + count, c->lat, c->count * sizeof(uint64_t));
+    memcpy(wait + count, c->wait, c->count * sizeof(uint64_t));
+    count += c->count;
+    errors += c->errors;
+    report(backend, c->name, c->count, c->errors, c->lat, c->wait, json, i == 0);
+  }
+  report(backend, "all", count, errors, lat, wait, json, false);
+  if (json) {
+    printf ("\n]\n");
+  }
+
+  free(lat);
+  free(wait);
+  if (ad) {
+    ad->close(ad);
+  }
+  if (i2c_fd >= 0) {
+    close(i2c_fd);
+  }
+  return 0;
+}
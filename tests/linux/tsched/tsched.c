@@ -0,0 +1,453 @@
+/*
+   Tests for the job scheduler (firmware/i2csched.c)
+
+   Runs in a PC, the bbi2c primitives are replaced by a simulated bus
+   (100kHz, each byte takes 90us) with
+   - a 24C32 EEPROM at 0x50 (16-bit address, 32 byte pages, 5ms write cycle)
+   - a sensor at 0x48 that returns its register address in each byte
+   - a stuck device at 0x30 that holds SCL low after its address
+   and one gang bus (i2cgang_run is replaced) with a 24C02 EEPROM at 0x50
+   (8-bit address, 16 byte pages, 5ms write cycle)
+   The bulk endpoints are replaced by buffers.
+
+   Checks that a high priority job waits at most one chunk of a long low
+   priority job, that the data is correct, deadlines, aborts, that jobs
+   on different buses end out of order and the counters.
+
+   Compile with
+     gcc -Wall -I../picohost -I../../../firmware -o tsched tsched.c ../../../firmware/i2csched.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tusb.h"
+#include "pico/stdlib.h"
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "usbstream.h"
+#include "i2csched.h"
+#include "i2cgang.h"
+
+#define MEM_ADDR    0x50
+#define SENSOR_ADDR 0x48
+#define STUCK_ADDR  0x30
+#define BYTE_US     90
+
+// Simulated time
+static uint32_t now_us;
+
+void busy_wait_us_32(uint32_t delay_us) {
+  now_us += delay_us;
+}
+
+uint32_t time_us_32(void) {
+  return now_us;
+}
+
+// Simulated bus
+static enum { IDLE, ADDR, WRITE, READ } state;
+static uint8_t target;
+static int wr_count;
+static uint16_t ptr;
+static bool written;
+static uint32_t busy_until;
+static uint8_t sensor_reg;
+static uint8_t mem[4096];
+static int transactions;
+static bool bus_error;
+static uint32_t stretch_timeout = 25000;
+
+void bbi2c_start(void) {
+  now_us += 10;
+  bus_error = false;
+  state = ADDR;
+  transactions++;
+}
+
+void bbi2c_restart(void) {
+  now_us += 10;
+  state = ADDR;
+}
+
+void bbi2c_stop(void) {
+  now_us += 10;
+  if (written) {
+    busy_until = now_us + 5000;
+    written = false;
+  }
+  state = IDLE;
+}
+
+bool bbi2c_write(uint8_t b) {
+  now_us += BYTE_US;
+  switch (state) {
+    case ADDR:
+      target = b >> 1;
+      if (target == STUCK_ADDR) {
+        now_us += stretch_timeout;    // clock stretch timeout
+        bus_error = true;
+        state = IDLE;
+        return false;
+      }
+      if (((target == MEM_ADDR) && (now_us >= busy_until)) || (target == SENSOR_ADDR)) {
+        state = (b & 1) ? READ : WRITE;
+        wr_count = 0;
+        return true;
+      }
+      state = IDLE;
+      return false;
+    case WRITE:
+      if (target == SENSOR_ADDR) {
+        sensor_reg = b;
+      } else if (wr_count == 0) {
+        ptr = (b << 8) & 0x0F00;
+      } else if (wr_count == 1) {
+        ptr |= b;
+      } else {
+        mem[ptr] = b;
+        ptr = (ptr & 0xFE0) | ((ptr + 1) & 0x1F);   // wraps in the page
+        written = true;
+      }
+      wr_count++;
+      return true;
+    default:
+      return false;
+  }
+}
+
+uint8_t bbi2c_read(bool last) {
+  now_us += BYTE_US;
+  if (state != READ) {
+    return 0xFF;
+  }
+  if (target == SENSOR_ADDR) {
+    return sensor_reg;
+  }
+  uint8_t b = mem[ptr];
+  ptr = (ptr + 1) & 0xFFF;
+  return b;
+}
+
+bool bbi2c_bus_error(void) {
+  return bus_error;
+}
+
+bool bbi2c_busy(void) {
+  return false;
+}
+
+bool bbi2c_recover(void) {
+  bus_error = false;
+  state = IDLE;
+  return true;
+}
+
+// Prefetch is not tested here
+void i2cprefetch_invalidate(uint8_t addr) {
+}
+
+uint32_t bbi2c_swap_timeout(uint32_t timeout_us) {
+  uint32_t prev = stretch_timeout;
+  stretch_timeout = timeout_us;
+  return prev;
+}
+
+uint32_t bbi2c_get_timeout(void) {
+  return stretch_timeout;
+}
+
+// Gang bus
+static uint8_t gmem[256];
+static uint8_t gptr;
+static uint32_t gbusy_until;
+
+uint8_t i2cgang_buses(void) {
+  return 1;
+}
+
+bool i2cgang_run(uint8_t buses, const uint8_t *req, uint16_t len,
+                 struct gang_result *res, uint8_t *out) {
+  struct gang_msg msg;
+  uint16_t pos = 0;
+  memset(res, 0, sizeof(*res));
+  res->buses = 1;
+  res->status[0] = STATUS_ADDRESS_ACK;
+  for (uint8_t i = 0; pos < len; i++) {
+    memcpy(&msg, req + pos, sizeof(msg));
+    pos += sizeof(msg);
+    now_us += BYTE_US + 20;
+    if ((msg.addr != MEM_ADDR) || (now_us < gbusy_until)) {
+      res->status[0] = STATUS_ADDRESS_NACK;
+      res->msg[0] = i;
+      return true;
+    }
+    now_us += msg.len * BYTE_US;
+    if (msg.flags & GANG_RD) {
+      for (int j = 0; j < msg.len; j++) {
+        out[res->out_len++] = gmem[gptr++];
+      }
+    } else {
+      gptr = req[pos];
+      for (int j = 1; j < msg.len; j++) {
+        gmem[(gptr & 0xF0) | ((gptr + j - 1) & 0x0F)] = req[pos + j];
+      }
+      if (msg.len > 1) {
+        gbusy_until = now_us + 5000;
+      }
+      pos += msg.len;
+    }
+  }
+  return true;
+}
+
+// Bulk OUT
+static uint8_t out_buf[4096];
+static uint32_t out_len, out_pos;
+
+uint32_t tud_vendor_available(void) {
+  return out_len - out_pos;
+}
+
+uint32_t tud_vendor_read(void *buffer, uint32_t bufsize) {
+  if (bufsize > (out_len - out_pos)) {
+    bufsize = out_len - out_pos;
+  }
+  memcpy(buffer, out_buf + out_pos, bufsize);
+  out_pos += bufsize;
+  return bufsize;
+}
+
+static void send_job(uint8_t id, uint8_t prio, uint8_t op, uint8_t addr, uint8_t flags,
+                     const uint8_t *data, uint8_t wlen, uint16_t rlen, uint16_t mem_addr, uint8_t chunk,
+                     uint32_t deadline_us) {
+  struct job_req req = { id, prio, op, addr, flags, wlen, rlen, mem_addr, chunk, 0, deadline_us };
+  memcpy(out_buf + out_len, &req, sizeof(req));
+  out_len += sizeof(req);
+  memcpy(out_buf + out_len, data, wlen);
+  out_len += wlen;
+}
+
+static void send_job_bus(uint8_t id, uint8_t bus, uint8_t op, uint8_t flags, const uint8_t *data,
+                         uint8_t wlen, uint16_t rlen, uint16_t mem_addr, uint8_t chunk) {
+  struct job_req req = { id, JOB_PRIO_LOW, op, MEM_ADDR, flags, wlen, rlen, mem_addr, chunk, bus, 0 };
+  memcpy(out_buf + out_len, &req, sizeof(req));
+  out_len += sizeof(req);
+  memcpy(out_buf + out_len, data, wlen);
+  out_len += wlen;
+}
+
+// Records (bulk IN)
+#define MAX_RECORDS 100
+
+static struct {
+  uint8_t type;
+  uint8_t len;
+  uint8_t data[255];
+  int transactions;     // transactions done when the record was sent
+} records[MAX_RECORDS];
+static int nrecords;
+
+uint32_t usbstream_available(void) {
+  return 256;
+}
+
+bool usbstream_send(uint8_t type, const void *data, uint8_t len) {
+  if (nrecords == MAX_RECORDS) {
+    return false;
+  }
+  records[nrecords].type = type;
+  records[nrecords].len = len;
+  memcpy(records[nrecords].data, data, len);
+  records[nrecords].transactions = transactions;
+  nrecords++;
+  return true;
+}
+
+// Returns the index of the DONE record for a job, -1 if not found
+static int find_done(uint8_t id, struct job_done_record *done) {
+  for (int i = 0; i < nrecords; i++) {
+    if ((records[i].type == RECORD_JOB_DONE) && (records[i].data[0] == id)) {
+      memcpy(done, records[i].data, sizeof(*done));
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Collects the data read by a job
+static int job_data(uint8_t id, uint8_t *buf) {
+  int total = 0;
+  for (int i = 0; i < nrecords; i++) {
+    struct job_data_record hdr;
+    memcpy(&hdr, records[i].data, sizeof(hdr));
+    if ((records[i].type == RECORD_JOB_DATA) && (hdr.id == id)) {
+      int len = records[i].len - sizeof(hdr);
+      memcpy(buf + hdr.offset, records[i].data + sizeof(hdr), len);
+      total += len;
+    }
+  }
+  return total;
+}
+
+static void run(int steps) {
+  for (int i = 0; i < steps; i++) {
+    i2csched_task();
+    now_us += 20;
+  }
+}
+
+static int errors = 0;
+
+static void check(bool ok, const char *msg) {
+  printf ("%-50s %s\n", msg, ok ? "ok" : "FAILED");
+  if (!ok) {
+    errors++;
+  }
+}
+
+// Main program
+int main (void) {
+  struct job_done_record done;
+  uint8_t buf[4096];
+
+  for (int i = 0; i < sizeof(mem); i++) {
+    mem[i] = (i * 7) ^ (i >> 8);
+  }
+
+  // Long low priority read, then a short high priority one
+  send_job(1, JOB_PRIO_LOW, JOB_MEM_READ, MEM_ADDR, JOB_MEM16, NULL, 0, 1024, 0x100, 32, 0);
+  run(3);
+  int before = transactions;
+  uint8_t reg = 0x5A;
+  send_job(2, JOB_PRIO_HIGH, JOB_XFER, SENSOR_ADDR, 0, &reg, 1, 2, 0, 0, 0);
+  run(200);
+  int hi = find_done(2, &done);
+  check((hi >= 0) && (done.status == STATUS_ADDRESS_ACK) && (done.count == 3), "high priority job done");
+  check((hi >= 0) && (records[hi].transactions - before) <= 2, "high priority waited at most one chunk");
+  printf ("high priority job: wait %uus, total %uus\n", done.wait_us, done.total_us);
+  check(done.total_us < (32 + 4) * BYTE_US + 2 * (3 * BYTE_US + 100), "high priority latency");
+  check((job_data(2, buf) == 2) && (buf[0] == 0x5A) && (buf[1] == 0x5A), "high priority data");
+
+  int lo = find_done(1, &done);
+  check((lo > hi) && (done.status == STATUS_ADDRESS_ACK) && (done.count == 1024), "low priority job done");
+  check((job_data(1, buf) == 1024) && !memcmp(buf, mem + 0x100, 1024), "low priority data");
+
+  // Page write, with a read while the memory is busy
+  uint8_t page[40];
+  for (int i = 0; i < sizeof(page); i++) {
+    page[i] = 0xC0 + i;
+  }
+  nrecords = 0;
+  send_job(3, JOB_PRIO_LOW, JOB_MEM_WRITE, MEM_ADDR, JOB_MEM16, page, sizeof(page), 0, 0x0210, 32, 0);
+  run(2);
+  send_job(4, JOB_PRIO_HIGH, JOB_XFER, SENSOR_ADDR, 0, &reg, 1, 1, 0, 0, 0);
+  run(1000);
+  check((find_done(4, &done) >= 0) && (done.status == STATUS_ADDRESS_ACK), "job served during write cycle");
+  int wr = find_done(3, &done);
+  check((wr >= 0) && (done.status == STATUS_ADDRESS_ACK) && (done.count == sizeof(page)) &&
+        !memcmp(mem + 0x210, page, sizeof(page)), "page write");
+
+  // Jobs of the same class and bus use the write cycle, except for the same target
+  nrecords = 0;
+  send_job(32, JOB_PRIO_LOW, JOB_MEM_WRITE, MEM_ADDR, JOB_MEM16, page, sizeof(page), 0, 0x0310, 32, 0);
+  send_job(33, JOB_PRIO_LOW, JOB_MEM_READ, MEM_ADDR, JOB_MEM16, NULL, 0, 8, 0x0310, 8, 0);
+  send_job(34, JOB_PRIO_LOW, JOB_XFER, SENSOR_ADDR, 0, &reg, 1, 1, 0, 0, 0);
+  run(1000);
+  int d32 = find_done(32, &done);
+  bool waited = (d32 >= 0) && (done.status == STATUS_ADDRESS_ACK) && (find_done(33, &done) > d32);
+  int d34 = find_done(34, &done);
+  check((d34 >= 0) && (d34 < d32) && (done.status == STATUS_ADDRESS_ACK), "same bus job served during write cycle");
+  check(waited, "same target job waits for the write");
+
+  // Invalid jobs
+  nrecords = 0;
+  send_job(5, JOB_PRIO_LOW, JOB_MEM_READ, MEM_ADDR, 0, NULL, 0, 16, 0, JOB_MAX_CHUNK+1, 0);
+  send_job(6, 7, JOB_XFER, SENSOR_ADDR, 0, &reg, 1, 1, 0, 0, 0);
+  send_job(7, JOB_PRIO_LOW, JOB_XFER, 0x20, 0, &reg, 1, 0, 0, 0, 0);
+  run(10);
+  check((find_done(5, &done) >= 0) && (done.status == JOB_STATUS_REJECTED), "invalid chunk rejected");
+  check((find_done(6, &done) >= 0) && (done.status == JOB_STATUS_REJECTED), "invalid priority rejected");
+  check((find_done(7, &done) >= 0) && (done.status == STATUS_ADDRESS_NACK), "address NACK");
+
+  // Too much data, the rest of the job is dropped
+  uint8_t big[JOB_MAX_DATA + 72];
+  memset(big, 0xFF, sizeof(big));
+  nrecords = 0;
+  send_job(30, JOB_PRIO_LOW, JOB_XFER, SENSOR_ADDR, 0, big, sizeof(big), 0, 0, 0, 0);
+  send_job(31, JOB_PRIO_LOW, JOB_XFER, 0x20, 0, &reg, 1, 0, 0, 0, 0);
+  run(10);
+  check((find_done(30, &done) >= 0) && (done.status == JOB_STATUS_REJECTED) &&
+        (find_done(31, &done) >= 0) && (done.status == STATUS_ADDRESS_NACK) &&
+        (nrecords == 2), "oversized job rejected, next job in sync");
+
+  // Stuck device with a deadline
+  nrecords = 0;
+  uint32_t t0 = now_us;
+  send_job(8, JOB_PRIO_HIGH, JOB_XFER, STUCK_ADDR, 0, &reg, 1, 1, 0, 0, 2000);
+  run(1);
+  check((find_done(8, &done) >= 0) && (done.status == JOB_STATUS_DEADLINE) &&
+        ((now_us - t0) < 2500), "stuck device fails at the deadline");
+  check(stretch_timeout == 25000, "stretch timeout restored");
+
+  // Deadline expires while waiting in the queue (checked between chunks)
+  nrecords = 0;
+  send_job(9, JOB_PRIO_LOW, JOB_MEM_READ, MEM_ADDR, JOB_MEM16, NULL, 0, 512, 0, 64, 0);
+  send_job(10, JOB_PRIO_LOW, JOB_XFER, SENSOR_ADDR, 0, &reg, 1, 1, 0, 0, 1000);
+  run(100);
+  check((find_done(10, &done) >= 0) && (done.status == JOB_STATUS_DEADLINE) &&
+        (done.total_us < 1000 + (64 + 4) * BYTE_US + 100) &&
+        (find_done(10, &done) < find_done(9, &done)), "queued job expired after one chunk");
+
+  // Abort a long job between chunks
+  nrecords = 0;
+  send_job(11, JOB_PRIO_LOW, JOB_MEM_READ, MEM_ADDR, JOB_MEM16, NULL, 0, 1024, 0, 32, 0);
+  send_job(12, JOB_PRIO_LOW, JOB_XFER, SENSOR_ADDR, 0, &reg, 1, 1, 0, 0, 0);
+  run(4);
+  int before_abort = transactions;
+  check(i2csched_abort(11) == 1, "abort found the job");
+  run(10);
+  check((find_done(11, &done) >= 0) && (done.status == JOB_STATUS_ABORTED) &&
+        (done.count > 0) && (done.count < 1024), "job aborted");
+  check((find_done(12, &done) >= 0) && (done.status == STATUS_ADDRESS_ACK) &&
+        ((transactions - before_abort) == 1), "next job runs after the abort");
+  check(i2csched_abort(11) == 0, "abort of unknown job");
+
+  // Jobs on two buses
+  nrecords = 0;
+  uint8_t gpage[40];
+  for (int i = 0; i < sizeof(gpage); i++) {
+    gpage[i] = 0x30 + i;
+  }
+  uint8_t zero = 0;
+  send_job_bus(20, 1, JOB_MEM_WRITE, 0, gpage, sizeof(gpage), 0, 0x20, 16);
+  send_job_bus(21, 0, JOB_MEM_READ, JOB_MEM16, NULL, 0, 128, 0, 32);
+  send_job_bus(22, 1, JOB_XFER, 0, &zero, 1, 8, 0, 0);
+  send_job_bus(23, 2, JOB_XFER, 0, &zero, 1, 8, 0, 0);
+  run(2000);
+  int d20 = find_done(20, &done);
+  bool ok = (d20 >= 0) && (done.status == STATUS_ADDRESS_ACK) && !memcmp(gmem + 0x20, gpage, sizeof(gpage));
+  printf ("gang bus write: total %uus, on the bus %uus\n", done.total_us, done.bus_us);
+  ok = ok && (done.bus_us < done.total_us / 2);
+  check(ok, "write on the gang bus");
+  int d21 = find_done(21, &done);
+  check((d21 >= 0) && (done.status == STATUS_ADDRESS_ACK) && (job_data(21, buf) == 128) &&
+        !memcmp(buf, mem, 128), "read on the main bus");
+  check((d21 >= 0) && (d21 < d20), "jobs end out of order");
+  int d22 = find_done(22, &done);
+  check(d22 > d20, "same bus jobs end in order");
+  check((find_done(23, &done) >= 0) && (done.status == JOB_STATUS_REJECTED), "invalid bus rejected");
+
+  // Counters
+  struct i2csched_stats st;
+  i2csched_get_stats(&st);
+  check((st.cls[JOB_PRIO_HIGH].jobs == 3) && (st.cls[JOB_PRIO_LOW].jobs == 12) &&
+        (st.cls[JOB_PRIO_LOW].depth == 0) && (st.cls[JOB_PRIO_HIGH].max_depth == 1) &&
+        (st.cls[JOB_PRIO_HIGH].expired == 1) && (st.cls[JOB_PRIO_LOW].expired == 1) &&
+        (st.cls[JOB_PRIO_LOW].aborted == 1), "counters");
+  printf ("wait max: high %uus, low %uus\n", st.cls[JOB_PRIO_HIGH].wait_us_max, st.cls[JOB_PRIO_LOW].wait_us_max);
+
+  printf ("\n%s\n", errors ? "TESTS FAILED" : "ALL TESTS PASSED");
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,329 @@
+/*
+   Tests for the I2C script interpreter (firmware/i2cscript.c)
+
+   Runs in a PC, the bbi2c primitives are replaced by a simulated
+   device with 16 registers at address 0x48. Register 0 is a status
+   register that reports "ready" (bit 0) after a few reads. The device
+   can also NACK its address a few times (as in a write cycle).
+
+   Compile with
+     gcc -Wall -I../picohost -I../../../firmware -o tscript tscript.c ../../../firmware/i2cscript.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "bbi2c.h"
+#include "i2cscript.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define DEV_ADDR 0x48
+
+// Simulated time
+static uint32_t now_us;
+
+void busy_wait_us_32(uint32_t delay_us) {
+  now_us += delay_us;
+}
+
+uint32_t time_us_32(void) {
+  return now_us++;
+}
+
+// Simulated device
+enum { BUS_IDLE, BUS_ADDR, BUS_PTR, BUS_WRITE, BUS_READ, BUS_OTHER };
+
+static int bus_state = BUS_IDLE;
+static uint8_t regs[16];
+static uint8_t ptr;
+static int status_reads;    // reads of register 0 before it reports ready
+static int busy_nacks;      // address NACKs before the device answers
+static int stops;
+
+void bbi2c_start(void) {
+  bus_state = BUS_ADDR;
+}
+
+void bbi2c_restart(void) {
+  bus_state = BUS_ADDR;
+}
+
+void bbi2c_stop(void) {
+  bus_state = BUS_IDLE;
+  stops++;
+}
+
+bool bbi2c_write(uint8_t b) {
+  switch (bus_state) {
+    case BUS_ADDR:
+      if (((b >> 1) != DEV_ADDR) || (busy_nacks && busy_nacks--)) {
+        bus_state = BUS_OTHER;
+        return false;
+      }
+      bus_state = (b & 1) ? BUS_READ : BUS_PTR;
+      return true;
+    case BUS_PTR:
+      ptr = b & 0x0F;
+      bus_state = BUS_WRITE;
+      return true;
+    case BUS_WRITE:
+      regs[ptr] = b;
+      ptr = (ptr + 1) & 0x0F;
+      return true;
+  }
+  return false;
+}
+
+uint8_t bbi2c_read(bool last) {
+  uint8_t b = 0xFF;
+  if (bus_state == BUS_READ) {
+    if (ptr == 0) {
+      b = (status_reads > 0) ? 0 : 1;
+      status_reads--;
+    } else {
+      b = regs[ptr];
+    }
+    ptr = (ptr + 1) & 0x0F;
+  }
+  return b;
+}
+
+bool bbi2c_bus_error(void) {
+  return false;
+}
+
+bool bbi2c_recover(void) {
+  bus_state = BUS_IDLE;
+  return true;
+}
+
+// Simple assembler
+static uint8_t code[SCRIPT_MAX_LEN];
+static uint16_t code_len;
+
+static void emit(int n, ...) {
+  __builtin_va_list ap;
+  __builtin_va_start(ap, n);
+  for (int i = 0; i < n; i++) {
+    code[code_len++] = (uint8_t) __builtin_va_arg(ap, int);
+  }
+  __builtin_va_end(ap);
+}
+
+// Emits a 16-bit value, returns its position (for patching jumps)
+static uint16_t emit16(uint16_t val) {
+  uint16_t pos = code_len;
+  code[code_len++] = val & 0xFF;
+  code[code_len++] = val >> 8;
+  return pos;
+}
+
+static void patch16(uint16_t pos, uint16_t val) {
+  code[pos] = val & 0xFF;
+  code[pos+1] = val >> 8;
+}
+
+// Emits code to read n bytes from a register
+static void emit_read_reg(uint8_t reg, uint8_t n) {
+  emit(5, OP_START, OP_ADDR, DEV_ADDR << 1, OP_WRITE, 1);
+  emit(1, reg);
+  emit(5, OP_RESTART, OP_ADDR, (DEV_ADDR << 1) | 1, OP_READ, n);
+}
+
+static void reset(void) {
+  memset(code, 0, sizeof(code));
+  code_len = 0;
+  memset(regs, 0, sizeof(regs));
+  bus_state = BUS_IDLE;
+  status_reads = 0;
+  busy_nacks = 0;
+  stops = 0;
+  now_us = 0;
+}
+
+static int failures = 0;
+
+static void check(int cond, const char *msg) {
+  printf("%s: %s\n", cond ? "OK  " : "FAIL", msg);
+  if (!cond) {
+    failures++;
+  }
+}
+
+// Wait for ready, read two registers, write a third if the first is > 0x10
+static void test_poll(void) {
+  struct i2c_script_result res;
+  uint8_t out[SCRIPT_MAX_OUT];
+
+  reset();
+  status_reads = 3;
+  regs[1] = 0x20;
+  regs[2] = 0x33;
+
+  emit(2, OP_SETCNT, 0); emit16(10);
+  uint16_t loop = code_len;
+  emit_read_reg(0, 1);
+  emit(4, OP_BRANCH, COND_SET, 0, 0x01); uint16_t to_ready = emit16(0);
+  emit(1, OP_WAIT_US); emit16(100);
+  emit(2, OP_LOOP, 0); emit16(loop);
+  emit(2, OP_FAIL, 0x55);
+  patch16(to_ready, code_len);
+  emit_read_reg(1, 2);
+  emit(3, OP_OUT, 0, 2);
+  emit(4, OP_BRANCH, COND_GT, 0, 0x10); uint16_t to_write = emit16(0);
+  emit(1, OP_END);
+  patch16(to_write, code_len);
+  emit(5, OP_START, OP_ADDR, DEV_ADDR << 1, OP_WRITE, 2);
+  emit(2, 5, 0xAA);
+  emit(2, OP_STOP, OP_END);
+
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_OK, "poll: status");
+  check(res.out_len == 2 && out[0] == 0x20 && out[1] == 0x33, "poll: output");
+  check(regs[5] == 0xAA, "poll: conditional write");
+  check(now_us >= 300, "poll: waits");
+  check(bus_state == BUS_IDLE, "poll: bus released");
+}
+
+// Device never gets ready, loop count is exhausted
+static void test_loop_count(void) {
+  struct i2c_script_result res;
+  uint8_t out[SCRIPT_MAX_OUT];
+
+  reset();
+  status_reads = 1000;
+  emit(2, OP_SETCNT, 1); emit16(5);
+  uint16_t loop = code_len;
+  emit_read_reg(0, 1);
+  emit(4, OP_BRANCH, COND_SET, 0, 0x01); uint16_t to_ready = emit16(0);
+  emit(2, OP_LOOP, 1); emit16(loop);
+  emit(2, OP_FAIL, 0x55);
+  patch16(to_ready, code_len);
+  emit(1, OP_END);
+
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_FAIL && res.fail_code == 0x55, "loop: fail after count");
+  check(status_reads == 995, "loop: iterations");
+  check(bus_state == BUS_IDLE, "loop: bus released");
+}
+
+// A script that never ends is stopped
+static void test_limit(void) {
+  struct i2c_script_result res;
+  uint8_t out[SCRIPT_MAX_OUT];
+
+  reset();
+  emit(1, OP_JMP); emit16(0);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_LIMIT, "limit: endless loop stopped");
+
+  reset();
+  emit(1, OP_WAIT_US); emit16(60000);
+  emit(1, OP_JMP); emit16(0);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_LIMIT && res.steps < 20, "limit: execution time");
+
+  reset();
+  uint32_t t0 = now_us;
+  emit(1, OP_WAIT_US); emit16(60000);
+  emit(1, OP_WAIT_US); emit16(60000);
+  emit(1, OP_WAIT_US); emit16(60000);
+  emit(1, OP_WAIT_US); emit16(60000);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_LIMIT && res.pc == 9 && (now_us - t0) < SCRIPT_MAX_TIME_US,
+        "limit: wait past the time limit not done");
+}
+
+// ACK polling of a device in a write cycle
+static void test_ack_poll(void) {
+  struct i2c_script_result res;
+  uint8_t out[SCRIPT_MAX_OUT];
+
+  reset();
+  emit(5, OP_START, OP_ADDR, DEV_ADDR << 1, OP_WRITE, 2);
+  emit(2, 3, 0x77);
+  emit(1, OP_STOP);
+  emit(2, OP_POLL, DEV_ADDR << 1); emit16(5000);
+  emit_read_reg(3, 1);
+  emit(3, OP_OUT, 0, 1);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_OK && res.out_len == 1 && out[0] == 0x77, "ack poll: device ready");
+
+  reset();
+  emit(2, OP_POLL, DEV_ADDR << 1); emit16(5000);
+  emit_read_reg(3, 1);
+  busy_nacks = 5;
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_OK && busy_nacks == 0 && stops == 7, "ack poll: waits for the ACK");
+
+  reset();
+  emit(2, OP_POLL, DEV_ADDR << 1); emit16(1000);
+  busy_nacks = 1000;
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_LIMIT && res.pc == 0 && now_us < 1500, "ack poll: timeout");
+
+  reset();
+  emit(4, OP_START, OP_POLL, DEV_ADDR << 1, 0); emit(1, 1);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_BAD_CODE, "ack poll: inside a transfer");
+}
+
+// Errors
+static void test_errors(void) {
+  struct i2c_script_result res;
+  uint8_t out[SCRIPT_MAX_OUT];
+
+  reset();
+  emit(4, OP_START, OP_ADDR, 0x50 << 1, OP_END);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_ADDRESS_NACK && res.pc == 1, "errors: address NACK");
+  check(stops == 1, "errors: stop after NACK");
+
+  reset();
+  emit(4, OP_START, OP_ADDR, DEV_ADDR << 1, OP_WRITE);
+  emit(2, 5, 1);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_BAD_CODE && stops == 1, "errors: truncated operand");
+
+  reset();
+  emit(1, 0x7F);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_BAD_CODE && stops == 0, "errors: invalid opcode");
+
+  reset();
+  emit_read_reg(1, 2);
+  emit(3, OP_OUT, 1, 2);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_BAD_CODE, "errors: output past read buffer");
+
+  reset();
+  emit(2, OP_ADDR, DEV_ADDR << 1);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_BAD_CODE, "errors: address without start");
+
+  reset();
+  emit(6, OP_START, OP_ADDR, DEV_ADDR << 1, OP_STOP, OP_WRITE, 1);
+  emit(1, 0);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_BAD_CODE && res.pc == 4, "errors: write after stop");
+
+  reset();
+  emit(2, OP_READ, 1);
+  i2c_script_run(code, code_len, &res, out);
+  check(res.status == SCRIPT_BAD_CODE && stops == 0, "errors: read without start");
+}
+
+// Main program
+int main (int argc, char **argv) {
+  test_poll();
+  test_loop_count();
+  test_limit();
+  test_ack_poll();
+  test_errors();
+  printf ("%s\n", failures ? "FAILED" : "ALL TESTS PASSED");
+  return failures ? 1 : 0;
+}
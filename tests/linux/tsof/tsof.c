@@ -0,0 +1,249 @@
+/*
+   Tests for the SOF synchronised sampling (firmware/i2csof.c)
+
+   Runs in a PC with virtual time. The USB frame number register follows
+   a simulated host that sends a SOF every 1000.05us (the host and the
+   adapter clocks are not the same), the main loop takes 50us per pass
+   and can be made to stop for a while (a long I2C transaction). The
+   script records the real time it was started, so the time of each
+   sample can be compared with the SOF.
+
+   Compile with
+     gcc -Wall -I../picohost -I../../../firmware -o tsof tsof.c ../../../firmware/i2csof.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/structs/usb.h"
+#include "bbi2c.h"
+#include "i2cusb.h"
+#include "i2cscript.h"
+#include "i2cprefetch.h"
+#include "usbstream.h"
+#include "i2csof.h"
+
+#define FRAME_NS      1000050ULL    // host frame period, in adapter time
+#define FRAME0        2000          // frame number at time 0 (wraps soon)
+#define SOF_PHASE_NS  123456ULL     // time of the first SOF
+#define LOOP_NS       50000ULL
+
+// Virtual time and the USB registers
+static uint64_t now_ns;
+static bool sof_running = true;
+static uint64_t frozen_frame;
+static usb_hw_t usb_regs;
+usb_hw_t *usb_hw = &usb_regs;
+
+// Frames since time 0 (SOFs seen)
+static uint64_t frames_at(uint64_t t_ns) {
+  return (t_ns < SOF_PHASE_NS) ? 0 : (t_ns - SOF_PHASE_NS) / FRAME_NS + 1;
+}
+
+// Time of the SOF of a frame (counted from time 0)
+static uint64_t sof_ns(uint64_t n) {
+  return SOF_PHASE_NS + (n - 1) * FRAME_NS;
+}
+
+static void advance(uint64_t ns) {
+  now_ns += ns;
+  uint64_t n = sof_running ? frames_at(now_ns) : frozen_frame;
+  usb_regs.sof_rd = (FRAME0 + n) & USB_SOF_RD_BITS;
+}
+
+void busy_wait_us_32(uint32_t delay_us) {
+  advance(delay_us * 1000ULL);
+}
+
+uint32_t time_us_32(void) {
+  advance(100);
+  return (uint32_t) (now_ns / 1000);
+}
+
+// Replacements for the other firmware modules
+static bool busy;
+
+bool bbi2c_busy(void) {
+  return busy;
+}
+
+void i2cprefetch_invalidate(uint8_t addr) {
+}
+
+void i2c_script_run(const uint8_t *code, uint16_t len, struct i2c_script_result *res, uint8_t *out) {
+  memset(res, 0, sizeof(*res));
+  res->status = SCRIPT_OK;
+  memcpy(out, &now_ns, sizeof(now_ns));
+  res->out_len = sizeof(now_ns);
+  advance(200000);    // bus time
+}
+
+// Records received
+#define MAX_SAMPLES 4000
+
+struct sample {
+  struct sof_sample_record rec;
+  uint64_t t_ns;      // when the script started
+};
+
+static struct sample samples[MAX_SAMPLES];
+static int nsamples;
+
+bool usbstream_send(uint8_t type, const void *data, uint8_t len) {
+  if ((type == RECORD_SOF_SAMPLE) && (len == sizeof(struct sof_sample_record) + 8) &&
+      (nsamples < MAX_SAMPLES)) {
+    memcpy(&samples[nsamples].rec, data, sizeof(struct sof_sample_record));
+    memcpy(&samples[nsamples].t_ns, (const uint8_t *) data + sizeof(struct sof_sample_record), 8);
+    nsamples++;
+  }
+  return true;
+}
+
+// Runs the main loop for some time
+static void run(uint64_t ns) {
+  uint64_t end = now_ns + ns;
+  while (now_ns < end) {
+    i2csof_task();
+    advance(LOOP_NS);
+  }
+}
+
+// Frame number of a sample, extended (counted from time 0)
+static uint64_t sample_frames(const struct sample *s) {
+  uint64_t n = frames_at(s->t_ns);
+  uint16_t f = (FRAME0 + n) & USB_SOF_RD_BITS;
+  return n - ((f - s->rec.frame) & USB_SOF_RD_BITS);
+}
+
+static int errors = 0;
+
+static void check(bool ok, const char *msg) {
+  printf ("%-50s %s\n", msg, ok ? "ok" : "FAILED");
+  if (!ok) {
+    errors++;
+  }
+}
+
+// Main program
+int main (void) {
+  static const uint8_t code[] = { OP_STOP };
+  struct sof_sample_config cfg;
+  struct sof_status st;
+
+  advance(0);
+
+  // Invalid configurations
+  cfg.start_frame = 0;
+  cfg.offset_us = 1000;
+  cfg.period = 10;
+  cfg.count = 0;
+  bool ok = !i2csof_start(&cfg, code, sizeof(code));
+  cfg.offset_us = 0;
+  cfg.period = 0;
+  ok = ok && !i2csof_start(&cfg, code, sizeof(code));
+  cfg.period = SOF_MAX_PERIOD + 1;
+  ok = ok && !i2csof_start(&cfg, code, sizeof(code));
+  cfg.period = 10;
+  ok = ok && !i2csof_start(&cfg, code, 0);
+  check(ok, "invalid configurations rejected");
+
+  // Samples every 10 frames, starting 100 frames ahead (crosses the frame number wrap)
+  run(5000000);
+  i2csof_get_status(&st);
+  uint64_t n0 = frames_at(now_ns);
+  cfg.start_frame = (st.frame + 100) & USB_SOF_RD_BITS;
+  cfg.offset_us = 250;
+  cfg.period = 10;
+  cfg.count = 200;
+  check(i2csof_start(&cfg, code, sizeof(code)), "sampling started");
+  run(2500000000ULL);
+  i2csof_get_status(&st);
+  ok = (nsamples == 200) && !st.active && (st.samples == 200) && (st.late == 0) && (st.skipped == 0);
+  int64_t max_err = 0;
+  int max_off_err = 0;
+  for (int i = 0; i < nsamples; i++) {
+    struct sample *s = &samples[i];
+    uint64_t n = n0 + 100 + 10 * i;
+    ok = ok && (s->rec.seq == i) && (s->rec.flags == 0) &&
+         (s->rec.frame == ((FRAME0 + n) & USB_SOF_RD_BITS)) && (sample_frames(s) == n);
+    int64_t err = (int64_t) s->t_ns - (int64_t) (sof_ns(n) + 250000);
+    max_err = (llabs(err) > max_err) ? llabs(err) : max_err;
+    int off_err = abs((int) s->rec.offset_us - (int) ((s->t_ns - sof_ns(n)) / 1000));
+    max_off_err = (off_err > max_off_err) ? off_err : max_off_err;
+  }
+  printf ("max error %lldns, max offset error %dus\n", (long long) max_err, max_off_err);
+  check(ok, "samples at the configured frames");
+  check((max_err < 2000) && (max_off_err <= 1), "samples at the configured offset");
+
+  // Start frame already past: the first samples are skipped, seq follows the frames
+  nsamples = 0;
+  i2csof_get_status(&st);
+  n0 = frames_at(now_ns);
+  cfg.start_frame = (st.frame - 35) & USB_SOF_RD_BITS;
+  cfg.count = 10;
+  i2csof_start(&cfg, code, sizeof(code));
+  run(200000000ULL);
+  i2csof_get_status(&st);
+  ok = (nsamples == 6) && (samples[0].rec.seq == 4) && (st.skipped == 4);
+  for (int i = 0; i < nsamples; i++) {
+    ok = ok && (sample_frames(&samples[i]) == n0 - 35 + 10 * samples[i].rec.seq);
+  }
+  check(ok, "late start skips the samples already past");
+
+  // Main loop stopped for 3.5ms and for 25ms
+  nsamples = 0;
+  i2csof_get_status(&st);
+  n0 = frames_at(now_ns);
+  cfg.start_frame = (st.frame + 20) & USB_SOF_RD_BITS;
+  cfg.count = 0;
+  i2csof_start(&cfg, code, sizeof(code));
+  run(sof_ns(n0 + 40) - now_ns - 1500000);
+  advance(3500000);
+  run(sof_ns(n0 + 70) - now_ns - 1500000);
+  busy = true;
+  run(25000000);
+  busy = false;
+  run(50000000);
+  i2csof_get_status(&st);
+  ok = st.active && (st.late == 2) && (st.skipped == 2);
+  int late = 0;
+  for (int i = 0; i < nsamples; i++) {
+    struct sample *s = &samples[i];
+    uint64_t due = n0 + 20 + 10 * s->rec.seq;
+    if (s->rec.flags & SOF_LATE) {
+      // frame where it was taken, offset estimated from the last SOF seen
+      // (the clock difference adds 0.05us per frame since then)
+      int off_err = abs((int) s->rec.offset_us - (int) ((s->t_ns - sof_ns(sample_frames(s))) / 1000));
+      ok = ok && (sample_frames(s) > due) && (sample_frames(s) < due + 10) && (off_err <= 5);
+      late++;
+    } else {
+      ok = ok && (sample_frames(s) == due);
+    }
+    if (i > 0) {
+      ok = ok && (s->rec.seq > samples[i-1].rec.seq);
+    }
+  }
+  check(ok && (late == 2), "late samples flagged and skipped");
+
+  // Host stops sending SOFs (suspend) just before a sample
+  i2csof_get_status(&st);
+  frozen_frame = n0 + 20 + 10 * st.seq - 1;
+  sof_running = false;
+  run(20000000);
+  i2csof_get_status(&st);
+  check(!st.active, "stops without SOFs");
+  sof_running = true;
+
+  // Stop command
+  cfg.start_frame = (st.frame + 20) & USB_SOF_RD_BITS;
+  i2csof_start(&cfg, code, sizeof(code));
+  i2csof_stop();
+  nsamples = 0;
+  run(100000000ULL);
+  check(nsamples == 0, "stopped by the host");
+
+  printf ("\n%s\n", errors ? "TESTS FAILED" : "ALL TESTS PASSED");
+  return errors ? 1 : 0;
+}